@@ -0,0 +1,413 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <iostream>
+#include <cstdint>
+#include "primitives.cpp"
+#include "siphash.cpp"
+#include "fs_util.cpp"
+#include "net_messages.cpp"
+
+// ------------------- ADDRESS MANAGER -------------------
+// Peer addresses we know, in two bucketed tables:
+//   new   - heard of (gossip, seeds, inbound peers) but never connected to
+//   tried - connected to successfully at least once
+// An address lives in exactly one slot of one table. New buckets are picked
+// from the group (/16) of the address and of whoever told us about it, so one
+// source can only fill a few buckets; tried buckets from the address itself.
+// Bucket positions are a keyed hash with a secret key, so peers can't aim at a
+// slot. A full slot keeps its entry unless that one has gone bad, which caps
+// memory and stops a flood of fake addresses from pushing good ones out.
+//
+// Failing addresses back off exponentially (kRetryBaseSecs doubling up to
+// kMaxRetrySecs) and become less likely to be picked.
+//
+// File (<dataDir>/peers.dat), rewritten whole:
+//   magic(8) | key(16) | count(LE32) | count * entry(39) | sha256(all before)
+//   entry: ip(LE32) port(LE16) sourceGroup(LE32) lastSeen lastTry lastSuccess(LE64 each)
+//          attempts(LE32) tried(1)
+// Slots aren't stored; entries are re-placed on load with the same key.
+
+static const size_t kAddrBucketSize = 64;
+static const size_t kNewBucketCount = 256;
+static const size_t kTriedBucketCount = 64;
+static const uint32_t kNewBucketsPerSourceGroup = 32;
+static const uint32_t kTriedBucketsPerGroup = 8;
+static const int64_t kRetryBaseSecs = 60;
+static const int64_t kMaxRetrySecs = 3600;
+static const int64_t kAddrHorizonSecs = 30 * 24 * 3600; // not heard of for longer: forget
+static const char kAddrFileMagic[8] = {'M', 'Y', 'A', 'D', 'D', 'R', '0', '1'};
+static const size_t kAddrFileEntrySize = 39;
+
+class AddrMan {
+public:
+    AddrMan() : rng(std::random_device{}()) {
+        key0 = rng();
+        key1 = rng();
+        clear();
+    }
+
+    // Learn an address from `source` (our own address for seeds and config).
+    // Returns true if it is new to us.
+    bool add(const NetAddress &addr, uint32_t sourceGroup, int64_t lastSeen, int64_t now) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (addr.ip == 0 || addr.port == 0) return false;
+        auto it = byAddr.find(addr.key());
+        if (it != byAddr.end()) {
+            Info &info = infos[it->second];
+            if (lastSeen > info.lastSeen && lastSeen <= now + 600) info.lastSeen = lastSeen;
+            return false;
+        }
+        Info info;
+        info.addr = addr;
+        info.sourceGroup = sourceGroup;
+        info.lastSeen = std::min(lastSeen, now);
+        if (!placeNew(info, now)) return false;
+        dirty = true;
+        return true;
+    }
+
+    // We completed a handshake with it: it moves to the tried table
+    void good(const NetAddress &addr, int64_t now) {
+        std::lock_guard<std::mutex> lock(mutex);
+        int id;
+        auto it = byAddr.find(addr.key());
+        if (it != byAddr.end()) {
+            id = it->second;
+            if (!infos[id].tried) unplace(id);
+        } else {
+            // Straight to tried (e.g. an address from config we never stored)
+            id = nextId++;
+            infos[id].addr = addr;
+            infos[id].sourceGroup = addr.group();
+            byAddr[addr.key()] = id;
+        }
+        Info &info = infos[id];
+        info.lastSeen = now;
+        info.lastTry = now;
+        info.lastSuccess = now;
+        info.attempts = 0;
+        dirty = true;
+        if (info.tried) return;
+        size_t slot = triedSlot(addr);
+        if (tried[slot] >= 0) {
+            // Bump the old occupant back to the new table (dropped if that's full too)
+            int old = tried[slot];
+            Info oldInfo = infos[old];
+            unplace(old);
+            forget(old);
+            oldInfo.tried = false;
+            placeNew(oldInfo, now);
+        }
+        Info &moved = infos[id];
+        moved.tried = true;
+        tried[slot] = id;
+        list(true).push_back(id);
+        moved.listIndex = list(true).size() - 1;
+        moved.slot = slot;
+    }
+
+    // About to connect to it
+    void attempt(const NetAddress &addr, int64_t now) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = byAddr.find(addr.key());
+        if (it == byAddr.end()) return;
+        Info &info = infos[it->second];
+        info.lastTry = now;
+        info.attempts++;
+        dirty = true;
+    }
+
+    // Drop it altogether (e.g. it turned out to be ourselves)
+    void remove(const NetAddress &addr) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = byAddr.find(addr.key());
+        if (it == byAddr.end()) return;
+        int id = it->second;
+        unplace(id);
+        forget(id);
+        dirty = true;
+    }
+
+    // Pick an address to connect to that isn't in `exclude` (keys) and isn't
+    // backing off. Tried and new are drawn from equally; each failed attempt
+    // makes an address less likely to come up.
+    bool select(int64_t now, const std::unordered_set<uint64_t> &exclude, NetAddress &out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (triedIds.empty() && newIds.empty()) return false;
+        for (int i = 0; i < 200; i++) {
+            bool fromTried = newIds.empty() || (!triedIds.empty() && (rng() & 1));
+            const std::vector<int> &ids = list(fromTried);
+            const Info &info = infos[ids[rng() % ids.size()]];
+            if (exclude.count(info.addr.key()) || !isReady(info, now)) continue;
+            double chance = std::pow(0.66, std::min<uint32_t>(info.attempts, 8));
+            if (std::uniform_real_distribution<double>(0.0, 1.0)(rng) >= chance) continue;
+            out = info.addr;
+            return true;
+        }
+        return false;
+    }
+
+    // A random sample to answer getaddr with: at most maxPercent of what we
+    // know, leaving out the asker's own address
+    std::vector<AddrEntry> getAddresses(size_t maxCount, size_t maxPercent, uint64_t excludeKey, int64_t now) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<int> ids;
+        ids.reserve(infos.size());
+        for (int id : newIds) {
+            if (infos[id].addr.key() != excludeKey) ids.push_back(id);
+        }
+        for (int id : triedIds) {
+            if (infos[id].addr.key() != excludeKey) ids.push_back(id);
+        }
+        size_t count = std::min(maxCount, (ids.size() * maxPercent + 99) / 100);
+        std::vector<AddrEntry> out;
+        for (size_t i = 0; i < ids.size() && out.size() < count; i++) {
+            std::swap(ids[i], ids[i + rng() % (ids.size() - i)]);
+            const Info &info = infos[ids[i]];
+            if (isTerrible(info, now)) continue;
+            out.push_back(AddrEntry{static_cast<uint32_t>(info.lastSeen), info.addr});
+        }
+        return out;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return infos.size();
+    }
+
+    bool save(const std::string &path) {
+        std::string data;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            appendBytes(data, kAddrFileMagic, sizeof(kAddrFileMagic));
+            appendLE64(data, key0);
+            appendLE64(data, key1);
+            appendLE32(data, static_cast<uint32_t>(infos.size()));
+            for (auto &entry : infos) {
+                const Info &info = entry.second;
+                appendLE32(data, info.addr.ip);
+                data.push_back(static_cast<char>(info.addr.port));
+                data.push_back(static_cast<char>(info.addr.port >> 8));
+                appendLE32(data, info.sourceGroup);
+                appendLE64(data, static_cast<uint64_t>(info.lastSeen));
+                appendLE64(data, static_cast<uint64_t>(info.lastTry));
+                appendLE64(data, static_cast<uint64_t>(info.lastSuccess));
+                appendLE32(data, info.attempts);
+                data.push_back(info.tried ? 1 : 0);
+            }
+            dirty = false;
+        }
+        uint256 check = sha256(data);
+        appendBytes(data, check.data, 32);
+
+        std::string tmpPath = path + ".tmp";
+        std::remove(tmpPath.c_str());
+        int fd = openFile(tmpPath, true);
+        if (fd < 0) return false;
+        bool ok = writeAt(fd, data.data(), data.size(), 0) && syncFile(fd);
+        closeFile(fd);
+        if (!ok || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+            std::cerr << "[AddrMan] Failed to write " << path << std::endl;
+            return false;
+        }
+        size_t slash = path.find_last_of('/');
+        if (slash != std::string::npos) syncDirectory(path.substr(0, slash));
+        return true;
+    }
+
+    // Replace the contents with the file's. A missing file is an empty table;
+    // a corrupt one is ignored (and rewritten on the next save).
+    bool load(const std::string &path, int64_t now) {
+        if (!fileExists(path)) return true;
+        int fd = openFile(path, false);
+        if (fd < 0) return false;
+        std::string data(static_cast<size_t>(fileSize(fd)), '\0');
+        bool ok = data.empty() || readAt(fd, &data[0], data.size(), 0);
+        closeFile(fd);
+        const size_t fixed = sizeof(kAddrFileMagic) + 16 + 4;
+        if (!ok || data.size() < fixed + 32 || std::memcmp(data.data(), kAddrFileMagic, sizeof(kAddrFileMagic)) != 0
+            || sha256(reinterpret_cast<const unsigned char*>(data.data()), data.size() - 32)
+                   != uint256FromBytes(data.data() + data.size() - 32)) {
+            std::cerr << "[AddrMan] Ignoring corrupt " << path << std::endl;
+            return false;
+        }
+        ByteReader in(data.data() + sizeof(kAddrFileMagic), data.size() - sizeof(kAddrFileMagic) - 32);
+        uint64_t k0 = in.readU64();
+        uint64_t k1 = in.readU64();
+        uint32_t count = in.readU32();
+        if (in.failed || uint64_t(count) * kAddrFileEntrySize != in.left) {
+            std::cerr << "[AddrMan] Ignoring corrupt " << path << std::endl;
+            return false;
+        }
+        std::vector<Info> loaded(count);
+        for (auto &info : loaded) {
+            info.addr.ip = in.readU32();
+            unsigned char port[2];
+            in.readBytes(port, 2);
+            info.addr.port = static_cast<uint16_t>(port[0] | (port[1] << 8));
+            info.sourceGroup = in.readU32();
+            info.lastSeen = static_cast<int64_t>(in.readU64());
+            info.lastTry = static_cast<int64_t>(in.readU64());
+            info.lastSuccess = static_cast<int64_t>(in.readU64());
+            info.attempts = in.readU32();
+            unsigned char triedFlag = 0;
+            in.readBytes(&triedFlag, 1);
+            info.tried = triedFlag != 0;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        key0 = k0;
+        key1 = k1;
+        clear();
+        // Tried first so they get their slots back
+        std::stable_partition(loaded.begin(), loaded.end(), [](const Info &i) { return i.tried; });
+        for (auto &info : loaded) {
+            if (byAddr.count(info.addr.key()) || info.addr.ip == 0 || info.addr.port == 0) continue;
+            size_t slot = triedSlot(info.addr);
+            if (info.tried && tried[slot] < 0) {
+                int id = nextId++;
+                infos[id] = info;
+                byAddr[info.addr.key()] = id;
+                tried[slot] = id;
+                list(true).push_back(id);
+                infos[id].listIndex = list(true).size() - 1;
+                infos[id].slot = slot;
+            } else {
+                info.tried = false;
+                placeNew(info, now);
+            }
+        }
+        dirty = false;
+        return true;
+    }
+
+    bool isDirty() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return dirty;
+    }
+
+private:
+    struct Info {
+        NetAddress addr;
+        uint32_t sourceGroup = 0;
+        int64_t lastSeen = 0;     // unix seconds, as gossiped or observed
+        int64_t lastTry = 0;
+        int64_t lastSuccess = 0;
+        uint32_t attempts = 0;    // failed (or in progress) since the last success
+        bool tried = false;
+        size_t slot = 0;          // in newTable or tried
+        size_t listIndex = 0;     // in newIds or triedIds
+    };
+
+    static uint256 uint256FromBytes(const char *p) {
+        uint256 h;
+        std::memcpy(h.data, p, 32);
+        return h;
+    }
+
+    // Keyed hash of a few small values
+    uint64_t keyedHash(uint64_t tag, uint64_t a, uint64_t b) const {
+        uint256 msg;
+        writeLE64(msg.data, tag);
+        writeLE64(msg.data + 8, a);
+        writeLE64(msg.data + 16, b);
+        return SipHasher(key0, key1).hash(msg);
+    }
+
+    size_t newSlot(const NetAddress &addr, uint32_t sourceGroup) const {
+        uint64_t spread = keyedHash(1, addr.group(), sourceGroup) % kNewBucketsPerSourceGroup;
+        size_t bucket = keyedHash(2, sourceGroup, spread) % kNewBucketCount;
+        return bucket * kAddrBucketSize + keyedHash(3, bucket, addr.key()) % kAddrBucketSize;
+    }
+
+    size_t triedSlot(const NetAddress &addr) const {
+        uint64_t spread = keyedHash(4, addr.key(), 0) % kTriedBucketsPerGroup;
+        size_t bucket = keyedHash(5, addr.group(), spread) % kTriedBucketCount;
+        return bucket * kAddrBucketSize + keyedHash(6, bucket, addr.key()) % kAddrBucketSize;
+    }
+
+    // Not worth keeping: long unheard of, or failing with no success to show
+    static bool isTerrible(const Info &info, int64_t now) {
+        if (info.lastTry && now - info.lastTry < 60) return false; // give it a chance to finish
+        if (now - info.lastSeen > kAddrHorizonSecs) return true;
+        if (info.lastSuccess == 0 && info.attempts >= 3) return true;
+        if (now - info.lastSuccess > 7 * 24 * 3600 && info.attempts >= 10) return true;
+        return false;
+    }
+
+    // Not backing off from a recent try
+    static bool isReady(const Info &info, int64_t now) {
+        if (info.lastTry == 0) return true;
+        uint32_t doublings = std::min<uint32_t>(info.attempts > 0 ? info.attempts - 1 : 0, 16);
+        int64_t wait = std::min(kMaxRetrySecs, kRetryBaseSecs << doublings);
+        return now - info.lastTry >= wait;
+    }
+
+    std::vector<int> &list(bool isTried) { return isTried ? triedIds : newIds; }
+
+    // Put a new-table entry in its slot, evicting the occupant only if terrible
+    bool placeNew(Info info, int64_t now) {
+        size_t slot = newSlot(info.addr, info.sourceGroup);
+        if (newTable[slot] >= 0) {
+            int old = newTable[slot];
+            if (!isTerrible(infos[old], now)) return false;
+            unplace(old);
+            forget(old);
+        }
+        int id = nextId++;
+        info.tried = false;
+        info.slot = slot;
+        newIds.push_back(id);
+        info.listIndex = newIds.size() - 1;
+        infos[id] = info;
+        byAddr[info.addr.key()] = id;
+        newTable[slot] = id;
+        return true;
+    }
+
+    // Take an entry out of its table slot and list (it stays in infos)
+    void unplace(int id) {
+        Info &info = infos[id];
+        (info.tried ? tried : newTable)[info.slot] = -1;
+        std::vector<int> &ids = list(info.tried);
+        int last = ids.back();
+        ids[info.listIndex] = last;
+        infos[last].listIndex = info.listIndex;
+        ids.pop_back();
+    }
+
+    void forget(int id) {
+        byAddr.erase(infos[id].addr.key());
+        infos.erase(id);
+    }
+
+    void clear() {
+        infos.clear();
+        byAddr.clear();
+        newIds.clear();
+        triedIds.clear();
+        newTable.assign(kNewBucketCount * kAddrBucketSize, -1);
+        tried.assign(kTriedBucketCount * kAddrBucketSize, -1);
+    }
+
+    std::mutex mutex;
+    std::mt19937_64 rng;
+    uint64_t key0;
+    uint64_t key1;
+    std::unordered_map<int, Info> infos;
+    std::unordered_map<uint64_t, int> byAddr; // NetAddress::key() -> id
+    std::vector<int> newTable;                // slot -> id, -1 = empty
+    std::vector<int> tried;
+    std::vector<int> newIds;                  // every id in each table, for random picks
+    std::vector<int> triedIds;
+    int nextId = 0;
+    bool dirty = false;
+};
@@ -0,0 +1,578 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <memory>
+#include <cstdlib>
+#include <ctime>
+#include <filesystem>
+#include <unordered_set>
+#include <jsoncpp/json/json.h>
+#include "miner.cpp"
+#include "key_pool.cpp"
+
+// ------------------- BENCHMARKS -------------------
+// mycoin_bench times the node's hot paths and prints the results as one JSON
+// document, so runs can be kept and compared across releases:
+//   sha256/<bytes>, sha256Hash64Many/<backend>   hashing
+//   merkleRoot/<txs>                            calculateMerkleRoot
+//   txid/<inputs>x<outputs>                     building a Transaction; its txid
+//                                               (getTxId) is computed right there
+//   validateTransaction/cold/<utxos>            against a UTXO set of <utxos>
+//   validateTransaction/cached/<utxos>          coins, 10^4 up to --max-utxos;
+//   applyTransaction/<utxos>                    cached: signatures already verified
+//   mining/<threads>                            header hashes per second
+//   connectBlocks/<blocks>                      a synthetic chain read back from
+//                                               disk and connected with addBlock
+// Every result has name, iterations, seconds, nsPerOp and opsPerSec, plus fields
+// of its own (bytesPerSec, utxos, hashesPerSecPerThread, txsPerSec...). Progress
+// goes to stderr and the node's own logging is muted while a case runs.
+//
+// Usage: mycoin_bench [--filter <substring>] [--min-time <seconds>]
+//                     [--max-utxos <n>] [--blocks <n>] [--block-txs <n>]
+//                     [--db-cache-mb <n>] [--data-dir <dir>] [--out <file>]
+// The data directory is wiped before and after the run.
+
+#ifndef MYCOIN_BUILD_TYPE
+#define MYCOIN_BUILD_TYPE "unknown"
+#endif
+
+struct BenchOptions {
+    std::string filter;             // only cases whose name contains it
+    double minTime = 0.5;           // seconds per timed case
+    uint64_t maxUtxos = 10000000;
+    uint64_t blocks = 200;          // length of the synthetic chain
+    uint64_t blockTxs = 100;        // transactions per synthetic block, besides the coinbase
+    uint64_t dbCacheMB = 100;
+    std::string dataDir = "bench-data";
+    std::string out;                // empty: stdout
+};
+
+static BenchOptions g_options;
+static Json::Value g_results(Json::arrayValue);
+static volatile unsigned char g_sink; // keeps measured results from being optimized away
+
+static const uint64_t kSyntheticCoinValue = 100000;
+static const size_t kUtxoBenchTxs = 500; // transactions validated and applied per UTXO set size
+
+static bool selected(const std::string &name) {
+    return g_options.filter.empty() || name.find(g_options.filter) != std::string::npos;
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Add a result; the caller may add fields of its own to what is returned
+static Json::Value &record(const std::string &name, uint64_t iterations, double seconds) {
+    Json::Value r;
+    r["name"] = name;
+    r["iterations"] = Json::UInt64(iterations);
+    r["seconds"] = seconds;
+    r["nsPerOp"] = seconds * 1e9 / iterations;
+    r["opsPerSec"] = iterations / seconds;
+    std::cerr << "[Bench] " << name << ": " << r["nsPerOp"].asDouble() << " ns/op, "
+              << iterations << " iterations" << std::endl;
+    return g_results.append(r);
+}
+
+// Call fn() in doubling batches until minTime has passed
+template <typename F>
+static Json::Value &measure(const std::string &name, F fn) {
+    uint64_t iterations = 0;
+    uint64_t batch = 1;
+    double seconds = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (seconds < g_options.minTime) {
+        for (uint64_t i = 0; i < batch; i++) {
+            fn();
+        }
+        iterations += batch;
+        seconds = secondsSince(start);
+        if (batch < (1u << 16)) batch *= 2;
+    }
+    return record(name, iterations, seconds);
+}
+
+// Deterministic distinct hashes
+static uint256 indexHash(uint64_t i) {
+    unsigned char buf[8];
+    writeLE64(buf, i);
+    return sha256(buf, sizeof(buf));
+}
+
+// One key owns every coin the benchmarks create
+struct BenchKey {
+    std::string secretHex;
+    uint256 pubKeyHash;
+};
+
+static const BenchKey &benchKey() {
+    static const BenchKey key = []() {
+        BenchKey k;
+        uint256 secret = sha256(std::string("mycoin-bench-key"));
+        k.secretHex = secret.toHex();
+        EC_GROUP *group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+        BN_CTX *ctx = BN_CTX_new();
+        if (!group || !ctx || !pubKeyHashFromSecret(group, ctx, secret, k.pubKeyHash)) {
+            std::cerr << "[Bench] Cannot derive the benchmark key" << std::endl;
+            std::exit(1);
+        }
+        BN_CTX_free(ctx);
+        EC_GROUP_free(group);
+        return k;
+    }();
+    return key;
+}
+
+// Spend `coins` (worth `total` together) into `outputs` equal outputs, no fee, signed
+static TransactionRef makeSpend(const std::vector<OutPoint> &coins, uint64_t total, size_t outputs) {
+    const BenchKey &key = benchKey();
+    MutableTransaction tx;
+    for (auto &coin : coins) {
+        TxInput in;
+        in.txid = coin.txid;
+        in.index = coin.index;
+        tx.inputs.push_back(in);
+    }
+    for (size_t i = 0; i < outputs; i++) {
+        TxOutput out;
+        out.amount = total / outputs + (i == 0 ? total % outputs : 0);
+        out.pubKeyHash = key.pubKeyHash;
+        tx.outputs.push_back(out);
+    }
+    for (size_t i = 0; i < tx.inputs.size(); i++) {
+        if (!signTransactionInput(tx, i, key.secretHex)) {
+            std::cerr << "[Bench] Signing failed" << std::endl;
+            std::exit(1);
+        }
+    }
+    return makeTransactionRef(std::move(tx));
+}
+
+static void benchSha256() {
+    for (size_t size : {size_t(64), size_t(1024), size_t(1) << 20}) {
+        std::string name = "sha256/" + std::to_string(size);
+        if (!selected(name)) continue;
+        std::vector<unsigned char> data(size, 0x5a);
+        Json::Value &r = measure(name, [&]() {
+            g_sink = sha256(data.data(), data.size()).data[0];
+        });
+        r["bytes"] = Json::UInt64(size);
+        r["bytesPerSec"] = size * r["opsPerSec"].asDouble();
+    }
+
+    // The batched kernel behind merkle levels, on every backend this CPU has
+    const size_t kMessages = 1024;
+    std::vector<unsigned char> in(kMessages * 64, 0x5a), out(kMessages * 32);
+    std::string calibrated = sha256Backend().name;
+    for (auto &backend : sha256AvailableBackends()) {
+        std::string name = std::string("sha256Hash64Many/") + backend.name;
+        if (!selected(name)) continue;
+        setSha256Backend(backend.name);
+        Json::Value &r = measure(name, [&]() {
+            sha256Hash64Many(in.data(), out.data(), kMessages);
+            g_sink = out[0];
+        });
+        r["messages"] = Json::UInt64(kMessages);
+        r["hashesPerSec"] = kMessages * r["opsPerSec"].asDouble();
+    }
+    setSha256Backend(calibrated);
+}
+
+static void benchMerkleRoot() {
+    for (size_t txs : {size_t(1), size_t(16), size_t(256), size_t(4096), size_t(65536)}) {
+        std::string name = "merkleRoot/" + std::to_string(txs);
+        if (!selected(name)) continue;
+        std::vector<uint256> txids(txs);
+        for (size_t i = 0; i < txs; i++) {
+            txids[i] = indexHash(i);
+        }
+        Json::Value &r = measure(name, [&]() {
+            g_sink = calculateMerkleRoot(txids).data[0];
+        });
+        r["txs"] = Json::UInt64(txs);
+    }
+}
+
+// A Transaction serializes and hashes itself once, when it is built, so
+// getTxId() is only a load; this times the construction that computes it
+static void benchTxId() {
+    const size_t shapes[][2] = {{1, 1}, {1, 2}, {2, 2}, {10, 10}};
+    for (auto &shape : shapes) {
+        std::string name = "txid/" + std::to_string(shape[0]) + "x" + std::to_string(shape[1]);
+        if (!selected(name)) continue;
+        MutableTransaction tx;
+        for (size_t i = 0; i < shape[0]; i++) {
+            TxInput in;
+            in.txid = indexHash(i);
+            in.index = static_cast<uint32_t>(i);
+            in.signature.assign(1 + 72 + 1 + 65, '\x30'); // as long as a signed input's
+            tx.inputs.push_back(in);
+        }
+        for (size_t i = 0; i < shape[1]; i++) {
+            TxOutput out;
+            out.amount = 1000 + i;
+            out.pubKeyHash = indexHash(1000 + i);
+            tx.outputs.push_back(out);
+        }
+        size_t bytes = 0;
+        Json::Value &r = measure(name, [&]() {
+            TransactionRef ref = makeTransactionRef(tx);
+            bytes = ref->getSerializedSize();
+            g_sink = ref->getTxId().data[0];
+        });
+        r["inputs"] = Json::UInt64(shape[0]);
+        r["outputs"] = Json::UInt64(shape[1]);
+        r["bytes"] = Json::UInt64(bytes);
+    }
+}
+
+// The miner's inner loop (HeaderPowHasher batches plus the target check) on
+// 1, 2, 4... threads up to the hardware thread count
+static void benchMining() {
+    unsigned maxThreads = MiningEngine::defaultThreadCount();
+    std::vector<unsigned> counts;
+    for (unsigned t = 1; t < maxThreads; t *= 2) counts.push_back(t);
+    counts.push_back(maxThreads);
+
+    for (unsigned threads : counts) {
+        std::string name = "mining/" + std::to_string(threads);
+        if (!selected(name)) continue;
+        std::unique_ptr<MinerWorkerStats[]> stats(new MinerWorkerStats[threads]);
+        std::atomic<bool> stop{false};
+        std::vector<std::thread> workers;
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned id = 0; id < threads; id++) {
+            workers.emplace_back([&stats, &stop, id]() {
+                BlockHeader header;
+                header.version = 1;
+                header.prevBlockHash = indexHash(0);
+                header.merkleRoot = indexHash(id + 1); // a different template per worker
+                header.timestamp = 1700000000;
+                header.difficultyTarget = 0x1f00ffff;
+                header.nonce = 0;
+                HeaderPowHasher hasher(header);
+                uint256 hashes[HeaderPowHasher::kBatch];
+                uint32_t nonce = 0;
+                uint64_t local = 0;
+                uint64_t solutions = 0;
+                while (!stop.load(std::memory_order_relaxed)) {
+                    for (int round = 0; round < 256; round++) {
+                        hasher.hashNonces(nonce, hashes);
+                        for (size_t i = 0; i < HeaderPowHasher::kBatch; i++) {
+                            if (Blockchain::checkProofOfWork(hashes[i], header.difficultyTarget)) solutions++;
+                        }
+                        nonce += HeaderPowHasher::kBatch;
+                    }
+                    local += 256 * HeaderPowHasher::kBatch;
+                    stats[id].hashes.store(local, std::memory_order_relaxed);
+                }
+                g_sink = static_cast<unsigned char>(solutions);
+            });
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(std::max(g_options.minTime, 1.0)));
+        stop.store(true);
+        for (auto &t : workers) {
+            t.join();
+        }
+        double seconds = secondsSince(start);
+        uint64_t hashes = 0;
+        for (unsigned id = 0; id < threads; id++) {
+            hashes += stats[id].hashes.load();
+        }
+        Json::Value &r = record(name, hashes, seconds);
+        r["threads"] = threads;
+        r["hashesPerSec"] = hashes / seconds;
+        r["hashesPerSecPerThread"] = hashes / seconds / threads;
+    }
+}
+
+// Find a nonce that satisfies the proof of work, on this thread
+static void solveBlock(Block &block) {
+    while (true) {
+        HeaderPowHasher hasher(block.header);
+        uint32_t nonce = 0;
+        do {
+            if (Blockchain::checkProofOfWork(hasher.hashWithNonce(nonce), block.header.difficultyTarget)) {
+                block.header.nonce = nonce;
+                return;
+            }
+        } while (++nonce != 0);
+        block.header.timestamp++;
+    }
+}
+
+// Write `count` valid blocks on top of the chain's tip to `path`, each as
+// LE32 length | serialized block. Every block spends up to blockTxs of the
+// coins created before it, one coin into two, so the chain fans out quickly.
+static bool writeSyntheticChain(Blockchain &chain, const std::string &path, uint64_t count,
+                                uint64_t &txs, uint64_t &bytes) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        std::cerr << "[Bench] Cannot create " << path << std::endl;
+        return false;
+    }
+    const BenchKey &key = benchKey();
+    std::deque<std::pair<OutPoint, uint64_t>> coins;
+    uint256 prevHash = chain.getTipHash();
+    uint64_t height = chain.getHeight();
+    uint32_t timestamp = chain.getLatestBlock()->header.timestamp;
+    txs = 0;
+    bytes = 0;
+    for (uint64_t b = 0; b < count; b++) {
+        height++;
+        timestamp += 600;
+        Block block;
+        block.header.version = 1;
+        block.header.prevBlockHash = prevHash;
+        block.header.timestamp = timestamp;
+        block.header.difficultyTarget = chain.getDifficultyTarget();
+        block.header.nonce = 0;
+
+        MutableTransaction coinbase;
+        TxInput coinbaseIn;
+        coinbaseIn.txid.setNull();
+        coinbaseIn.index = 0;
+        coinbaseIn.signature = "bench:" + std::to_string(height); // a distinct txid per block
+        coinbase.inputs.push_back(coinbaseIn);
+        TxOutput reward;
+        reward.amount = chain.getBlockReward(height) * 100000000ULL;
+        reward.pubKeyHash = key.pubKeyHash;
+        coinbase.outputs.push_back(reward);
+        block.appendTransaction(makeTransactionRef(std::move(coinbase)));
+
+        std::vector<std::pair<OutPoint, uint64_t>> created;
+        while (block.getTransactions().size() <= g_options.blockTxs && !coins.empty()) {
+            auto coin = coins.front();
+            coins.pop_front();
+            if (coin.second < 2) continue;
+            TransactionRef tx = makeSpend({coin.first}, coin.second, 2);
+            for (uint32_t i = 0; i < 2; i++) {
+                created.push_back(std::make_pair(OutPoint(tx->getTxId(), i), tx->outputs[i].amount));
+            }
+            block.appendTransaction(tx);
+        }
+        const Transaction &cb = *block.getTransactions().front();
+        coins.push_back(std::make_pair(OutPoint(cb.getTxId(), 0), cb.outputs[0].amount));
+        coins.insert(coins.end(), created.begin(), created.end());
+
+        solveBlock(block); // appendTransaction kept the merkle root current
+        prevHash = block.getBlockHash();
+
+        std::string data;
+        block.serialize(data);
+        unsigned char length[4];
+        writeLE32(length, static_cast<uint32_t>(data.size()));
+        file.write(reinterpret_cast<const char*>(length), sizeof(length));
+        file.write(data.data(), data.size());
+        txs += block.getTransactions().size();
+        bytes += data.size();
+    }
+    return static_cast<bool>(file.flush());
+}
+
+// Macro benchmark: read the synthetic chain back and connect it block by
+// block, as a node catching up would, including the final chainstate flush
+static void benchConnectBlocks(Blockchain &chain) {
+    std::string name = "connectBlocks/" + std::to_string(g_options.blocks);
+    if (!selected(name) || g_options.blocks == 0) return;
+    std::string path = g_options.dataDir + "/synthetic-chain.dat";
+    uint64_t txs, bytes;
+    auto built = std::chrono::steady_clock::now();
+    if (!writeSyntheticChain(chain, path, g_options.blocks, txs, bytes)) return;
+    std::cerr << "[Bench] Wrote " << g_options.blocks << " synthetic blocks (" << txs << " transactions) in "
+              << secondsSince(built) << "s" << std::endl;
+
+    std::ifstream file(path, std::ios::binary);
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t b = 0; b < g_options.blocks; b++) {
+        unsigned char length[4];
+        std::string data;
+        Block block;
+        if (file.read(reinterpret_cast<char*>(length), sizeof(length))) {
+            data.resize(readLE32(length));
+            file.read(&data[0], data.size());
+        }
+        if (!file || !block.deserialize(reinterpret_cast<const unsigned char*>(data.data()), data.size())) {
+            std::cerr << "[Bench] Cannot read synthetic block " << b << std::endl;
+            return;
+        }
+        if (!chain.addBlock(block)) {
+            std::cerr << "[Bench] Synthetic block " << b << " was rejected" << std::endl;
+            return;
+        }
+    }
+    g_utxoSet.flush();
+    double seconds = secondsSince(start);
+    Json::Value &r = record(name, g_options.blocks, seconds);
+    r["blocks"] = Json::UInt64(g_options.blocks);
+    r["txs"] = Json::UInt64(txs);
+    r["bytes"] = Json::UInt64(bytes);
+    r["txsPerSec"] = txs / seconds;
+}
+
+// validateTransaction and applyTransaction against UTXO sets of 10^4 coins up
+// to maxUtxos. Synthetic coin i is output 0 of txid indexHash(i); the set grows
+// between sizes and is flushed to the chainstate before each is measured, so
+// larger sets are mostly read from disk through the dbCacheMB cache, as on a node.
+static void benchUtxo(Blockchain &chain) {
+    const BenchKey &key = benchKey();
+    std::mt19937_64 rng(1);
+    std::unordered_set<uint64_t> spent;
+    uint64_t filled = 0;
+    for (uint64_t size = 10000; size <= g_options.maxUtxos; size *= 10) {
+        std::string suffix = "/" + std::to_string(size);
+        std::string coldName = "validateTransaction/cold" + suffix;
+        std::string cachedName = "validateTransaction/cached" + suffix;
+        std::string applyName = "applyTransaction" + suffix;
+        if (!selected(coldName) && !selected(cachedName) && !selected(applyName)) continue;
+
+        auto start = std::chrono::steady_clock::now();
+        for (; filled < size; filled++) {
+            g_utxoSet.put(OutPoint(indexHash(filled), 0), UTXO{kSyntheticCoinValue, key.pubKeyHash});
+            if (filled % 100000 == 99999) g_utxoSet.flushIfNeeded();
+        }
+        g_utxoSet.flush();
+        std::cerr << "[Bench] UTXO set filled to " << size << " coins in " << secondsSince(start) << "s" << std::endl;
+
+        // Two random unspent coins in, two outputs out
+        std::vector<TransactionRef> txs;
+        std::uniform_int_distribution<uint64_t> pick(0, filled - 1);
+        for (size_t i = 0; i < kUtxoBenchTxs; i++) {
+            std::vector<OutPoint> coins;
+            while (coins.size() < 2) {
+                uint64_t coin = pick(rng);
+                if (spent.insert(coin).second) coins.push_back(OutPoint(indexHash(coin), 0));
+            }
+            txs.push_back(makeSpend(coins, 2 * kSyntheticCoinValue, 2));
+        }
+
+        getSignatureCache().resize(32u << 20); // empty it
+        for (int pass = 0; pass < 2; pass++) {
+            start = std::chrono::steady_clock::now();
+            for (auto &tx : txs) {
+                if (!chain.validateTransaction(*tx)) {
+                    std::cerr << "[Bench] Synthetic transaction failed validation" << std::endl;
+                    return;
+                }
+            }
+            double seconds = secondsSince(start);
+            const std::string &name = pass == 0 ? coldName : cachedName;
+            if (selected(name)) {
+                record(name, txs.size(), seconds)["utxos"] = Json::UInt64(size);
+            }
+        }
+
+        start = std::chrono::steady_clock::now();
+        for (auto &tx : txs) {
+            chain.applyTransaction(*tx, nullptr);
+        }
+        double seconds = secondsSince(start);
+        if (selected(applyName)) {
+            record(applyName, txs.size(), seconds)["utxos"] = Json::UInt64(size);
+        }
+    }
+}
+
+static bool parseArgs(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--filter") {
+            g_options.filter = value;
+        } else if (arg == "--min-time") {
+            g_options.minTime = std::strtod(value.c_str(), nullptr);
+        } else if (arg == "--max-utxos") {
+            g_options.maxUtxos = std::strtoull(value.c_str(), nullptr, 10);
+        } else if (arg == "--blocks") {
+            g_options.blocks = std::strtoull(value.c_str(), nullptr, 10);
+        } else if (arg == "--block-txs") {
+            g_options.blockTxs = std::strtoull(value.c_str(), nullptr, 10);
+        } else if (arg == "--db-cache-mb") {
+            g_options.dbCacheMB = std::strtoull(value.c_str(), nullptr, 10);
+        } else if (arg == "--data-dir") {
+            g_options.dataDir = value;
+        } else if (arg == "--out") {
+            g_options.out = value;
+        } else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+    return !g_options.dataDir.empty();
+}
+
+int main(int argc, char *argv[]) {
+    if (!parseArgs(argc, argv)) {
+        std::cerr << "Usage: " << argv[0] << " [--filter <substring>] [--min-time <seconds>] [--max-utxos <n>]"
+                  << " [--blocks <n>] [--block-txs <n>] [--db-cache-mb <n>] [--data-dir <dir>] [--out <file>]"
+                  << std::endl;
+        return 1;
+    }
+    Json::Value doc;
+    doc["suite"] = "mycoin";
+    doc["formatVersion"] = 1;
+    doc["timestamp"] = Json::UInt64(std::time(nullptr));
+    doc["buildType"] = MYCOIN_BUILD_TYPE;
+#ifdef __VERSION__
+    doc["compiler"] = __VERSION__;
+#endif
+    doc["sha256Backend"] = sha256Backend().name;
+    doc["hardwareThreads"] = std::thread::hardware_concurrency();
+    Json::Value &options = doc["options"];
+    options["filter"] = g_options.filter;
+    options["minTime"] = g_options.minTime;
+    options["maxUtxos"] = Json::UInt64(g_options.maxUtxos);
+    options["blocks"] = Json::UInt64(g_options.blocks);
+    options["blockTxs"] = Json::UInt64(g_options.blockTxs);
+    options["dbCacheMB"] = Json::UInt64(g_options.dbCacheMB);
+
+    // The node logs to stdout; keep it for the results
+    std::streambuf *stdoutBuffer = std::cout.rdbuf(nullptr);
+
+    benchSha256();
+    benchMerkleRoot();
+    benchTxId();
+    benchMining();
+
+    std::error_code ec;
+    std::filesystem::remove_all(g_options.dataDir, ec);
+    {
+        Json::Value cfg;
+        cfg["dataDir"] = g_options.dataDir;
+        cfg["dbCacheMB"] = Json::UInt64(g_options.dbCacheMB);
+        Blockchain chain(cfg);
+        // The synthetic chain builds on genesis, so it goes first
+        benchConnectBlocks(chain);
+        benchUtxo(chain);
+    }
+    std::filesystem::remove_all(g_options.dataDir, ec);
+
+    std::cout.rdbuf(stdoutBuffer);
+    std::cout.clear();
+    doc["benchmarks"] = g_results;
+    Json::StreamWriterBuilder writer;
+    writer["indentation"] = "  ";
+    std::string json = Json::writeString(writer, doc) + "\n";
+    if (g_options.out.empty()) {
+        std::cout << json;
+    } else {
+        std::ofstream file(g_options.out, std::ios::trunc);
+        if (!(file << json)) {
+            std::cerr << "Cannot write " << g_options.out << std::endl;
+            return 1;
+        }
+        std::cerr << "[Bench] Results written to " << g_options.out << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,351 @@
+#pragma once
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <unordered_map>
+#include <algorithm>
+#include "blockchain_core.cpp"
+
+// ------------------- BLOCK DOWNLOAD -------------------
+// Headers-first sync. Headers are cheap to fetch and check (PoW, linkage), so
+// the header chain ahead of our blocks is learned first; it may start from any
+// block we have, so a competing branch is fetched like the one we follow. A
+// branch with more work than the queued one replaces it from the fork on.
+// Bodies for the next kBlockDownloadWindow heights are then requested from
+// every peer that announced them, at most kMaxBlocksInFlightPerPeer per peer.
+// Queued headers no connected peer offers any more (it left, or answered
+// notfound) are dropped so the caller can ask around again. Bodies
+// arriving out of order are buffered and handed to the chain strictly in
+// height order; the chain stores them and switches to whichever branch has
+// the most work.
+//
+// A request not answered within kBlockRequestTimeoutMs is handed to another
+// peer. A peer holding up the whole window (everything else in it has been
+// claimed, but the block we need next hasn't arrived) for longer than the stall
+// timeout is reported so the caller can drop it. The timeout doubles on each
+// stall and decays as blocks connect.
+//
+// Peers are identified by number only, so this knows nothing about sockets.
+
+static const size_t kBlockDownloadWindow = 1024;
+static const size_t kMaxBlocksInFlightPerPeer = 16;
+static const size_t kMaxBufferedBlockBytes = 256u << 20;
+static const int64_t kBlockRequestTimeoutMs = 30000;
+static const int64_t kMinStallTimeoutMs = 2000;
+static const int64_t kMaxStallTimeoutMs = 64000;
+
+static int64_t steadyMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class BlockDownloader {
+public:
+    // Track a newly connected peer; only tracked peers are asked for blocks
+    void peerConnected(uint64_t peer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        peers[peer] = PeerState();
+    }
+
+    // Queue headers a peer sent. Those we already have are skipped; the rest
+    // branch off a queued header or a block we have. Extending our best known
+    // header (or with nothing queued) they are appended; branching off earlier,
+    // they replace the queue from the fork on if their chain has more work and
+    // are ignored otherwise. A header that doesn't link stops the batch.
+    // lastHeight receives the height of the last header that linked, or 0.
+    // Returns false on a header with bad PoW.
+    bool addHeaders(Blockchain &chain, uint64_t peer, const std::vector<BlockHeader> &headers, uint64_t &lastHeight) {
+        std::lock_guard<std::mutex> lock(mutex);
+        syncWithChain(chain);
+        lastHeight = 0;
+        size_t i = 0;
+        for (; i < headers.size(); i++) {
+            uint64_t height;
+            auto it = heights.find(headers[i].getHash());
+            if (it != heights.end()) {
+                lastHeight = it->second;
+                noteAnnounced(peer, lastHeight);
+            } else if (chain.lookupBlock(headers[i].getHash(), height)) {
+                lastHeight = height;
+            } else {
+                break;
+            }
+        }
+        if (i == headers.size()) return true;
+        size_t fork; // queue position of the first new header
+        uint64_t parentHeight;
+        uint64_t work;
+        auto parent = heights.find(headers[i].prevBlockHash);
+        if (parent != heights.end()) {
+            parentHeight = parent->second;
+            fork = parentHeight + 1 - firstHeight;
+            work = slots[fork - 1].chainWork;
+        } else if (chain.lookupBlock(headers[i].prevBlockHash, parentHeight, work)) {
+            fork = 0;
+        } else {
+            return true;
+        }
+        std::vector<Slot> branch;
+        for (; i < headers.size(); i++) {
+            const BlockHeader &header = headers[i];
+            uint256 hash = header.getHash();
+            if (!branch.empty() && header.prevBlockHash != branch.back().hash) break;
+            if (!Blockchain::checkProofOfWork(hash, header.difficultyTarget)) return false;
+            work += getBlockProof(header);
+            Slot slot;
+            slot.hash = hash;
+            slot.chainWork = work;
+            branch.push_back(slot);
+        }
+        lastHeight = parentHeight + branch.size();
+        if (fork < slots.size()) {
+            // A competing branch: ties go to the one queued first
+            if (work <= slots.back().chainWork) return true;
+            truncate(fork);
+        }
+        if (slots.empty()) firstHeight = parentHeight + 1;
+        for (auto &slot : branch) {
+            heights[slot.hash] = firstHeight + slots.size();
+            slots.push_back(slot);
+        }
+        noteAnnounced(peer, lastHeight);
+        return true;
+    }
+
+    // Hash of the last queued header, if any (to extend a getheaders locator)
+    bool getBestHeader(uint256 &hash) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (slots.empty()) return false;
+        hash = slots.back().hash;
+        return true;
+    }
+
+    // Whether a block just connected is the last one we know of (nothing is
+    // queued after it), i.e. worth announcing
+    bool isBestHeader(const uint256 &hash) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return slots.empty() || slots.back().hash == hash;
+    }
+
+    // Claim up to the peer's free slots of unrequested blocks inside the window
+    // that it announced; the caller sends the getdata
+    std::vector<uint256> requestBlocks(uint64_t peer, int64_t now) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<uint256> out;
+        auto it = peers.find(peer);
+        if (it == peers.end()) return out;
+        size_t &inFlight = it->second.inFlight;
+        size_t end = std::min(slots.size(), kBlockDownloadWindow);
+        for (size_t i = 0; i < end && inFlight < kMaxBlocksInFlightPerPeer; i++) {
+            if (firstHeight + i > it->second.announced) break;
+            Slot &slot = slots[i];
+            if (slot.block || slot.peer) continue;
+            // Enough is buffered ahead; only the block everything waits on may still go out
+            if (i > 0 && bufferedBytes >= kMaxBufferedBlockBytes) break;
+            slot.peer = peer;
+            slot.requestedAt = now;
+            inFlight++;
+            out.push_back(slot.hash);
+        }
+        return out;
+    }
+
+    // Buffer a delivered body. False if it isn't one we're downloading.
+    bool blockReceived(uint64_t peer, const std::shared_ptr<const Block> &block, size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = heights.find(block->getBlockHash());
+        if (it == heights.end()) return false;
+        Slot &slot = slots[it->second - firstHeight];
+        if (slot.block) return true; // duplicate
+        release(slot);
+        slot.block = block;
+        slot.size = size;
+        slot.source = peer;
+        bufferedBytes += size;
+        return true;
+    }
+
+    // Hand buffered blocks whose parent we have to the chain, in order. Only one thread
+    // connects at a time; others return at once and their blocks are picked up
+    // by the one connecting. Peers that delivered invalid blocks are added to
+    // badPeers. Returns how many blocks this call connected.
+    size_t connectReady(Blockchain &chain, std::vector<uint64_t> &badPeers) {
+        size_t connected = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> connectLock(connectMutex, std::try_to_lock);
+                if (!connectLock.owns_lock()) return connected;
+                while (true) {
+                    std::shared_ptr<const Block> block;
+                    uint64_t source;
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        syncWithChain(chain);
+                        if (slots.empty() || !slots.front().block) break;
+                        block = slots.front().block;
+                        source = slots.front().source;
+                    }
+                    // Validation runs without the lock so deliveries keep being buffered
+                    bool linked = chain.hasBlock(block->header.prevBlockHash);
+                    bool ok = linked && chain.addBlock(*block);
+                    std::lock_guard<std::mutex> lock(mutex);
+                    syncWithChain(chain); // pops the block if it was stored
+                    if (!ok) {
+                        // Either its parent turned out invalid or it is invalid itself.
+                        // Either way nothing queued from it on can connect.
+                        if (linked) badPeers.push_back(source);
+                        if (!slots.empty() && slots.front().block == block) clear();
+                        break;
+                    }
+                    stallTimeoutMs = std::max(kMinStallTimeoutMs, stallTimeoutMs * 85 / 100);
+                    connected++;
+                }
+            }
+            // A block may have arrived while the connect lock was being released
+            std::lock_guard<std::mutex> lock(mutex);
+            if (slots.empty() || !slots.front().block) return connected;
+        }
+    }
+
+    // Hand timed-out requests back to the pool and report peers stalling the
+    // window
+    std::vector<uint64_t> checkTimeouts(Blockchain &chain, int64_t now) {
+        std::lock_guard<std::mutex> lock(mutex);
+        syncWithChain(chain);
+        std::vector<uint64_t> stalling;
+        if (slots.empty()) return stalling;
+        size_t end = std::min(slots.size(), kBlockDownloadWindow);
+        for (size_t i = 0; i < end; i++) {
+            Slot &slot = slots[i];
+            if (slot.peer && now - slot.requestedAt > kBlockRequestTimeoutMs) release(slot);
+        }
+        const Slot &front = slots.front();
+        const Slot &last = slots[end - 1];
+        bool windowClaimed = last.peer || last.block;
+        if (front.peer && windowClaimed && now - front.requestedAt > stallTimeoutMs) {
+            stalling.push_back(front.peer);
+            stallTimeoutMs = std::min(kMaxStallTimeoutMs, stallTimeoutMs * 2);
+        }
+        return stalling;
+    }
+
+    // A peer doesn't have a block after all: take the request back and stop
+    // counting on the peer for it. Returns whether queued headers were dropped
+    // for nobody offering them any more.
+    bool blockNotFound(uint64_t peer, const uint256 &hash) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = heights.find(hash);
+        if (it == heights.end()) return false;
+        Slot &slot = slots[it->second - firstHeight];
+        if (slot.peer == peer) release(slot);
+        auto state = peers.find(peer);
+        if (state != peers.end()) state->second.announced = std::min(state->second.announced, it->second - 1);
+        return dropUnannounced();
+    }
+
+    // Return a departed peer's requests to the pool. Returns whether queued
+    // headers were dropped for nobody offering them any more.
+    bool peerDisconnected(uint64_t peer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &slot : slots) {
+            if (slot.peer == peer) release(slot);
+        }
+        peers.erase(peer);
+        return dropUnannounced();
+    }
+
+private:
+    struct Slot {
+        uint256 hash;
+        uint64_t chainWork = 0;              // of the chain ending in it
+        uint64_t peer = 0;                   // requested from (0 = not requested)
+        int64_t requestedAt = 0;
+        std::shared_ptr<const Block> block;  // received, waiting for its parent
+        size_t size = 0;
+        uint64_t source = 0;                 // who delivered it
+    };
+
+    struct PeerState {
+        size_t inFlight = 0;
+        uint64_t announced = 0; // height of the last queued header it sent us
+    };
+
+    void release(Slot &slot) {
+        if (!slot.peer) return;
+        auto it = peers.find(slot.peer);
+        if (it != peers.end() && it->second.inFlight > 0) it->second.inFlight--;
+        slot.peer = 0;
+    }
+
+    void noteAnnounced(uint64_t peer, uint64_t height) {
+        auto it = peers.find(peer);
+        if (it != peers.end()) it->second.announced = std::max(it->second.announced, height);
+    }
+
+    // Announcements above the queue's end were for headers no longer queued
+    void limitAnnounced() {
+        uint64_t last = slots.empty() ? 0 : firstHeight + slots.size() - 1;
+        for (auto &p : peers) {
+            p.second.announced = std::min(p.second.announced, last);
+        }
+    }
+
+    void popFront() {
+        Slot &slot = slots.front();
+        release(slot);
+        bufferedBytes -= slot.size;
+        heights.erase(slot.hash);
+        slots.pop_front();
+        firstHeight++;
+        if (slots.empty()) limitAnnounced();
+    }
+
+    // Drop the queued headers from position `keep` on
+    void truncate(size_t keep) {
+        while (slots.size() > keep) {
+            Slot &slot = slots.back();
+            release(slot);
+            bufferedBytes -= slot.size;
+            heights.erase(slot.hash);
+            slots.pop_back();
+        }
+        limitAnnounced();
+    }
+
+    void clear() {
+        truncate(0);
+    }
+
+    // Nobody left to ask for a block no connected peer announced: drop the
+    // queue from the first such block not already buffered
+    bool dropUnannounced() {
+        uint64_t announced = 0;
+        for (auto &p : peers) {
+            announced = std::max(announced, p.second.announced);
+        }
+        size_t keep = 0;
+        while (keep < slots.size() && (firstHeight + keep <= announced || slots[keep].block)) keep++;
+        if (keep == slots.size()) return false;
+        truncate(keep);
+        return true;
+    }
+
+    // Drop queued blocks the chain already has, on whichever branch. The rest
+    // still link to what it has, whatever its tip did meanwhile.
+    void syncWithChain(Blockchain &chain) {
+        while (!slots.empty() && chain.hasBlock(slots.front().hash)) {
+            popFront();
+        }
+    }
+
+    std::mutex mutex;
+    std::mutex connectMutex;
+    std::deque<Slot> slots;          // slots[i] is the block at height firstHeight + i
+    uint64_t firstHeight = 0;
+    std::unordered_map<uint256, uint64_t, Uint256Hasher> heights;
+    std::unordered_map<uint64_t, PeerState> peers; // connected peers
+    size_t bufferedBytes = 0;
+    int64_t stallTimeoutMs = kMinStallTimeoutMs;
+};
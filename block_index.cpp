@@ -0,0 +1,148 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <unordered_map>
+#include "primitives.cpp"
+
+// ------------------- BLOCK INDEX -------------------
+// Every stored block, on the active chain or not, as a tree linked to its
+// parent. Each entry carries the total work of the chain ending in it, so the
+// best chain is simply the entry with the most work. Entries are created once
+// and never freed while the node runs; everything but `status` is fixed at
+// creation, so readers may walk prev/skip links without a lock.
+//
+// `skip` points at an ancestor chosen so that getAncestor() reaches any height
+// in O(log n) hops (the same scheme as Bitcoin's CBlockIndex::pskip).
+
+// Expected number of hashes to find a block: a hash starting with two zero
+// bytes (Blockchain::checkProofOfWork) takes 2^16 tries on average
+static uint64_t getBlockProof(const BlockHeader &header) {
+    (void)header;
+    return uint64_t(1) << 16;
+}
+
+struct BlockIndex {
+    enum : uint32_t {
+        HAVE_UNDO = 1, // connected once: its undo record is stored and the block is valid
+        FAILED = 2,    // invalid, or descends from an invalid block
+    };
+
+    uint256 hash;
+    BlockHeader header;
+    uint32_t height = 0;
+    uint32_t position = 0;       // record number in the block store
+    uint64_t chainWork = 0;      // including this block
+    BlockIndex *prev = nullptr;
+    BlockIndex *skip = nullptr;
+    std::atomic<uint32_t> status{0}; // set under the chain's connect lock
+
+    // The ancestor at `target` height (this one if equal), or nullptr if higher
+    const BlockIndex *getAncestor(uint32_t target) const {
+        if (target > height) return nullptr;
+        const BlockIndex *walk = this;
+        uint32_t walkHeight = height;
+        while (walkHeight > target) {
+            uint32_t skipHeight = getSkipHeight(walkHeight);
+            uint32_t skipHeightPrev = getSkipHeight(walkHeight - 1);
+            // Take the skip unless it overshoots, or the parent's skip gets closer
+            if (walk->skip && (skipHeight == target
+                               || (skipHeight > target && !(skipHeightPrev + 2 < skipHeight && skipHeightPrev >= target)))) {
+                walk = walk->skip;
+                walkHeight = skipHeight;
+            } else {
+                walk = walk->prev;
+                walkHeight--;
+            }
+        }
+        return walk;
+    }
+
+    BlockIndex *getAncestor(uint32_t target) {
+        return const_cast<BlockIndex*>(static_cast<const BlockIndex*>(this)->getAncestor(target));
+    }
+
+    void buildSkip() {
+        if (prev) skip = prev->getAncestor(getSkipHeight(height));
+    }
+
+    // Clear the lowest set bit, twice for odd heights: spreads skip targets so
+    // that any height is a few hops away
+    static uint32_t getSkipHeight(uint32_t h) {
+        if (h < 2) return 0;
+        return (h & 1) ? invertLowestOne(invertLowestOne(h - 1)) + 1 : invertLowestOne(h);
+    }
+
+private:
+    static uint32_t invertLowestOne(uint32_t n) {
+        return n & (n - 1);
+    }
+};
+
+// Last block both chains share
+static const BlockIndex *findFork(const BlockIndex *a, const BlockIndex *b) {
+    if (!a || !b) return nullptr;
+    if (a->height > b->height) a = a->getAncestor(b->height);
+    else if (b->height > a->height) b = b->getAncestor(a->height);
+    while (a != b) {
+        a = a->prev;
+        b = b->prev;
+    }
+    return a;
+}
+
+// hash -> entry for every stored block
+class BlockTree {
+public:
+    // Add a block whose parent is already in the tree (or the genesis block)
+    BlockIndex *add(const uint256 &hash, const BlockHeader &header, uint32_t position) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &slot = entries[hash];
+        if (slot) return slot.get();
+        slot.reset(new BlockIndex());
+        BlockIndex *entry = slot.get();
+        entry->hash = hash;
+        entry->header = header;
+        entry->position = position;
+        auto parent = entries.find(header.prevBlockHash);
+        if (parent != entries.end() && parent->second.get() != entry) {
+            entry->prev = parent->second.get();
+            entry->height = entry->prev->height + 1;
+            entry->chainWork = entry->prev->chainWork;
+        }
+        entry->chainWork += getBlockProof(header);
+        entry->buildSkip();
+        return entry;
+    }
+
+    BlockIndex *find(const uint256 &hash) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(hash);
+        return it == entries.end() ? nullptr : it->second.get();
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+    // Visit every entry (under the lock: fn must not call back in)
+    template <typename Fn>
+    void forEach(Fn fn) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &e : entries) {
+            fn(e.second.get());
+        }
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+    }
+
+private:
+    std::mutex mutex;
+    std::unordered_map<uint256, std::unique_ptr<BlockIndex>, Uint256Hasher> entries;
+};
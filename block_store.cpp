@@ -0,0 +1,514 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <cstdio>
+#include <unordered_map>
+#include "primitives.cpp"
+#include "fs_util.cpp"
+
+// ------------------- BLOCK STORAGE -------------------
+// <dir>/blkNNNNN.dat  append-only segments of "MCBK" | size(LE32) | serialized block,
+//                     a new segment is started once one passes kMaxBlockFileSize
+// <dir>/index.dat     128-byte file header, then one fixed-size record per block in
+//                     the order blocks were stored (any branch), its "position":
+//                     hash(32) | header(80) | height(LE32) | file(LE32) | offset(LE32) | size(LE32)
+//                     | undo file(LE32) | undo offset(LE32) | undo size(LE32)
+// <dir>/revNNNNN.dat  append-only segments of undo records, written when a block
+//                     is first connected: "MCUN" | size(LE32) | block hash(32) | data
+//
+// A block is written and synced to its segment before its index record is
+// appended, so every record on disk points at a complete body; likewise its
+// undo record is synced before the index record is pointed at it (an undo
+// offset of 0 means none yet). Startup maps the index and builds the
+// hash -> position table; bodies and undo data are read on demand.
+
+static const size_t kBlockIndexHeaderSize = 128;
+static const size_t kBlockIndexRecordSize = 140;
+static const size_t kOldBlockIndexRecordSize = 128; // "MCBIDX01": no undo location
+static const uint64_t kMaxBlockFileSize = 128ull << 20;
+static const size_t kBlockRecordPrefix = 8; // "MCBK" | size
+static const size_t kUndoRecordPrefix = 40; // "MCUN" | size | block hash
+
+// One index record, decoded
+struct BlockIndexEntry {
+    uint256 hash;
+    BlockHeader header;
+    uint32_t height = 0; // in the block tree
+    uint32_t file = 0;
+    uint32_t offset = 0; // of the block bytes (after the record prefix)
+    uint32_t size = 0;
+    uint32_t undoFile = 0;
+    uint32_t undoOffset = 0; // of the undo data (after the record prefix); 0 = none
+    uint32_t undoSize = 0;
+};
+
+class BlockStore {
+public:
+    ~BlockStore() { close(); }
+
+    // Open (or create) the store. On failure the store keeps blocks in memory.
+    bool open(const std::string &directory) {
+        std::lock_guard<std::mutex> lock(mutex);
+        closeLocked();
+        dir = directory;
+        if (!ensureDirectory(dir)) {
+            std::cerr << "[BlockStore] Cannot create directory " << dir << std::endl;
+            return false;
+        }
+        indexFd = openFile(indexPath(), true);
+        if (indexFd < 0) {
+            std::cerr << "[BlockStore] Cannot open " << indexPath() << std::endl;
+            return false;
+        }
+        if (!loadIndex()) {
+            std::cerr << "[BlockStore] Corrupt block index " << indexPath() << std::endl;
+            closeLocked();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closeLocked();
+    }
+
+    bool isOpen() const { return indexFd >= 0; }
+
+    // Number of stored blocks
+    uint32_t count() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return mappedCount + static_cast<uint32_t>(pending.size());
+    }
+
+    bool getEntry(uint32_t position, BlockIndexEntry &out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entryAt(position, out);
+    }
+
+    // Position of a stored block, by hash
+    bool findPosition(const uint256 &hash, uint32_t &position) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = positions.find(hash);
+        if (it == positions.end()) return false;
+        position = it->second;
+        return true;
+    }
+
+    // Load a block body from its segment
+    bool readBlock(uint32_t position, Block &out) {
+        BlockIndexEntry e;
+        std::string buf;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!entryAt(position, e)) return false;
+            if (indexFd < 0) {
+                buf = memoryBodies[position];
+            } else {
+                int fd = segmentFd(e.file, false);
+                buf.resize(kBlockRecordPrefix + e.size);
+                if (fd < 0 || !readAt(fd, &buf[0], buf.size(), e.offset - kBlockRecordPrefix)) {
+                    std::cerr << "[BlockStore] Cannot read block " << e.hash.toHex() << std::endl;
+                    return false;
+                }
+                const unsigned char *p = reinterpret_cast<const unsigned char*>(buf.data());
+                if (std::memcmp(p, "MCBK", 4) != 0 || readLE32(p + 4) != e.size) {
+                    std::cerr << "[BlockStore] Bad record for block " << e.hash.toHex() << std::endl;
+                    return false;
+                }
+                buf.erase(0, kBlockRecordPrefix);
+            }
+        }
+        if (!out.deserialize(reinterpret_cast<const unsigned char*>(buf.data()), buf.size())
+            || out.getBlockHash() != e.hash) {
+            std::cerr << "[BlockStore] Corrupt block " << e.hash.toHex() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Append a block at the next position; `height` is where it sits in the tree
+    bool appendBlock(const Block &block, uint32_t height, uint32_t &position) {
+        std::string body;
+        block.serialize(body);
+        std::lock_guard<std::mutex> lock(mutex);
+
+        BlockIndexEntry e;
+        e.hash = block.getBlockHash();
+        e.header = block.header;
+        e.height = height;
+        e.size = static_cast<uint32_t>(body.size());
+        position = mappedCount + static_cast<uint32_t>(pending.size());
+
+        if (indexFd < 0) {
+            // Memory-only fallback
+            memoryBodies.push_back(std::move(body));
+        } else {
+            if (currentFileSize > 0 && currentFileSize + kBlockRecordPrefix + body.size() > kMaxBlockFileSize) {
+                currentFile++;
+                currentFileSize = 0;
+            }
+            int fd = segmentFd(currentFile, true);
+            if (fd < 0) return false;
+            std::string rec("MCBK", 4);
+            appendLE32(rec, e.size);
+            rec += body;
+            if (!writeAt(fd, rec.data(), rec.size(), currentFileSize) || !syncFile(fd)) {
+                std::cerr << "[BlockStore] Failed to write block " << e.hash.toHex() << std::endl;
+                return false;
+            }
+            e.file = currentFile;
+            e.offset = static_cast<uint32_t>(currentFileSize + kBlockRecordPrefix);
+            currentFileSize += rec.size();
+
+            unsigned char raw[kBlockIndexRecordSize];
+            encodeEntry(e, raw);
+            uint64_t pos = kBlockIndexHeaderSize + uint64_t(position) * kBlockIndexRecordSize;
+            if (!writeAt(indexFd, raw, sizeof(raw), pos) || !syncFile(indexFd)) {
+                std::cerr << "[BlockStore] Failed to index block " << e.hash.toHex() << std::endl;
+                return false;
+            }
+        }
+        positions[e.hash] = position;
+        pending.push_back(e);
+        // Fold new records into the mapping now and then rather than on every block
+        if (indexFd >= 0 && pending.size() >= 1024) remapIndex();
+        return true;
+    }
+
+    // Store the undo record of a stored block (see Blockchain::connectTip) and
+    // point its index record at it. Synced before returning: the chainstate may
+    // only move past the block after this.
+    bool writeUndo(const uint256 &hash, const std::string &data) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto pos = positions.find(hash);
+        if (pos == positions.end()) return false;
+        uint32_t position = pos->second;
+        if (indexFd < 0) {
+            memoryUndo.emplace(position, data);
+            return true;
+        }
+        BlockIndexEntry e;
+        if (!entryAt(position, e)) return false;
+        if (e.undoOffset) return true;
+        if (undoFileSize > 0 && undoFileSize + kUndoRecordPrefix + data.size() > kMaxBlockFileSize) {
+            undoFile++;
+            undoFileSize = 0;
+        }
+        int fd = undoFd(undoFile, true);
+        if (fd < 0) return false;
+        std::string rec("MCUN", 4);
+        appendLE32(rec, static_cast<uint32_t>(data.size()));
+        appendBytes(rec, hash.data, 32);
+        rec += data;
+        if (!writeAt(fd, rec.data(), rec.size(), undoFileSize) || !syncFile(fd)) {
+            std::cerr << "[BlockStore] Failed to write undo data for " << hash.toHex() << std::endl;
+            return false;
+        }
+        e.undoFile = undoFile;
+        e.undoOffset = static_cast<uint32_t>(undoFileSize + kUndoRecordPrefix);
+        e.undoSize = static_cast<uint32_t>(data.size());
+        undoFileSize += rec.size();
+
+        unsigned char raw[kBlockIndexRecordSize];
+        encodeEntry(e, raw);
+        uint64_t at = kBlockIndexHeaderSize + uint64_t(position) * kBlockIndexRecordSize;
+        if (!writeAt(indexFd, raw, sizeof(raw), at) || !syncFile(indexFd)) {
+            std::cerr << "[BlockStore] Failed to index undo data for " << hash.toHex() << std::endl;
+            return false;
+        }
+        // The mapping may not see the write (or be a copy); remember it until the next remap
+        if (position < mappedCount) undoPatches[position] = e;
+        else pending[position - mappedCount] = e;
+        return true;
+    }
+
+    bool hasUndo(const uint256 &hash) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto pos = positions.find(hash);
+        if (pos == positions.end()) return false;
+        if (indexFd < 0) return memoryUndo.count(pos->second) != 0;
+        BlockIndexEntry e;
+        return entryAt(pos->second, e) && e.undoOffset != 0;
+    }
+
+    // Load a block's undo data from its segment
+    bool readUndo(const uint256 &hash, std::string &out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto pos = positions.find(hash);
+        if (pos == positions.end()) return false;
+        if (indexFd < 0) {
+            auto it = memoryUndo.find(pos->second);
+            if (it == memoryUndo.end()) return false;
+            out = it->second;
+            return true;
+        }
+        BlockIndexEntry e;
+        if (!entryAt(pos->second, e) || !e.undoOffset) return false;
+        int fd = undoFd(e.undoFile, false);
+        std::string buf(kUndoRecordPrefix + e.undoSize, '\0');
+        if (fd < 0 || !readAt(fd, &buf[0], buf.size(), e.undoOffset - kUndoRecordPrefix)) {
+            std::cerr << "[BlockStore] Cannot read undo data for " << hash.toHex() << std::endl;
+            return false;
+        }
+        const unsigned char *p = reinterpret_cast<const unsigned char*>(buf.data());
+        if (std::memcmp(p, "MCUN", 4) != 0 || readLE32(p + 4) != e.undoSize || std::memcmp(p + 8, hash.data, 32) != 0) {
+            std::cerr << "[BlockStore] Bad undo record for block " << hash.toHex() << std::endl;
+            return false;
+        }
+        out.assign(buf, kUndoRecordPrefix, std::string::npos);
+        return true;
+    }
+
+    // Delete every block and start over empty
+    bool wipe() {
+        std::lock_guard<std::mutex> lock(mutex);
+        bool wasOpen = indexFd >= 0;
+        uint32_t lastFile = currentFile;
+        uint32_t lastUndoFile = undoFile;
+        closeLocked();
+        memoryBodies.clear();
+        memoryUndo.clear();
+        if (!wasOpen) return true;
+        for (uint32_t f = 0; f <= lastFile; f++) {
+            std::remove(segmentPath(f).c_str());
+        }
+        for (uint32_t f = 0; f <= lastUndoFile; f++) {
+            std::remove(undoPath(f).c_str());
+        }
+        std::remove(indexPath().c_str());
+        syncDirectory(dir);
+        indexFd = openFile(indexPath(), true);
+        return indexFd >= 0 && loadIndex();
+    }
+
+private:
+    std::string indexPath() const { return dir + "/index.dat"; }
+
+    std::string segmentPath(uint32_t file) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/blk%05u.dat", file);
+        return dir + name;
+    }
+
+    int segmentFd(uint32_t file, bool create) {
+        if (file >= segments.size()) segments.resize(file + 1, -1);
+        if (segments[file] < 0) segments[file] = openFile(segmentPath(file), create);
+        return segments[file];
+    }
+
+    std::string undoPath(uint32_t file) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/rev%05u.dat", file);
+        return dir + name;
+    }
+
+    int undoFd(uint32_t file, bool create) {
+        if (file >= undoSegments.size()) undoSegments.resize(file + 1, -1);
+        if (undoSegments[file] < 0) undoSegments[file] = openFile(undoPath(file), create);
+        return undoSegments[file];
+    }
+
+    static void encodeEntry(const BlockIndexEntry &e, unsigned char *p) {
+        std::memcpy(p, e.hash.data, 32);
+        e.header.serialize(p + 32);
+        writeLE32(p + 112, e.height);
+        writeLE32(p + 116, e.file);
+        writeLE32(p + 120, e.offset);
+        writeLE32(p + 124, e.size);
+        writeLE32(p + 128, e.undoFile);
+        writeLE32(p + 132, e.undoOffset);
+        writeLE32(p + 136, e.undoSize);
+    }
+
+    static void decodeEntry(const unsigned char *p, BlockIndexEntry &e) {
+        std::memcpy(e.hash.data, p, 32);
+        e.header.deserialize(p + 32);
+        e.height = readLE32(p + 112);
+        e.file = readLE32(p + 116);
+        e.offset = readLE32(p + 120);
+        e.size = readLE32(p + 124);
+        e.undoFile = readLE32(p + 128);
+        e.undoOffset = readLE32(p + 132);
+        e.undoSize = readLE32(p + 136);
+    }
+
+    bool entryAt(uint32_t position, BlockIndexEntry &out) const {
+        if (position < mappedCount) {
+            auto patched = undoPatches.find(position);
+            if (patched != undoPatches.end()) out = patched->second;
+            else decodeEntry(index.data + kBlockIndexHeaderSize + size_t(position) * kBlockIndexRecordSize, out);
+            return true;
+        }
+        if (position - mappedCount < pending.size()) {
+            out = pending[position - mappedCount];
+            return true;
+        }
+        return false;
+    }
+
+    bool remapIndex() {
+        MappedFile fresh;
+        if (!mapFile(indexFd, fresh)) return false;
+        unmapFile(index);
+        index = std::move(fresh);
+        uint64_t records = index.size > kBlockIndexHeaderSize
+            ? (index.size - kBlockIndexHeaderSize) / kBlockIndexRecordSize : 0;
+        mappedCount = static_cast<uint32_t>(records);
+        pending.clear();
+        undoPatches.clear();
+        return true;
+    }
+
+    // Map index.dat, drop any tail that doesn't point at a complete body, and
+    // build the hash table
+    bool loadIndex() {
+        if (fileSize(indexFd) < kBlockIndexHeaderSize) {
+            unsigned char header[kBlockIndexHeaderSize] = {0};
+            std::memcpy(header, "MCBIDX02", 8);
+            if (!truncateFile(indexFd, 0) || !writeAt(indexFd, header, sizeof(header), 0) || !syncFile(indexFd)) {
+                return false;
+            }
+        }
+        if (!remapIndex()) return false;
+        if (std::memcmp(index.data, "MCBIDX01", 8) == 0 && !upgradeIndex()) return false;
+        if (std::memcmp(index.data, "MCBIDX02", 8) != 0) return false;
+
+        // Walk back over records whose body didn't make it to disk (or a torn record)
+        uint32_t valid = mappedCount;
+        while (valid > 0) {
+            BlockIndexEntry e;
+            entryAt(valid - 1, e);
+            int fd = segmentFd(e.file, false);
+            if (fd >= 0 && uint64_t(e.offset) + e.size <= fileSize(fd)) break;
+            valid--;
+        }
+        uint64_t wantSize = kBlockIndexHeaderSize + uint64_t(valid) * kBlockIndexRecordSize;
+        if (wantSize != index.size) {
+            std::cerr << "[BlockStore] Truncating block index to " << valid << " complete record(s)" << std::endl;
+            if (!truncateFile(indexFd, wantSize) || !syncFile(indexFd) || !remapIndex()) return false;
+        }
+
+        positions.clear();
+        positions.reserve(mappedCount);
+        for (uint32_t i = 0; i < mappedCount; i++) {
+            uint256 hash;
+            std::memcpy(hash.data, index.data + kBlockIndexHeaderSize + size_t(i) * kBlockIndexRecordSize, 32);
+            positions[hash] = i;
+        }
+
+        // Resume appending right after the last indexed body
+        currentFile = 0;
+        currentFileSize = 0;
+        if (mappedCount > 0) {
+            BlockIndexEntry last;
+            entryAt(mappedCount - 1, last);
+            currentFile = last.file;
+            currentFileSize = uint64_t(last.offset) + last.size;
+            int fd = segmentFd(currentFile, false);
+            if (fd >= 0 && fileSize(fd) > currentFileSize) truncateFile(fd, currentFileSize);
+        }
+        // Undo records go after whatever the last segment holds; one torn by a
+        // crash is never pointed at, so it is simply left behind
+        undoFile = 0;
+        while (fileExists(undoPath(undoFile + 1))) undoFile++;
+        int fd = undoFd(undoFile, false);
+        undoFileSize = fd >= 0 ? fileSize(fd) : 0;
+        return true;
+    }
+
+    // Rewrite an index of the previous layout, which had no undo locations, in
+    // the current one. The undo segments are scanned this once to find them.
+    bool upgradeIndex() {
+        std::cout << "[BlockStore] Upgrading the block index" << std::endl;
+        std::unordered_map<uint256, BlockIndexEntry, Uint256Hasher> found;
+        for (uint32_t file = 0; ; file++) {
+            int fd = undoFd(file, false);
+            if (fd < 0) break;
+            uint64_t size = fileSize(fd);
+            uint64_t pos = 0;
+            unsigned char prefix[kUndoRecordPrefix];
+            while (pos + kUndoRecordPrefix <= size && readAt(fd, prefix, sizeof(prefix), pos)
+                   && std::memcmp(prefix, "MCUN", 4) == 0) {
+                uint32_t len = readLE32(prefix + 4);
+                if (pos + kUndoRecordPrefix + len > size) break;
+                uint256 hash;
+                std::memcpy(hash.data, prefix + 8, 32);
+                BlockIndexEntry &loc = found[hash];
+                loc.undoFile = file;
+                loc.undoOffset = static_cast<uint32_t>(pos + kUndoRecordPrefix);
+                loc.undoSize = len;
+                pos += kUndoRecordPrefix + len;
+            }
+        }
+        std::string out(reinterpret_cast<const char*>(index.data), kBlockIndexHeaderSize);
+        std::memcpy(&out[0], "MCBIDX02", 8);
+        size_t records = (index.size - kBlockIndexHeaderSize) / kOldBlockIndexRecordSize;
+        for (size_t i = 0; i < records; i++) {
+            const unsigned char *p = index.data + kBlockIndexHeaderSize + i * kOldBlockIndexRecordSize;
+            uint256 hash;
+            std::memcpy(hash.data, p, 32);
+            out.append(reinterpret_cast<const char*>(p), kOldBlockIndexRecordSize);
+            auto it = found.find(hash);
+            if (it == found.end()) {
+                out.append(12, '\0');
+                continue;
+            }
+            appendLE32(out, it->second.undoFile);
+            appendLE32(out, it->second.undoOffset);
+            appendLE32(out, it->second.undoSize);
+        }
+        std::string tmp = indexPath() + ".tmp";
+        int fd = openFile(tmp, true);
+        if (fd < 0) return false;
+        bool written = truncateFile(fd, 0) && writeAt(fd, out.data(), out.size(), 0) && syncFile(fd);
+        closeFile(fd);
+        if (!written || std::rename(tmp.c_str(), indexPath().c_str()) != 0) return false;
+        syncDirectory(dir);
+        unmapFile(index);
+        closeFile(indexFd);
+        indexFd = openFile(indexPath(), false);
+        return indexFd >= 0 && remapIndex();
+    }
+
+    void closeLocked() {
+        unmapFile(index);
+        if (indexFd >= 0) closeFile(indexFd);
+        indexFd = -1;
+        for (int fd : segments) {
+            if (fd >= 0) closeFile(fd);
+        }
+        segments.clear();
+        for (int fd : undoSegments) {
+            if (fd >= 0) closeFile(fd);
+        }
+        undoSegments.clear();
+        pending.clear();
+        undoPatches.clear();
+        positions.clear();
+        mappedCount = 0;
+        currentFile = 0;
+        currentFileSize = 0;
+        undoFile = 0;
+        undoFileSize = 0;
+    }
+
+    std::mutex mutex;
+    std::string dir;
+    int indexFd = -1;
+    MappedFile index;
+    uint32_t mappedCount = 0;              // records covered by `index`
+    std::vector<BlockIndexEntry> pending;  // appended since the last remap
+    std::unordered_map<uint256, uint32_t, Uint256Hasher> positions;
+    std::vector<int> segments;
+    uint32_t currentFile = 0;
+    uint64_t currentFileSize = 0;
+    std::unordered_map<uint32_t, BlockIndexEntry> undoPatches; // mapped records given undo data since the last remap
+    std::vector<int> undoSegments;
+    uint32_t undoFile = 0;
+    uint64_t undoFileSize = 0;
+    std::vector<std::string> memoryBodies; // only used when the store couldn't be opened
+    std::unordered_map<uint32_t, std::string> memoryUndo; // by position
+};
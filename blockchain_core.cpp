@@ -1,3 +1,4 @@
+#pragma once
 #include <iostream>
 #include <vector>
 #include <string>
@@ -6,14 +7,23 @@
 #include <ctime>
 #include <mutex>
 #include <fstream>
-#include <map>
 #include <cstdint>
+#include <cstring>
 #include <openssl/sha.h>
 #include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <functional>
 #include <jsoncpp/json/json.h>
+#include "primitives.cpp"
+#include "utxo_set.cpp"
+#include "utxo_db.cpp"
+#include "block_store.cpp"
+#include "sig_check.cpp"
+#include "mempool.cpp"
+#include "chain_snapshot.cpp"
 
 // ------------------- GLOBAL CONFIG / STRUCTS -------------------
-static std::mutex g_blockchainMutex; // For thread safety around blockchain
 
 // Basic function to load config.json:
 static Json::Value loadConfig(const std::string &filename) {
@@ -31,183 +41,153 @@ static Json::Value loadConfig(const std::string &filename) {
     return config;
 }
 
-// Simple SHA-256 wrapper using OpenSSL
-static std::string sha256(const std::string &input) {
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256(reinterpret_cast<const unsigned char*>(input.c_str()), input.size(), hash);
-    std::stringstream ss;
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
-        ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
-    }
-    return ss.str();
-}
-
-// Merkle root calculation for a list of transaction hashes
-static std::string calculateMerkleRoot(const std::vector<std::string> &txHashes) {
-    if (txHashes.empty()) {
-        return std::string(SHA256_DIGEST_LENGTH * 2, '0');
-    }
-
-    std::vector<std::string> currentLevel = txHashes;
-    while (currentLevel.size() > 1) {
-        if (currentLevel.size() % 2 != 0) {
-            currentLevel.push_back(currentLevel.back());
-        }
-        std::vector<std::string> newLevel;
-        for (size_t i = 0; i < currentLevel.size(); i += 2) {
-            newLevel.push_back(sha256(currentLevel[i] + currentLevel[i + 1]));
-        }
-        currentLevel = newLevel;
-    }
-    return currentLevel.front();
-}
-
-// Represents an input to a transaction, referencing a previous tx's output
-struct TxInput {
-    std::string txid;  // The transaction hash that this input references
-    uint32_t index;    // Which output index of the previous tx is used
-    std::string signature;  // ECDSA signature of the input (placeholder)
-
-    std::string toString() const {
-        std::stringstream ss;
-        ss << txid << index << signature;
-        return ss.str();
-    }
-};
-
-// Represents an output from a transaction, specifying the amount and "locking script"
-struct TxOutput {
-    uint64_t amount;           // Amount in "satoshis"
-    std::string pubKeyHash;    // Simplified "scriptPubKey" (hash of public key)
+// The UTXO set (chainstate): (txid, index) -> (amount, pubKeyHash), kept in
+// <dataDir>/chainstate behind a bounded write-back cache (see utxo_db.cpp).
+// Only block connection and mempool admission touch it, under the chain's
+// connect lock; everyone else reads the UTXO view of a ChainSnapshot.
+static UtxoCache g_utxoSet;
 
-    std::string toString() const {
-        std::stringstream ss;
-        ss << amount << pubKeyHash;
-        return ss.str();
-    }
-};
+typedef std::function<void(const Block &block, uint64_t height)> BlockConnectedListener;
+typedef std::function<void(const Block &block, uint64_t height)> BlockDisconnectedListener;
+typedef std::function<void(const TransactionRef &tx)> TransactionAcceptedListener;
 
-// Represents a transaction with multiple inputs and outputs
-class Transaction {
-public:
-    std::vector<TxInput> inputs;
-    std::vector<TxOutput> outputs;
-    uint32_t version;
-    uint32_t lockTime; // not fully used in this PoC
+// What connecting a block took from the UTXO set, so it can be disconnected
+// again: the coins its inputs spent, in input order, and any coin a coinbase
+// output overwrote (coinbase txids can repeat).
+//   compactSize(n) (amount(LE64) pubKeyHash(32))*n | compactSize(m) (output(LE32) amount pubKeyHash)*m
+struct BlockUndo {
+    std::vector<UTXO> spent;
+    std::vector<std::pair<uint32_t, UTXO>> replaced;
 
-    // For quick identification
-    std::string getTxId() const {
-        // We'll hash the entire transaction data
-        std::stringstream ss;
-        ss << version << lockTime;
-        for (auto &in : inputs) {
-            ss << in.toString();
+    void serialize(std::string &out) const {
+        appendCompactSize(out, spent.size());
+        for (auto &coin : spent) {
+            appendLE64(out, coin.amount);
+            appendBytes(out, coin.pubKeyHash.data, 32);
         }
-        for (auto &out : outputs) {
-            ss << out.toString();
+        appendCompactSize(out, replaced.size());
+        for (auto &r : replaced) {
+            appendLE32(out, r.first);
+            appendLE64(out, r.second.amount);
+            appendBytes(out, r.second.pubKeyHash.data, 32);
         }
-        return sha256(ss.str());
     }
-};
-
-// Represents a block header, separate from the transactions themselves
-struct BlockHeader {
-    uint32_t version;
-    std::string prevBlockHash;
-    std::string merkleRoot;
-    uint64_t timestamp;
-    uint32_t difficultyTarget;
-    uint64_t nonce;
-};
 
-// Represents a full block
-class Block {
-public:
-    BlockHeader header;
-    std::vector<Transaction> transactions;
-
-    // Return the block hash
-    std::string getBlockHash() const {
-        std::stringstream ss;
-        ss << header.version
-           << header.prevBlockHash
-           << header.merkleRoot
-           << header.timestamp
-           << header.difficultyTarget
-           << header.nonce;
-        return sha256(ss.str());
-    }
-
-    // Construct merkle root from this block's transactions
-    void buildMerkleRoot() {
-        std::vector<std::string> txHashes;
-        for (auto &tx : transactions) {
-            txHashes.push_back(tx.getTxId());
+    bool deserialize(const std::string &data) {
+        ByteReader in(reinterpret_cast<const unsigned char*>(data.data()), data.size());
+        uint64_t n = in.readCompactSize();
+        if (in.failed || n > in.left / 40) return false;
+        spent.resize(static_cast<size_t>(n));
+        for (auto &coin : spent) {
+            coin.amount = in.readU64();
+            in.readBytes(coin.pubKeyHash.data, 32);
         }
-        header.merkleRoot = calculateMerkleRoot(txHashes);
+        uint64_t m = in.readCompactSize();
+        if (in.failed || m > in.left / 44) return false;
+        replaced.resize(static_cast<size_t>(m));
+        for (auto &r : replaced) {
+            r.first = in.readU32();
+            r.second.amount = in.readU64();
+            in.readBytes(r.second.pubKeyHash.data, 32);
+        }
+        return !in.failed && in.left == 0;
     }
 };
 
-// In a real system, the UTXO set is typically a LevelDB or RocksDB database on disk.
-// For this proof-of-concept, we'll keep it in memory in a map: (txid:index) -> (amount, pubKeyHash).
-struct UTXO {
-    uint64_t amount;
-    std::string pubKeyHash;
-};
-
-static std::map<std::string, UTXO> g_utxoSet;
-
-static uint64_t g_totalBlocks = 0; // Track how many blocks are in the chain
-
 // The main Blockchain manager
 class Blockchain {
 private:
-    std::vector<Block> chain; 
+    BlockStore blockStore; // every block we have, on disk, in the order received
+    BlockTree blockTree;   // the same blocks as a tree, with cumulative work
+    BlockIndex *tipIndex = nullptr; // writer's view of the tip (under connectMutex)
+    ChainSnapshotRef snapshot; // current tip; only touched through std::atomic_load/store
+    std::mutex connectMutex; // serializes changes to the chain and the UTXO set (blocks, mempool admission)
+    bool chainstateWriteFailed = false; // the last UTXO flush failed (under connectMutex)
+    Mempool mempool;
     Json::Value config;
+    std::mutex listenersMutex;
+    std::vector<BlockConnectedListener> blockConnectedListeners;
+    std::vector<BlockDisconnectedListener> blockDisconnectedListeners;
+    std::vector<TransactionAcceptedListener> transactionAcceptedListeners;
 
     uint64_t blockReward;
     uint64_t blockHalvingInterval;
     uint32_t targetSpacing; // seconds
     uint32_t difficultyTarget; // we use a simplified difficulty mechanism
+    size_t maxBlockSize;
+
+    // Blocks connected and disconnected by one change of the active chain, in
+    // the order it happened; listeners hear about them once the lock is released
+    struct ChainEvent {
+        std::shared_ptr<const Block> block;
+        uint64_t height;
+        bool connected;
+    };
+    struct ChainUpdate {
+        std::vector<ChainEvent> blocks;
+        std::vector<TransactionRef> readded; // from disconnected blocks, back in the mempool
+    };
 
 public:
     Blockchain(const Json::Value &cfg)
-        : config(cfg) {
+        : mempool(g_utxoSet), config(cfg) {
         // Load config
         blockReward = cfg.get("blockReward", 50).asUInt64();
         blockHalvingInterval = cfg.get("blockHalvingInterval", 210000).asUInt64();
         targetSpacing = cfg.get("targetSpacing", 600).asUInt();
         difficultyTarget = 0x1f00ffff; // A simplistic placeholder
+        maxBlockSize = static_cast<size_t>(cfg.get("maxBlockSize", 2000000).asUInt64());
+        mempool.configure(static_cast<size_t>(cfg.get("maxMempoolMB", 300).asUInt64()) << 20,
+                          cfg.get("minRelayFeePerKB", 1000).asUInt64(), maxBlockSize - kBlockReservedBytes);
+
+        std::string dataDir = cfg.get("dataDir", "data").asString();
+        if (!blockStore.open(dataDir + "/blocks")) {
+            std::cerr << "[Blockchain] Block storage unavailable, keeping blocks in memory only" << std::endl;
+        }
+        // Open the chainstate; without it the node still runs, memory-only
+        size_t cacheBytes = static_cast<size_t>(cfg.get("dbCacheMB", 100).asUInt64()) << 20;
+        if (!g_utxoSet.open(dataDir + "/chainstate", cacheBytes)) {
+            std::cerr << "[Blockchain] Chainstate unavailable, keeping the UTXO set in memory only" << std::endl;
+        }
+
+        getSignatureCache().resize(static_cast<size_t>(cfg.get("sigCacheMB", 32).asUInt64()) << 20);
 
         // Build or load genesis block
-        if (chain.empty()) {
-            Block genesis = createGenesisBlock(cfg.get("genesisMessage", "Hello from Genesis!").asString());
-            chain.push_back(genesis);
-            g_totalBlocks = 1;
-            // Add coinbase UTXO from genesis
-            const Transaction &coinbaseTx = genesis.transactions.front();
-            for (size_t i = 0; i < coinbaseTx.outputs.size(); i++) {
-                std::string outKey = coinbaseTx.getTxId() + ":" + std::to_string(i);
-                UTXO utxo{coinbaseTx.outputs[i].amount, coinbaseTx.outputs[i].pubKeyHash};
-                g_utxoSet[outKey] = utxo;
-            }
+        Block genesis = createGenesisBlock(cfg.get("genesisMessage", "Hello from Genesis!").asString());
+        BlockIndexEntry first;
+        if (blockStore.getEntry(0, first) && first.hash != genesis.getBlockHash()) {
+            std::cout << "[Blockchain] Stored blocks belong to a different genesis; discarding them" << std::endl;
+            blockStore.wipe();
+            g_utxoSet.wipe();
+        }
+        if (blockStore.count() == 0) {
+            uint32_t position;
+            blockStore.appendBlock(genesis, 0, position);
         }
+        loadBlockTree();
+        activateStoredChain();
+    }
+
+    // Clean shutdown: leave nothing for the next start to replay
+    ~Blockchain() {
+        g_utxoSet.flush();
     }
 
     Block createGenesisBlock(const std::string &msg) {
         Block genesis;
         genesis.header.version = 1;
-        genesis.header.prevBlockHash = std::string(64, '0');
-        genesis.header.timestamp = static_cast<uint64_t>(std::time(nullptr));
+        genesis.header.prevBlockHash.setNull();
+        // Fixed timestamp: every node (and every restart) must derive the same genesis
+        genesis.header.timestamp = static_cast<uint32_t>(config.get("genesisTimestamp", 1700000000).asUInt());
         genesis.header.difficultyTarget = difficultyTarget;
         genesis.header.nonce = 0;
 
-        Transaction coinbaseTx;
+        MutableTransaction coinbaseTx;
         coinbaseTx.version = 1;
         coinbaseTx.lockTime = 0;
         // No real inputs
         TxInput in;
-        in.txid = "0";
+        in.txid.setNull();
         in.index = 0;
         in.signature = msg; // embed message in coinbase
         coinbaseTx.inputs.push_back(in);
@@ -218,98 +198,321 @@ public:
         out.pubKeyHash = sha256("genesis-pubkey"); 
         coinbaseTx.outputs.push_back(out);
 
-        genesis.transactions.push_back(coinbaseTx);
+        genesis.setTransactions({makeTransactionRef(std::move(coinbaseTx))});
         genesis.buildMerkleRoot();
 
         return genesis;
     }
 
+    // The chain as of the current tip. Never blocks; the snapshot stays valid
+    // (and unchanged) for as long as the caller holds it. Take one snapshot when
+    // several values have to agree with each other.
+    ChainSnapshotRef getSnapshot() const {
+        return std::atomic_load(&snapshot);
+    }
+
     // Return the most recent block
-    Block getLatestBlock() const {
-        return chain.back();
+    std::shared_ptr<const Block> getLatestBlock() const {
+        return getSnapshot()->tip;
     }
 
-    // Return entire chain
-    const std::vector<Block>& getChain() const {
-        return chain;
+    uint256 getTipHash() const {
+        return getSnapshot()->tipHash;
     }
 
-    // Add a new block to the chain (after validation)
-    bool addBlock(const Block &newBlock) {
-        // Basic checks
-        std::string prevHash = newBlock.header.prevBlockHash;
-        std::string latestHash = getLatestBlock().getBlockHash();
+    // Height of the tip (genesis = 0)
+    uint64_t getHeight() const {
+        return getSnapshot()->height;
+    }
 
-        if (prevHash != latestHash) {
-            std::cerr << "[Blockchain] Rejecting block: prevHash mismatch" << std::endl;
-            return false;
-        }
-        // Validate PoW
-        if (!isValidProofOfWork(newBlock)) {
-            std::cerr << "[Blockchain] Rejecting block: invalid PoW" << std::endl;
-            return false;
-        }
-        // Validate transactions, update UTXO set
-        if (!validateAndApplyTransactions(newBlock.transactions)) {
-            std::cerr << "[Blockchain] Rejecting block: invalid transaction(s)" << std::endl;
-            return false;
+    // Read a block of the active chain from disk
+    bool getBlock(uint64_t height, Block &out) {
+        const BlockIndex *entry = activeAt(height);
+        return entry && blockStore.readBlock(entry->position, out);
+    }
+
+    // Any stored block, on the active chain or not
+    bool getBlockByHash(const uint256 &hash, Block &out) {
+        const BlockIndex *entry = blockTree.find(hash);
+        return entry && blockStore.readBlock(entry->position, out);
+    }
+
+    // Header only; served from the block index without touching block files
+    bool getBlockHeader(uint64_t height, BlockHeader &out) {
+        const BlockIndex *entry = activeAt(height);
+        if (!entry) return false;
+        out = entry->header;
+        return true;
+    }
+
+    // Header of any stored block and its height in the tree, from the block index
+    bool getBlockHeaderByHash(const uint256 &hash, BlockHeader &out, uint64_t &height) {
+        const BlockIndex *entry = blockTree.find(hash);
+        if (!entry) return false;
+        out = entry->header;
+        height = entry->height;
+        return true;
+    }
+
+    bool getBlockHash(uint64_t height, uint256 &out) {
+        const BlockIndex *entry = activeAt(height);
+        if (!entry) return false;
+        out = entry->hash;
+        return true;
+    }
+
+    // Height of a block on the active chain, by hash
+    bool findBlockHeight(const uint256 &hash, uint64_t &height) {
+        const BlockIndex *entry = blockTree.find(hash);
+        if (!entry || activeAt(entry->height) != entry) return false;
+        height = entry->height;
+        return true;
+    }
+
+    // Whether we have a block and don't know it to be invalid, on any branch;
+    // height is its height in the tree
+    bool lookupBlock(const uint256 &hash, uint64_t &height) {
+        const BlockIndex *entry = blockTree.find(hash);
+        if (!entry || (entry->status & BlockIndex::FAILED)) return false;
+        height = entry->height;
+        return true;
+    }
+
+    // The same, also giving the total work of the chain ending in it
+    bool lookupBlock(const uint256 &hash, uint64_t &height, uint64_t &chainWork) {
+        const BlockIndex *entry = blockTree.find(hash);
+        if (!entry || (entry->status & BlockIndex::FAILED)) return false;
+        height = entry->height;
+        chainWork = entry->chainWork;
+        return true;
+    }
+
+    bool hasBlock(const uint256 &hash) {
+        uint64_t height;
+        return lookupBlock(hash, height);
+    }
+
+    // Hashes from the tip back to genesis: the last 10 blocks, then doubling the
+    // step, so a peer can find where our chains fork in O(log n) hashes
+    std::vector<uint256> getBlockLocator() {
+        std::vector<uint256> locator;
+        const BlockIndex *tip = getSnapshot()->tipIndex;
+        uint32_t height = tip->height;
+        uint32_t step = 1;
+        while (true) {
+            locator.push_back(tip->getAncestor(height)->hash);
+            if (height == 0) break;
+            if (locator.size() >= 10) step *= 2;
+            height = height > step ? height - step : 0;
         }
+        return locator;
+    }
 
-        // Everything is good
+    // Store a block and make the chain with the most work active. A block that
+    // doesn't extend the tip is kept on a side branch, and the chain reorganizes
+    // onto that branch once it has more work. Listeners hear about every block
+    // connected or disconnected, and about transactions a reorg puts back into
+    // the mempool. False if the block is invalid.
+    bool addBlock(const Block &newBlock) {
+        ChainUpdate update;
+        bool ok;
         {
-            std::lock_guard<std::mutex> lock(g_blockchainMutex);
-            chain.push_back(newBlock);
-            g_totalBlocks++;
+            std::lock_guard<std::mutex> connectLock(connectMutex);
+            BlockIndex *entry;
+            ok = acceptBlock(newBlock, entry);
+            if (ok && entry->chainWork > tipIndex->chainWork) {
+                ok = activateChain(entry, &newBlock, &update);
+            } else if (ok && tipIndex->getAncestor(entry->height) != entry) {
+                std::cout << "[Blockchain] Block " << entry->hash.toHex() << " stored on a side branch at height "
+                          << entry->height << std::endl;
+            }
         }
-        return true;
+        notifyListeners(update);
+        return ok;
+    }
+
+    // Run fn(block, height) after every block connected from now on, on the
+    // connecting thread. It may call back into the chain.
+    void addBlockConnectedListener(BlockConnectedListener fn) {
+        std::lock_guard<std::mutex> lock(listenersMutex);
+        blockConnectedListeners.push_back(std::move(fn));
+    }
+
+    // Same for blocks taken off the active chain by a reorg, tip first
+    void addBlockDisconnectedListener(BlockDisconnectedListener fn) {
+        std::lock_guard<std::mutex> lock(listenersMutex);
+        blockDisconnectedListeners.push_back(std::move(fn));
     }
 
     // Check the block's hash is below the difficulty target
     bool isValidProofOfWork(const Block &block) {
-        // Construct target from block.header.difficultyTarget
+        return checkProofOfWork(block.getBlockHash(), block.header.difficultyTarget);
+    }
+
+    static bool hasValidMerkleRoot(const Block &block) {
+        std::vector<uint256> txids;
+        txids.reserve(block.getTransactions().size());
+        for (auto &tx : block.getTransactions()) {
+            txids.push_back(tx->getTxId());
+        }
+        return calculateMerkleRoot(txids) == block.header.merkleRoot;
+    }
+
+    // Same check on an already computed hash, so the miner only hashes once per attempt
+    static bool checkProofOfWork(const uint256 &hash, uint32_t difficultyTarget) {
+        // Construct target from difficultyTarget
         // For simplicity, we interpret difficultyTarget as a 32-bit "network difficulty bits" 
         // but we won't fully replicate the Bitcoin alg. We'll just do a numeric compare.
+        (void)difficultyTarget;
 
-        std::string hash = block.getBlockHash();
         // Compare the first few hex digits
         // E.g., difficultyTarget=0x1f00ffff might require the first 4 hex digits to be zero
         // This is naive, but workable for demonstration.
 
-        // Let's say we require the first 4 hex chars to be '0'
+        // Let's say we require the first 4 hex chars (= first 2 bytes) to be zero
         // (You can do more elaborate decode of 'bits' for a real system.)
-        for (int i = 0; i < 4; i++) {
-            if (hash[i] != '0') {
-                return false;
-            }
-        }
-        return true;
+        return hash.data[0] == 0 && hash.data[1] == 0;
     }
 
     // Validate each transaction, ensure no double spends, correct signatures, etc.
-    bool validateAndApplyTransactions(const std::vector<Transaction> &transactions) {
-        for (auto &tx : transactions) {
-            if (!validateTransaction(tx)) {
+    // Runs in two phases so a large block uses every core:
+    //  1. parallel, against the UTXO set as it was before the block: context-free
+    //     checks, input lookups, and outpoints spent twice within the block;
+    //  2. ordered and short: resolve inputs that spend outputs created earlier in
+    //     the same block, then commit.
+    // Nothing is applied unless the whole block is valid; what is applied is recorded in `undo`.
+    bool validateAndApplyTransactions(const std::vector<TransactionRef> &transactions, uint64_t height, BlockUndo &undo) {
+        if (transactions.empty() || !transactions.front()->isCoinbase()) {
+            std::cerr << "First transaction must be the coinbase" << std::endl;
+            return false;
+        }
+        size_t n = transactions.size();
+        ThreadPool &pool = getWorkerPool();
+
+        // Inputs are numbered block-wide: tx i owns [inputStart[i], inputStart[i + 1])
+        std::vector<size_t> inputStart(n + 1, 0);
+        for (size_t i = 0; i < n; i++) {
+            inputStart[i + 1] = inputStart[i] + transactions[i]->inputs.size();
+        }
+        std::vector<UTXO> spentCoins(inputStart[n]);
+        std::vector<uint8_t> inSnapshot(inputStart[n], 0);
+        std::vector<TxCheck> checks(n);
+
+        // Phase 1: every transaction on its own
+        pool.parallelFor(n, 16, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                checkTransaction(i, *transactions[i], spentCoins.data() + inputStart[i], inSnapshot.data() + inputStart[i], checks[i]);
+            }
+        });
+        size_t firstDuplicate = findDuplicateInputs(transactions, inputStart);
+
+        // Phase 2: in block order, so the first invalid tx is the one reported
+        std::unordered_map<uint256, size_t, Uint256Hasher> blockTxIndex;
+        uint64_t fees = 0;
+        for (size_t i = 0; i < n; i++) {
+            TxCheck &check = checks[i];
+            if (!check.error.empty()) {
+                std::cerr << check.error << std::endl;
+                return false;
+            }
+            if (i == firstDuplicate) {
+                std::cerr << "Transaction " << transactions[i]->getTxId().toHex()
+                          << " spends an output already spent in this block" << std::endl;
+                return false;
+            }
+            if (!check.needsBlockOutputs) {
+                if (i > 0) fees += check.inputSum - check.outputSum;
+                continue;
+            }
+
+            if (blockTxIndex.empty()) {
+                blockTxIndex.reserve(n);
+                for (size_t j = 0; j < n; j++) {
+                    blockTxIndex.emplace(transactions[j]->getTxId(), j);
+                }
+            }
+            const Transaction &tx = *transactions[i];
+            for (size_t k = 0; k < tx.inputs.size(); k++) {
+                if (inSnapshot[inputStart[i] + k]) continue;
+                const TxInput &in = tx.inputs[k];
+                auto it = blockTxIndex.find(in.txid);
+                if (it == blockTxIndex.end() || it->second >= i
+                    || in.index >= transactions[it->second]->outputs.size()) {
+                    std::cerr << "Double spend or missing UTXO for " << OutPoint(in.txid, in.index).toString() << std::endl;
+                    return false;
+                }
+                const TxOutput &out = transactions[it->second]->outputs[in.index];
+                if (!makeSigCheck(tx, check.txDigest, k, out.pubKeyHash, i, check.sigChecks[k])) {
+                    std::cerr << "Bad signature script for " << OutPoint(in.txid, in.index).toString() << std::endl;
+                    return false;
+                }
+                check.inputSum += out.amount;
+            }
+            if (check.outputSum > check.inputSum) {
+                std::cerr << "Output sum exceeds input sum" << std::endl;
                 return false;
             }
-            // Update UTXO set
-            applyTransaction(tx);
+            fees += check.inputSum - check.outputSum;
+        }
+        // Coinbase creates new coins: bound its outputs by the block reward plus fees
+        if (checks[0].outputSum > getBlockReward(height) * 100000000ULL + fees) {
+            std::cerr << "Coinbase pays more than the block reward" << std::endl;
+            return false;
+        }
+
+        // Every signature of the block in one batch across the worker pool
+        SigCheckQueue sigQueue;
+        for (auto &check : checks) {
+            sigQueue.add(check.sigChecks);
+        }
+        size_t badTx;
+        if (!sigQueue.run(false, badTx)) {
+            std::cerr << "Invalid signature in transaction " << transactions[badTx]->getTxId().toHex() << std::endl;
+            return false;
+        }
+
+        // Commit. Coins found in phase 1 go into the cache first so spending them
+        // doesn't read the disk a second time.
+        for (size_t i = 1; i < n; i++) {
+            const Transaction &tx = *transactions[i];
+            for (size_t k = 0; k < tx.inputs.size(); k++) {
+                if (inSnapshot[inputStart[i] + k]) {
+                    g_utxoSet.prime(OutPoint(tx.inputs[k].txid, tx.inputs[k].index), spentCoins[inputStart[i] + k]);
+                }
+            }
+        }
+        for (auto &tx : transactions) {
+            applyTransaction(*tx, &undo);
         }
         return true;
     }
 
+    // Check one loose transaction (wallet / mempool admission): inputs are
+    // unspent, signatures valid, and sum(inputs) >= sum(outputs). Verified
+    // signatures are cached, so the block containing the tx skips them.
     bool validateTransaction(const Transaction &tx) {
-        // Check inputs are unspent, signatures valid (placeholder check)
-        // Also ensure sum(inputs) >= sum(outputs)
+        if (tx.isCoinbase() || tx.inputs.empty()) {
+            std::cerr << "Transaction must spend at least one existing output" << std::endl;
+            return false;
+        }
+        uint256 txDigest = signatureDigest(tx);
+        SigCheckQueue sigQueue;
         uint64_t inputSum = 0;
-        for (auto &in : tx.inputs) {
-            std::string key = in.txid + ":" + std::to_string(in.index);
+        for (size_t k = 0; k < tx.inputs.size(); k++) {
+            OutPoint key(tx.inputs[k].txid, tx.inputs[k].index);
             // Must exist in UTXO
-            if (g_utxoSet.find(key) == g_utxoSet.end()) {
-                std::cerr << "Double spend or missing UTXO for " << key << std::endl;
+            const UTXO *coin = g_utxoSet.find(key);
+            if (!coin) {
+                std::cerr << "Double spend or missing UTXO for " << key.toString() << std::endl;
+                return false;
+            }
+            SigCheck check;
+            if (!makeSigCheck(tx, txDigest, k, coin->pubKeyHash, 0, check)) {
+                std::cerr << "Bad signature script for " << key.toString() << std::endl;
                 return false;
             }
-            // In real code, also verify the signature matches the pubKeyHash in g_utxoSet[key]
-            inputSum += g_utxoSet[key].amount;
+            sigQueue.add(std::move(check));
+            inputSum += coin->amount;
         }
 
         uint64_t outputSum = 0;
@@ -321,26 +524,43 @@ public:
             std::cerr << "Output sum exceeds input sum" << std::endl;
             return false;
         }
+        size_t badTx;
+        if (!sigQueue.run(true, badTx)) {
+            std::cerr << "Invalid signature in transaction " << tx.getTxId().toHex() << std::endl;
+            return false;
+        }
         return true;
     }
 
-    void applyTransaction(const Transaction &tx) {
-        // Remove spent UTXOs
-        for (auto &in : tx.inputs) {
-            std::string key = in.txid + ":" + std::to_string(in.index);
-            g_utxoSet.erase(key);
+    // Apply a valid transaction to the chainstate; with `undo`, record what it
+    // takes away
+    void applyTransaction(const Transaction &tx, BlockUndo *undo) {
+        // Remove spent UTXOs (a coinbase spends nothing)
+        if (!tx.isCoinbase()) {
+            for (auto &in : tx.inputs) {
+                UTXO spent;
+                g_utxoSet.erase(OutPoint(in.txid, in.index), &spent);
+                if (undo) undo->spent.push_back(spent);
+            }
         }
         // Create new UTXOs
+        const uint256 &txid = tx.getTxId();
         for (size_t i = 0; i < tx.outputs.size(); i++) {
-            std::string outKey = tx.getTxId() + ":" + std::to_string(i);
             UTXO utxo{tx.outputs[i].amount, tx.outputs[i].pubKeyHash};
-            g_utxoSet[outKey] = utxo;
+            OutPoint key(txid, static_cast<uint32_t>(i));
+            if (undo && tx.isCoinbase()) {
+                const UTXO *old = g_utxoSet.find(key);
+                if (old) undo->replaced.push_back(std::make_pair(static_cast<uint32_t>(i), *old));
+            }
+            // Outputs of a regular tx can't already exist (its txid commits to the
+            // inputs it spends), so they may skip the disk if spent before a flush
+            g_utxoSet.put(key, utxo, !tx.isCoinbase());
         }
     }
 
-    // Return next block reward, with halving logic
-    uint64_t getBlockReward() const {
-        uint64_t halvings = g_totalBlocks / blockHalvingInterval;
+    // Reward of the block at `height`, with halving logic
+    uint64_t getBlockReward(uint64_t height) const {
+        uint64_t halvings = height / blockHalvingInterval;
         if (halvings >= 64) {
             return 0; // Once it halves enough times, it's effectively zero
         }
@@ -354,33 +574,539 @@ public:
         return difficultyTarget;
     }
 
-    // Create a new block with a coinbase transaction (reward + optional fees)
-    Block createNewBlock(const std::string &minerPubKeyHash) {
+    // Validate a loose transaction against the chainstate and add it to the mempool
+    bool acceptTransaction(const TransactionRef &tx, std::string &reason) {
+        {
+            std::lock_guard<std::mutex> connectLock(connectMutex);
+            if (!mempool.accept(tx, reason)) return false;
+        }
+        std::vector<TransactionAcceptedListener> listeners;
+        {
+            std::lock_guard<std::mutex> lock(listenersMutex);
+            listeners = transactionAcceptedListeners;
+        }
+        for (auto &listener : listeners) {
+            listener(tx);
+        }
+        return true;
+    }
+
+    // Run fn(tx) after every transaction accepted into the mempool from now on
+    void addTransactionAcceptedListener(TransactionAcceptedListener fn) {
+        std::lock_guard<std::mutex> lock(listenersMutex);
+        transactionAcceptedListeners.push_back(std::move(fn));
+    }
+
+    Mempool &getMempool() {
+        return mempool;
+    }
+
+    // Create a new block with a coinbase transaction (reward + fees) and the best
+    // mempool transactions that fit in maxBlockSize
+    Block createNewBlock(const uint256 &minerPubKeyHash) {
+        ChainSnapshotRef chain = getSnapshot();
         Block newBlock;
         newBlock.header.version = 1;
-        newBlock.header.prevBlockHash = getLatestBlock().getBlockHash();
-        newBlock.header.timestamp = static_cast<uint64_t>(std::time(nullptr));
+        newBlock.header.prevBlockHash = chain->tipHash;
+        newBlock.header.timestamp = static_cast<uint32_t>(std::time(nullptr));
         newBlock.header.difficultyTarget = getDifficultyTarget();
         newBlock.header.nonce = 0;
 
         // Coinbase Tx
-        Transaction coinbaseTx;
+        MutableTransaction coinbaseTx;
         coinbaseTx.version = 1;
         coinbaseTx.lockTime = 0;
         TxInput coinbaseIn;
-        coinbaseIn.txid = "0";
+        coinbaseIn.txid.setNull();
         coinbaseIn.index = 0;
         coinbaseIn.signature = "coinbase"; 
         coinbaseTx.inputs.push_back(coinbaseIn);
 
         TxOutput coinbaseOut;
-        coinbaseOut.amount = getBlockReward() * 100000000ULL;
+        uint64_t fees = 0;
+        std::vector<TransactionRef> txs = mempool.buildTemplate(maxBlockSize - kBlockReservedBytes, fees);
+
+        coinbaseOut.amount = getBlockReward(chain->height + 1) * 100000000ULL + fees;
         coinbaseOut.pubKeyHash = minerPubKeyHash;
         coinbaseTx.outputs.push_back(coinbaseOut);
 
-        newBlock.transactions.push_back(coinbaseTx);
+        txs.insert(txs.begin(), makeTransactionRef(std::move(coinbaseTx)));
+        newBlock.setTransactions(std::move(txs));
+        newBlock.buildMerkleRoot();
         return newBlock;
     }
+
+private:
+    // Room left in a template for the header, tx count and coinbase
+    static const size_t kBlockReservedBytes = 1000;
+
+    // Phase-1 result for one transaction of a block
+    struct TxCheck {
+        std::string error;              // first problem found, empty if none
+        uint64_t inputSum = 0;          // inputs resolved so far
+        uint64_t outputSum = 0;
+        bool needsBlockOutputs = false; // some input wasn't in the pre-block UTXO set
+        uint256 txDigest;               // see signatureDigest()
+        std::vector<SigCheck> sigChecks; // one per input
+    };
+
+
+    // Context-free checks plus lookups against the pre-block UTXO set. Runs on a
+    // worker thread: only reads shared state and writes to its own slots.
+    void checkTransaction(size_t position, const Transaction &tx, UTXO *spent, uint8_t *found, TxCheck &check) const {
+        for (auto &out : tx.outputs) {
+            if (check.outputSum + out.amount < check.outputSum) {
+                check.error = "Output sum overflows";
+                return;
+            }
+            check.outputSum += out.amount;
+        }
+        if (position == 0) return; // coinbase: bounded once the block's fees are known
+        if (tx.isCoinbase()) {
+            check.error = "Only the first transaction may be a coinbase";
+            return;
+        }
+        if (tx.inputs.empty()) {
+            check.error = "Transaction " + tx.getTxId().toHex() + " has no inputs";
+            return;
+        }
+        check.txDigest = signatureDigest(tx);
+        check.sigChecks.resize(tx.inputs.size());
+        for (size_t k = 0; k < tx.inputs.size(); k++) {
+            const TxInput &in = tx.inputs[k];
+            if (g_utxoSet.peek(OutPoint(in.txid, in.index), spent[k])) {
+                found[k] = 1;
+                check.inputSum += spent[k].amount;
+                if (!makeSigCheck(tx, check.txDigest, k, spent[k].pubKeyHash, position, check.sigChecks[k])) {
+                    check.error = "Bad signature script for " + OutPoint(in.txid, in.index).toString();
+                    return;
+                }
+            } else {
+                check.needsBlockOutputs = true;
+            }
+        }
+        if (!check.needsBlockOutputs && check.outputSum > check.inputSum) {
+            check.error = "Output sum exceeds input sum";
+        }
+    }
+
+    // Index of the first transaction spending an outpoint that an earlier
+    // transaction of the block already spends, or SIZE_MAX. Inputs are split into
+    // shards by hash bits; each shard is sorted and scanned on its own worker.
+    static size_t findDuplicateInputs(const std::vector<TransactionRef> &transactions,
+                                      const std::vector<size_t> &inputStart) {
+        struct Spend {
+            OutPoint key;
+            size_t tx;
+            bool operator<(const Spend &o) const { return key < o.key || (key == o.key && tx < o.tx); }
+        };
+        ThreadPool &pool = getWorkerPool();
+        size_t shardBits = 0;
+        while ((size_t(1) << shardBits) < size_t(pool.size()) * 4) shardBits++;
+        size_t shardCount = size_t(1) << shardBits;
+        auto shardOf = [shardBits](const TxInput &in) {
+            uint64_t h = (in.txid.getCheapHash() ^ (uint64_t(in.index) * 0x9e3779b97f4a7c15ULL)) * 0xbf58476d1ce4e5b9ULL;
+            return shardBits == 0 ? size_t(0) : static_cast<size_t>(h >> (64 - shardBits));
+        };
+
+        // Counting sort of the inputs (coinbase excluded) into their shards
+        size_t first = inputStart[1];
+        std::vector<size_t> shardStart(shardCount + 1, 0);
+        for (size_t i = 1; i < transactions.size(); i++) {
+            for (auto &in : transactions[i]->inputs) shardStart[shardOf(in) + 1]++;
+        }
+        for (size_t s = 0; s < shardCount; s++) shardStart[s + 1] += shardStart[s];
+        std::vector<Spend> spends(inputStart.back() - first);
+        std::vector<size_t> fill(shardStart.begin(), shardStart.end() - 1);
+        for (size_t i = 1; i < transactions.size(); i++) {
+            for (auto &in : transactions[i]->inputs) {
+                spends[fill[shardOf(in)]++] = Spend{OutPoint(in.txid, in.index), i};
+            }
+        }
+
+        std::vector<size_t> shardDuplicate(shardCount, SIZE_MAX);
+        pool.parallelFor(shardCount, 1, [&](size_t begin, size_t end) {
+            for (size_t s = begin; s < end; s++) {
+                auto from = spends.begin() + shardStart[s];
+                auto to = spends.begin() + shardStart[s + 1];
+                std::sort(from, to);
+                for (auto it = from; it != to && it + 1 != to; ++it) {
+                    if (it->key == (it + 1)->key) {
+                        shardDuplicate[s] = std::min(shardDuplicate[s], (it + 1)->tx);
+                    }
+                }
+            }
+        });
+        return *std::min_element(shardDuplicate.begin(), shardDuplicate.end());
+    }
+
+    // Index every stored block. A block is only stored once its parent is, so
+    // store order has parents first.
+    void loadBlockTree() {
+        uint32_t count = blockStore.count();
+        BlockIndexEntry e;
+        for (uint32_t position = 0; position < count; position++) {
+            if (!blockStore.getEntry(position, e)) break;
+            if (position > 0 && !blockTree.find(e.header.prevBlockHash)) {
+                std::cerr << "[Blockchain] Stored block " << e.hash.toHex() << " has no parent; ignoring it" << std::endl;
+                continue;
+            }
+            BlockIndex *entry = blockTree.add(e.hash, e.header, position);
+            if (blockStore.hasUndo(e.hash)) entry->status |= BlockIndex::HAVE_UNDO;
+        }
+    }
+
+    // Startup: bring the chainstate to the stored chain with the most work. The
+    // chainstate may lag behind the stored blocks (flushes happen only now and
+    // then) or still sit on a branch a reorg left before the last flush; both are
+    // handled like any other switch of the active chain.
+    void activateStoredChain() {
+        BlockIndexEntry first;
+        blockStore.getEntry(0, first);
+        const uint256 &best = g_utxoSet.getBestBlock();
+        tipIndex = best.isNull() ? nullptr : blockTree.find(best);
+        if (!best.isNull() && !tipIndex) {
+            std::cout << "[Blockchain] Chainstate best block is not in the block store; rebuilding it" << std::endl;
+            g_utxoSet.wipe();
+        }
+        auto tip = std::make_shared<Block>();
+        if (!tipIndex) {
+            tipIndex = blockTree.find(first.hash);
+            blockStore.readBlock(tipIndex->position, *tip);
+            for (auto &tx : tip->getTransactions()) {
+                applyTransaction(*tx, nullptr);
+            }
+            g_utxoSet.setBestBlock(tipIndex->hash, 0);
+        } else if (!blockStore.readBlock(tipIndex->position, *tip)) {
+            std::cerr << "[Blockchain] Cannot read the chainstate's best block " << tipIndex->hash.toHex() << std::endl;
+        }
+        // Snapshots read the coins from disk; a memory-only set is just genesis here
+        g_utxoSet.flush();
+        UtxoView view(g_utxoSet.diskStore());
+        if (!g_utxoSet.diskStore().isOpen()) {
+            std::vector<UtxoView::Change> coins;
+            g_utxoSet.forEach([&](const OutPoint &key, const UTXO &coin) {
+                coins.push_back(UtxoView::Change{key, coin, false, true});
+                return true;
+            });
+            view = view.apply(coins);
+        }
+        publishSnapshot(tip, tipIndex, std::move(view));
+
+        // Nobody listens yet and the mempool is empty: no events to keep
+        while (true) {
+            BlockIndex *target = tipIndex;
+            blockTree.forEach([&](BlockIndex *entry) {
+                if (!(entry->status & BlockIndex::FAILED) && entry->chainWork > target->chainWork) target = entry;
+            });
+            if (target == tipIndex) break;
+            std::cout << "[Blockchain] Moving the chainstate from height " << tipIndex->height << " to stored block "
+                      << target->hash.toHex() << " at height " << target->height << std::endl;
+            // A failure marks the bad block, so the next round picks another branch
+            if (!activateChain(target, nullptr, nullptr) && !(target->status & BlockIndex::FAILED)) break;
+        }
+        g_utxoSet.flush();
+        std::cout << "[Blockchain] Loaded " << blockTree.size() << " block(s), tip " << tipIndex->hash.toHex()
+                  << " at height " << tipIndex->height << std::endl;
+    }
+
+    // Check a block on its own (PoW, merkle root, known and valid parent) and
+    // store it in the tree. Its transactions are checked when it is connected.
+    // A block we already have is accepted unless it is known to be invalid.
+    bool acceptBlock(const Block &block, BlockIndex *&entry) {
+        uint256 hash = block.getBlockHash();
+        entry = blockTree.find(hash);
+        if (entry) return !(entry->status & BlockIndex::FAILED);
+        BlockIndex *parent = blockTree.find(block.header.prevBlockHash);
+        if (!parent) {
+            std::cerr << "[Blockchain] Rejecting block: unknown parent" << std::endl;
+            return false;
+        }
+        if (parent->status & BlockIndex::FAILED) {
+            std::cerr << "[Blockchain] Rejecting block: descends from an invalid block" << std::endl;
+            return false;
+        }
+        // Validate PoW
+        if (!checkProofOfWork(hash, block.header.difficultyTarget)) {
+            std::cerr << "[Blockchain] Rejecting block: invalid PoW" << std::endl;
+            return false;
+        }
+        // The header only commits to the body through the merkle root
+        if (!hasValidMerkleRoot(block)) {
+            std::cerr << "[Blockchain] Rejecting block: merkle root mismatch" << std::endl;
+            return false;
+        }
+        uint32_t position;
+        if (!blockStore.appendBlock(block, parent->height + 1, position)) {
+            std::cerr << "[Blockchain] Rejecting block: cannot store it" << std::endl;
+            return false;
+        }
+        entry = blockTree.add(hash, block.header, position);
+        return true;
+    }
+
+    // Make `target` the tip and publish the result as one snapshot, so readers
+    // never see the chain halfway through a reorg. `known` is target's body if
+    // the caller has it. On a reorg the mempool is emptied first and refilled
+    // afterwards: transactions of disconnected blocks (oldest first), then the
+    // old pool; whatever conflicts with the new chain is dropped. If a block of
+    // the new branch is invalid and the branch ends up with less work than the
+    // old tip, the old tip is restored.
+    bool activateChain(BlockIndex *target, const Block *known, ChainUpdate *update) {
+        ChainSnapshotRef prev = getSnapshot();
+        BlockIndex *oldTip = tipIndex;
+        UtxoView view = prev->utxos;
+        std::shared_ptr<const Block> tipBlock = prev->tip;
+        const BlockIndex *fork = findFork(tipIndex, target);
+        bool reorg = fork != tipIndex;
+        std::vector<TransactionRef> pool;
+        std::vector<ChainEvent> steps;
+        if (reorg) {
+            std::cout << "[Blockchain] Reorganizing: " << (tipIndex->height - fork->height) << " block(s) off, "
+                      << (target->height - fork->height) << " on, fork at height " << fork->height << std::endl;
+            pool = mempool.removeAll();
+        }
+
+        bool ok = switchTip(target, known, view, tipBlock, steps);
+        if (!ok && tipIndex->chainWork < oldTip->chainWork) {
+            std::cerr << "[Blockchain] Switching back to " << oldTip->hash.toHex() << std::endl;
+            switchTip(oldTip, nullptr, view, tipBlock, steps);
+        }
+        if (!tipBlock) {
+            auto block = std::make_shared<Block>();
+            blockStore.readBlock(tipIndex->position, *block);
+            tipBlock = block;
+        }
+        publishSnapshot(tipBlock, tipIndex, std::move(view));
+
+        std::vector<TransactionRef> readded;
+        if (reorg) {
+            std::string reason;
+            for (auto it = steps.rbegin(); it != steps.rend(); ++it) {
+                if (it->connected) continue;
+                for (auto &tx : it->block->getTransactions()) {
+                    if (!tx->isCoinbase() && mempool.accept(tx, reason)) readded.push_back(tx);
+                }
+            }
+            for (auto &tx : pool) {
+                mempool.accept(tx, reason);
+            }
+        }
+        if (update) {
+            update->blocks.insert(update->blocks.end(), steps.begin(), steps.end());
+            update->readded.insert(update->readded.end(), readded.begin(), readded.end());
+        }
+        return ok;
+    }
+
+    // Walk tipIndex to `target`: disconnect down to the fork, then connect the
+    // branch up. Stops at the first block that can't be connected; an invalid
+    // one is marked FAILED along with its descendants. tipBlock is the body of
+    // the tip when known, null after a disconnect. Also stops when the
+    // chainstate can't be written (see flushChainstate).
+    bool switchTip(BlockIndex *target, const Block *known, UtxoView &view,
+                   std::shared_ptr<const Block> &tipBlock, std::vector<ChainEvent> &steps) {
+        if (chainstateWriteFailed && !flushChainstate(view)) return false;
+        const BlockIndex *fork = findFork(tipIndex, target);
+        while (tipIndex != fork) {
+            if (!disconnectTip(view, steps)) return false;
+            tipBlock.reset();
+            if (!flushChainstate(view)) return false;
+        }
+        std::vector<BlockIndex*> branch;
+        for (BlockIndex *walk = target; walk != fork; walk = walk->prev) {
+            branch.push_back(walk);
+        }
+        for (auto it = branch.rbegin(); it != branch.rend(); ++it) {
+            BlockIndex *entry = *it;
+            auto block = std::make_shared<Block>();
+            if (known && entry == target) {
+                *block = *known;
+            } else if (!blockStore.readBlock(entry->position, *block)) {
+                std::cerr << "[Blockchain] Cannot read block " << entry->hash.toHex() << std::endl;
+                return false;
+            }
+            if (!connectTip(entry, block, view, steps)) {
+                markFailed(entry);
+                return false;
+            }
+            tipBlock = block;
+            if (!flushChainstate(view)) return false;
+        }
+        return true;
+    }
+
+    // At a block boundary: flush the UTXO cache if it's due, and then start
+    // `view` over from the disk store it was written to. Once a write has
+    // failed no block is connected or disconnected until a retry succeeds; the
+    // changes stay in the cache meanwhile.
+    bool flushChainstate(UtxoView &view) {
+        auto version = g_utxoSet.diskStore().currentVersion();
+        if (chainstateWriteFailed ? g_utxoSet.flush() : g_utxoSet.flushIfNeeded()) {
+            chainstateWriteFailed = false;
+            if (g_utxoSet.diskStore().currentVersion() != version) view = UtxoView(g_utxoSet.diskStore());
+            return true;
+        }
+        if (!chainstateWriteFailed) {
+            std::cerr << "[Blockchain] Cannot write the chainstate; not moving the tip until it can be" << std::endl;
+        }
+        chainstateWriteFailed = true;
+        return false;
+    }
+
+    // Connect entry's block on top of tipIndex. A block connected before was
+    // valid then and has its undo record, so it is only applied.
+    bool connectTip(BlockIndex *entry, const std::shared_ptr<const Block> &block, UtxoView &view,
+                    std::vector<ChainEvent> &steps) {
+        if (entry->status & BlockIndex::HAVE_UNDO) {
+            for (auto &tx : block->getTransactions()) {
+                applyTransaction(*tx, nullptr);
+            }
+        } else {
+            BlockUndo undo;
+            if (!validateAndApplyTransactions(block->getTransactions(), entry->height, undo)) {
+                std::cerr << "[Blockchain] Rejecting block " << entry->hash.toHex() << ": invalid transaction(s)" << std::endl;
+                return false;
+            }
+            // Synced before the chainstate can record this block as its best
+            std::string data;
+            undo.serialize(data);
+            if (blockStore.writeUndo(entry->hash, data)) {
+                entry->status |= BlockIndex::HAVE_UNDO;
+            } else {
+                std::cerr << "[Blockchain] Cannot store undo data for " << entry->hash.toHex()
+                          << "; the block can't be disconnected" << std::endl;
+            }
+        }
+        view = view.apply(utxoChanges(*block));
+        mempool.removeForBlock(*block);
+        tipIndex = entry;
+        // Block boundary: the chainstate is consistent again (switchTip may flush)
+        g_utxoSet.setBestBlock(entry->hash, entry->height);
+        steps.push_back(ChainEvent{block, entry->height, true});
+        return true;
+    }
+
+    // Undo the tip block: in reverse order, remove each transaction's outputs and
+    // put back the coins it spent (for the coinbase, the coins it overwrote)
+    bool disconnectTip(UtxoView &view, std::vector<ChainEvent> &steps) {
+        BlockIndex *entry = tipIndex;
+        auto block = std::make_shared<Block>();
+        std::string data;
+        BlockUndo undo;
+        if (!entry->prev || !blockStore.readBlock(entry->position, *block)
+            || !blockStore.readUndo(entry->hash, data) || !undo.deserialize(data)) {
+            std::cerr << "[Blockchain] Cannot disconnect block " << entry->hash.toHex() << ": no undo data" << std::endl;
+            return false;
+        }
+        size_t next = 0;
+        for (auto &tx : block->getTransactions()) {
+            if (!tx->isCoinbase()) next += tx->inputs.size();
+        }
+        if (next != undo.spent.size()) {
+            std::cerr << "[Blockchain] Undo data of block " << entry->hash.toHex() << " doesn't match it" << std::endl;
+            return false;
+        }
+
+        std::vector<UtxoView::Change> changes;
+        for (size_t i = block->getTransactions().size(); i-- > 0;) {
+            const Transaction &tx = *block->getTransactions()[i];
+            const uint256 &txid = tx.getTxId();
+            for (size_t k = 0; k < tx.outputs.size(); k++) {
+                OutPoint key(txid, static_cast<uint32_t>(k));
+                g_utxoSet.erase(key);
+                changes.push_back(UtxoView::Change{key, UTXO(), true, false});
+            }
+            if (tx.isCoinbase()) {
+                for (auto &r : undo.replaced) {
+                    OutPoint key(txid, r.first);
+                    g_utxoSet.put(key, r.second);
+                    changes.push_back(UtxoView::Change{key, r.second, false, true});
+                }
+                continue;
+            }
+            for (size_t k = tx.inputs.size(); k-- > 0;) {
+                const UTXO &coin = undo.spent[--next];
+                OutPoint key(tx.inputs[k].txid, tx.inputs[k].index);
+                g_utxoSet.put(key, coin);
+                changes.push_back(UtxoView::Change{key, coin, false, true});
+            }
+        }
+        view = view.apply(changes);
+        tipIndex = entry->prev;
+        g_utxoSet.setBestBlock(tipIndex->hash, tipIndex->height);
+        steps.push_back(ChainEvent{block, entry->height, false});
+        return true;
+    }
+
+    // An invalid block makes every block built on it invalid too
+    void markFailed(BlockIndex *bad) {
+        bad->status |= BlockIndex::FAILED;
+        blockTree.forEach([&](BlockIndex *entry) {
+            if (entry->height > bad->height && entry->getAncestor(bad->height) == bad) {
+                entry->status |= BlockIndex::FAILED;
+            }
+        });
+    }
+
+    void notifyListeners(const ChainUpdate &update) {
+        if (update.blocks.empty()) return;
+        std::vector<BlockConnectedListener> connected;
+        std::vector<BlockDisconnectedListener> disconnected;
+        std::vector<TransactionAcceptedListener> accepted;
+        {
+            std::lock_guard<std::mutex> lock(listenersMutex);
+            connected = blockConnectedListeners;
+            disconnected = blockDisconnectedListeners;
+            accepted = transactionAcceptedListeners;
+        }
+        for (auto &event : update.blocks) {
+            if (event.connected) {
+                for (auto &listener : connected) listener(*event.block, event.height);
+            } else {
+                for (auto &listener : disconnected) listener(*event.block, event.height);
+            }
+        }
+        for (auto &tx : update.readded) {
+            for (auto &listener : accepted) listener(tx);
+        }
+    }
+
+    // The active chain's entry at `height`, or nullptr above the tip
+    const BlockIndex *activeAt(uint64_t height) const {
+        const BlockIndex *tip = getSnapshot()->tipIndex;
+        if (height > tip->height) return nullptr;
+        return tip->getAncestor(static_cast<uint32_t>(height));
+    }
+
+    void publishSnapshot(std::shared_ptr<const Block> tip, const BlockIndex *index, UtxoView utxos) {
+        auto next = std::make_shared<ChainSnapshot>();
+        next->tip = std::move(tip);
+        next->tipIndex = index;
+        next->tipHash = index->hash;
+        next->height = index->height;
+        next->utxos = std::move(utxos);
+        std::atomic_store(&snapshot, ChainSnapshotRef(std::move(next)));
+    }
+
+    // What connecting `block` does to the UTXO set, in order
+    static std::vector<UtxoView::Change> utxoChanges(const Block &block) {
+        std::vector<UtxoView::Change> changes;
+        for (auto &tx : block.getTransactions()) {
+            if (!tx->isCoinbase()) {
+                for (auto &in : tx->inputs) {
+                    changes.push_back(UtxoView::Change{OutPoint(in.txid, in.index), UTXO(), true, false});
+                }
+            }
+            const uint256 &txid = tx->getTxId();
+            for (size_t i = 0; i < tx->outputs.size(); i++) {
+                UTXO coin{tx->outputs[i].amount, tx->outputs[i].pubKeyHash};
+                // A coinbase's txid can repeat, so its outputs may replace coins
+                changes.push_back(UtxoView::Change{OutPoint(txid, static_cast<uint32_t>(i)), coin, false, !tx->isCoinbase()});
+            }
+        }
+        return changes;
+    }
 };
 
 // Global pointer to the main blockchain instance
@@ -0,0 +1,149 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include "primitives.cpp"
+#include "utxo_db.cpp"
+#include "block_index.cpp"
+
+// ------------------- CHAIN SNAPSHOTS -------------------
+// Readers (wallet, miner, P2P, RPC) see the chain through immutable snapshots:
+// tip block, tip hash, height and the UTXO set as of that tip. The tip's entry
+// in the block index leads to every block of the active chain. Each connected
+// block publishes a new snapshot with an atomic pointer swap; readers load the
+// pointer and keep the snapshot alive for as long as they use it, so they never
+// wait for a block being connected and never see half of one (a coin lookup
+// that reaches the disk does wait while a flush writes it). Old snapshots go
+// away with their last reader.
+//
+// The UTXO view is the chainstate's disk store as of one flush (read through
+// UtxoDiskStore::getAt, so later flushes don't show) under a stack of immutable
+// deltas: the coins blocks connected since then created and spent. A new view
+// shares its parent's deltas and adds one; a delta at most twice the size of
+// the one below it absorbs that one, so a lookup searches O(log blocks) of them.
+// After a flush the writer starts over from the store (rebase), so the deltas
+// never hold more than the UTXO cache has in memory anyway. Without a disk store
+// (memory-only node) they hold the whole set.
+
+class UtxoView {
+public:
+    // One change a block makes to the set. `fresh`: the key holds no coin
+    // before this change (outputs of a regular tx, coins put back on a
+    // disconnect); otherwise an added coin is looked up to keep size() right.
+    struct Change {
+        OutPoint key;
+        UTXO coin;
+        bool spent;
+        bool fresh;
+    };
+
+    UtxoView() {}
+
+    // `store` as it is now
+    explicit UtxoView(const UtxoDiskStore &store)
+        : disk(&store), base(store.currentVersion()), count(base ? base->entries : 0) {}
+
+    bool find(const OutPoint &key, UTXO &out) const {
+        for (const Delta *d = top.get(); d; d = d->below.get()) {
+            const UtxoOp *op = findUtxoOp(d->coins, key);
+            if (op) {
+                if (op->erase) return false;
+                out = op->value;
+                return true;
+            }
+        }
+        return base && disk->getAt(*base, key, out);
+    }
+
+    bool contains(const OutPoint &key) const {
+        UTXO coin;
+        return find(key, coin);
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    // This view with `changes` applied in order. A spent change always takes
+    // a coin away: blocks only spend coins that exist.
+    UtxoView apply(const std::vector<Change> &changes) const {
+        UtxoView out = *this;
+        auto delta = std::make_shared<Delta>();
+        std::vector<UtxoOp> &coins = delta->coins;
+        coins.reserve(changes.size());
+        for (auto &c : changes) {
+            if (c.spent) {
+                out.count--;
+            } else if (c.fresh || !existsAfter(coins, c.key)) {
+                out.count++;
+            }
+            coins.push_back(UtxoOp{c.key, c.coin, c.spent});
+        }
+        // By key, the last change to each
+        std::stable_sort(coins.begin(), coins.end(), [](const UtxoOp &a, const UtxoOp &b) { return a.key < b.key; });
+        size_t kept = 0;
+        for (size_t i = 0; i < coins.size(); i++) {
+            if (kept && coins[kept - 1].key == coins[i].key) coins[kept - 1] = coins[i];
+            else coins[kept++] = coins[i];
+        }
+        coins.resize(kept);
+
+        delta->below = top;
+        while (delta->below && delta->below->coins.size() <= 2 * coins.size()) {
+            coins = merge(coins, delta->below->coins, !delta->below->below && !base);
+            delta->below = delta->below->below;
+        }
+        out.top = delta;
+        return out;
+    }
+
+private:
+    struct Delta {
+        std::vector<UtxoOp> coins; // sorted by key; erase: spent
+        std::shared_ptr<const Delta> below;
+    };
+
+    // Whether `key` holds a coin after the changes in `pending` (in order) on top of this view
+    bool existsAfter(const std::vector<UtxoOp> &pending, const OutPoint &key) const {
+        for (size_t i = pending.size(); i-- > 0;) {
+            if (pending[i].key == key) return !pending[i].erase;
+        }
+        return contains(key);
+    }
+
+    // Two sorted runs as one, `newer` winning; spent markers are dropped when
+    // nothing is left below them
+    static std::vector<UtxoOp> merge(const std::vector<UtxoOp> &newer, const std::vector<UtxoOp> &older, bool bottom) {
+        std::vector<UtxoOp> out;
+        out.reserve(newer.size() + older.size());
+        size_t i = 0, j = 0;
+        while (i < newer.size() || j < older.size()) {
+            const UtxoOp *next;
+            if (j == older.size() || (i < newer.size() && !(older[j].key < newer[i].key))) {
+                if (j < older.size() && older[j].key == newer[i].key) j++;
+                next = &newer[i++];
+            } else {
+                next = &older[j++];
+            }
+            if (!(bottom && next->erase)) out.push_back(*next);
+        }
+        return out;
+    }
+
+    std::shared_ptr<const Delta> top;
+    const UtxoDiskStore *disk = nullptr;
+    std::shared_ptr<const UtxoVersion> base;
+    size_t count = 0;
+};
+
+// Everything a reader needs about the chain at one tip
+struct ChainSnapshot {
+    std::shared_ptr<const Block> tip;
+    const BlockIndex *tipIndex = nullptr; // its ancestors are the active chain
+    uint256 tipHash;
+    uint64_t height = 0; // genesis = 0
+    UtxoView utxos;
+};
+
+typedef std::shared_ptr<const ChainSnapshot> ChainSnapshotRef;
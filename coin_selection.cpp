@@ -0,0 +1,163 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+#include "wallet_index.cpp"
+
+// ------------------- COIN SELECTION -------------------
+// Picks which of the wallet's coins fund a payment. Every coin is valued at its
+// effective value: its amount minus the fee for the input that spends it at
+// the chosen fee rate, so a coin worth less than its own input is never used.
+//
+// First a branch-and-bound search (the algorithm Bitcoin Core uses) looks for
+// a set of coins that pays the target with no change output: its excess over
+// the target must stay below the cost of a change output plus the fee to spend
+// that change later, which is then simply left to the fee. Ties go to fewer
+// inputs. The search gives up after kBnbMaxTries steps, so a wallet with many
+// coins falls back to a single pass: the smallest coin that covers the payment
+// and a change output on its own, or else the largest coins first.
+//
+// Sizes are upper bounds, so the fee paid is never below the rate asked for.
+
+// DER signature (at most 72 bytes) and uncompressed public key (65), each
+// behind a compactSize, in the input's compactSize-prefixed signature script
+static const size_t kSignatureScriptSize = 1 + 72 + 1 + 65;
+static const size_t kInputSize = 32 + 4 + 1 + kSignatureScriptSize;
+static const size_t kOutputSize = 8 + 32;
+static const size_t kBnbMaxTries = 100000;
+
+static size_t compactSizeLength(uint64_t n) {
+    return n < 0xfd ? 1 : n <= 0xffff ? 3 : n <= 0xffffffffULL ? 5 : 9;
+}
+
+// Serialized size of a signed transaction with this many inputs and outputs
+static size_t estimateTransactionSize(size_t inputs, size_t outputs) {
+    return 4 + compactSizeLength(inputs) + inputs * kInputSize
+        + compactSizeLength(outputs) + outputs * kOutputSize + 4;
+}
+
+// Fee for `size` bytes at feePerKB, rounded up (what the mempool checks)
+static uint64_t feeForSize(size_t size, uint64_t feePerKB) {
+    return (static_cast<uint64_t>(size) * feePerKB + 999) / 1000;
+}
+
+struct CoinSelection {
+    std::vector<WalletIndex::Coin> inputs;
+    uint64_t inputSum = 0;
+    uint64_t fee = 0;
+    uint64_t change = 0; // 0: no change output
+};
+
+// Fund `payments` outputs totalling `amount` from `coins` at feePerKB. False
+// (with the reason) if the coins can't cover it.
+static bool selectCoins(const std::vector<WalletIndex::Coin> &coins, uint64_t amount, size_t payments,
+                        uint64_t feePerKB, CoinSelection &out, std::string &error) {
+    struct Candidate {
+        const WalletIndex::Coin *coin;
+        uint64_t effective;
+    };
+    uint64_t inputFee = feeForSize(kInputSize, feePerKB);
+    uint64_t changeOutputFee = feeForSize(kOutputSize, feePerKB);
+    // A change output is only worth it if it is worth more than creating and
+    // later spending it
+    uint64_t costOfChange = changeOutputFee + inputFee;
+    // Everything but the inputs and change
+    uint64_t target = amount + feeForSize(estimateTransactionSize(0, payments), feePerKB);
+
+    std::vector<Candidate> pool;
+    uint64_t available = 0;
+    for (auto &c : coins) {
+        if (c.coin.amount <= inputFee) continue;
+        pool.push_back(Candidate{&c, c.coin.amount - inputFee});
+        available += c.coin.amount - inputFee;
+    }
+    if (available < target) {
+        error = "Insufficient funds: need " + std::to_string(target) + " satoshis including fees, have "
+              + std::to_string(available) + " spendable after fees";
+        return false;
+    }
+    std::sort(pool.begin(), pool.end(), [](const Candidate &a, const Candidate &b) {
+        return a.effective > b.effective;
+    });
+
+    // Branch and bound over the sorted pool: at each step include pool[i] or,
+    // on the way back, exclude it. `remaining` is what the unvisited coins add up to.
+    std::vector<size_t> selection, best;
+    uint64_t bestExcess = UINT64_MAX;
+    uint64_t value = 0;
+    uint64_t remaining = available;
+    size_t i = 0;
+    for (size_t tries = 0; tries < kBnbMaxTries; tries++, i++) {
+        bool backtrack = false;
+        if (value + remaining < target || value > target + costOfChange) {
+            backtrack = true; // can't reach the target, or overshot it
+        } else if (value >= target) {
+            uint64_t excess = value - target;
+            if (excess < bestExcess || (excess == bestExcess && selection.size() < best.size())) {
+                best = selection;
+                bestExcess = excess;
+            }
+            backtrack = true;
+        }
+        if (backtrack) {
+            if (selection.empty()) break; // every branch explored
+            // Put back the coins skipped since the last one included, then
+            // explore the branch without that one
+            for (--i; i > selection.back(); --i) remaining += pool[i].effective;
+            value -= pool[i].effective;
+            selection.pop_back();
+        } else {
+            remaining -= pool[i].effective;
+            // Excluding a coin and then including an identical one is a branch
+            // already explored
+            if (selection.empty() || i - 1 == selection.back() || pool[i].effective != pool[i - 1].effective) {
+                selection.push_back(i);
+                value += pool[i].effective;
+            }
+        }
+    }
+
+    out = CoinSelection();
+    uint64_t selected = 0;
+    if (!best.empty()) {
+        for (size_t index : best) {
+            out.inputs.push_back(*pool[index].coin);
+            selected += pool[index].effective;
+        }
+    } else {
+        // Fallback: aim for the target plus a change output worth keeping
+        uint64_t withChange = target + changeOutputFee + costOfChange;
+        auto single = std::find_if(pool.rbegin(), pool.rend(), [&](const Candidate &c) {
+            return c.effective >= withChange;
+        });
+        if (single != pool.rend()) {
+            out.inputs.push_back(*single->coin);
+            selected = single->effective;
+        } else {
+            for (auto &c : pool) {
+                if (selected >= withChange) break;
+                out.inputs.push_back(*c.coin);
+                selected += c.effective;
+            }
+        }
+        if (selected - target >= changeOutputFee + costOfChange) {
+            out.change = selected - target - changeOutputFee;
+        }
+    }
+    for (auto &coin : out.inputs) {
+        out.inputSum += coin.coin.amount;
+    }
+    out.fee = out.inputSum - amount - out.change;
+    // The target assumed a one-byte input count; past 252 inputs it takes more
+    uint64_t required = feeForSize(estimateTransactionSize(out.inputs.size(), payments + (out.change ? 1 : 0)), feePerKB);
+    if (out.fee < required) {
+        if (out.change < required - out.fee) {
+            error = "Too many small coins to fund this payment in one transaction";
+            return false;
+        }
+        out.change -= required - out.fee;
+        out.fee = required;
+    }
+    return true;
+}
@@ -0,0 +1,279 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <unordered_map>
+#include "primitives.cpp"
+#include "mempool.cpp"
+#include "siphash.cpp"
+
+// ------------------- COMPACT BLOCKS -------------------
+// A freshly mined block is announced as its header plus a 6-byte short id per
+// transaction; the coinbase, which nobody else has seen, is sent in full
+// ("prefilled"). The receiver finds the rest in its own mempool and asks for
+// whatever it lacks with one getblocktxn / blocktxn round trip.
+//
+// Short ids are SipHash-2-4 of the txid, keyed from the header and a random
+// nonce chosen by the sender, so nobody can grind transactions whose ids
+// collide across every announcement. A collision that does happen either
+// leaves a slot unfilled (then requested) or gives a wrong merkle root, in
+// which case the receiver falls back to fetching the full block.
+//
+//   cmpctblock:  header(80) | nonce(LE64) | compactSize(n) short ids(6 bytes each)
+//                | compactSize(m) prefilled: compactSize(index delta) tx
+//   getblocktxn: block hash(32) | compactSize(n) compactSize(index delta)
+//   blocktxn:    block hash(32) | compactSize(n) tx
+//   sendcmpct:   announce(1) | version(LE64)
+// Indexes are sent as the gap from the previous one, minus one.
+
+static const size_t kShortIdSize = 6;
+static const uint64_t kCompactBlockVersion = 1;
+
+struct PrefilledTransaction {
+    uint32_t index;
+    TransactionRef tx;
+};
+
+class CompactBlock {
+public:
+    BlockHeader header;
+    uint64_t nonce = 0;
+    std::vector<uint64_t> shortIds;              // the transactions not prefilled, in order
+    std::vector<PrefilledTransaction> prefilled; // ascending index
+
+    CompactBlock() = default;
+
+    // Announce `block`: only the coinbase is prefilled
+    CompactBlock(const Block &block, uint64_t saltNonce) : header(block.header), nonce(saltNonce) {
+        SipHasher hasher = getHasher();
+        for (size_t i = 0; i < block.getTransactions().size(); i++) {
+            if (i == 0) {
+                prefilled.push_back(PrefilledTransaction{0, block.getTransactions()[0]});
+            } else {
+                shortIds.push_back(shortId(hasher, block.getTransactions()[i]->getTxId()));
+            }
+        }
+    }
+
+    size_t getTransactionCount() const {
+        return shortIds.size() + prefilled.size();
+    }
+
+    // Keys are the first 16 bytes of sha256(header | nonce)
+    SipHasher getHasher() const {
+        unsigned char buf[BlockHeader::kSerializedSize + 8];
+        header.serialize(buf);
+        writeLE64(buf + BlockHeader::kSerializedSize, nonce);
+        uint256 h = sha256(buf, sizeof(buf));
+        return SipHasher(readLE64(h.data), readLE64(h.data + 8));
+    }
+
+    static uint64_t shortId(const SipHasher &hasher, const uint256 &txid) {
+        return hasher.hash(txid) & 0xffffffffffffULL;
+    }
+
+    void serialize(std::string &out) const {
+        unsigned char buf[BlockHeader::kSerializedSize];
+        header.serialize(buf);
+        appendBytes(out, buf, sizeof(buf));
+        appendLE64(out, nonce);
+        appendCompactSize(out, shortIds.size());
+        for (uint64_t id : shortIds) {
+            writeLE64(buf, id);
+            appendBytes(out, buf, kShortIdSize);
+        }
+        appendCompactSize(out, prefilled.size());
+        uint32_t next = 0;
+        for (auto &p : prefilled) {
+            appendCompactSize(out, p.index - next);
+            p.tx->serialize(out);
+            next = p.index + 1;
+        }
+    }
+
+    // Fails on trailing bytes and on prefilled indexes that are out of order or
+    // past the end of the block
+    bool deserialize(const unsigned char *data, size_t len) {
+        ByteReader in(data, len);
+        unsigned char buf[BlockHeader::kSerializedSize];
+        if (!in.readBytes(buf, sizeof(buf))) return false;
+        header.deserialize(buf);
+        nonce = in.readU64();
+        uint64_t count = in.readCompactSize();
+        if (in.failed || count > in.left / kShortIdSize) return false;
+        shortIds.resize(static_cast<size_t>(count));
+        for (auto &id : shortIds) {
+            unsigned char raw[8] = {0};
+            in.readBytes(raw, kShortIdSize);
+            id = readLE64(raw);
+        }
+        uint64_t nPrefilled = in.readCompactSize();
+        if (in.failed || nPrefilled > in.left / 11) return false; // 1-byte index + 10-byte tx
+        prefilled.clear();
+        uint64_t total = count + nPrefilled;
+        uint64_t next = 0;
+        for (uint64_t i = 0; i < nPrefilled; i++) {
+            uint64_t index = next + in.readCompactSize();
+            if (in.failed || index >= total) return false;
+            MutableTransaction tx;
+            if (!deserializeTransaction(in, tx)) return false;
+            prefilled.push_back(PrefilledTransaction{static_cast<uint32_t>(index), makeTransactionRef(std::move(tx))});
+            next = index + 1;
+        }
+        return in.left == 0;
+    }
+};
+
+// A block being rebuilt from a compact announcement
+class PartialBlock {
+public:
+    // Place the prefilled transactions and whatever the mempool has. False if
+    // the announcement repeats a short id, which can't be resolved: get the
+    // full block instead.
+    bool init(const CompactBlock &compact, Mempool &mempool) {
+        header = compact.header;
+        txs.assign(compact.getTransactionCount(), TransactionRef());
+        fromMempool = 0;
+        std::vector<bool> isPrefilled(txs.size(), false);
+        for (auto &p : compact.prefilled) {
+            txs[p.index] = p.tx;
+            isPrefilled[p.index] = true;
+        }
+        // short id -> position in the block
+        std::unordered_map<uint64_t, size_t> positions;
+        positions.reserve(compact.shortIds.size());
+        size_t next = 0;
+        for (uint64_t id : compact.shortIds) {
+            while (isPrefilled[next]) next++;
+            if (!positions.emplace(id, next).second) return false;
+            next++;
+        }
+        if (positions.empty()) return true;
+        // Two mempool transactions with the same short id: neither can be trusted
+        std::vector<bool> ambiguous(txs.size(), false);
+        SipHasher hasher = compact.getHasher();
+        mempool.forEachTransaction([&](const TransactionRef &tx) {
+            auto it = positions.find(CompactBlock::shortId(hasher, tx->getTxId()));
+            if (it == positions.end() || ambiguous[it->second]) return;
+            if (txs[it->second]) {
+                txs[it->second] = TransactionRef();
+                ambiguous[it->second] = true;
+                fromMempool--;
+                return;
+            }
+            txs[it->second] = tx;
+            fromMempool++;
+        });
+        return true;
+    }
+
+    uint256 getHash() const {
+        return header.getHash();
+    }
+
+    // Positions still to fetch, ascending
+    std::vector<uint32_t> getMissing() const {
+        std::vector<uint32_t> missing;
+        for (size_t i = 0; i < txs.size(); i++) {
+            if (!txs[i]) missing.push_back(static_cast<uint32_t>(i));
+        }
+        return missing;
+    }
+
+    // Fill the missing positions, in order, from a blocktxn reply. False if the
+    // count doesn't match what we asked for.
+    bool fill(const std::vector<TransactionRef> &found) {
+        size_t next = 0;
+        for (auto &slot : txs) {
+            if (slot) continue;
+            if (next == found.size()) return false;
+            slot = found[next++];
+        }
+        return next == found.size();
+    }
+
+    size_t getTransactionCount() const {
+        return txs.size();
+    }
+
+    size_t getFromMempoolCount() const {
+        return fromMempool;
+    }
+
+    // Only once nothing is missing
+    void getBlock(Block &out) const {
+        out.header = header;
+        out.setTransactions(txs);
+    }
+
+private:
+    BlockHeader header;
+    std::vector<TransactionRef> txs;
+    size_t fromMempool = 0;
+};
+
+static std::string serializeGetBlockTxn(const uint256 &hash, const std::vector<uint32_t> &indexes) {
+    std::string out;
+    appendBytes(out, hash.data, 32);
+    appendCompactSize(out, indexes.size());
+    uint32_t next = 0;
+    for (uint32_t index : indexes) {
+        appendCompactSize(out, index - next);
+        next = index + 1;
+    }
+    return out;
+}
+
+static bool deserializeGetBlockTxn(const unsigned char *data, size_t len, uint256 &hash, std::vector<uint32_t> &indexes) {
+    ByteReader in(data, len);
+    in.readBytes(hash.data, 32);
+    uint64_t count = in.readCompactSize();
+    if (in.failed || count > in.left) return false;
+    indexes.clear();
+    uint64_t next = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t index = next + in.readCompactSize();
+        if (in.failed || index > 0xffffffffULL) return false;
+        indexes.push_back(static_cast<uint32_t>(index));
+        next = index + 1;
+    }
+    return in.left == 0;
+}
+
+static std::string serializeBlockTxn(const uint256 &hash, const std::vector<TransactionRef> &txs) {
+    std::string out;
+    appendBytes(out, hash.data, 32);
+    appendCompactSize(out, txs.size());
+    for (auto &tx : txs) {
+        tx->serialize(out);
+    }
+    return out;
+}
+
+static bool deserializeBlockTxn(const unsigned char *data, size_t len, uint256 &hash, std::vector<TransactionRef> &txs) {
+    ByteReader in(data, len);
+    in.readBytes(hash.data, 32);
+    uint64_t count = in.readCompactSize();
+    if (in.failed || count > in.left / 10) return false;
+    txs.clear();
+    for (uint64_t i = 0; i < count; i++) {
+        MutableTransaction tx;
+        if (!deserializeTransaction(in, tx)) return false;
+        txs.push_back(makeTransactionRef(std::move(tx)));
+    }
+    return in.left == 0;
+}
+
+static std::string serializeSendCompact(bool announce) {
+    std::string out;
+    out.push_back(announce ? 1 : 0);
+    appendLE64(out, kCompactBlockVersion);
+    return out;
+}
+
+static bool deserializeSendCompact(const unsigned char *data, size_t len, bool &announce, uint64_t &version) {
+    if (len != 9 || data[0] > 1) return false;
+    announce = data[0] == 1;
+    version = readLE64(data + 1);
+    return true;
+}
@@ -0,0 +1,169 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+  #include <io.h>
+  #include <direct.h>
+  #include <vector>
+#else
+  #include <unistd.h>
+  #include <sys/mman.h>
+#endif
+
+// Small file helpers shared by the on-disk stores (chainstate, block files).
+// All offsets are absolute; reads/writes loop until the full length is done.
+
+static int openFile(const std::string &path, bool create) {
+#ifdef _WIN32
+    int flags = _O_RDWR | _O_BINARY | (create ? _O_CREAT : 0);
+    return _open(path.c_str(), flags, _S_IREAD | _S_IWRITE);
+#else
+    int flags = O_RDWR | (create ? O_CREAT : 0);
+    return open(path.c_str(), flags, 0644);
+#endif
+}
+
+static void closeFile(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+static bool readAt(int fd, void *buf, size_t len, uint64_t offset) {
+    char *p = static_cast<char*>(buf);
+    while (len > 0) {
+#ifdef _WIN32
+        if (_lseeki64(fd, static_cast<__int64>(offset), SEEK_SET) < 0) return false;
+        int n = _read(fd, p, static_cast<unsigned>(len));
+#else
+        ssize_t n = pread(fd, p, len, static_cast<off_t>(offset));
+#endif
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool writeAt(int fd, const void *buf, size_t len, uint64_t offset) {
+    const char *p = static_cast<const char*>(buf);
+    while (len > 0) {
+#ifdef _WIN32
+        if (_lseeki64(fd, static_cast<__int64>(offset), SEEK_SET) < 0) return false;
+        int n = _write(fd, p, static_cast<unsigned>(len));
+#else
+        ssize_t n = pwrite(fd, p, len, static_cast<off_t>(offset));
+#endif
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool syncFile(int fd) {
+#ifdef _WIN32
+    return _commit(fd) == 0;
+#else
+    return fsync(fd) == 0;
+#endif
+}
+
+static uint64_t fileSize(int fd) {
+#ifdef _WIN32
+    return static_cast<uint64_t>(_lseeki64(fd, 0, SEEK_END));
+#else
+    struct stat st;
+    return fstat(fd, &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+#endif
+}
+
+static bool truncateFile(int fd, uint64_t size) {
+#ifdef _WIN32
+    return _chsize_s(fd, static_cast<__int64>(size)) == 0;
+#else
+    return ftruncate(fd, static_cast<off_t>(size)) == 0;
+#endif
+}
+
+static bool fileExists(const std::string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+// Create `path` and any missing parents
+static bool ensureDirectory(const std::string &path) {
+    if (path.empty() || fileExists(path)) return true;
+    size_t slash = path.find_last_of('/');
+    if (slash != std::string::npos && slash > 0 && !ensureDirectory(path.substr(0, slash))) {
+        return false;
+    }
+#ifdef _WIN32
+    return _mkdir(path.c_str()) == 0 || errno == EEXIST;
+#else
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+// Make a rename/unlink inside `dir` durable
+static void syncDirectory(const std::string &dir) {
+#ifndef _WIN32
+    int fd = open(dir.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+#else
+    (void)dir;
+#endif
+}
+
+// Read-only view of a whole file. mmap where available; elsewhere the file is
+// read into memory, which keeps callers identical.
+struct MappedFile {
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    std::vector<unsigned char> copy;
+#endif
+};
+
+static bool mapFile(int fd, MappedFile &map) {
+    map.data = nullptr;
+    map.size = static_cast<size_t>(fileSize(fd));
+    if (map.size == 0) return true;
+#ifdef _WIN32
+    map.copy.resize(map.size);
+    if (!readAt(fd, map.copy.data(), map.size, 0)) return false;
+    map.data = map.copy.data();
+#else
+    void *p = mmap(nullptr, map.size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        map.size = 0;
+        return false;
+    }
+    map.data = static_cast<const unsigned char*>(p);
+#endif
+    return true;
+}
+
+static void unmapFile(MappedFile &map) {
+#ifdef _WIN32
+    map.copy.clear();
+#else
+    if (map.data) munmap(const_cast<unsigned char*>(map.data), map.size);
+#endif
+    map.data = nullptr;
+    map.size = 0;
+}
@@ -0,0 +1,457 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <openssl/ec.h>
+#include <openssl/bn.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/obj_mac.h>
+#include <openssl/rand.h>
+#include "primitives.cpp"
+#include "fs_util.cpp"
+#include "wallet_index.cpp"
+
+// ------------------- HD KEYS AND KEY POOL -------------------
+// Every wallet key is derived from one random seed as in BIP-32: the master
+// key is HMAC-SHA512("Bitcoin seed", seed) and key i is the hardened child
+// m/0'/0'/i' (the path Bitcoin Core's HD wallets use for receiving keys), so
+// backing up the seed backs up every key, past and future.
+//
+// A background thread keeps keypoolSize keys derived ahead of the next one to
+// be handed out, and adds their pubKeyHashes to the wallet index as it goes:
+// asking for an address never waits for an EC multiplication, and a payment to
+// an address handed out on another copy of the wallet is still recognized.
+// Private keys aren't kept; a hardened child costs one HMAC and a modular
+// addition, so signing simply derives the key again.
+//
+// File (<dataDir>/wallet.dat), rewritten whole:
+//   magic(8) | seed(32) | nextIndex(LE32) | birthHeight(LE64) | sha256(all before)
+// nextIndex is reserved kKeyReserveAhead at a time by the background thread,
+// ahead of the keys handed out, so handing out a key doesn't touch the disk;
+// after a crash the unused rest of a reservation is skipped, never handed out
+// twice. The seed is not encrypted.
+
+static const char kWalletFileMagic[8] = {'M', 'Y', 'W', 'A', 'L', 'L', '0', '1'};
+static const uint32_t kHardenedIndex = 0x80000000u;
+static const uint32_t kKeyReserveAhead = 100;
+static const size_t kKeyDeriveBatch = 100; // keys derived per pass of the filler
+
+// A private key and the chain code its children are derived with
+struct ExtKey {
+    uint256 key; // big-endian, as toHex()/signTransactionInput expect
+    uint256 chainCode;
+};
+
+// Valid private keys are 1 .. n-1 for the secp256k1 group order n
+static const BIGNUM *secp256k1Order() {
+    static BIGNUM *order = []() {
+        BIGNUM *n = BN_new();
+        EC_GROUP *group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+        EC_GROUP_get_order(group, n, NULL);
+        EC_GROUP_free(group);
+        return n;
+    }();
+    return order;
+}
+
+// Left half of an HMAC-SHA512 becomes `left`, the right half `right`
+static void hmacSha512(const void *key, size_t keyLen, const std::string &data, uint256 &left, uint256 &right) {
+    unsigned char out[64];
+    unsigned int outLen = 0;
+    HMAC(EVP_sha512(), key, static_cast<int>(keyLen), reinterpret_cast<const unsigned char*>(data.data()),
+         data.size(), out, &outLen);
+    std::memcpy(left.data, out, 32);
+    std::memcpy(right.data, out + 32, 32);
+    OPENSSL_cleanse(out, sizeof(out));
+}
+
+static bool deriveMasterKey(const std::string &seed, ExtKey &out) {
+    static const char kSeedKey[] = "Bitcoin seed";
+    hmacSha512(kSeedKey, sizeof(kSeedKey) - 1, seed, out.key, out.chainCode);
+    BIGNUM *k = BN_bin2bn(out.key.data, 32, NULL);
+    bool ok = k && !BN_is_zero(k) && BN_cmp(k, secp256k1Order()) < 0;
+    BN_clear_free(k);
+    return ok;
+}
+
+// Hardened child `index` (below 2^31) of a private extended key. False for the
+// roughly 1 in 2^127 indexes that have no valid key; BIP-32 skips those.
+static bool deriveHardenedChild(const ExtKey &parent, uint32_t index, ExtKey &child) {
+    std::string data(1, '\0');
+    appendBytes(data, parent.key.data, 32);
+    unsigned char ser[4] = {
+        static_cast<unsigned char>((index | kHardenedIndex) >> 24), static_cast<unsigned char>(index >> 16),
+        static_cast<unsigned char>(index >> 8), static_cast<unsigned char>(index)};
+    appendBytes(data, ser, 4);
+    uint256 tweak;
+    hmacSha512(parent.chainCode.data, 32, data, tweak, child.chainCode);
+    OPENSSL_cleanse(&data[0], data.size());
+
+    BN_CTX *ctx = BN_CTX_new();
+    BIGNUM *t = BN_bin2bn(tweak.data, 32, NULL);
+    BIGNUM *k = BN_bin2bn(parent.key.data, 32, NULL);
+    const BIGNUM *n = secp256k1Order();
+    bool ok = ctx && t && k && BN_cmp(t, n) < 0 && BN_mod_add(k, k, t, n, ctx) == 1 && !BN_is_zero(k)
+        && BN_bn2binpad(k, child.key.data, 32) == 32;
+    BN_clear_free(t);
+    BN_clear_free(k);
+    BN_CTX_free(ctx);
+    return ok;
+}
+
+// sha256 of the uncompressed public key (what i2o_ECPublicKey encodes)
+static bool pubKeyHashFromSecret(const EC_GROUP *group, BN_CTX *ctx, const uint256 &secret, uint256 &pubKeyHash) {
+    BIGNUM *k = BN_bin2bn(secret.data, 32, NULL);
+    EC_POINT *pub = EC_POINT_new(group);
+    unsigned char encoded[65];
+    bool ok = k && pub && EC_POINT_mul(group, pub, k, NULL, NULL, ctx) == 1
+        && EC_POINT_point2oct(group, pub, POINT_CONVERSION_UNCOMPRESSED, encoded, sizeof(encoded), ctx) == sizeof(encoded);
+    if (ok) pubKeyHash = sha256(encoded, sizeof(encoded));
+    EC_POINT_free(pub);
+    BN_clear_free(k);
+    return ok;
+}
+
+// Signature script of an input (format in sig_check.cpp)
+static std::string encodeSignatureScript(const std::string &derSig, const std::string &pubKey) {
+    std::string out;
+    appendCompactSize(out, derSig.size());
+    out += derSig;
+    appendCompactSize(out, pubKey.size());
+    out += pubKey;
+    return out;
+}
+
+// Signing uses the EC_KEY API like verifyEcdsa; it is deprecated (not removed) in OpenSSL 3
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#endif
+
+// Encoded public key, as carried in signature scripts
+static std::string encodePublicKey(EC_KEY *ecKey) {
+    int size = i2o_ECPublicKey(ecKey, NULL);
+    std::string rawPubKey(size > 0 ? size : 0, '\0');
+    unsigned char *p = reinterpret_cast<unsigned char*>(&rawPubKey[0]);
+    i2o_ECPublicKey(ecKey, &p);
+    return rawPubKey;
+}
+
+// Sign input `index` of tx with a hex private key. Sign only once every input
+// and output is in place: the signature commits to all of them.
+static bool signTransactionInput(MutableTransaction &tx, size_t index, const std::string &privKeyHex) {
+    EC_KEY *ecKey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    BIGNUM *priv = NULL;
+    if (!ecKey || !BN_hex2bn(&priv, privKeyHex.c_str())) {
+        EC_KEY_free(ecKey);
+        return false;
+    }
+    const EC_GROUP *group = EC_KEY_get0_group(ecKey);
+    EC_POINT *pub = EC_POINT_new(group);
+    bool ok = pub && EC_POINT_mul(group, pub, priv, NULL, NULL, NULL) == 1
+        && EC_KEY_set_private_key(ecKey, priv) == 1 && EC_KEY_set_public_key(ecKey, pub) == 1;
+    if (ok) {
+        uint256 sighash = signatureHash(signatureDigest(tx), static_cast<uint32_t>(index));
+        std::string sig(ECDSA_size(ecKey), '\0');
+        unsigned int sigLen = 0;
+        ok = ECDSA_sign(0, sighash.data, 32, reinterpret_cast<unsigned char*>(&sig[0]), &sigLen, ecKey) == 1;
+        if (ok) {
+            sig.resize(sigLen);
+            tx.inputs[index].signature = encodeSignatureScript(sig, encodePublicKey(ecKey));
+        }
+    }
+    EC_POINT_free(pub);
+    BN_free(priv);
+    EC_KEY_free(ecKey);
+    return ok;
+}
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+class KeyPool {
+public:
+    // Keeps `targetSize` keys derived ahead and adds each to `index`
+    KeyPool(std::shared_ptr<WalletIndex> index, size_t targetSize)
+        : index(index), targetSize(targetSize ? targetSize : 1) {}
+
+    ~KeyPool() {
+        stop();
+    }
+
+    // Load the wallet at `path`, or create one with a new seed whose keys have
+    // no history before `birthHeight`, then start filling the pool. A loaded
+    // wallet rescans from its birth height once the keys it handed out (and
+    // the pool) are derived.
+    bool open(const std::string &path, uint64_t birthHeight) {
+        filePath = path;
+        if (fileExists(path)) {
+            if (!load()) return false;
+            rescanPending = true;
+        } else {
+            unsigned char seed[32];
+            if (RAND_bytes(seed, sizeof(seed)) != 1) {
+                std::cerr << "[Wallet] Failed to generate a seed" << std::endl;
+                return false;
+            }
+            seedBytes.assign(reinterpret_cast<const char*>(seed), sizeof(seed));
+            OPENSSL_cleanse(seed, sizeof(seed));
+            birth = birthHeight;
+            nextIndex = reservedIndex = 0;
+            if (!writeFile(0)) return false;
+            std::cout << "[Wallet] Created new HD wallet " << path << std::endl;
+        }
+        ExtKey master, account;
+        if (!deriveMasterKey(seedBytes, master) || !deriveHardenedChild(master, 0, account)
+            || !deriveHardenedChild(account, 0, chainKey)) {
+            std::cerr << "[Wallet] Unusable seed in " << path << std::endl;
+            return false;
+        }
+        derivedIndex = 0;
+        savedIndex = reservedIndex;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready = true;
+        }
+        filler = std::thread(&KeyPool::fillLoop, this);
+        return true;
+    }
+
+    // False until open() succeeds; getNewKey() and getSecret() fail meanwhile
+    bool isReady() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return ready;
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        derived.notify_all();
+        if (filler.joinable()) filler.join();
+    }
+
+    // Hand out the next unused key. Only waits if the pool has run dry, and
+    // fails at once if the wallet isn't open. The filler keeps the reservation
+    // in the file ahead, so this only writes the file itself after a burst of
+    // kKeyReserveAhead / 2 keys, and never while holding the lock.
+    bool getNewKey(uint256 &pubKeyHash, uint32_t &keyIndex) {
+        std::unique_lock<std::mutex> lock(mutex);
+        uint32_t next;
+        while (true) {
+            derived.wait(lock, [this]() { return !ready || stopping || !pool.empty(); });
+            if (!ready || pool.empty()) return false;
+            next = pool.front().second;
+            if (next < reservedIndex) break;
+            uint32_t upTo = next + kKeyReserveAhead;
+            lock.unlock();
+            bool saved = reserveThrough(upTo);
+            lock.lock();
+            if (!saved) return false;
+            reservedIndex = std::max(reservedIndex, upTo);
+        }
+        pubKeyHash = pool.front().first;
+        keyIndex = next;
+        pool.pop_front();
+        nextIndex = next + 1;
+        lock.unlock();
+        wake.notify_one();
+        return true;
+    }
+
+    // Private key of a key handed out (or pooled) under `keyIndex`
+    bool getSecret(uint32_t keyIndex, uint256 &secret) {
+        if (!isReady()) return false;
+        ExtKey child;
+        if (!deriveHardenedChild(chainKey, keyIndex, child)) return false;
+        secret = child.key;
+        return true;
+    }
+
+    // Keys derived and waiting to be handed out
+    size_t available() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return pool.size();
+    }
+
+private:
+    // Derive in batches until targetSize keys lie ahead of nextIndex. Keys below
+    // nextIndex (handed out in an earlier run) only go to the index.
+    void fillLoop() {
+        EC_GROUP *group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+        BN_CTX *ctx = BN_CTX_new();
+        std::vector<std::pair<uint256, uint32_t>> batch;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            // Move the reservation in the file on before getNewKey reaches it
+            if (reserveAhead && reservedIndex - nextIndex < kKeyReserveAhead / 2) {
+                uint32_t upTo = nextIndex + kKeyReserveAhead;
+                lock.unlock();
+                bool saved = reserveThrough(upTo);
+                lock.lock();
+                if (saved) {
+                    reservedIndex = std::max(reservedIndex, upTo);
+                } else {
+                    reserveAhead = false; // getNewKey will report it
+                }
+                continue;
+            }
+            uint64_t want = uint64_t(nextIndex) + targetSize;
+            if (derivedIndex >= want) {
+                if (rescanPending) {
+                    rescanPending = false;
+                    lock.unlock();
+                    startRescan();
+                    lock.lock();
+                    continue;
+                }
+                wake.wait(lock);
+                continue;
+            }
+            uint64_t from = derivedIndex;
+            uint64_t to = std::min<uint64_t>(want, from + kKeyDeriveBatch);
+            lock.unlock();
+
+            batch.clear();
+            for (uint64_t i = from; i < to && i < kHardenedIndex; i++) {
+                ExtKey child;
+                uint256 pubKeyHash;
+                if (!deriveHardenedChild(chainKey, static_cast<uint32_t>(i), child)) continue;
+                if (!pubKeyHashFromSecret(group, ctx, child.key, pubKeyHash)) continue;
+                batch.push_back(std::make_pair(pubKeyHash, static_cast<uint32_t>(i)));
+            }
+            // Indexed before they can be handed out, so no payment is missed
+            index->addKeys(batch);
+
+            lock.lock();
+            for (auto &key : batch) {
+                if (key.second >= nextIndex) pool.push_back(key);
+            }
+            derivedIndex = to;
+            if (to >= kHardenedIndex) {
+                std::cerr << "[Wallet] Key pool exhausted" << std::endl;
+                stopping = true; // getNewKey fails once the pool is empty
+                break;
+            }
+            derived.notify_all();
+        }
+        lock.unlock();
+        derived.notify_all();
+        BN_CTX_free(ctx);
+        EC_GROUP_free(group);
+    }
+
+    // The index only knows about outputs to keys added before it saw them
+    void startRescan() {
+        std::cout << "[Wallet] Rescanning from birth height " << birth << std::endl;
+        while (!index->startRescan(birth, WalletIndex::ProgressFn())) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping) return;
+            }
+            // A catch-up is running; it wouldn't revisit the older blocks
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+
+    // Make sure the file reserves every index below `upTo`. Called without the
+    // pool's lock; writes are serialized, and the saved value never goes back.
+    bool reserveThrough(uint32_t upTo) {
+        std::lock_guard<std::mutex> lock(fileMutex);
+        if (upTo <= savedIndex) return true;
+        if (!writeFile(upTo)) return false;
+        savedIndex = upTo;
+        return true;
+    }
+
+    // Rewrite the file with `reserved` as its nextIndex (seed and birth never
+    // change after open)
+    bool writeFile(uint32_t reserved) {
+        std::string data;
+        appendBytes(data, kWalletFileMagic, sizeof(kWalletFileMagic));
+        appendBytes(data, seedBytes.data(), seedBytes.size());
+        appendLE32(data, reserved);
+        appendLE64(data, birth);
+        uint256 check = sha256(data);
+        appendBytes(data, check.data, 32);
+
+        std::string tmpPath = filePath + ".tmp";
+        std::remove(tmpPath.c_str());
+        int fd = openFile(tmpPath, true);
+        bool ok = fd >= 0;
+#ifndef _WIN32
+        ok = ok && fchmod(fd, 0600) == 0; // holds the seed
+#endif
+        ok = ok && writeAt(fd, data.data(), data.size(), 0) && syncFile(fd);
+        if (fd >= 0) closeFile(fd);
+        OPENSSL_cleanse(&data[0], data.size());
+        if (!ok || std::rename(tmpPath.c_str(), filePath.c_str()) != 0) {
+            std::cerr << "[Wallet] Failed to write " << filePath << std::endl;
+            return false;
+        }
+        size_t slash = filePath.find_last_of('/');
+        if (slash != std::string::npos) syncDirectory(filePath.substr(0, slash));
+        return true;
+    }
+
+    bool load() {
+        int fd = openFile(filePath, false);
+        if (fd < 0) return false;
+        std::string data(static_cast<size_t>(fileSize(fd)), '\0');
+        bool ok = data.empty() || readAt(fd, &data[0], data.size(), 0);
+        closeFile(fd);
+        const size_t expected = sizeof(kWalletFileMagic) + 32 + 4 + 8 + 32;
+        uint256 check;
+        if (ok && data.size() == expected) std::memcpy(check.data, data.data() + data.size() - 32, 32);
+        if (!ok || data.size() != expected
+            || std::memcmp(data.data(), kWalletFileMagic, sizeof(kWalletFileMagic)) != 0
+            || sha256(reinterpret_cast<const unsigned char*>(data.data()), data.size() - 32) != check) {
+            // Unlike peers.dat this can't be rebuilt: never overwrite it
+            std::cerr << "[Wallet] Corrupt wallet file " << filePath << std::endl;
+            return false;
+        }
+        seedBytes = data.substr(sizeof(kWalletFileMagic), 32);
+        ByteReader in(data.data() + sizeof(kWalletFileMagic) + 32, 12);
+        reservedIndex = in.readU32();
+        birth = in.readU64();
+        nextIndex = reservedIndex;
+        OPENSSL_cleanse(&data[0], data.size());
+        std::cout << "[Wallet] Loaded HD wallet " << filePath << " (" << nextIndex << " keys used)" << std::endl;
+        return true;
+    }
+
+    std::shared_ptr<WalletIndex> index;
+    size_t targetSize;
+    std::string filePath;
+    std::string seedBytes;
+    ExtKey chainKey;             // m/0'/0': parent of every wallet key
+    uint64_t birth = 0;          // no key has history before this height
+    std::mutex mutex;
+    std::condition_variable wake;    // filler: more keys wanted, or stopping
+    std::condition_variable derived; // getNewKey: pool refilled, or stopping
+    std::deque<std::pair<uint256, uint32_t>> pool; // derived, not handed out, in index order
+    uint32_t nextIndex = 0;      // keys below it were (or may have been) handed out
+    uint32_t reservedIndex = 0;  // keys below it may be handed out (saved in the file)
+    uint64_t derivedIndex = 0;   // every key below it is in the index
+    bool ready = false;          // open() succeeded
+    bool reserveAhead = true;    // the filler extends the reservation
+    bool rescanPending = false;
+    bool stopping = false;
+    std::mutex fileMutex;        // serializes writeFile() after open
+    uint32_t savedIndex = 0;     // highest reservation written (under fileMutex)
+    std::thread filler;
+};
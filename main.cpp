@@ -1,12 +1,20 @@
 #include <iostream>
 #include <string>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 
 // Declarations of special main_ functions from other files
 int main_seedNode();
+#ifndef MYCOIN_NO_WALLET
 int main_wallet(int argc, char *argv[]);
+#endif
 
 void initBlockchain();
 void startP2P();
+void startRPC();
 void startMining(const std::string &minerPubKeyHash);
 void stopMining();
 
@@ -20,10 +28,16 @@ int main(int argc, char *argv[]) {
     if (mode == "--seed") {
         return main_seedNode();
     } else if (mode == "--wallet") {
+#ifndef MYCOIN_NO_WALLET
         return main_wallet(argc, argv);
+#else
+        std::cerr << "This build has no wallet (it was configured without Qt 5)" << std::endl;
+        return 1;
+#endif
     } else if (mode == "--miner") {
         initBlockchain();
         startP2P();
+        startRPC();
         std::cout << "[Miner] Starting miner with dummy pubKeyHash = 'minerKey'" << std::endl;
         startMining("minerKey"); 
         while(true) {
@@ -40,6 +54,7 @@ int main(int argc, char *argv[]) {
         std::cout << "[Full Node] Starting full node..." << std::endl;
         initBlockchain();
         startP2P();
+        startRPC();
         while(true) {
 #ifdef _WIN32
             Sleep(1000);
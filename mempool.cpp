@@ -0,0 +1,491 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <string>
+#include <set>
+#include <mutex>
+#include <algorithm>
+#include <unordered_map>
+#include "primitives.cpp"
+#include "utxo_set.cpp"
+#include "utxo_db.cpp"
+#include "sig_check.cpp"
+
+// ------------------- MEMPOOL -------------------
+// Unconfirmed transactions waiting for a block, indexed three ways:
+//   by txid            -> the entry (the tx plus its package bookkeeping)
+//   by spent outpoint  -> txid of the spender, for conflict checks
+//   by ancestor score  -> fee rate of the tx together with all its unconfirmed
+//                         ancestors, best first; templates are filled from the
+//                         front and eviction takes from the back
+// Parent/child links between entries let package statistics be updated when a
+// block confirms an ancestor or a tx is evicted with its descendants.
+class Mempool {
+public:
+    struct Entry {
+        TransactionRef tx;
+        uint256 txid;
+        uint64_t fee = 0;
+        size_t size = 0;
+        uint64_t ancestorFee = 0;  // including this tx
+        size_t ancestorSize = 0;
+        size_t ancestorCount = 0;
+        double score = 0;          // ancestorFee / ancestorSize
+        size_t usage = 0;          // estimated bytes of memory held
+        std::vector<Entry*> parents;
+        std::vector<Entry*> children;
+        uint64_t mark = 0;         // scratch for graph walks
+        uint64_t templateMark = 0; // == templateEpoch while in the cached template
+    };
+
+    explicit Mempool(UtxoCache &coinView) : coins(coinView) {}
+
+    void configure(size_t maxBytes, uint64_t minFeePerKB, size_t maxTxBytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        maxUsage = maxBytes;
+        minRelayFeePerKB = minFeePerKB;
+        maxTxSize = maxTxBytes;
+    }
+
+    // Validate tx against the UTXO set plus the mempool and add it. The caller
+    // must keep the UTXO set from changing meanwhile (Blockchain::acceptTransaction).
+    bool accept(const TransactionRef &txRef, std::string &reason) {
+        const Transaction &tx = *txRef;
+        const uint256 &txid = tx.getTxId();
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (tx.isCoinbase()) return rejectWith(reason, "coinbase transactions can't be relayed");
+        if (tx.inputs.empty() || tx.outputs.empty()) return rejectWith(reason, "no inputs or no outputs");
+        if (entries.count(txid)) return rejectWith(reason, "already in the mempool");
+        if (tx.getSerializedSize() > maxTxSize) return rejectWith(reason, "too large");
+
+        std::vector<OutPoint> prevouts;
+        prevouts.reserve(tx.inputs.size());
+        for (auto &in : tx.inputs) {
+            prevouts.emplace_back(in.txid, in.index);
+        }
+        std::sort(prevouts.begin(), prevouts.end());
+        if (std::adjacent_find(prevouts.begin(), prevouts.end()) != prevouts.end()) {
+            return rejectWith(reason, "spends the same output twice");
+        }
+
+        // Resolve every input from a mempool parent or the UTXO set
+        uint256 txDigest = signatureDigest(tx);
+        SigCheckQueue sigQueue;
+        std::vector<Entry*> parents;
+        uint64_t inputSum = 0;
+        for (size_t k = 0; k < tx.inputs.size(); k++) {
+            OutPoint key(tx.inputs[k].txid, tx.inputs[k].index);
+            if (const uint256 *spender = spentBy.find(key)) {
+                return rejectWith(reason, "conflicts with mempool transaction " + spender->toHex());
+            }
+            uint64_t amount;
+            uint256 pubKeyHash;
+            auto parent = entries.find(key.txid);
+            if (parent != entries.end()) {
+                if (key.index >= parent->second.tx->outputs.size()) {
+                    return rejectWith(reason, "missing input " + key.toString());
+                }
+                const TxOutput &out = parent->second.tx->outputs[key.index];
+                amount = out.amount;
+                pubKeyHash = out.pubKeyHash;
+                if (std::find(parents.begin(), parents.end(), &parent->second) == parents.end()) {
+                    parents.push_back(&parent->second);
+                }
+            } else if (const UTXO *coin = coins.find(key)) {
+                amount = coin->amount;
+                pubKeyHash = coin->pubKeyHash;
+            } else {
+                return rejectWith(reason, "missing input " + key.toString());
+            }
+            SigCheck check;
+            if (!makeSigCheck(tx, txDigest, k, pubKeyHash, 0, check)) {
+                return rejectWith(reason, "bad signature script for " + key.toString());
+            }
+            sigQueue.add(std::move(check));
+            inputSum += amount;
+        }
+
+        uint64_t outputSum = 0;
+        for (auto &out : tx.outputs) {
+            if (outputSum + out.amount < outputSum) return rejectWith(reason, "output sum overflows");
+            outputSum += out.amount;
+        }
+        if (outputSum > inputSum) return rejectWith(reason, "output sum exceeds input sum");
+        uint64_t fee = inputSum - outputSum;
+        size_t size = tx.getSerializedSize();
+        if (fee * 1000 < minRelayFeePerKB * size) return rejectWith(reason, "fee below the minimum relay fee");
+
+        // Package statistics over every unconfirmed ancestor
+        std::vector<Entry*> ancestors;
+        if (!collectAncestors(parents, ancestors)) {
+            return rejectWith(reason, "too many unconfirmed ancestors");
+        }
+
+        size_t badTx;
+        if (!sigQueue.run(true, badTx)) return rejectWith(reason, "invalid signature");
+
+        Entry &e = entries[txid];
+        e.tx = txRef;
+        e.txid = txid;
+        e.fee = fee;
+        e.size = size;
+        e.ancestorFee = fee;
+        e.ancestorSize = size;
+        e.ancestorCount = 1 + ancestors.size();
+        for (Entry *a : ancestors) {
+            e.ancestorFee += a->fee;
+            e.ancestorSize += a->size;
+        }
+        e.score = double(e.ancestorFee) / double(e.ancestorSize);
+        e.usage = entryUsage(tx);
+        e.parents = parents;
+        for (Entry *p : parents) {
+            p->children.push_back(&e);
+        }
+        for (auto &key : prevouts) {
+            spentBy.put(key, txid);
+        }
+        byScore.insert(ScoreKey{e.score, &e});
+        usage += e.usage;
+        sequence++;
+        noteAdded(&e);
+
+        // Over the cap: evict the worst packages, possibly the new tx itself
+        while (usage > maxUsage && !byScore.empty()) {
+            Entry *worst = std::prev(byScore.end())->entry;
+            removeWithDescendants(worst);
+        }
+        if (!entries.count(txid)) return rejectWith(reason, "mempool full");
+        return true;
+    }
+
+    // A block was connected: drop its transactions, update the package stats of
+    // their descendants, and evict everything that now conflicts with it.
+    void removeForBlock(const Block &block) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &txRef : block.getTransactions()) {
+            auto it = entries.find(txRef->getTxId());
+            if (it != entries.end()) {
+                removeConfirmed(&it->second);
+            }
+            if (txRef->isCoinbase()) continue;
+            for (auto &in : txRef->inputs) {
+                const uint256 *spender = spentBy.find(OutPoint(in.txid, in.index));
+                if (spender) {
+                    auto c = entries.find(*spender);
+                    if (c != entries.end()) removeWithDescendants(&c->second);
+                }
+            }
+        }
+        sequence++;
+        templateValid = false;
+    }
+
+    // Empty the pool and return what was in it, parents before children. A
+    // reorg does this and offers everything back once the new chain is in place.
+    std::vector<TransactionRef> removeAll() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<Entry*> order;
+        order.reserve(entries.size());
+        for (auto &e : entries) {
+            order.push_back(&e.second);
+        }
+        // A child counts every ancestor of its parents plus the parents themselves
+        std::sort(order.begin(), order.end(), [](const Entry *a, const Entry *b) {
+            return a->ancestorCount < b->ancestorCount;
+        });
+        std::vector<TransactionRef> txs;
+        txs.reserve(order.size());
+        for (Entry *e : order) {
+            txs.push_back(e->tx);
+        }
+        entries.clear();
+        spentBy.clear();
+        byScore.clear();
+        usage = 0;
+        sequence++;
+        templateValid = false;
+        return txs;
+    }
+
+    bool contains(const uint256 &txid) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.count(txid) != 0;
+    }
+
+    TransactionRef get(const uint256 &txid) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(txid);
+        return it == entries.end() ? TransactionRef() : it->second.tx;
+    }
+
+    // Visit every transaction, under the pool lock (fn must not call back in)
+    template <typename Fn>
+    void forEachTransaction(Fn fn) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &e : entries) {
+            fn(e.second.tx);
+        }
+    }
+
+    // Whether some mempool transaction already spends this output
+    bool isSpent(const OutPoint &key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return spentBy.contains(key);
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+    size_t memoryUsage() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return usage;
+    }
+
+    // Bumped on every change; lets miners tell whether a template is out of date
+    uint64_t getSequence() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return sequence;
+    }
+
+    // Best transactions by ancestor fee rate, in a valid block order, using at
+    // most maxBytes of serialized size. A tx is taken together with any
+    // ancestors not yet included. The template is kept between calls and
+    // extended as transactions arrive; it is only rebuilt from the score index
+    // after a block, an eviction, or an arrival that would displace something.
+    std::vector<TransactionRef> buildTemplate(size_t maxBytes, uint64_t &totalFees) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!templateValid || templateMaxBytes != maxBytes) {
+            rebuildTemplate(maxBytes);
+        }
+        totalFees = templateFees;
+        return templateTxs;
+    }
+
+private:
+    static const size_t kMaxAncestors = 25;
+
+    // Ordered best score first; txid breaks ties so the order is deterministic
+    struct ScoreKey {
+        double score;
+        Entry *entry;
+        bool operator<(const ScoreKey &o) const {
+            if (score != o.score) return score > o.score;
+            return entry->txid < o.entry->txid;
+        }
+    };
+
+    void rebuildTemplate(size_t maxBytes) {
+        templateTxs.clear();
+        templateFees = 0;
+        templateUsed = 0;
+        templateMinScore = 0;
+        templateMaxBytes = maxBytes;
+        uint64_t epoch = ++templateEpoch;
+        size_t misses = 0;
+        bool complete = true;
+        std::vector<Entry*> package;
+        for (const ScoreKey &k : byScore) {
+            Entry *e = k.entry;
+            if (e->templateMark == epoch) continue;
+
+            // The tx plus whichever of its ancestors aren't in the template yet
+            package.clear();
+            size_t packageSize = e->size;
+            uint64_t packageFee = e->fee;
+            if (!e->parents.empty()) {
+                collectMissing(e, epoch, ++markEpoch, package);
+                for (Entry *a : package) {
+                    packageSize += a->size;
+                    packageFee += a->fee;
+                }
+            }
+            if (templateUsed + packageSize > maxBytes) {
+                complete = false;
+                // Nearly full: stop after a run of packages that don't fit
+                if (++misses > 1000 && templateUsed + 4000 > maxBytes) break;
+                continue;
+            }
+            // Ancestors first; fewer ancestors means earlier in any valid order
+            std::sort(package.begin(), package.end(),
+                      [](const Entry *a, const Entry *b) { return a->ancestorCount < b->ancestorCount; });
+            package.push_back(e);
+            for (Entry *p : package) {
+                p->templateMark = epoch;
+                templateTxs.push_back(p->tx);
+            }
+            templateUsed += packageSize;
+            templateFees += packageFee;
+            templateMinScore = k.score;
+        }
+        templateComplete = complete;
+        templateValid = true;
+    }
+
+    // Keep the template current after e was admitted. While everything fits, e is
+    // just appended (its parents are already in). A tx scoring below everything in
+    // a full template wouldn't change it; anything else forces a rebuild.
+    void noteAdded(Entry *e) {
+        if (!templateValid) return;
+        if (templateComplete) {
+            for (Entry *p : e->parents) {
+                if (p->templateMark != templateEpoch) {
+                    templateValid = false;
+                    return;
+                }
+            }
+            if (templateUsed + e->size <= templateMaxBytes) {
+                e->templateMark = templateEpoch;
+                templateTxs.push_back(e->tx);
+                templateUsed += e->size;
+                templateFees += e->fee;
+                return;
+            }
+        } else if (e->score <= templateMinScore) {
+            return;
+        }
+        templateValid = false;
+    }
+
+    static bool rejectWith(std::string &reason, const std::string &why) {
+        reason = why;
+        return false;
+    }
+
+    // Rough heap footprint of one entry across all indexes
+    static size_t entryUsage(const Transaction &tx) {
+        size_t bytes = sizeof(Transaction) + sizeof(Entry) + 3 * 64; // entry, map/set nodes, control block
+        bytes += tx.inputs.size() * (sizeof(TxInput) + 64);           // input plus its spentBy slot
+        for (auto &in : tx.inputs) {
+            bytes += in.signature.capacity();
+        }
+        bytes += tx.outputs.size() * sizeof(TxOutput);
+        return bytes;
+    }
+
+    // All in-mempool ancestors reachable from `parents`; false past kMaxAncestors
+    bool collectAncestors(const std::vector<Entry*> &parents, std::vector<Entry*> &out) {
+        uint64_t walk = ++markEpoch;
+        std::vector<Entry*> stack(parents.begin(), parents.end());
+        while (!stack.empty()) {
+            Entry *a = stack.back();
+            stack.pop_back();
+            if (a->mark == walk) continue;
+            a->mark = walk;
+            out.push_back(a);
+            if (out.size() > kMaxAncestors) return false;
+            for (Entry *p : a->parents) {
+                stack.push_back(p);
+            }
+        }
+        return true;
+    }
+
+    // Ancestors of e not yet marked with `included`
+    void collectMissing(Entry *e, uint64_t included, uint64_t walk, std::vector<Entry*> &out) {
+        for (Entry *p : e->parents) {
+            if (p->templateMark == included || p->mark == walk) continue;
+            p->mark = walk;
+            out.push_back(p);
+            collectMissing(p, included, walk, out);
+        }
+    }
+
+    void collectDescendants(Entry *e, std::vector<Entry*> &out) {
+        uint64_t walk = ++markEpoch;
+        std::vector<Entry*> stack{e};
+        while (!stack.empty()) {
+            Entry *d = stack.back();
+            stack.pop_back();
+            if (d->mark == walk) continue;
+            d->mark = walk;
+            out.push_back(d);
+            for (Entry *c : d->children) {
+                stack.push_back(c);
+            }
+        }
+    }
+
+    void setScore(Entry *e) {
+        byScore.erase(ScoreKey{e->score, e});
+        e->score = double(e->ancestorFee) / double(e->ancestorSize);
+        byScore.insert(ScoreKey{e->score, e});
+    }
+
+    static void unlink(std::vector<Entry*> &list, Entry *e) {
+        list.erase(std::remove(list.begin(), list.end(), e), list.end());
+    }
+
+    // Drop one entry from every index (links to it must already be gone or irrelevant)
+    void erase(Entry *e) {
+        byScore.erase(ScoreKey{e->score, e});
+        for (auto &in : e->tx->inputs) {
+            spentBy.erase(OutPoint(in.txid, in.index));
+        }
+        usage -= e->usage;
+        uint256 txid = e->txid;
+        entries.erase(txid);
+    }
+
+    // e was confirmed: it leaves the ancestor sets of all its descendants
+    void removeConfirmed(Entry *e) {
+        std::vector<Entry*> descendants;
+        collectDescendants(e, descendants);
+        for (Entry *d : descendants) {
+            if (d == e) continue;
+            d->ancestorFee -= e->fee;
+            d->ancestorSize -= e->size;
+            d->ancestorCount--;
+            setScore(d);
+        }
+        for (Entry *c : e->children) {
+            unlink(c->parents, e);
+        }
+        for (Entry *p : e->parents) {
+            unlink(p->children, e);
+        }
+        erase(e);
+    }
+
+    // Evict e and everything that spends its outputs
+    void removeWithDescendants(Entry *e) {
+        std::vector<Entry*> doomed;
+        collectDescendants(e, doomed);
+        for (Entry *d : doomed) {
+            for (Entry *p : d->parents) {
+                unlink(p->children, d);
+            }
+        }
+        for (Entry *d : doomed) {
+            if (d->templateMark == templateEpoch) templateValid = false;
+            erase(d);
+        }
+        sequence++;
+    }
+
+    UtxoCache &coins;
+    std::mutex mutex;
+    std::unordered_map<uint256, Entry, Uint256Hasher> entries;
+    OutPointTable<uint256> spentBy;
+    std::set<ScoreKey> byScore;
+
+    size_t usage = 0;
+    size_t maxUsage = 300u << 20;
+    uint64_t minRelayFeePerKB = 1000;
+    size_t maxTxSize = 1000000;
+    uint64_t sequence = 0;
+    uint64_t markEpoch = 0;
+
+    // Cached block template (see buildTemplate)
+    std::vector<TransactionRef> templateTxs;
+    uint64_t templateFees = 0;
+    size_t templateUsed = 0;
+    size_t templateMaxBytes = 0;
+    double templateMinScore = 0;   // lowest package score taken
+    uint64_t templateEpoch = 0;
+    bool templateComplete = false; // every mempool tx is in it
+    bool templateValid = false;
+};
@@ -3,51 +3,261 @@
 #include <atomic>
 #include <chrono>
 #include <sstream>
+#include <memory>
+#include <functional>
+#include <limits>
 #include <openssl/sha.h>
 #include "blockchain_core.cpp" // or a separate header if you prefer
 
 static std::atomic<bool> g_mining{false};
 
-static std::string sha256(const std::string &input); // forward
+static uint256 sha256(const std::string &input); // forward
 
-// The simple miner thread function
-void mineBlock(const std::string &minerPubKeyHash) {
+// Per-worker hash counter, padded to its own cache line so workers don't
+// false-share while they bump it.
+struct alignas(64) MinerWorkerStats {
+    std::atomic<uint64_t> hashes{0};
+};
+
+// Multi-threaded PoW search over a single block template.
+// Every worker owns a disjoint slice of the nonce space on the shared template;
+// when a slice runs out the worker moves to a fresh extranonce (which changes the
+// coinbase and so the merkle root) and searches the whole nonce space there.
+// A shared atomic stops all workers on a solution, a new tip, or shutdown.
+class MiningEngine {
+public:
+    typedef decltype(BlockHeader::nonce) Nonce;
+
+    explicit MiningEngine(unsigned threads)
+        : numThreads(threads ? threads : defaultThreadCount()),
+          stats(new MinerWorkerStats[numThreads]) {}
+
+    static unsigned defaultThreadCount() {
+        unsigned n = std::thread::hardware_concurrency();
+        return n ? n : 1;
+    }
+
+    unsigned getThreadCount() const { return numThreads; }
+
+    // Search `blockTemplate` until a worker finds a valid nonce (returns true and
+    // fills `solved`), or `isStale()` reports the template is no longer useful.
+    bool search(Block blockTemplate, Block &solved, const std::function<bool()> &isStale) {
+        stopFlag.store(false);
+        {
+            std::lock_guard<std::mutex> lock(solutionMutex);
+            found = false;
+        }
+        setExtraNonce(blockTemplate, nextExtraNonce.fetch_add(1));
+
+        std::vector<std::thread> workers;
+        workers.reserve(numThreads);
+        for (unsigned i = 0; i < numThreads; i++) {
+            workers.emplace_back(&MiningEngine::workerLoop, this, i, std::cref(blockTemplate));
+        }
+
+        std::vector<uint64_t> lastCounts(numThreads);
+        for (unsigned i = 0; i < numThreads; i++) {
+            lastCounts[i] = getHashCount(i);
+        }
+        auto lastReport = std::chrono::steady_clock::now();
+        while (!stopFlag.load()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            if (isStale()) {
+                stopFlag.store(true);
+                break;
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (hashrateReportSeconds && now - lastReport >= std::chrono::seconds(hashrateReportSeconds)) {
+                reportHashrate(lastCounts, std::chrono::duration<double>(now - lastReport).count());
+                lastReport = now;
+            }
+        }
+        for (auto &t : workers) {
+            t.join();
+        }
+
+        std::lock_guard<std::mutex> lock(solutionMutex);
+        if (found) {
+            solved = solution;
+        }
+        return found;
+    }
+
+    // Stop all workers as soon as possible (e.g. from another thread on shutdown)
+    void abort() {
+        stopFlag.store(true);
+    }
+
+    // Total number of hashes computed by a worker since the engine was created
+    uint64_t getHashCount(unsigned worker) const {
+        return stats[worker].hashes.load(std::memory_order_relaxed);
+    }
+
+    // Embed the extranonce in the coinbase "scriptSig" and refresh the merkle root
+    static void setExtraNonce(Block &block, uint64_t extraNonce) {
+        MutableTransaction coinbase(*block.getTransactions().front());
+        coinbase.inputs.front().signature = "coinbase:" + std::to_string(extraNonce);
+        block.replaceTransaction(0, makeTransactionRef(std::move(coinbase)));
+    }
+
+    unsigned hashrateReportSeconds = 10; // 0 disables the periodic report
+
+private:
+    // How often a worker flushes its local hash count and polls the stop flag
+    static const uint64_t kFlushInterval = 4096;
+
+    void workerLoop(unsigned id, const Block &blockTemplate) {
+        Block work = blockTemplate;
+        const uint64_t nonceSpace = static_cast<uint64_t>(std::numeric_limits<Nonce>::max());
+        const uint64_t slice = nonceSpace / numThreads;
+
+        // Initial slice on the shared template
+        uint64_t begin = slice * id;
+        uint64_t end = (id + 1 == numThreads) ? nonceSpace : begin + slice - 1;
+
+        while (!stopFlag.load(std::memory_order_relaxed)) {
+            if (scanRange(id, work, begin, end)) {
+                return;
+            }
+            // Slice exhausted: take a fresh extranonce nobody else is using
+            setExtraNonce(work, nextExtraNonce.fetch_add(1));
+            begin = 0;
+            end = nonceSpace;
+        }
+    }
+
+    // Scan nonces [begin, end]. Returns true if this worker found a solution.
+    // The loop itself does no allocation: the header prefix lives in a midstate,
+    // and nonces are hashed HeaderPowHasher::kBatch at a time on the SIMD backend.
+    bool scanRange(unsigned id, Block &work, uint64_t begin, uint64_t end) {
+        const uint64_t kBatch = HeaderPowHasher::kBatch;
+        HeaderPowHasher hasher(work.header);
+        const uint32_t bits = work.header.difficultyTarget;
+        uint256 hashes[HeaderPowHasher::kBatch];
+        uint64_t local = 0;
+        uint64_t nonce = begin;
+        while (true) {
+            if (end - nonce + 1 >= kBatch) {
+                hasher.hashNonces(static_cast<Nonce>(nonce), hashes);
+                for (uint64_t i = 0; i < kBatch; i++) {
+                    if (Blockchain::checkProofOfWork(hashes[i], bits)) {
+                        work.header.nonce = static_cast<Nonce>(nonce + i);
+                        stats[id].hashes.fetch_add(local + i + 1, std::memory_order_relaxed);
+                        publish(work);
+                        return true;
+                    }
+                }
+                local += kBatch;
+                nonce += kBatch - 1;
+            } else {
+                // Tail of the range that doesn't fill a batch
+                uint256 hash = hasher.hashWithNonce(static_cast<Nonce>(nonce));
+                local++;
+                if (Blockchain::checkProofOfWork(hash, bits)) {
+                    work.header.nonce = static_cast<Nonce>(nonce);
+                    stats[id].hashes.fetch_add(local, std::memory_order_relaxed);
+                    publish(work);
+                    return true;
+                }
+            }
+            if (local >= kFlushInterval) {
+                stats[id].hashes.fetch_add(local, std::memory_order_relaxed);
+                local = 0;
+                if (stopFlag.load(std::memory_order_relaxed)) break;
+            }
+            if (nonce == end) break;
+            nonce++;
+        }
+        stats[id].hashes.fetch_add(local, std::memory_order_relaxed);
+        return false;
+    }
+
+    void publish(const Block &work) {
+        std::lock_guard<std::mutex> lock(solutionMutex);
+        if (!found) {
+            found = true;
+            solution = work;
+        }
+        stopFlag.store(true);
+    }
+
+    void reportHashrate(std::vector<uint64_t> &lastCounts, double seconds) {
+        std::stringstream ss;
+        double total = 0;
+        ss << "[Miner] Hashrate:";
+        for (unsigned i = 0; i < numThreads; i++) {
+            uint64_t now = getHashCount(i);
+            double rate = (now - lastCounts[i]) / seconds;
+            lastCounts[i] = now;
+            total += rate;
+            ss << " t" << i << "=" << static_cast<uint64_t>(rate);
+        }
+        ss << " total=" << static_cast<uint64_t>(total) << " H/s";
+        std::cout << ss.str() << std::endl;
+    }
+
+    unsigned numThreads;
+    std::unique_ptr<MinerWorkerStats[]> stats;
+    std::atomic<bool> stopFlag{false};
+    std::atomic<uint64_t> nextExtraNonce{1};
+
+    std::mutex solutionMutex;
+    bool found = false;
+    Block solution;
+};
+
+// Minimum age of a template before new mempool transactions trigger a rebuild
+static const unsigned kTemplateRefreshSeconds = 5;
+
+// The miner coordinator: builds a template, lets the engine search it,
+// and starts over on a solution or when another block extends the tip.
+void mineBlock(const uint256 &minerPubKeyHash, unsigned numThreads) {
     Blockchain *chain = getBlockchain();
+    MiningEngine engine(numThreads);
+    std::cout << "[Miner] Mining with " << engine.getThreadCount() << " thread(s)" << std::endl;
+
     while (g_mining.load()) {
-        // Create a new block with coinbase
+        // Create a new block with coinbase and the best mempool transactions
+        const uint64_t mempoolSequence = chain->getMempool().getSequence();
         Block newBlock = chain->createNewBlock(minerPubKeyHash);
-        // Attempt PoW
-        newBlock.buildMerkleRoot();
+        const uint256 tipHash = newBlock.header.prevBlockHash;
+        const auto builtAt = std::chrono::steady_clock::now();
 
-        // PoW loop
-        while (true) {
-            if (!g_mining.load()) break;
-
-            std::string blockHash = newBlock.getBlockHash();
-            // Check if blockHash < difficulty
-            if (chain->isValidProofOfWork(newBlock)) {
-                // Found a valid block
-                if (chain->addBlock(newBlock)) {
-                    std::cout << "[Miner] Found a new block! Hash: " << blockHash << std::endl;
-                } else {
-                    std::cout << "[Miner] Block was rejected. Possibly a race condition." << std::endl;
-                }
-                break;
+        // Stale on a new tip, or when the mempool has changed and the template
+        // is a few seconds old (so new fees are picked up without constant rebuilds)
+        Block solved;
+        bool found = engine.search(newBlock, solved, [chain, &tipHash, mempoolSequence, builtAt]() {
+            if (!g_mining.load() || chain->getTipHash() != tipHash) return true;
+            return std::chrono::steady_clock::now() - builtAt >= std::chrono::seconds(kTemplateRefreshSeconds)
+                && chain->getMempool().getSequence() != mempoolSequence;
+        });
+
+        if (found) {
+            if (chain->addBlock(solved)) {
+                std::cout << "[Miner] Found a new block! Hash: " << solved.getBlockHash().toHex() << std::endl;
             } else {
-                newBlock.header.nonce++;
+                std::cout << "[Miner] Block was rejected. Possibly a race condition." << std::endl;
             }
+        } else if (g_mining.load() && chain->getTipHash() != tipHash) {
+            std::cout << "[Miner] New tip received, rebuilding block template" << std::endl;
         }
-        // Sleep a bit before building a new block again
-        // In reality, you'd continuously update block time, transaction set, etc.
-        std::this_thread::sleep_for(std::chrono::seconds(1));
     }
 }
 
-// Start the mining process in a background thread
-void startMining(const std::string &minerPubKeyHash) {
+// Start the mining process in a background thread.
+// Accepts a 64-char hex pubKeyHash, or any other label which is hashed into one.
+// Thread count comes from "minerThreads" in config.json (0 = hardware concurrency).
+void startMining(const std::string &minerPubKeyHashHex) {
+    uint256 minerPubKeyHash;
+    if (!minerPubKeyHash.setHex(minerPubKeyHashHex)) {
+        minerPubKeyHash = sha256(minerPubKeyHashHex);
+    }
+    Json::Value cfg = loadConfig("config.json");
+    unsigned numThreads = cfg.get("minerThreads", 0).asUInt();
+
     g_mining.store(true);
-    std::thread t([minerPubKeyHash]() {
-        mineBlock(minerPubKeyHash);
+    std::thread t([minerPubKeyHash, numThreads]() {
+        mineBlock(minerPubKeyHash, numThreads);
     });
     t.detach();
 }
@@ -0,0 +1,376 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include "primitives.cpp"
+
+// ------------------- P2P WIRE FORMAT -------------------
+// Every message is a 24-byte header followed by the payload:
+//   magic(4)  command(12, ASCII, NUL padded)  length(LE32)  checksum(4)
+// magic comes from "magicBytes" in config.json, so different networks never
+// talk to each other; checksum is the first 4 bytes of sha256(payload).
+// Payloads use the same compact binary encodings as the rest of the node.
+
+static const size_t kMessageHeaderSize = 24;
+static const size_t kCommandSize = 12;
+static const size_t kMinMessagePayloadLimit = 2u << 20; // a full inv/getdata (kMaxInvItems * 36 bytes)
+static const size_t kParserGrowStep = 256u << 10;
+static const size_t kMaxInvItems = 50000;
+static const size_t kMaxHeadersPerMessage = 2000;
+static const size_t kMaxAddrPerMessage = 1000;
+static const uint32_t kProtocolVersion = 1;
+
+struct NetMagic {
+    unsigned char bytes[4];
+};
+
+// "f9beb4d9" -> {0xf9, 0xbe, 0xb4, 0xd9}; anything malformed falls back to that
+static NetMagic parseNetMagic(const std::string &hex) {
+    NetMagic magic = {{0xf9, 0xbe, 0xb4, 0xd9}};
+    if (hex.size() != 8) return magic;
+    unsigned char tmp[4];
+    for (size_t i = 0; i < 4; i++) {
+        unsigned value = 0;
+        for (size_t j = 0; j < 2; j++) {
+            char c = hex[2 * i + j];
+            value <<= 4;
+            if (c >= '0' && c <= '9') value |= c - '0';
+            else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+            else return magic;
+        }
+        tmp[i] = static_cast<unsigned char>(value);
+    }
+    std::memcpy(magic.bytes, tmp, 4);
+    return magic;
+}
+
+static void writeMessageHeader(const NetMagic &magic, const std::string &command, const std::string &payload,
+                               unsigned char out[kMessageHeaderSize]) {
+    std::memset(out, 0, kMessageHeaderSize);
+    std::memcpy(out, magic.bytes, 4);
+    std::memcpy(out + 4, command.data(), std::min(command.size(), kCommandSize));
+    writeLE32(out + 16, static_cast<uint32_t>(payload.size()));
+    uint256 check = sha256(payload);
+    std::memcpy(out + 20, check.data, 4);
+}
+
+// Largest payload a peer may announce: a block of maxBlockSize ("maxBlockSize"
+// in config.json), or any other message at its item limit
+static size_t maxMessagePayload(size_t maxBlockSize) {
+    return std::max(maxBlockSize, kMinMessagePayloadLimit);
+}
+
+// A complete message inside the parser's buffer. The payload pointer stays valid
+// until the parser is written to again.
+struct MessageView {
+    std::string command;
+    const unsigned char *payload = nullptr;
+    size_t size = 0;
+};
+
+// Incremental frame parser for one connection. Socket reads go straight into
+// its buffer (writeBuffer + commit) and complete messages come back as views
+// into that buffer, so framing and checksumming need no copy; the caller copies
+// out what it keeps. A large payload is buffered whole, but the buffer grows
+// at most kParserGrowStep ahead of the bytes that actually arrived, so a
+// header announcing one costs nothing until the peer sends it.
+class MessageParser {
+public:
+    enum Result { NeedMore, Ready, Error };
+
+    MessageParser(const NetMagic &netMagic, size_t maxPayloadSize)
+        : magic(netMagic), maxPayload(maxPayloadSize), buffer(64 * 1024) {}
+
+    // At least `minFree` writable bytes at the end of the buffered data;
+    // `available` receives how many may be written
+    unsigned char *writeBuffer(size_t minFree, size_t &available) {
+        size_t missing = wanted > end - start ? wanted - (end - start) : size_t(0);
+        size_t want = std::max(minFree, std::min(missing, kParserGrowStep));
+        if (buffer.size() - end < want) {
+            // Slide the unread bytes to the front, then grow if still short
+            if (start > 0) {
+                std::memmove(buffer.data(), buffer.data() + start, end - start);
+                end -= start;
+                start = 0;
+            }
+            if (buffer.size() - end < want) buffer.resize(end + want);
+        }
+        available = buffer.size() - end;
+        return buffer.data() + end;
+    }
+
+    void commit(size_t n) { end += n; }
+
+    // Next complete message, if any. On Error the connection should be dropped.
+    Result next(MessageView &out) {
+        size_t have = end - start;
+        if (have < kMessageHeaderSize) return NeedMore;
+        const unsigned char *h = buffer.data() + start;
+        if (std::memcmp(h, magic.bytes, 4) != 0) return fail("bad magic");
+        size_t cmdLen = 0;
+        while (cmdLen < kCommandSize && h[4 + cmdLen] != 0) {
+            if (h[4 + cmdLen] < 0x20 || h[4 + cmdLen] > 0x7e) return fail("bad command");
+            cmdLen++;
+        }
+        for (size_t i = cmdLen; i < kCommandSize; i++) {
+            if (h[4 + i] != 0) return fail("bad command padding");
+        }
+        uint32_t length = readLE32(h + 16);
+        if (length > maxPayload) return fail("oversized message");
+        if (have < kMessageHeaderSize + length) {
+            wanted = kMessageHeaderSize + length;
+            return NeedMore;
+        }
+        const unsigned char *payload = h + kMessageHeaderSize;
+        uint256 check = sha256(payload, length);
+        if (std::memcmp(check.data, h + 20, 4) != 0) return fail("bad checksum");
+
+        out.command.assign(reinterpret_cast<const char*>(h + 4), cmdLen);
+        out.payload = payload;
+        out.size = length;
+        start += kMessageHeaderSize + length;
+        wanted = 0;
+        if (start == end) start = end = 0; // rewind; the view's bytes stay in place
+        return Ready;
+    }
+
+    const std::string &getError() const { return error; }
+
+private:
+    Result fail(const char *why) {
+        error = why;
+        return Error;
+    }
+
+    NetMagic magic;
+    size_t maxPayload;
+    std::vector<unsigned char> buffer;
+    size_t start = 0;  // first unread byte
+    size_t end = 0;    // one past the last buffered byte
+    size_t wanted = 0; // size of the message currently being received
+    std::string error;
+};
+
+// ---- payloads ----
+
+// version: who we are and how far our chain goes
+struct VersionMessage {
+    uint32_t version = kProtocolVersion;
+    uint64_t services = 0;
+    uint64_t timestamp = 0;
+    uint64_t nonce = 0;      // detects connections to ourselves
+    uint32_t startHeight = 0;
+    uint16_t listenPort = 0; // 0 = not accepting connections
+    std::string userAgent;
+
+    void serialize(std::string &out) const {
+        appendLE32(out, version);
+        appendLE64(out, services);
+        appendLE64(out, timestamp);
+        appendLE64(out, nonce);
+        appendLE32(out, startHeight);
+        out.push_back(static_cast<char>(listenPort));
+        out.push_back(static_cast<char>(listenPort >> 8));
+        appendCompactSize(out, userAgent.size());
+        out += userAgent;
+    }
+
+    bool deserialize(const unsigned char *data, size_t len) {
+        ByteReader in(data, len);
+        version = in.readU32();
+        services = in.readU64();
+        timestamp = in.readU64();
+        nonce = in.readU64();
+        startHeight = in.readU32();
+        unsigned char port[2];
+        in.readBytes(port, 2);
+        listenPort = static_cast<uint16_t>(port[0] | (port[1] << 8));
+        in.readString(userAgent);
+        return !in.failed && userAgent.size() <= 256;
+    }
+};
+
+enum InvType : uint32_t {
+    INV_TX = 1,
+    INV_BLOCK = 2,
+};
+
+struct InvItem {
+    uint32_t type;
+    uint256 hash;
+};
+
+// inv / getdata / notfound: compactSize(count) | count * (type LE32 | hash)
+static std::string serializeInv(const std::vector<InvItem> &items) {
+    std::string out;
+    appendCompactSize(out, items.size());
+    for (auto &item : items) {
+        appendLE32(out, item.type);
+        appendBytes(out, item.hash.data, 32);
+    }
+    return out;
+}
+
+static bool deserializeInv(const unsigned char *data, size_t len, std::vector<InvItem> &items) {
+    ByteReader in(data, len);
+    uint64_t count = in.readCompactSize();
+    if (in.failed || count > kMaxInvItems || count * 36 != in.left) return false;
+    items.resize(static_cast<size_t>(count));
+    for (auto &item : items) {
+        item.type = in.readU32();
+        in.readBytes(item.hash.data, 32);
+    }
+    return !in.failed;
+}
+
+// An IPv4 listening address (the P2P layer is IPv4 only)
+struct NetAddress {
+    uint32_t ip = 0;   // a.b.c.d as (a << 24) | (b << 16) | (c << 8) | d
+    uint16_t port = 0;
+
+    // "a.b.c.d:port"
+    static bool parse(const std::string &text, NetAddress &out) {
+        uint32_t ip = 0;
+        size_t pos = 0;
+        for (int part = 0; part < 4; part++) {
+            size_t digits = 0;
+            uint32_t value = 0;
+            while (pos < text.size() && text[pos] >= '0' && text[pos] <= '9' && digits < 3) {
+                value = value * 10 + (text[pos++] - '0');
+                digits++;
+            }
+            if (digits == 0 || value > 255) return false;
+            ip = (ip << 8) | value;
+            if (pos >= text.size() || text[pos++] != (part < 3 ? '.' : ':')) return false;
+        }
+        uint32_t port = 0;
+        size_t digits = 0;
+        while (pos < text.size() && text[pos] >= '0' && text[pos] <= '9' && digits < 5) {
+            port = port * 10 + (text[pos++] - '0');
+            digits++;
+        }
+        if (digits == 0 || pos != text.size() || port == 0 || port > 65535 || ip == 0) return false;
+        out.ip = ip;
+        out.port = static_cast<uint16_t>(port);
+        return true;
+    }
+
+    std::string toString() const {
+        return std::to_string(ip >> 24) + "." + std::to_string((ip >> 16) & 0xff) + "." +
+               std::to_string((ip >> 8) & 0xff) + "." + std::to_string(ip & 0xff) + ":" + std::to_string(port);
+    }
+
+    // Addresses in the same /16 are likely run by the same operator
+    uint32_t group() const { return ip >> 16; }
+
+    uint64_t key() const { return (uint64_t(ip) << 16) | port; }
+
+    bool operator==(const NetAddress &o) const { return ip == o.ip && port == o.port; }
+};
+
+// An address as gossiped: when it was last known to be reachable
+struct AddrEntry {
+    uint32_t time;  // unix seconds
+    NetAddress addr;
+};
+
+// addr: compactSize(count) | count * (time LE32 | ip BE32 | port BE16)
+static std::string serializeAddr(const std::vector<AddrEntry> &entries) {
+    std::string out;
+    appendCompactSize(out, entries.size());
+    for (auto &e : entries) {
+        appendLE32(out, e.time);
+        unsigned char buf[6] = {
+            static_cast<unsigned char>(e.addr.ip >> 24), static_cast<unsigned char>(e.addr.ip >> 16),
+            static_cast<unsigned char>(e.addr.ip >> 8), static_cast<unsigned char>(e.addr.ip),
+            static_cast<unsigned char>(e.addr.port >> 8), static_cast<unsigned char>(e.addr.port)};
+        appendBytes(out, buf, sizeof(buf));
+    }
+    return out;
+}
+
+static bool deserializeAddr(const unsigned char *data, size_t len, std::vector<AddrEntry> &entries) {
+    ByteReader in(data, len);
+    uint64_t count = in.readCompactSize();
+    if (in.failed || count > kMaxAddrPerMessage || count * 10 != in.left) return false;
+    entries.resize(static_cast<size_t>(count));
+    for (auto &e : entries) {
+        e.time = in.readU32();
+        unsigned char buf[6];
+        in.readBytes(buf, sizeof(buf));
+        e.addr.ip = (uint32_t(buf[0]) << 24) | (uint32_t(buf[1]) << 16) | (uint32_t(buf[2]) << 8) | buf[3];
+        e.addr.port = static_cast<uint16_t>((buf[4] << 8) | buf[5]);
+    }
+    return !in.failed;
+}
+
+// getheaders: compactSize(count) locator hashes (newest first) | hashStop (null = as many as allowed)
+static std::string serializeGetHeaders(const std::vector<uint256> &locator, const uint256 &hashStop) {
+    std::string out;
+    appendCompactSize(out, locator.size());
+    for (auto &h : locator) {
+        appendBytes(out, h.data, 32);
+    }
+    appendBytes(out, hashStop.data, 32);
+    return out;
+}
+
+static bool deserializeGetHeaders(const unsigned char *data, size_t len, std::vector<uint256> &locator, uint256 &hashStop) {
+    ByteReader in(data, len);
+    uint64_t count = in.readCompactSize();
+    if (in.failed || count > 101 || (count + 1) * 32 != in.left) return false;
+    locator.resize(static_cast<size_t>(count));
+    for (auto &h : locator) {
+        in.readBytes(h.data, 32);
+    }
+    in.readBytes(hashStop.data, 32);
+    return !in.failed;
+}
+
+// headers: compactSize(count) | count * 80-byte header
+static std::string serializeHeaders(const std::vector<BlockHeader> &headers) {
+    std::string out;
+    appendCompactSize(out, headers.size());
+    unsigned char buf[BlockHeader::kSerializedSize];
+    for (auto &h : headers) {
+        h.serialize(buf);
+        appendBytes(out, buf, sizeof(buf));
+    }
+    return out;
+}
+
+static bool deserializeHeaders(const unsigned char *data, size_t len, std::vector<BlockHeader> &headers) {
+    ByteReader in(data, len);
+    uint64_t count = in.readCompactSize();
+    if (in.failed || count > kMaxHeadersPerMessage || count * BlockHeader::kSerializedSize != in.left) return false;
+    headers.resize(static_cast<size_t>(count));
+    unsigned char buf[BlockHeader::kSerializedSize];
+    for (auto &h : headers) {
+        in.readBytes(buf, sizeof(buf));
+        h.deserialize(buf);
+    }
+    return !in.failed;
+}
+
+// tx: the transaction's own serialization
+static TransactionRef deserializeTxMessage(const unsigned char *data, size_t len) {
+    ByteReader in(data, len);
+    MutableTransaction tx;
+    if (!deserializeTransaction(in, tx) || in.left != 0) return TransactionRef();
+    return makeTransactionRef(std::move(tx));
+}
+
+// ping / pong: nonce(LE64)
+static std::string serializeNonce(uint64_t nonce) {
+    std::string out;
+    appendLE64(out, nonce);
+    return out;
+}
+
+static bool deserializeNonce(const unsigned char *data, size_t len, uint64_t &nonce) {
+    if (len != 8) return false;
+    nonce = readLE64(data);
+    return true;
+}
@@ -0,0 +1,253 @@
+#pragma once
+#include <vector>
+#include <mutex>
+#include <map>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#ifdef _WIN32
+  #include <winsock2.h>
+  #define poll WSAPoll
+#else
+  #include <sys/socket.h>
+  #include <sys/uio.h>
+  #include <fcntl.h>
+  #include <poll.h>
+  #include <unistd.h>
+  #include <cerrno>
+#endif
+#ifdef __linux__
+  #include <sys/epoll.h>
+#endif
+
+// ------------------- NETWORK REACTOR PIECES -------------------
+// Building blocks for the event-driven P2P and RPC servers: a byte ring for
+// queued outgoing data and a readiness poller (epoll on Linux, poll() elsewhere).
+
+static void closeSocket(int sock) {
+#ifdef _WIN32
+    closesocket(sock);
+#else
+    close(sock);
+#endif
+}
+
+static bool setNonBlocking(int sock) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(sock, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    return flags >= 0 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+// The last socket call failed only because it would have blocked
+static bool socketWouldBlock() {
+#ifdef _WIN32
+    int err = WSAGetLastError();
+    return err == WSAEWOULDBLOCK || err == WSAEINPROGRESS;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS || errno == EINTR;
+#endif
+}
+
+// FIFO of bytes in a power-of-two ring. It grows when a write doesn't fit and
+// drops back to its initial size once drained, so idle peers stay small.
+class ByteRing {
+public:
+    explicit ByteRing(size_t initialCapacity = 16 * 1024) : initial(roundUp(initialCapacity)) {}
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    void write(const void *data, size_t len) {
+        if (count + len > buffer.size()) grow(count + len);
+        size_t mask = buffer.size() - 1;
+        size_t tail = (head + count) & mask;
+        size_t first = std::min(len, buffer.size() - tail);
+        std::memcpy(&buffer[tail], data, first);
+        std::memcpy(&buffer[0], static_cast<const unsigned char*>(data) + first, len - first);
+        count += len;
+    }
+
+    // The queued bytes as at most two contiguous spans; returns how many spans
+    size_t spans(const unsigned char *ptr[2], size_t len[2]) const {
+        if (count == 0) return 0;
+        ptr[0] = &buffer[head];
+        len[0] = std::min(count, buffer.size() - head);
+        ptr[1] = &buffer[0];
+        len[1] = count - len[0];
+        return len[1] ? 2 : 1;
+    }
+
+    void consume(size_t n) {
+        n = std::min(n, count);
+        count -= n;
+        head = count ? (head + n) & (buffer.size() - 1) : 0;
+        if (count == 0 && buffer.size() > initial) std::vector<unsigned char>().swap(buffer);
+    }
+
+private:
+    static size_t roundUp(size_t n) {
+        size_t cap = 1024;
+        while (cap < n) cap *= 2;
+        return cap;
+    }
+
+    void grow(size_t need) {
+        std::vector<unsigned char> bigger(roundUp(std::max(need, initial)));
+        const unsigned char *ptr[2];
+        size_t len[2];
+        size_t n = spans(ptr, len);
+        if (n > 0) std::memcpy(&bigger[0], ptr[0], len[0]);
+        if (n > 1) std::memcpy(&bigger[len[0]], ptr[1], len[1]);
+        buffer.swap(bigger);
+        head = 0;
+    }
+
+    size_t initial;
+    std::vector<unsigned char> buffer;
+    size_t head = 0;  // first queued byte
+    size_t count = 0; // queued bytes
+};
+
+// Send as much of the ring as the socket takes without blocking, in one call
+// when the data wraps. Returns bytes sent, or -1 on a hard error.
+static long sendFromRing(int sock, const ByteRing &ring) {
+    const unsigned char *ptr[2];
+    size_t len[2];
+    size_t n = ring.spans(ptr, len);
+    if (n == 0) return 0;
+#ifdef _WIN32
+    int sent = send(sock, reinterpret_cast<const char*>(ptr[0]), static_cast<int>(len[0]), 0);
+#else
+    iovec iov[2];
+    for (size_t i = 0; i < n; i++) {
+        iov[i].iov_base = const_cast<unsigned char*>(ptr[i]);
+        iov[i].iov_len = len[i];
+    }
+    msghdr hdr;
+    std::memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = n;
+  #ifdef MSG_NOSIGNAL
+    ssize_t sent = sendmsg(sock, &hdr, MSG_NOSIGNAL);
+  #else
+    ssize_t sent = sendmsg(sock, &hdr, 0);
+  #endif
+#endif
+    if (sent < 0) return socketWouldBlock() ? 0 : -1;
+    return static_cast<long>(sent);
+}
+
+// Readiness notification for a set of sockets, each tagged with a pointer.
+// Interest may be changed from any thread while another thread waits.
+class Poller {
+public:
+    enum { Read = 1, Write = 2 };
+
+    struct Event {
+        void *tag;
+        bool readable;
+        bool writable;
+        bool error;
+    };
+
+#ifdef __linux__
+    Poller() : epfd(epoll_create1(EPOLL_CLOEXEC)) {}
+    ~Poller() { if (epfd >= 0) close(epfd); }
+
+    bool add(int sock, int interest, void *tag) { return control(EPOLL_CTL_ADD, sock, interest, tag); }
+    bool modify(int sock, int interest, void *tag) { return control(EPOLL_CTL_MOD, sock, interest, tag); }
+    void remove(int sock) {
+        epoll_event ev;
+        std::memset(&ev, 0, sizeof(ev));
+        epoll_ctl(epfd, EPOLL_CTL_DEL, sock, &ev);
+    }
+
+    void wait(std::vector<Event> &out, int timeoutMs) {
+        epoll_event events[256];
+        out.clear();
+        int n = epoll_wait(epfd, events, 256, timeoutMs);
+        for (int i = 0; i < n; i++) {
+            uint32_t e = events[i].events;
+            out.push_back(Event{events[i].data.ptr, (e & (EPOLLIN | EPOLLRDHUP)) != 0,
+                                (e & EPOLLOUT) != 0, (e & (EPOLLERR | EPOLLHUP)) != 0});
+        }
+    }
+
+private:
+    bool control(int op, int sock, int interest, void *tag) {
+        epoll_event ev;
+        std::memset(&ev, 0, sizeof(ev));
+        ev.events = (interest & Read ? uint32_t(EPOLLIN | EPOLLRDHUP) : 0u) | (interest & Write ? uint32_t(EPOLLOUT) : 0u);
+        ev.data.ptr = tag;
+        return epoll_ctl(epfd, op, sock, &ev) == 0;
+    }
+
+    int epfd;
+#else
+    // poll() fallback: the set is rebuilt on every wait, and waits are capped so
+    // interest changes made meanwhile are picked up promptly
+    bool add(int sock, int interest, void *tag) {
+        std::lock_guard<std::mutex> lock(mutex);
+        sockets[sock] = Interest{interest, tag};
+        return true;
+    }
+    // Like EPOLL_CTL_MOD: a socket removed meanwhile stays removed, so a late
+    // caller can't bring back a tag whose owner is gone
+    bool modify(int sock, int interest, void *tag) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = sockets.find(sock);
+        if (it == sockets.end()) return false;
+        it->second = Interest{interest, tag};
+        return true;
+    }
+    void remove(int sock) {
+        std::lock_guard<std::mutex> lock(mutex);
+        sockets.erase(sock);
+    }
+
+    void wait(std::vector<Event> &out, int timeoutMs) {
+        std::vector<pollfd> fds;
+        std::vector<void*> tags;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto &s : sockets) {
+                pollfd p;
+                p.fd = s.first;
+                p.events = (s.second.interest & Read ? POLLIN : 0) | (s.second.interest & Write ? POLLOUT : 0);
+                p.revents = 0;
+                fds.push_back(p);
+                tags.push_back(s.second.tag);
+            }
+        }
+        out.clear();
+        int capped = timeoutMs < 0 || timeoutMs > 50 ? 50 : timeoutMs;
+        if (fds.empty()) {
+  #ifdef _WIN32
+            Sleep(capped);
+  #else
+            usleep(capped * 1000);
+  #endif
+            return;
+        }
+        if (poll(fds.data(), static_cast<unsigned long>(fds.size()), capped) <= 0) return;
+        for (size_t i = 0; i < fds.size(); i++) {
+            short e = fds[i].revents;
+            if (e == 0) continue;
+            out.push_back(Event{tags[i], (e & POLLIN) != 0, (e & POLLOUT) != 0, (e & (POLLERR | POLLHUP | POLLNVAL)) != 0});
+        }
+    }
+
+private:
+    struct Interest {
+        int interest;
+        void *tag;
+    };
+    std::mutex mutex;
+    std::map<int, Interest> sockets;
+#endif
+};
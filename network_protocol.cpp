@@ -1,18 +1,29 @@
 #include <iostream>
 #include <thread>
 #include <vector>
+#include <deque>
 #include <string>
 #include <mutex>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <atomic>
+#include <random>
+#include <chrono>
+#include <ctime>
 #include <cstring>
 #include <sys/types.h>
 
 #ifdef _WIN32
   #include <winsock2.h>
+  #include <ws2tcpip.h>
   #pragma comment(lib, "ws2_32.lib")
   typedef int socklen_t;
+  #define SHUT_RDWR SD_BOTH
 #else
   #include <netinet/in.h>
+  #include <netinet/tcp.h>
   #include <arpa/inet.h>
   #include <unistd.h>
   #include <fcntl.h>
@@ -20,9 +31,56 @@
 #endif
 
 #include "blockchain_core.cpp"
+#include "net_messages.cpp"
+#include "net_reactor.cpp"
+#include "block_download.cpp"
+#include "compact_block.cpp"
+#include "rolling_bloom.cpp"
+#include "addrman.cpp"
 
-static std::vector<std::string> g_knownPeers;
-static std::mutex g_peersMutex;
+// ------------------- P2P NETWORKING -------------------
+// Event driven: a few I/O threads each poll a share of the sockets, reading
+// into each peer's MessageParser and flushing its send ring. Complete messages
+// are queued on the peer and handled by a separate pool of message workers,
+// one worker per peer at a time so a peer's messages stay in order.
+//
+// Backpressure, per peer:
+//  - receive: once kReceiveQueueLimit bytes of messages wait for a worker, the
+//    socket stops being read until the worker catches up;
+//  - send: while more than kSendBufferSoftLimit bytes are queued, the peer's
+//    messages (and pending getdata) aren't processed; a peer that lets it reach
+//    kSendBufferHardLimit is disconnected.
+
+static const size_t kReceiveQueueLimit = 4u << 20;
+static const size_t kSendBufferSoftLimit = 4u << 20;
+static const size_t kSendBufferHardLimit = 64u << 20;
+static const size_t kMaxReadPerEvent = 1u << 20;  // then let other sockets have a turn
+static const size_t kMessagesPerTurn = 32;        // per worker task, for fairness
+
+// Transaction relay. New transactions are queued per peer and announced in one
+// inv on a randomized timer (a shared one for all inbound peers, so they can't
+// time us one by one). Each peer has a filter of what it already knows (sent
+// to it, announced by it), so a txid goes out at most once per peer, and a
+// transaction body is fetched from only one peer at a time however many
+// announce it.
+static const int64_t kRelayTickMs = 100;
+static const int64_t kOutboundInvIntervalMs = 2000; // mean
+static const int64_t kInboundInvIntervalMs = 5000;
+static const size_t kMaxInvPerTrickle = 1000;
+static const size_t kMaxTxInvQueue = 50000;
+static const size_t kInventoryKnownMax = 20000;     // ~210 KB of filter per peer
+static const int64_t kTxRequestTimeoutMs = 60000;
+static const size_t kMaxTxRequests = 100000;
+
+// Connections. A fixed number of outbound slots is kept filled from the
+// address manager; inbound peers get what's left of maxConnections. Seeds are
+// only dialed while the address manager has nothing to offer.
+static const int kConnectionTickMs = 500;
+static const int64_t kSeedRetrySecs = 60;
+static const int64_t kAddrSaveIntervalSecs = 60;
+static const size_t kAddrSharePercent = 25;     // of our address table, per getaddr answer
+static const size_t kMaxAddrRelay = 10;         // bigger addr messages aren't gossip: not passed on
+static const int64_t kAddrFreshSecs = 600;
 
 // Cross-platform sleep
 static void sleepMilliseconds(int ms) {
@@ -63,128 +121,1100 @@ static int createSocket(uint16_t port) {
 
     if (bind(sockfd, (sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
         std::cerr << "Bind failed on port " << port << std::endl;
-#ifdef _WIN32
-        closesocket(sockfd);
-#else
-        close(sockfd);
-#endif
+        closeSocket(sockfd);
         return -1;
     }
-    if (listen(sockfd, 8) < 0) {
+    // Connection storms are absorbed by the kernel queue, not refused
+    if (listen(sockfd, SOMAXCONN) < 0) {
         std::cerr << "Listen failed on port " << port << std::endl;
-#ifdef _WIN32
-        closesocket(sockfd);
-#else
-        close(sockfd);
-#endif
+        closeSocket(sockfd);
         return -1;
     }
     return sockfd;
 }
 
-// Peer handler
-static void handleClient(int clientSock) {
-    char buffer[1024];
-    while (true) {
-        memset(buffer, 0, 1024);
-        int bytesRead = recv(clientSock, buffer, 1023, 0);
-        if (bytesRead <= 0) {
+// ------------------- PEERS -------------------
+
+struct NetIoThread;
+
+// A message waiting for a worker
+struct NetMessage {
+    std::string command;
+    std::string payload;
+};
+
+// One connection. The parser belongs to the peer's I/O thread; the handshake
+// state belongs to whichever worker is processing the peer. Both queues are
+// shared (the I/O thread checks them when scheduling) and taken under recvMutex.
+struct Peer : std::enable_shared_from_this<Peer> {
+    uint64_t id = 0;
+    int sock;
+    std::string address;
+    bool inbound;
+    NetIoThread *io = nullptr;
+    std::atomic<bool> disconnect{false};
+    std::atomic<bool> connecting{false};  // outbound connect still in progress
+    std::atomic<bool> addrFetch{false};   // dialed only for its addresses: hang up on the answer
+    std::atomic<uint64_t> listenAddrKey{0}; // NetAddress::key() of where it accepts connections
+    bool closed = false;                  // I/O thread only
+
+    // Receive side
+    MessageParser parser;
+    std::mutex recvMutex;                 // guards both queues and `scheduled`
+    std::deque<NetMessage> recvQueue;
+    std::deque<InvItem> getDataQueue;     // requested items not served yet
+    size_t recvQueueBytes = 0;
+    bool scheduled = false;               // a worker task is queued or running
+    std::atomic<bool> pauseRecv{false};
+
+    // Send side
+    std::mutex sendMutex;
+    ByteRing sendBuffer;
+    std::atomic<size_t> sendQueued{0};    // sendBuffer.size(), readable without the lock
+
+    std::mutex interestMutex;
+    int interest = 0;                     // what the poller currently watches for
+
+    // Transaction relay
+    std::mutex invMutex;                  // guards the known filter and the queue
+    RollingBloomFilter knownInventory{kInventoryKnownMax, 0.000001};
+    std::deque<uint256> txInvQueue;       // waiting for the next trickle
+    int64_t nextInvSend = 0;              // outbound peers; relay thread only
+    bool versionReceived = false;
+    std::atomic<uint64_t> bestKnownHeight{0}; // from its version and the headers it sent
+    std::atomic<bool> verackReceived{false}; // read by relaying threads
+    std::atomic<bool> wantsCompact{false};   // announce new blocks as cmpctblock
+    std::unique_ptr<PartialBlock> pendingCompact; // waiting for its blocktxn
+    VersionMessage remoteVersion;
+    bool addrRequested = false;           // we sent getaddr and await the answer
+    bool addrAnswered = false;            // we answered its getaddr (once per connection)
+
+    Peer(int s, const std::string &addr, bool in, const NetMagic &magic, size_t maxPayload)
+        : sock(s), address(addr), inbound(in), parser(magic, maxPayload) {}
+    // The socket is closed only when nothing references the peer any more
+    ~Peer() { closeSocket(sock); }
+};
+typedef std::shared_ptr<Peer> PeerRef;
+
+struct NetIoThread {
+    Poller poller;
+    std::thread thread;
+};
+
+static std::vector<PeerRef> g_peers;   // connected peers
+static std::mutex g_peersMutex;
+static std::vector<std::unique_ptr<NetIoThread>> g_ioThreads;
+static std::atomic<size_t> g_nextIoThread{0};
+static ThreadPool *g_messagePool = nullptr;
+static int g_listenSocket = -1;
+static size_t g_maxConnections = 256;
+static NetMagic g_netMagic = parseNetMagic("f9beb4d9");
+static size_t g_maxMessagePayload = maxMessagePayload(2000000);
+static uint64_t g_localNonce = 0;      // in our version messages, to spot self-connections
+static uint16_t g_listenPort = 0;
+static std::atomic<uint64_t> g_nextPeerId{1};
+static BlockDownloader g_blockDownloader;
+static std::mutex g_txRequestsMutex;
+static std::unordered_map<uint256, int64_t, Uint256Hasher> g_txRequests; // txid -> when requested
+static AddrMan g_addrMan;
+static std::string g_addrManPath;
+static size_t g_maxOutbound = 8;
+static bool g_seedMode = false;        // only collect and serve addresses, don't stay connected
+
+static const char *kUserAgent = "/MyCoin:0.1/";
+
+// Point the poller at what the peer currently needs: reads unless paused,
+// writes while data is queued or the connect is pending
+static void updateInterest(Peer &peer) {
+    std::lock_guard<std::mutex> lock(peer.interestMutex);
+    if (peer.disconnect) return;
+    int interest = (peer.pauseRecv ? 0 : Poller::Read)
+        | (peer.connecting || peer.sendQueued > 0 ? Poller::Write : 0);
+    if (interest != peer.interest) {
+        peer.interest = interest;
+        peer.io->poller.modify(peer.sock, interest, &peer);
+    }
+}
+
+// Safe from any thread. Shutting the socket down wakes its I/O thread, which
+// then unregisters the peer.
+static void disconnectPeer(Peer &peer) {
+    if (!peer.disconnect.exchange(true)) {
+        shutdown(peer.sock, SHUT_RDWR);
+    }
+}
+
+// Queue one framed message; the peer's I/O thread writes it out together with
+// anything else queued by then
+static bool sendMessage(Peer &peer, const std::string &command, const std::string &payload) {
+    if (peer.disconnect) return false;
+    unsigned char header[kMessageHeaderSize];
+    writeMessageHeader(g_netMagic, command, payload, header);
+    bool wasEmpty = false;
+    bool overflow = false;
+    {
+        std::lock_guard<std::mutex> lock(peer.sendMutex);
+        if (peer.sendBuffer.size() + sizeof(header) + payload.size() > kSendBufferHardLimit) {
+            overflow = true;
+        } else {
+            wasEmpty = peer.sendBuffer.empty();
+            peer.sendBuffer.write(header, sizeof(header));
+            peer.sendBuffer.write(payload.data(), payload.size());
+            peer.sendQueued = peer.sendBuffer.size();
+        }
+    }
+    if (overflow) {
+        std::cerr << "[P2P] Dropping " << peer.address << ": not reading what we send" << std::endl;
+        disconnectPeer(peer);
+        return false;
+    }
+    if (wasEmpty) updateInterest(peer);
+    return true;
+}
+
+static void sendVersion(Peer &peer) {
+    VersionMessage v;
+    v.timestamp = static_cast<uint64_t>(std::time(nullptr));
+    v.nonce = g_localNonce;
+    v.listenPort = g_listenPort;
+    v.userAgent = kUserAgent;
+    Blockchain *chain = getBlockchain();
+    if (chain) v.startHeight = static_cast<uint32_t>(chain->getHeight());
+    std::string payload;
+    v.serialize(payload);
+    sendMessage(peer, "version", payload);
+}
+
+// Ask for the headers after our tip; the reply tells us which blocks to fetch
+static void sendGetHeaders(Peer &peer) {
+    Blockchain *chain = getBlockchain();
+    if (!chain) return;
+    std::vector<uint256> locator = chain->getBlockLocator();
+    uint256 bestHeader;
+    if (g_blockDownloader.getBestHeader(bestHeader)) locator.insert(locator.begin(), bestHeader);
+    sendMessage(peer, "getheaders", serializeGetHeaders(locator, uint256()));
+}
+
+static PeerRef findPeer(uint64_t id) {
+    std::lock_guard<std::mutex> lock(g_peersMutex);
+    for (auto &p : g_peers) {
+        if (p->id == id) return p;
+    }
+    return PeerRef();
+}
+
+static void addKnownInventory(Peer &peer, const uint256 &hash) {
+    std::lock_guard<std::mutex> lock(peer.invMutex);
+    peer.knownInventory.insert(hash);
+}
+
+// Claim the download of a transaction unless another peer is already sending
+// it; claims lapse after kTxRequestTimeoutMs
+static bool claimTxRequest(const uint256 &txid, int64_t now) {
+    std::lock_guard<std::mutex> lock(g_txRequestsMutex);
+    auto it = g_txRequests.find(txid);
+    if (it != g_txRequests.end() && now - it->second < kTxRequestTimeoutMs) return false;
+    if (it == g_txRequests.end() && g_txRequests.size() >= kMaxTxRequests) return false;
+    g_txRequests[txid] = now;
+    return true;
+}
+
+static void releaseTxRequest(const uint256 &txid) {
+    std::lock_guard<std::mutex> lock(g_txRequestsMutex);
+    g_txRequests.erase(txid);
+}
+
+static int64_t unixTime() {
+    return static_cast<int64_t>(std::time(nullptr));
+}
+
+// Group of the peer's IP (for the address manager's source buckets)
+static uint32_t peerGroup(const Peer &peer) {
+    NetAddress addr;
+    return NetAddress::parse(peer.address, addr) ? addr.group() : 0;
+}
+
+// Tell up to two random peers (other than `from`) about an address
+static void relayAddress(const AddrEntry &entry, const Peer *from) {
+    std::vector<PeerRef> peers;
+    {
+        std::lock_guard<std::mutex> lock(g_peersMutex);
+        for (auto &p : g_peers) {
+            if (p.get() != from && p->verackReceived && !p->disconnect) peers.push_back(p);
+        }
+    }
+    static thread_local std::mt19937 rng(std::random_device{}());
+    std::string payload = serializeAddr(std::vector<AddrEntry>(1, entry));
+    for (size_t i = 0; i < 2 && i < peers.size(); i++) {
+        std::swap(peers[i], peers[i + rng() % (peers.size() - i)]);
+        sendMessage(*peers[i], "addr", payload);
+    }
+}
+
+// Give every ready peer as many block downloads as it has free slots for
+static void requestBlocksFromPeers() {
+    std::vector<PeerRef> peers;
+    {
+        std::lock_guard<std::mutex> lock(g_peersMutex);
+        peers = g_peers;
+    }
+    int64_t now = steadyMillis();
+    for (auto &p : peers) {
+        if (!p->verackReceived || p->disconnect) continue;
+        std::vector<uint256> hashes = g_blockDownloader.requestBlocks(p->id, now);
+        if (hashes.empty()) continue;
+        std::vector<InvItem> items;
+        for (auto &h : hashes) {
+            items.push_back(InvItem{INV_BLOCK, h});
+        }
+        sendMessage(*p, "getdata", serializeInv(items));
+    }
+}
+
+// Queued headers nobody offers any more were dropped: ask the peers that are
+// ahead of us (but `except`) where the chain goes now
+static void requestHeadersFromPeers(const Peer *except) {
+    Blockchain *chain = getBlockchain();
+    if (!chain) return;
+    std::vector<PeerRef> peers;
+    {
+        std::lock_guard<std::mutex> lock(g_peersMutex);
+        peers = g_peers;
+    }
+    uint64_t height = chain->getHeight();
+    for (auto &p : peers) {
+        if (p.get() != except && p->verackReceived && !p->disconnect && p->bestKnownHeight > height) sendGetHeaders(*p);
+    }
+}
+
+static void noteBestHeight(Peer &peer, uint64_t height) {
+    uint64_t known = peer.bestKnownHeight;
+    while (known < height && !peer.bestKnownHeight.compare_exchange_weak(known, height)) {
+    }
+}
+
+// Runs whenever a block is connected (received or mined). Peers that may not
+// have it hear about it as a compact block if they asked for that, else by
+// inv. Blocks connected during a sync aren't announced until the last one.
+static void announceBlock(const Block &block, uint64_t height) {
+    uint256 hash = block.getBlockHash();
+    if (!g_blockDownloader.isBestHeader(hash)) return;
+    std::vector<PeerRef> peers;
+    {
+        std::lock_guard<std::mutex> lock(g_peersMutex);
+        peers = g_peers;
+    }
+    std::string compact;
+    std::string inv;
+    for (auto &p : peers) {
+        if (!p->verackReceived || p->bestKnownHeight >= height) continue;
+        if (p->wantsCompact) {
+            if (compact.empty()) {
+                uint64_t salt = (uint64_t(std::random_device()()) << 32) | std::random_device()();
+                CompactBlock(block, salt).serialize(compact);
+            }
+            sendMessage(*p, "cmpctblock", compact);
+        } else {
+            if (inv.empty()) inv = serializeInv(std::vector<InvItem>(1, InvItem{INV_BLOCK, hash}));
+            sendMessage(*p, "inv", inv);
+        }
+    }
+}
+
+// ------------------- MESSAGE HANDLING -------------------
+
+static bool handleVersion(Peer &peer, const MessageView &msg) {
+    if (peer.versionReceived) return true; // duplicate, ignore
+    if (!peer.remoteVersion.deserialize(msg.payload, msg.size)) return false;
+    NetAddress addr;
+    if (peer.remoteVersion.nonce == g_localNonce) {
+        std::cout << "[P2P] " << peer.address << " is ourselves, disconnecting" << std::endl;
+        if (!peer.inbound && NetAddress::parse(peer.address, addr)) g_addrMan.remove(addr);
+        return false;
+    }
+    peer.versionReceived = true;
+    peer.bestKnownHeight = peer.remoteVersion.startHeight;
+    if (peer.inbound) sendVersion(peer);
+    sendMessage(peer, "verack", "");
+    int64_t now = unixTime();
+    if (!peer.inbound) {
+        // It works: remember it, and learn who else is out there
+        if (NetAddress::parse(peer.address, addr)) g_addrMan.good(addr, now);
+        sendMessage(peer, "getaddr", "");
+        peer.addrRequested = true;
+    } else if (peer.remoteVersion.listenPort != 0 && NetAddress::parse(peer.address, addr)) {
+        // It listens too: others may connect to it
+        addr.port = peer.remoteVersion.listenPort;
+        peer.listenAddrKey = addr.key();
+        if (g_addrMan.add(addr, addr.group(), now, now)) {
+            relayAddress(AddrEntry{static_cast<uint32_t>(now), addr}, &peer);
+        }
+    }
+    std::cout << "[P2P] " << peer.address << " version " << peer.remoteVersion.version
+              << " " << peer.remoteVersion.userAgent << " height " << peer.remoteVersion.startHeight << std::endl;
+    Blockchain *chain = getBlockchain();
+    if (chain && peer.remoteVersion.startHeight > chain->getHeight()) sendGetHeaders(peer);
+    return true;
+}
+
+// Ask for whatever announced items we don't have yet
+static bool handleInv(Peer &peer, const MessageView &msg) {
+    std::vector<InvItem> items;
+    if (!deserializeInv(msg.payload, msg.size, items)) return false;
+    Blockchain *chain = getBlockchain();
+    if (!chain) return true;
+    std::vector<InvItem> wanted;
+    bool newBlock = false;
+    int64_t now = steadyMillis();
+    for (auto &item : items) {
+        if (item.type == INV_TX) {
+            addKnownInventory(peer, item.hash);
+            if (!chain->getMempool().contains(item.hash) && claimTxRequest(item.hash, now)) wanted.push_back(item);
+        } else if (item.type == INV_BLOCK && !chain->hasBlock(item.hash)) {
+            newBlock = true;
+        }
+    }
+    if (!wanted.empty()) sendMessage(peer, "getdata", serializeInv(wanted));
+    // Blocks are fetched headers-first: learn where it goes, then download it
+    if (newBlock) sendGetHeaders(peer);
+    return true;
+}
+
+// Queued and served by serveGetData as the peer's send buffer drains, so a
+// large request can't pile up more than the soft limit at once
+static bool handleGetData(Peer &peer, const MessageView &msg) {
+    std::vector<InvItem> items;
+    if (!deserializeInv(msg.payload, msg.size, items)) return false;
+    std::lock_guard<std::mutex> lock(peer.recvMutex);
+    if (peer.getDataQueue.size() + items.size() > kMaxInvItems) return false;
+    peer.getDataQueue.insert(peer.getDataQueue.end(), items.begin(), items.end());
+    return true;
+}
+
+static void serveGetData(Peer &peer) {
+    Blockchain *chain = getBlockchain();
+    std::vector<InvItem> missing;
+    while (!peer.disconnect && peer.sendQueued <= kSendBufferSoftLimit) {
+        InvItem item;
+        {
+            std::lock_guard<std::mutex> lock(peer.recvMutex);
+            if (peer.getDataQueue.empty()) break;
+            item = peer.getDataQueue.front();
+            peer.getDataQueue.pop_front();
+        }
+        if (item.type == INV_BLOCK) {
+            Block block;
+            if (chain && chain->getBlockByHash(item.hash, block)) {
+                std::string payload;
+                block.serialize(payload);
+                sendMessage(peer, "block", payload);
+                continue;
+            }
+        } else if (item.type == INV_TX) {
+            TransactionRef tx = chain ? chain->getMempool().get(item.hash) : TransactionRef();
+            if (tx) {
+                addKnownInventory(peer, item.hash);
+                std::string payload;
+                tx->serialize(payload);
+                sendMessage(peer, "tx", payload);
+                continue;
+            }
+        }
+        missing.push_back(item);
+    }
+    if (!missing.empty()) sendMessage(peer, "notfound", serializeInv(missing));
+}
+
+// Headers following the first locator hash we know, up to hashStop or the limit
+static bool handleGetHeaders(Peer &peer, const MessageView &msg) {
+    std::vector<uint256> locator;
+    uint256 hashStop;
+    if (!deserializeGetHeaders(msg.payload, msg.size, locator, hashStop)) return false;
+    Blockchain *chain = getBlockchain();
+    if (!chain) return true;
+    // Genesis comes from config, so every peer shares it
+    uint64_t from = 1;
+    uint64_t height;
+    for (auto &hash : locator) {
+        if (chain->findBlockHeight(hash, height)) {
+            from = height + 1;
             break;
         }
-        // In a real protocol, you'd parse messages here
-        // For demonstration, let's just print it
-        std::string msg(buffer, bytesRead);
-        std::cout << "[P2P] Received: " << msg << std::endl;
     }
-#ifdef _WIN32
-    closesocket(clientSock);
-#else
-    close(clientSock);
-#endif
+    std::vector<BlockHeader> headers;
+    BlockHeader header;
+    uint64_t tipHeight = chain->getHeight();
+    for (uint64_t h = from; h <= tipHeight && headers.size() < kMaxHeadersPerMessage; h++) {
+        if (!chain->getBlockHeader(h, header)) break;
+        headers.push_back(header);
+        if (header.getHash() == hashStop) break;
+    }
+    sendMessage(peer, "headers", serializeHeaders(headers));
+    return true;
 }
 
-// Node listening for inbound connections
-static void listenForPeers(uint16_t port) {
-    int serverSock = createSocket(port);
-    if (serverSock < 0) {
-        std::cerr << "Failed to open server socket on port " << port << std::endl;
+// Queue the announced headers for download. A full batch means the peer has
+// more, so ask for the next one too.
+static bool handleHeaders(Peer &peer, const MessageView &msg) {
+    std::vector<BlockHeader> headers;
+    if (!deserializeHeaders(msg.payload, msg.size, headers)) return false;
+    Blockchain *chain = getBlockchain();
+    if (!chain || headers.empty()) return true;
+    for (size_t i = 1; i < headers.size(); i++) {
+        if (headers[i].prevBlockHash != headers[i - 1].getHash()) return false; // not a chain
+    }
+    uint64_t lastHeight;
+    if (!g_blockDownloader.addHeaders(*chain, peer.id, headers, lastHeight)) return false;
+    noteBestHeight(peer, lastHeight);
+    if (headers.size() == kMaxHeadersPerMessage) {
+        std::vector<uint256> locator(1, headers.back().getHash());
+        sendMessage(peer, "getheaders", serializeGetHeaders(locator, uint256()));
+    }
+    requestBlocksFromPeers();
+    return true;
+}
+
+// Blocks we are downloading are buffered and connected in order; anything else
+// goes straight to the chain if we have its parent (it may extend a side branch
+// and trigger a reorg)
+static bool handleBlock(Peer &peer, const MessageView &msg) {
+    std::shared_ptr<Block> block = std::make_shared<Block>();
+    if (!block->deserialize(msg.payload, msg.size)) return false;
+    Blockchain *chain = getBlockchain();
+    if (!chain) return true;
+    uint256 hash = block->getBlockHash();
+    uint64_t height;
+    if (g_blockDownloader.blockReceived(peer.id, block, msg.size)) {
+        std::vector<uint64_t> badPeers;
+        size_t connected = g_blockDownloader.connectReady(*chain, badPeers);
+        for (uint64_t id : badPeers) {
+            PeerRef bad = findPeer(id);
+            if (!bad) continue;
+            std::cerr << "[P2P] Dropping " << bad->address << ": sent an invalid block" << std::endl;
+            disconnectPeer(*bad);
+        }
+        if (connected > 0) {
+            std::cout << "[P2P] Connected " << connected << " block(s), height " << chain->getHeight() << std::endl;
+        }
+        requestBlocksFromPeers();
+        return true;
+    }
+    if (chain->hasBlock(hash)) return true; // already have it
+    if (!chain->lookupBlock(block->header.prevBlockHash, height)) {
+        // Parent unknown: catch up on the headers in between
+        sendGetHeaders(peer);
+        return true;
+    }
+    noteBestHeight(peer, height + 1); // so it isn't announced back
+    if (chain->addBlock(*block)) {
+        std::cout << "[P2P] Block " << hash.toHex() << " from " << peer.address << std::endl;
+    }
+    return true;
+}
+
+// Connect a block rebuilt from a compact announcement. If the short ids picked
+// a wrong transaction the merkle root won't match; fetch the real block then.
+static void connectCompactBlock(Peer &peer, const PartialBlock &partial) {
+    Blockchain *chain = getBlockchain();
+    Block block;
+    partial.getBlock(block);
+    uint256 hash = block.getBlockHash();
+    if (!Blockchain::hasValidMerkleRoot(block)) {
+        sendMessage(peer, "getdata", serializeInv(std::vector<InvItem>(1, InvItem{INV_BLOCK, hash})));
         return;
     }
-    std::cout << "[P2P] Listening on port " << port << std::endl;
+    uint64_t height;
+    if (chain->lookupBlock(block.header.prevBlockHash, height)) noteBestHeight(peer, height + 1);
+    if (chain->addBlock(block)) {
+        std::cout << "[P2P] Compact block " << hash.toHex() << " from " << peer.address << " ("
+                  << partial.getFromMempoolCount() << "/" << partial.getTransactionCount()
+                  << " txs from mempool)" << std::endl;
+    }
+}
+
+// Rebuild an announced block from the mempool, asking the peer only for what
+// we lack
+static bool handleCmpctBlock(Peer &peer, const MessageView &msg) {
+    CompactBlock compact;
+    if (!compact.deserialize(msg.payload, msg.size)) return false;
+    Blockchain *chain = getBlockchain();
+    if (!chain) return true;
+    uint256 hash = compact.header.getHash();
+    if (!Blockchain::checkProofOfWork(hash, compact.header.difficultyTarget)) return false;
+    uint64_t height;
+    if (chain->hasBlock(hash)) return true; // already have it
+    if (!chain->lookupBlock(compact.header.prevBlockHash, height)) {
+        sendGetHeaders(peer);
+        return true;
+    }
+    std::unique_ptr<PartialBlock> partial(new PartialBlock());
+    if (!partial->init(compact, chain->getMempool())) {
+        sendMessage(peer, "getdata", serializeInv(std::vector<InvItem>(1, InvItem{INV_BLOCK, hash})));
+        return true;
+    }
+    std::vector<uint32_t> missing = partial->getMissing();
+    if (missing.empty()) {
+        connectCompactBlock(peer, *partial);
+        return true;
+    }
+    sendMessage(peer, "getblocktxn", serializeGetBlockTxn(hash, missing));
+    peer.pendingCompact = std::move(partial);
+    return true;
+}
+
+// The transactions a peer lacked from one of our compact blocks
+static bool handleGetBlockTxn(Peer &peer, const MessageView &msg) {
+    uint256 hash;
+    std::vector<uint32_t> indexes;
+    if (!deserializeGetBlockTxn(msg.payload, msg.size, hash, indexes)) return false;
+    Blockchain *chain = getBlockchain();
+    Block block;
+    if (!chain || !chain->getBlockByHash(hash, block)) return true;
+    std::vector<TransactionRef> txs;
+    txs.reserve(indexes.size());
+    for (uint32_t index : indexes) {
+        if (index >= block.getTransactions().size()) return false;
+        txs.push_back(block.getTransactions()[index]);
+    }
+    sendMessage(peer, "blocktxn", serializeBlockTxn(hash, txs));
+    return true;
+}
+
+static bool handleBlockTxn(Peer &peer, const MessageView &msg) {
+    uint256 hash;
+    std::vector<TransactionRef> txs;
+    if (!deserializeBlockTxn(msg.payload, msg.size, hash, txs)) return false;
+    if (!peer.pendingCompact || peer.pendingCompact->getHash() != hash) return true; // not waiting for it
+    std::unique_ptr<PartialBlock> partial = std::move(peer.pendingCompact);
+    if (!partial->fill(txs)) return false;
+    Blockchain *chain = getBlockchain();
+    if (chain && !chain->hasBlock(hash)) connectCompactBlock(peer, *partial);
+    return true;
+}
 
+static bool handleSendCompact(Peer &peer, const MessageView &msg) {
+    bool announce;
+    uint64_t version;
+    if (!deserializeSendCompact(msg.payload, msg.size, announce, version)) return false;
+    if (version == kCompactBlockVersion) peer.wantsCompact = announce;
+    return true;
+}
+
+// Accepted transactions are relayed by the mempool listener (queueTxRelay)
+static bool handleTx(Peer &peer, const MessageView &msg) {
+    TransactionRef tx = deserializeTxMessage(msg.payload, msg.size);
+    if (!tx) return false;
+    addKnownInventory(peer, tx->getTxId());
+    releaseTxRequest(tx->getTxId());
+    Blockchain *chain = getBlockchain();
+    if (!chain || chain->getMempool().contains(tx->getTxId())) return true;
+    std::string reason;
+    chain->acceptTransaction(tx, reason);
+    return true;
+}
+
+// A transaction we asked for is gone; the next peer to announce it may send it.
+// A block goes to another peer that announced it, or if none did, is dropped
+// from the download and other peers are asked for headers again.
+static bool handleNotFound(Peer &peer, const MessageView &msg) {
+    std::vector<InvItem> items;
+    if (!deserializeInv(msg.payload, msg.size, items)) return false;
+    bool blocks = false;
+    bool dropped = false;
+    for (auto &item : items) {
+        if (item.type == INV_TX) {
+            releaseTxRequest(item.hash);
+        } else if (item.type == INV_BLOCK) {
+            blocks = true;
+            if (g_blockDownloader.blockNotFound(peer.id, item.hash)) dropped = true;
+        }
+    }
+    if (dropped) requestHeadersFromPeers(&peer);
+    if (blocks) requestBlocksFromPeers();
+    return true;
+}
+
+// A sample of the address manager, once per connection
+static bool handleGetAddr(Peer &peer, const MessageView &msg) {
+    if (msg.size != 0) return false;
+    if (peer.addrAnswered) return true;
+    peer.addrAnswered = true;
+    // A node shares a sample of what it knows; handing out addresses is all a seed is for
+    size_t percent = g_seedMode ? 100 : kAddrSharePercent;
+    std::vector<AddrEntry> entries = g_addrMan.getAddresses(kMaxAddrPerMessage, percent, peer.listenAddrKey, unixTime());
+    sendMessage(peer, "addr", serializeAddr(entries));
+    return true;
+}
+
+// Learn gossiped addresses. The first addr after our getaddr is its answer and
+// stays here; in other small messages, what's fresh and new to us is passed on.
+static bool handleAddr(Peer &peer, const MessageView &msg) {
+    std::vector<AddrEntry> entries;
+    if (!deserializeAddr(msg.payload, msg.size, entries)) return false;
+    bool answer = peer.addrRequested;
+    peer.addrRequested = false;
+    int64_t now = unixTime();
+    uint32_t source = peerGroup(peer);
+    for (auto &entry : entries) {
+        int64_t seen = entry.time;
+        if (seen > now + 600 || seen < now - kAddrHorizonSecs) seen = now - 5 * 24 * 3600; // implausible
+        bool added = g_addrMan.add(entry.addr, source, seen, now);
+        if (added && !answer && entries.size() <= kMaxAddrRelay && now - seen < kAddrFreshSecs) {
+            relayAddress(entry, &peer);
+        }
+    }
+    if (answer && peer.addrFetch) disconnectPeer(peer);
+    return true;
+}
+
+// Returns false if the peer sent something malformed or out of order
+static bool processMessage(Peer &peer, const MessageView &msg) {
+    if (msg.command == "version") return handleVersion(peer, msg);
+    if (!peer.versionReceived) return false; // version must come first
+    if (msg.command == "verack") {
+        peer.verackReceived = true;
+        sendMessage(peer, "sendcmpct", serializeSendCompact(true));
+        return true;
+    }
+    if (msg.command == "ping") {
+        uint64_t nonce;
+        if (!deserializeNonce(msg.payload, msg.size, nonce)) return false;
+        sendMessage(peer, "pong", serializeNonce(nonce));
+        return true;
+    }
+    if (msg.command == "pong") return true;
+    if (msg.command == "inv") return handleInv(peer, msg);
+    if (msg.command == "getdata") return handleGetData(peer, msg);
+    if (msg.command == "notfound") return handleNotFound(peer, msg);
+    if (msg.command == "getheaders") return handleGetHeaders(peer, msg);
+    if (msg.command == "headers") return handleHeaders(peer, msg);
+    if (msg.command == "block") return handleBlock(peer, msg);
+    if (msg.command == "tx") return handleTx(peer, msg);
+    if (msg.command == "sendcmpct") return handleSendCompact(peer, msg);
+    if (msg.command == "cmpctblock") return handleCmpctBlock(peer, msg);
+    if (msg.command == "getblocktxn") return handleGetBlockTxn(peer, msg);
+    if (msg.command == "blocktxn") return handleBlockTxn(peer, msg);
+    if (msg.command == "getaddr") return handleGetAddr(peer, msg);
+    if (msg.command == "addr") return handleAddr(peer, msg);
+    // Unknown commands are ignored so newer peers can add messages
+    return true;
+}
+
+// ------------------- WORKERS -------------------
+
+static void processPeer(PeerRef peer);
+
+// Hand the peer to a worker if it has something to do and none has it yet
+static void schedulePeer(const PeerRef &peer) {
+    {
+        std::lock_guard<std::mutex> lock(peer->recvMutex);
+        if (peer->scheduled || peer->disconnect) return;
+        if (peer->recvQueue.empty() && peer->getDataQueue.empty()) return;
+        if (peer->sendQueued > kSendBufferSoftLimit) return; // resumed when the socket drains
+        peer->scheduled = true;
+    }
+    g_messagePool->submit([peer]() { processPeer(peer); });
+}
+
+// Handle up to kMessagesPerTurn of the peer's queued messages, then requeue
+// behind other peers if more are waiting
+static void processPeer(PeerRef peer) {
+    for (size_t i = 0; i < kMessagesPerTurn && !peer->disconnect; i++) {
+        if (peer->sendQueued > kSendBufferSoftLimit) break; // wait for the socket to drain
+        NetMessage msg;
+        bool serve;
+        bool resume = false;
+        {
+            std::lock_guard<std::mutex> lock(peer->recvMutex);
+            serve = !peer->getDataQueue.empty();
+            if (!serve) {
+                if (peer->recvQueue.empty()) break;
+                msg = std::move(peer->recvQueue.front());
+                peer->recvQueue.pop_front();
+                peer->recvQueueBytes -= msg.payload.size();
+                if (peer->pauseRecv && peer->recvQueueBytes < kReceiveQueueLimit) {
+                    peer->pauseRecv = false;
+                    resume = true;
+                }
+            }
+        }
+        if (serve) {
+            serveGetData(*peer);
+            continue;
+        }
+        if (resume) updateInterest(*peer);
+        MessageView view;
+        view.command = msg.command;
+        view.payload = reinterpret_cast<const unsigned char*>(msg.payload.data());
+        view.size = msg.payload.size();
+        if (!processMessage(*peer, view)) {
+            std::cerr << "[P2P] Bad '" << msg.command << "' message from " << peer->address << std::endl;
+            disconnectPeer(*peer);
+        }
+    }
+    bool again;
+    {
+        std::lock_guard<std::mutex> lock(peer->recvMutex);
+        again = !peer->disconnect && peer->sendQueued <= kSendBufferSoftLimit
+            && (!peer->recvQueue.empty() || !peer->getDataQueue.empty());
+        peer->scheduled = again;
+    }
+    if (again) g_messagePool->submit([peer]() { processPeer(peer); });
+}
+
+// ------------------- I/O THREADS -------------------
+
+static size_t inboundCount() {
+    std::lock_guard<std::mutex> lock(g_peersMutex);
+    size_t n = 0;
+    for (auto &p : g_peers) {
+        if (p->inbound) n++;
+    }
+    return n;
+}
+
+// Track a new non-blocking socket and give it to the next I/O thread
+static PeerRef registerPeer(int sock, const std::string &address, bool inbound, bool connecting) {
+    int optval = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&optval), sizeof(optval));
+    PeerRef peer = std::make_shared<Peer>(sock, address, inbound, g_netMagic, g_maxMessagePayload);
+    peer->id = g_nextPeerId++;
+    peer->io = g_ioThreads[g_nextIoThread++ % g_ioThreads.size()].get();
+    peer->connecting = connecting;
+    g_blockDownloader.peerConnected(peer->id);
+    {
+        std::lock_guard<std::mutex> lock(g_peersMutex);
+        g_peers.push_back(peer);
+    }
+    {
+        std::lock_guard<std::mutex> lock(peer->interestMutex);
+        peer->interest = Poller::Read | (connecting ? Poller::Write : 0);
+        peer->io->poller.add(sock, peer->interest, peer.get());
+    }
+    return peer;
+}
+
+// Unregister a disconnected peer; runs on its I/O thread
+static void closePeer(Peer &peer) {
+    if (peer.closed) return;
+    peer.closed = true;
+    PeerRef keep = peer.shared_from_this();
+    peer.io->poller.remove(peer.sock);
+    {
+        std::lock_guard<std::mutex> lock(g_peersMutex);
+        for (size_t i = 0; i < g_peers.size(); i++) {
+            if (g_peers[i] == keep) {
+                g_peers.erase(g_peers.begin() + i);
+                break;
+            }
+        }
+    }
+    std::cout << "[P2P] Disconnected " << peer.address << std::endl;
+    if (g_blockDownloader.peerDisconnected(peer.id)) requestHeadersFromPeers(&peer);
+}
+
+// Read what's available straight into the parser and queue complete messages
+static void readFromPeer(Peer &peer) {
+    MessageView msg;
+    size_t total = 0;
+    bool queued = false;
+    while (total < kMaxReadPerEvent && !peer.pauseRecv) {
+        size_t available;
+        unsigned char *dst = peer.parser.writeBuffer(4096, available);
+        int bytesRead = recv(peer.sock, reinterpret_cast<char*>(dst), static_cast<int>(std::min(available, kMaxReadPerEvent)), 0);
+        if (bytesRead == 0 || (bytesRead < 0 && !socketWouldBlock())) {
+            disconnectPeer(peer);
+            return;
+        }
+        if (bytesRead < 0) break;
+        peer.parser.commit(static_cast<size_t>(bytesRead));
+        total += static_cast<size_t>(bytesRead);
+
+        MessageParser::Result result;
+        while ((result = peer.parser.next(msg)) == MessageParser::Ready) {
+            NetMessage m;
+            m.command = msg.command;
+            m.payload.assign(reinterpret_cast<const char*>(msg.payload), msg.size);
+            std::lock_guard<std::mutex> lock(peer.recvMutex);
+            peer.recvQueueBytes += m.payload.size();
+            peer.recvQueue.push_back(std::move(m));
+            if (peer.recvQueueBytes >= kReceiveQueueLimit) peer.pauseRecv = true;
+            queued = true;
+        }
+        if (result == MessageParser::Error) {
+            std::cerr << "[P2P] Dropping " << peer.address << ": " << peer.parser.getError() << std::endl;
+            disconnectPeer(peer);
+            return;
+        }
+    }
+    if (peer.pauseRecv) updateInterest(peer);
+    if (queued) schedulePeer(peer.shared_from_this());
+}
+
+// Flush the send ring as far as the socket allows
+static void writeToPeer(Peer &peer) {
+    if (peer.connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(peer.sock, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&err), &len);
+        if (err != 0) {
+            std::cerr << "[P2P] Could not connect to " << peer.address << ": " << std::strerror(err) << std::endl;
+            disconnectPeer(peer);
+            return;
+        }
+        peer.connecting = false;
+        std::cout << "[P2P] Connected to peer " << peer.address << std::endl;
+    }
+    bool drained;
+    bool resume;
+    {
+        std::lock_guard<std::mutex> lock(peer.sendMutex);
+        size_t before = peer.sendBuffer.size();
+        while (!peer.sendBuffer.empty()) {
+            long sent = sendFromRing(peer.sock, peer.sendBuffer);
+            if (sent < 0) {
+                disconnectPeer(peer);
+                return;
+            }
+            if (sent == 0) break;
+            peer.sendBuffer.consume(static_cast<size_t>(sent));
+        }
+        peer.sendQueued = peer.sendBuffer.size();
+        drained = peer.sendBuffer.empty();
+        resume = before > kSendBufferSoftLimit && peer.sendQueued <= kSendBufferSoftLimit;
+    }
+    if (drained) updateInterest(peer);
+    if (resume) schedulePeer(peer.shared_from_this());
+}
+
+static void acceptPeers() {
     while (true) {
         sockaddr_in clientAddr;
         socklen_t addrLen = sizeof(clientAddr);
-        int clientSock = accept(serverSock, (sockaddr*)&clientAddr, &addrLen);
+        int clientSock = accept(g_listenSocket, (sockaddr*)&clientAddr, &addrLen);
         if (clientSock < 0) {
+            return;
+        }
+        // The outbound slots are never given to inbound peers
+        size_t inboundLimit = g_maxConnections > g_maxOutbound ? g_maxConnections - g_maxOutbound : 0;
+        if (inboundCount() >= inboundLimit || !setNonBlocking(clientSock)) {
+            closeSocket(clientSock);
             continue;
         }
-        std::thread t(handleClient, clientSock);
-        t.detach();
+        char ip[INET_ADDRSTRLEN] = {0};
+        inet_ntop(AF_INET, &clientAddr.sin_addr, ip, sizeof(ip));
+        std::string address = std::string(ip) + ":" + std::to_string(ntohs(clientAddr.sin_port));
+        // The connecting side speaks first; we answer its version
+        registerPeer(clientSock, address, true, false);
     }
 }
 
-// Connect to a peer
-static void connectToPeer(const std::string &peerAddrStr) {
-    size_t colonPos = peerAddrStr.find(':');
-    std::string ip = peerAddrStr.substr(0, colonPos);
-    int port = std::stoi(peerAddrStr.substr(colonPos+1));
+static void ioThreadLoop(NetIoThread *io) {
+    std::vector<Poller::Event> events;
+    while (true) {
+        io->poller.wait(events, 1000);
+        for (auto &ev : events) {
+            if (ev.tag == &g_listenSocket) {
+                acceptPeers();
+                continue;
+            }
+            Peer &peer = *static_cast<Peer*>(ev.tag);
+            if (peer.closed) continue;
+            if (!peer.disconnect && (ev.readable || ev.error)) readFromPeer(peer);
+            if (!peer.disconnect && ev.writable) writeToPeer(peer);
+            if (peer.disconnect) closePeer(peer);
+        }
+    }
+}
+
+// Listening socket, polled by the first I/O thread
+static bool startListening(uint16_t port) {
+    g_listenSocket = createSocket(port);
+    if (g_listenSocket < 0 || !setNonBlocking(g_listenSocket)) {
+        std::cerr << "Failed to open server socket on port " << port << std::endl;
+        return false;
+    }
+    g_ioThreads[0]->poller.add(g_listenSocket, Poller::Read, &g_listenSocket);
+    std::cout << "[P2P] Listening on port " << port << std::endl;
+    return true;
+}
+
+// Connect to a peer. The connect completes on the peer's I/O thread; our
+// version message waits in its send buffer until then. An address-fetch
+// connection is closed as soon as the peer has answered our getaddr.
+static void connectToPeer(const NetAddress &addr, bool addrFetch) {
+    std::string peerAddrStr = addr.toString();
+
+    // Already connected?
+    {
+        std::lock_guard<std::mutex> lock(g_peersMutex);
+        if (g_peers.size() >= g_maxConnections) return;
+        for (auto &p : g_peers) {
+            if (p->listenAddrKey == addr.key()) return;
+        }
+    }
 
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) return;
+    if (!setNonBlocking(sockfd)) {
+        closeSocket(sockfd);
+        return;
+    }
 
     sockaddr_in peerAddr;
     memset(&peerAddr, 0, sizeof(peerAddr));
     peerAddr.sin_family = AF_INET;
-    peerAddr.sin_port = htons(port);
-    inet_pton(AF_INET, ip.c_str(), &peerAddr.sin_addr);
+    peerAddr.sin_port = htons(addr.port);
+    peerAddr.sin_addr.s_addr = htonl(addr.ip);
 
-    if (connect(sockfd, (sockaddr*)&peerAddr, sizeof(peerAddr)) < 0) {
-#ifdef _WIN32
-        closesocket(sockfd);
-#else
-        close(sockfd);
-#endif
+    if (connect(sockfd, (sockaddr*)&peerAddr, sizeof(peerAddr)) < 0 && !socketWouldBlock()) {
+        closeSocket(sockfd);
         return;
     }
 
-    // Add to known peers
+    PeerRef peer = registerPeer(sockfd, peerAddrStr, false, true);
+    peer->listenAddrKey = addr.key();
+    peer->addrFetch = addrFetch;
+    sendVersion(*peer);
+}
+
+// Keep the outbound slots filled from the address manager, and save it now
+// and then. Seeds are dialed only while it has nothing usable, i.e. on a first
+// start or after everything it knew has failed, and only for their addresses.
+// A seed node itself just checks addresses and collects more from them.
+static void connectionLoop(const Json::Value &config) {
+    std::vector<NetAddress> seeds;
+    for (auto &seed : config["seedNodes"]) {
+        NetAddress addr;
+        if (NetAddress::parse(seed.asString(), addr)) seeds.push_back(addr);
+    }
+    int64_t nextSave = unixTime() + kAddrSaveIntervalSecs;
+    int64_t nextSeedTry = 0;
+    while (true) {
+        int64_t now = unixTime();
+        if (now >= nextSave) {
+            nextSave = now + kAddrSaveIntervalSecs;
+            if (g_addrMan.isDirty()) g_addrMan.save(g_addrManPath);
+        }
+        std::unordered_set<uint64_t> connected;
+        size_t outbound = 0;
+        {
+            std::lock_guard<std::mutex> lock(g_peersMutex);
+            for (auto &p : g_peers) {
+                if (p->listenAddrKey) connected.insert(p->listenAddrKey);
+                if (!p->inbound) outbound++;
+            }
+        }
+        if (outbound < g_maxOutbound) {
+            NetAddress addr;
+            if (g_addrMan.select(now, connected, addr)) {
+                g_addrMan.attempt(addr, now);
+                connectToPeer(addr, g_seedMode);
+            } else if (outbound == 0 && now >= nextSeedTry) {
+                nextSeedTry = now + kSeedRetrySecs;
+                for (auto &seed : seeds) {
+                    if (!connected.count(seed.key())) connectToPeer(seed, true);
+                }
+            }
+        }
+        sleepMilliseconds(kConnectionTickMs);
+    }
+}
+
+// Once a second: reassign timed-out block requests, drop peers stalling the
+// download window, and hand out any blocks still to fetch
+static void maintenanceLoop() {
+    while (true) {
+        sleepMilliseconds(1000);
+        Blockchain *chain = getBlockchain();
+        if (!chain) continue;
+        for (uint64_t id : g_blockDownloader.checkTimeouts(*chain, steadyMillis())) {
+            PeerRef peer = findPeer(id);
+            if (!peer) continue;
+            std::cerr << "[P2P] Dropping " << peer->address << ": stalling block download" << std::endl;
+            disconnectPeer(*peer);
+        }
+        requestBlocksFromPeers();
+    }
+}
+
+// Queue a newly accepted transaction for every peer that doesn't know it yet
+static void queueTxRelay(const TransactionRef &tx) {
+    const uint256 &txid = tx->getTxId();
+    std::vector<PeerRef> peers;
     {
         std::lock_guard<std::mutex> lock(g_peersMutex);
-        g_knownPeers.push_back(peerAddrStr);
+        peers = g_peers;
     }
-    std::cout << "[P2P] Connected to peer " << peerAddrStr << std::endl;
+    for (auto &p : peers) {
+        if (!p->verackReceived) continue;
+        std::lock_guard<std::mutex> lock(p->invMutex);
+        if (p->txInvQueue.size() < kMaxTxInvQueue && !p->knownInventory.contains(txid)) {
+            p->txInvQueue.push_back(txid);
+        }
+    }
+}
 
-    // Optionally spawn a thread to read data from this peer
-    std::thread t([sockfd, peerAddrStr]() {
-        char buffer[1024];
-        while (true) {
-            memset(buffer, 0, 1024);
-            int bytesRead = recv(sockfd, buffer, 1023, 0);
-            if (bytesRead <= 0) {
-                break;
-            }
-            std::string msg(buffer, bytesRead);
-            std::cout << "[P2P] From " << peerAddrStr << " >> " << msg << std::endl;
+// Announce the peer's queued transactions that it doesn't know of and that are
+// still in the mempool, up to kMaxInvPerTrickle at a time
+static void flushTxInventory(Peer &peer, Mempool &mempool) {
+    std::vector<InvItem> items;
+    {
+        std::lock_guard<std::mutex> lock(peer.invMutex);
+        while (!peer.txInvQueue.empty() && items.size() < kMaxInvPerTrickle) {
+            uint256 txid = peer.txInvQueue.front();
+            peer.txInvQueue.pop_front();
+            if (peer.knownInventory.contains(txid) || !mempool.contains(txid)) continue;
+            peer.knownInventory.insert(txid);
+            items.push_back(InvItem{INV_TX, txid});
         }
-#ifdef _WIN32
-        closesocket(sockfd);
-#else
-        close(sockfd);
-#endif
-    });
-    t.detach();
+    }
+    if (!items.empty()) sendMessage(peer, "inv", serializeInv(items));
+}
+
+// Exponentially distributed delay, so announcement times form a Poisson process
+static int64_t poissonDelay(std::mt19937_64 &rng, int64_t meanMs) {
+    return static_cast<int64_t>(std::exponential_distribution<double>(1.0 / meanMs)(rng));
 }
 
-// Periodically connect to known seed nodes
-static void discoveryLoop(const Json::Value &config) {
-    Json::Value seeds = config["seedNodes"];
+static void relayLoop() {
+    std::mt19937_64 rng(std::random_device{}());
+    int64_t nextInbound = 0;
+    int64_t nextExpiry = 0;
     while (true) {
-        for (auto &seed : seeds) {
-            connectToPeer(seed.asString());
+        sleepMilliseconds(kRelayTickMs);
+        Blockchain *chain = getBlockchain();
+        if (!chain) continue;
+        int64_t now = steadyMillis();
+        bool inboundDue = now >= nextInbound;
+        if (inboundDue) nextInbound = now + poissonDelay(rng, kInboundInvIntervalMs);
+        std::vector<PeerRef> peers;
+        {
+            std::lock_guard<std::mutex> lock(g_peersMutex);
+            peers = g_peers;
+        }
+        for (auto &p : peers) {
+            if (!p->verackReceived || p->disconnect) continue;
+            if (p->inbound) {
+                if (!inboundDue) continue;
+            } else {
+                if (now < p->nextInvSend) continue;
+                p->nextInvSend = now + poissonDelay(rng, kOutboundInvIntervalMs);
+            }
+            flushTxInventory(*p, chain->getMempool());
+        }
+        // Forget requests that were never answered
+        if (now >= nextExpiry) {
+            nextExpiry = now + kTxRequestTimeoutMs;
+            std::lock_guard<std::mutex> lock(g_txRequestsMutex);
+            for (auto it = g_txRequests.begin(); it != g_txRequests.end();) {
+                if (now - it->second >= kTxRequestTimeoutMs) {
+                    it = g_txRequests.erase(it);
+                } else {
+                    ++it;
+                }
+            }
         }
-        // Sleep then try again
-        sleepMilliseconds(30000);
     }
 }
 
@@ -192,11 +1222,46 @@ static void discoveryLoop(const Json::Value &config) {
 void startP2P() {
     Json::Value cfg = loadConfig("config.json");
     uint16_t port = cfg.get("p2pPort", 8333).asUInt();
+    g_netMagic = parseNetMagic(cfg.get("magicBytes", "f9beb4d9").asString());
+    g_maxMessagePayload = maxMessagePayload(static_cast<size_t>(cfg.get("maxBlockSize", 2000000).asUInt64()));
+    g_localNonce = std::mt19937_64(std::random_device()())();
+    g_listenPort = port;
+    g_maxConnections = cfg.get("maxConnections", 256).asUInt();
+    g_maxOutbound = cfg.get("maxOutbound", 8).asUInt();
+    std::string dataDir = cfg.get("dataDir", "data").asString();
+    g_addrManPath = dataDir + "/peers.dat";
+    ensureDirectory(dataDir);
+    if (g_addrMan.load(g_addrManPath, unixTime())) {
+        std::cout << "[AddrMan] Loaded " << g_addrMan.size() << " peer address(es)" << std::endl;
+    }
+    unsigned ioThreads = std::max(1u, cfg.get("netIoThreads", 2).asUInt());
+    unsigned workers = std::max(1u, cfg.get("netWorkerThreads", 2).asUInt());
+
+    static ThreadPool messagePool(workers);
+    g_messagePool = &messagePool;
+    for (unsigned i = 0; i < ioThreads; i++) {
+        g_ioThreads.emplace_back(new NetIoThread());
+    }
     // Start listening
-    std::thread t(listenForPeers, port);
-    t.detach();
+    startListening(port);
+    for (auto &io : g_ioThreads) {
+        io->thread = std::thread(ioThreadLoop, io.get());
+        io->thread.detach();
+    }
 
-    // Start discovery
-    std::thread t2(discoveryLoop, cfg);
+    // Start making outbound connections
+    std::thread t2(connectionLoop, cfg);
     t2.detach();
+
+    std::thread t3(maintenanceLoop);
+    t3.detach();
+
+    std::thread t4(relayLoop);
+    t4.detach();
+
+    Blockchain *chain = getBlockchain();
+    if (chain) {
+        chain->addBlockConnectedListener(announceBlock);
+        chain->addTransactionAcceptedListener(queueTxRelay);
+    }
 }
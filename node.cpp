@@ -0,0 +1,10 @@
+// Everything but main() as one translation unit. The modules include each
+// other and keep their state in file-static globals (the UTXO set, the
+// blockchain, the peers), so they only work when compiled together; main.cpp
+// reaches them through the non-static entry points.
+#include "seed_node.cpp" // blockchain_core.cpp and network_protocol.cpp
+#include "miner.cpp"
+#include "rpc_server.cpp"
+#ifndef MYCOIN_NO_WALLET
+#include "wallet.cpp"
+#endif
@@ -0,0 +1,705 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <openssl/sha.h>
+#include "sha256.cpp"
+#include "thread_pool.cpp"
+
+// Core data types shared by every subsystem: hashes, transactions, blocks and
+// their canonical binary encodings.
+
+// Fixed-size 256-bit hash value. Bytes are kept in digest order, so toHex()
+// prints exactly what the old hex-string hashes looked like.
+struct uint256 {
+    unsigned char data[32];
+
+    uint256() { setNull(); }
+
+    void setNull() { std::memset(data, 0, sizeof(data)); }
+
+    bool isNull() const {
+        for (unsigned char b : data) {
+            if (b != 0) return false;
+        }
+        return true;
+    }
+
+    unsigned char *begin() { return data; }
+    unsigned char *end() { return data + sizeof(data); }
+    const unsigned char *begin() const { return data; }
+    const unsigned char *end() const { return data + sizeof(data); }
+    static constexpr size_t size() { return 32; }
+
+    bool operator==(const uint256 &o) const { return std::memcmp(data, o.data, sizeof(data)) == 0; }
+    bool operator!=(const uint256 &o) const { return !(*this == o); }
+    bool operator<(const uint256 &o) const { return std::memcmp(data, o.data, sizeof(data)) < 0; }
+
+    // Hex is only used at display/logging/config edges
+    std::string toHex() const {
+        static const char digits[] = "0123456789abcdef";
+        std::string out(64, '0');
+        for (size_t i = 0; i < sizeof(data); ++i) {
+            out[2 * i] = digits[data[i] >> 4];
+            out[2 * i + 1] = digits[data[i] & 0x0f];
+        }
+        return out;
+    }
+
+    // Parse a 64-char hex string. Returns false (and leaves *this untouched) on bad input.
+    bool setHex(const std::string &hex) {
+        if (hex.size() != 64) return false;
+        unsigned char tmp[32];
+        for (size_t i = 0; i < 32; ++i) {
+            int hi = hexValue(hex[2 * i]);
+            int lo = hexValue(hex[2 * i + 1]);
+            if (hi < 0 || lo < 0) return false;
+            tmp[i] = static_cast<unsigned char>((hi << 4) | lo);
+        }
+        std::memcpy(data, tmp, sizeof(data));
+        return true;
+    }
+
+    // Cheap 64-bit digest of the hash, for use in hash tables. Taken from the last
+    // bytes: proof-of-work makes the leading bytes of block hashes zero.
+    uint64_t getCheapHash() const {
+        uint64_t v;
+        std::memcpy(&v, data + 24, sizeof(v));
+        return v;
+    }
+
+private:
+    static int hexValue(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+};
+
+// std::unordered_map/set hasher for uint256 keys
+struct Uint256Hasher {
+    size_t operator()(const uint256 &h) const { return static_cast<size_t>(h.getCheapHash()); }
+};
+
+// Simple SHA-256 wrapper using OpenSSL
+static uint256 sha256(const unsigned char *input, size_t len) {
+    uint256 hash;
+    SHA256(input, len, hash.data);
+    return hash;
+}
+
+static uint256 sha256(const std::string &input) {
+    return sha256(reinterpret_cast<const unsigned char*>(input.data()), input.size());
+}
+
+static_assert(sizeof(uint256) == 32, "uint256 must be exactly 32 packed bytes");
+
+// Merkle root calculation for a list of transaction hashes.
+// Adjacent uint256s in a vector are exactly the 64-byte messages of the next
+// level, so each level is hashed as one multi-buffer batch without copying pairs.
+static uint256 calculateMerkleRoot(const std::vector<uint256> &txHashes) {
+    if (txHashes.empty()) {
+        return uint256();
+    }
+
+    std::vector<uint256> currentLevel = txHashes;
+    while (currentLevel.size() > 1) {
+        if (currentLevel.size() % 2 != 0) {
+            currentLevel.push_back(currentLevel.back());
+        }
+        size_t pairs = currentLevel.size() / 2;
+        // Output i only overwrites input pair i after it has been read
+        sha256Hash64Many(currentLevel.front().data, currentLevel.front().data, pairs);
+        currentLevel.resize(pairs);
+    }
+    return currentLevel.front();
+}
+
+// Merkle tree that keeps every level, so changing or appending one leaf only
+// rehashes the O(log n) nodes on its path to the root. Produces the same root as
+// calculateMerkleRoot (an odd node at the end of a level is paired with itself).
+class MerkleTree {
+public:
+    // Levels with at least this many pairs are hashed across the worker pool
+    static const size_t kParallelThreshold = 2048;
+
+    // Rebuild the whole tree from scratch
+    void build(const std::vector<uint256> &leaves) {
+        levels.clear();
+        if (leaves.empty()) return;
+        levels.push_back(leaves);
+        while (levels.back().size() > 1) {
+            const std::vector<uint256> &below = levels.back();
+            std::vector<uint256> above((below.size() + 1) / 2);
+            hashLevel(below, above);
+            levels.push_back(std::move(above));
+        }
+    }
+
+    size_t size() const { return levels.empty() ? 0 : levels[0].size(); }
+
+    uint256 root() const { return levels.empty() ? uint256() : levels.back().front(); }
+
+    const uint256 &leaf(size_t index) const { return levels[0][index]; }
+
+    // Replace one leaf, e.g. the coinbase after an extranonce change
+    void update(size_t index, const uint256 &leaf) {
+        levels[0][index] = leaf;
+        updatePath(index);
+    }
+
+    void append(const uint256 &leaf) {
+        if (levels.empty()) levels.emplace_back();
+        levels[0].push_back(leaf);
+        updatePath(levels[0].size() - 1);
+    }
+
+    // Sibling hashes from the leaf up to (not including) the root
+    std::vector<uint256> getProof(size_t index) const {
+        std::vector<uint256> proof;
+        for (size_t k = 0; k + 1 < levels.size(); k++) {
+            const std::vector<uint256> &level = levels[k];
+            size_t sibling = index ^ 1;
+            proof.push_back(sibling < level.size() ? level[sibling] : level[index]);
+            index >>= 1;
+        }
+        return proof;
+    }
+
+    static uint256 rootFromProof(uint256 leaf, size_t index, const std::vector<uint256> &proof) {
+        for (const uint256 &sibling : proof) {
+            leaf = (index & 1) ? hashPair(sibling, leaf) : hashPair(leaf, sibling);
+            index >>= 1;
+        }
+        return leaf;
+    }
+
+private:
+    static uint256 hashPair(const uint256 &left, const uint256 &right) {
+        unsigned char pair[64];
+        std::memcpy(pair, left.data, 32);
+        std::memcpy(pair + 32, right.data, 32);
+        uint256 out;
+        sha256Hash64Many(pair, out.data, 1);
+        return out;
+    }
+
+    static void hashLevel(const std::vector<uint256> &below, std::vector<uint256> &above) {
+        size_t pairs = below.size() / 2;
+        const unsigned char *in = below.front().data;
+        unsigned char *out = above.front().data;
+        if (pairs >= kParallelThreshold) {
+            getWorkerPool().parallelFor(pairs, kParallelThreshold / 2, [in, out](size_t begin, size_t end) {
+                sha256Hash64Many(in + begin * 64, out + begin * 32, end - begin);
+            });
+        } else {
+            sha256Hash64Many(in, out, pairs);
+        }
+        if (below.size() % 2 != 0) {
+            above.back() = hashPair(below.back(), below.back());
+        }
+    }
+
+    // Recompute the parents of levels[0][index], growing upper levels as needed
+    void updatePath(size_t index) {
+        for (size_t k = 0; levels[k].size() > 1; k++) {
+            if (k + 1 == levels.size()) levels.emplace_back();
+            const std::vector<uint256> &below = levels[k];
+            size_t parent = index / 2;
+            size_t left = parent * 2;
+            const uint256 &right = (left + 1 < below.size()) ? below[left + 1] : below[left];
+            uint256 h = hashPair(below[left], right);
+            std::vector<uint256> &above = levels[k + 1];
+            above.resize((below.size() + 1) / 2);
+            above[parent] = h;
+            index = parent;
+        }
+        // A single-node level is the root; drop anything stale above it
+        for (size_t k = 0; k < levels.size(); k++) {
+            if (levels[k].size() == 1) {
+                levels.resize(k + 1);
+                break;
+            }
+        }
+    }
+
+    // levels[0] = leaves (txids), levels.back() = { root }
+    std::vector<std::vector<uint256>> levels;
+};
+
+static inline void writeLE32(unsigned char *p, uint32_t v) {
+    p[0] = static_cast<unsigned char>(v);
+    p[1] = static_cast<unsigned char>(v >> 8);
+    p[2] = static_cast<unsigned char>(v >> 16);
+    p[3] = static_cast<unsigned char>(v >> 24);
+}
+
+static inline uint32_t readLE32(const unsigned char *p) {
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static inline void writeLE64(unsigned char *p, uint64_t v) {
+    writeLE32(p, static_cast<uint32_t>(v));
+    writeLE32(p + 4, static_cast<uint32_t>(v >> 32));
+}
+
+static inline uint64_t readLE64(const unsigned char *p) {
+    return uint64_t(readLE32(p)) | (uint64_t(readLE32(p + 4)) << 32);
+}
+
+// Append helpers for the compact binary encodings (integers little-endian)
+static inline void appendBytes(std::string &out, const void *data, size_t len) {
+    out.append(static_cast<const char*>(data), len);
+}
+
+static inline void appendLE32(std::string &out, uint32_t v) {
+    unsigned char buf[4];
+    writeLE32(buf, v);
+    appendBytes(out, buf, 4);
+}
+
+static inline void appendLE64(std::string &out, uint64_t v) {
+    appendLE32(out, static_cast<uint32_t>(v));
+    appendLE32(out, static_cast<uint32_t>(v >> 32));
+}
+
+// Bitcoin-style variable length integer: 1, 3, 5 or 9 bytes
+static inline void appendCompactSize(std::string &out, uint64_t n) {
+    if (n < 0xfd) {
+        out.push_back(static_cast<char>(n));
+    } else if (n <= 0xffff) {
+        out.push_back(static_cast<char>(0xfd));
+        out.push_back(static_cast<char>(n));
+        out.push_back(static_cast<char>(n >> 8));
+    } else if (n <= 0xffffffffULL) {
+        out.push_back(static_cast<char>(0xfe));
+        appendLE32(out, static_cast<uint32_t>(n));
+    } else {
+        out.push_back(static_cast<char>(0xff));
+        appendLE64(out, n);
+    }
+}
+
+// Bounds-checked cursor for decoding the encodings above. A short or malformed
+// read sets `failed` and returns zeros; callers check failed once at the end.
+struct ByteReader {
+    const unsigned char *p;
+    size_t left;
+    bool failed = false;
+
+    ByteReader(const void *data, size_t len) : p(static_cast<const unsigned char*>(data)), left(len) {}
+
+    bool readBytes(void *out, size_t n) {
+        if (failed || n > left) {
+            failed = true;
+            std::memset(out, 0, n);
+            return false;
+        }
+        std::memcpy(out, p, n);
+        p += n;
+        left -= n;
+        return true;
+    }
+
+    uint32_t readU32() {
+        unsigned char buf[4];
+        readBytes(buf, 4);
+        return readLE32(buf);
+    }
+
+    uint64_t readU64() {
+        unsigned char buf[8];
+        readBytes(buf, 8);
+        return readLE64(buf);
+    }
+
+    uint64_t readCompactSize() {
+        unsigned char first = 0;
+        readBytes(&first, 1);
+        if (first < 0xfd) return first;
+        if (first == 0xfd) {
+            unsigned char buf[2];
+            readBytes(buf, 2);
+            return uint64_t(buf[0]) | (uint64_t(buf[1]) << 8);
+        }
+        if (first == 0xfe) return readU32();
+        return readU64();
+    }
+
+    // compactSize(len) bytes; a length that can't fit in what's left fails
+    bool readString(std::string &out) {
+        uint64_t n = readCompactSize();
+        if (failed || n > left) {
+            failed = true;
+            return false;
+        }
+        out.assign(reinterpret_cast<const char*>(p), static_cast<size_t>(n));
+        p += n;
+        left -= n;
+        return true;
+    }
+};
+
+// Represents an input to a transaction, referencing a previous tx's output
+struct TxInput {
+    uint256 txid;      // The transaction hash that this input references
+    uint32_t index;    // Which output index of the previous tx is used
+    std::string signature;  // ECDSA signature of the input (placeholder)
+
+    // txid | index | compactSize(len) signature
+    void serialize(std::string &out) const {
+        appendBytes(out, txid.data, 32);
+        appendLE32(out, index);
+        appendCompactSize(out, signature.size());
+        out.append(signature);
+    }
+
+    bool deserialize(ByteReader &in) {
+        in.readBytes(txid.data, 32);
+        index = in.readU32();
+        in.readString(signature);
+        return !in.failed;
+    }
+};
+
+// Represents an output from a transaction, specifying the amount and "locking script"
+struct TxOutput {
+    uint64_t amount;           // Amount in "satoshis"
+    uint256 pubKeyHash;        // Simplified "scriptPubKey" (hash of public key)
+
+    // amount | pubKeyHash
+    void serialize(std::string &out) const {
+        appendLE64(out, amount);
+        appendBytes(out, pubKeyHash.data, 32);
+    }
+
+    bool deserialize(ByteReader &in) {
+        amount = in.readU64();
+        in.readBytes(pubKeyHash.data, 32);
+        return !in.failed;
+    }
+};
+
+// version | compactSize(#in) inputs | compactSize(#out) outputs | lockTime
+template <typename Tx>
+static void serializeTransaction(const Tx &tx, std::string &out) {
+    appendLE32(out, tx.version);
+    appendCompactSize(out, tx.inputs.size());
+    for (auto &in : tx.inputs) {
+        in.serialize(out);
+    }
+    appendCompactSize(out, tx.outputs.size());
+    for (auto &out_ : tx.outputs) {
+        out_.serialize(out);
+    }
+    appendLE32(out, tx.lockTime);
+}
+
+// A transaction under construction (wallet, block templates). Turn it into an
+// immutable Transaction once it is complete.
+class Transaction;
+struct MutableTransaction {
+    std::vector<TxInput> inputs;
+    std::vector<TxOutput> outputs;
+    uint32_t version = 1;
+    uint32_t lockTime = 0; // not fully used in this PoC
+
+    MutableTransaction() = default;
+    explicit MutableTransaction(const Transaction &tx); // copy for editing
+};
+
+// Represents a transaction with multiple inputs and outputs.
+// Immutable once built, so its txid and size are computed exactly once;
+// blocks, the mempool and the network share it through TransactionRef.
+class Transaction {
+public:
+    const std::vector<TxInput> inputs;
+    const std::vector<TxOutput> outputs;
+    const uint32_t version;
+    const uint32_t lockTime; // not fully used in this PoC
+
+    explicit Transaction(const MutableTransaction &tx)
+        : inputs(tx.inputs), outputs(tx.outputs), version(tx.version), lockTime(tx.lockTime),
+          serializedSize(0) {
+        computeDerived();
+    }
+
+    explicit Transaction(MutableTransaction &&tx)
+        : inputs(std::move(tx.inputs)), outputs(std::move(tx.outputs)), version(tx.version),
+          lockTime(tx.lockTime), serializedSize(0) {
+        computeDerived();
+    }
+
+    // A coinbase has a single input that references no previous output
+    bool isCoinbase() const {
+        return inputs.size() == 1 && inputs[0].txid.isNull() && inputs[0].index == 0;
+    }
+
+    // For quick identification (hash of the serialized transaction, cached)
+    const uint256 &getTxId() const {
+        return txid;
+    }
+
+    size_t getSerializedSize() const {
+        return serializedSize;
+    }
+
+    void serialize(std::string &out) const {
+        serializeTransaction(*this, out);
+    }
+
+private:
+    void computeDerived() {
+        std::string buf;
+        serialize(buf);
+        serializedSize = buf.size();
+        txid = sha256(buf);
+    }
+
+    uint256 txid;
+    size_t serializedSize;
+};
+
+// Inverse of serializeTransaction. Element counts are checked against the bytes
+// left so a hostile length can't trigger a huge allocation.
+static bool deserializeTransaction(ByteReader &in, MutableTransaction &tx) {
+    tx.version = in.readU32();
+    uint64_t nIn = in.readCompactSize();
+    if (in.failed || nIn > in.left / 37) return false; // 36-byte outpoint + 1-byte length
+    tx.inputs.resize(static_cast<size_t>(nIn));
+    for (auto &input : tx.inputs) {
+        if (!input.deserialize(in)) return false;
+    }
+    uint64_t nOut = in.readCompactSize();
+    if (in.failed || nOut > in.left / 40) return false;
+    tx.outputs.resize(static_cast<size_t>(nOut));
+    for (auto &output : tx.outputs) {
+        if (!output.deserialize(in)) return false;
+    }
+    tx.lockTime = in.readU32();
+    return !in.failed;
+}
+
+inline MutableTransaction::MutableTransaction(const Transaction &tx)
+    : inputs(tx.inputs), outputs(tx.outputs), version(tx.version), lockTime(tx.lockTime) {}
+
+typedef std::shared_ptr<const Transaction> TransactionRef;
+
+static inline TransactionRef makeTransactionRef(MutableTransaction tx) {
+    return std::make_shared<const Transaction>(std::move(tx));
+}
+
+// Represents a block header, separate from the transactions themselves
+struct BlockHeader {
+    uint32_t version;
+    uint256 prevBlockHash;
+    uint256 merkleRoot;
+    uint32_t timestamp;
+    uint32_t difficultyTarget;
+    uint32_t nonce;
+
+    // Canonical fixed-width encoding (integers little-endian):
+    //   [0,4) version  [4,36) prevBlockHash  [36,68) merkleRoot
+    //   [68,72) timestamp  [72,76) difficultyTarget  [76,80) nonce
+    static const size_t kSerializedSize = 80;
+    static const size_t kNonceOffset = 76;
+
+    void serialize(unsigned char out[kSerializedSize]) const {
+        writeLE32(out, version);
+        std::memcpy(out + 4, prevBlockHash.data, 32);
+        std::memcpy(out + 36, merkleRoot.data, 32);
+        writeLE32(out + 68, timestamp);
+        writeLE32(out + 72, difficultyTarget);
+        writeLE32(out + kNonceOffset, nonce);
+    }
+
+    void deserialize(const unsigned char in[kSerializedSize]) {
+        version = readLE32(in);
+        std::memcpy(prevBlockHash.data, in + 4, 32);
+        std::memcpy(merkleRoot.data, in + 36, 32);
+        timestamp = readLE32(in + 68);
+        difficultyTarget = readLE32(in + 72);
+        nonce = readLE32(in + kNonceOffset);
+    }
+
+    uint256 getHash() const {
+        unsigned char buf[kSerializedSize];
+        serialize(buf);
+        return sha256(buf, sizeof(buf));
+    }
+};
+
+// Hashes one header for many nonces. The first 64 bytes of the encoding never
+// change while mining a template, so they are absorbed once into a SHA-256
+// midstate; each attempt then only compresses the final 16-byte chunk.
+class HeaderPowHasher {
+public:
+    explicit HeaderPowHasher(const BlockHeader &header) { reset(header); }
+
+    // Call again whenever anything other than the nonce changes (e.g. merkle root)
+    void reset(const BlockHeader &header) {
+        unsigned char buf[BlockHeader::kSerializedSize];
+        header.serialize(buf);
+        midstate = Sha256Midstate();
+        midstate.absorb(buf);
+        sha256PadFinalChunk(tail, buf + 64, BlockHeader::kSerializedSize - 64, BlockHeader::kSerializedSize);
+    }
+
+    uint256 hashWithNonce(uint32_t nonce) {
+        writeLE32(tail + (BlockHeader::kNonceOffset - 64), nonce);
+        uint32_t state[8];
+        std::memcpy(state, midstate.state, sizeof(state));
+        sha256Backend().transform(state, tail);
+        uint256 hash;
+        sha256StateToDigest(state, hash.data);
+        return hash;
+    }
+
+    // Hash kBatch consecutive nonces starting at firstNonce in one multi-buffer call
+    static const size_t kBatch = 16;
+    void hashNonces(uint32_t firstNonce, uint256 out[kBatch]) {
+        uint32_t states[kBatch][8];
+        const unsigned char *chunks[kBatch];
+        for (size_t i = 0; i < kBatch; i++) {
+            std::memcpy(batchTails[i], tail, sizeof(tail));
+            writeLE32(batchTails[i] + (BlockHeader::kNonceOffset - 64), firstNonce + static_cast<uint32_t>(i));
+            std::memcpy(states[i], midstate.state, sizeof(states[i]));
+            chunks[i] = batchTails[i];
+        }
+        sha256TransformMany(states, chunks, kBatch);
+        for (size_t i = 0; i < kBatch; i++) {
+            sha256StateToDigest(states[i], out[i].data);
+        }
+    }
+
+private:
+    Sha256Midstate midstate;
+    unsigned char tail[64];
+    unsigned char batchTails[kBatch][64];
+};
+
+// Represents a full block. The transactions are only changed through the
+// methods below, so the cached merkle tree can never silently disagree with
+// them: each mutation either keeps the tree in step or marks it stale.
+class Block {
+public:
+    BlockHeader header;
+
+    // Return the block hash
+    uint256 getBlockHash() const {
+        return header.getHash();
+    }
+
+    const std::vector<TransactionRef> &getTransactions() const {
+        return transactions;
+    }
+
+    // Replace every transaction. header.merkleRoot is left alone; call
+    // buildMerkleRoot() when the block is meant to commit to them.
+    void setTransactions(std::vector<TransactionRef> txs) {
+        transactions = std::move(txs);
+        merkleValid = false;
+    }
+
+    // header(80) | compactSize(#tx) | transactions
+    void serialize(std::string &out) const {
+        unsigned char buf[BlockHeader::kSerializedSize];
+        header.serialize(buf);
+        appendBytes(out, buf, sizeof(buf));
+        appendCompactSize(out, transactions.size());
+        for (auto &tx : transactions) {
+            tx->serialize(out);
+        }
+    }
+
+    // Decode a whole serialized block; trailing bytes are an error
+    bool deserialize(const unsigned char *data, size_t len) {
+        ByteReader in(data, len);
+        unsigned char buf[BlockHeader::kSerializedSize];
+        if (!in.readBytes(buf, sizeof(buf))) return false;
+        header.deserialize(buf);
+        uint64_t count = in.readCompactSize();
+        if (in.failed || count > in.left / 10) return false; // smallest possible tx is 10 bytes
+        transactions.clear();
+        merkleValid = false;
+        transactions.reserve(static_cast<size_t>(count));
+        for (uint64_t i = 0; i < count; i++) {
+            MutableTransaction tx;
+            if (!deserializeTransaction(in, tx)) return false;
+            transactions.push_back(makeTransactionRef(std::move(tx)));
+        }
+        return in.left == 0;
+    }
+
+    // Construct merkle root from this block's transactions
+    void buildMerkleRoot() {
+        std::vector<uint256> txHashes;
+        txHashes.reserve(transactions.size());
+        for (auto &tx : transactions) {
+            txHashes.push_back(tx->getTxId());
+        }
+        merkleTree.build(txHashes);
+        merkleValid = true;
+        header.merkleRoot = merkleTree.root();
+    }
+
+    // Swap in a new transactions[index] (e.g. the coinbase with a new
+    // extranonce) and refresh the merkle root. Only O(log n) hashes if the
+    // tree is already built.
+    void replaceTransaction(size_t index, const TransactionRef &tx) {
+        transactions[index] = tx;
+        if (!merkleValid) {
+            buildMerkleRoot();
+            return;
+        }
+        merkleTree.update(index, tx->getTxId());
+        header.merkleRoot = merkleTree.root();
+    }
+
+    // Append a transaction and extend the merkle tree incrementally
+    void appendTransaction(const TransactionRef &tx) {
+        transactions.push_back(tx);
+        if (!merkleValid) {
+            buildMerkleRoot();
+            return;
+        }
+        merkleTree.append(tx->getTxId());
+        header.merkleRoot = merkleTree.root();
+    }
+
+    // Merkle branch proving transactions[index] is committed to by header.merkleRoot
+    std::vector<uint256> getMerkleProof(size_t index) {
+        if (!merkleValid) {
+            buildMerkleRoot();
+        }
+        return merkleTree.getProof(index);
+    }
+
+private:
+    std::vector<TransactionRef> transactions;
+    // Levels from the last build/update; valid only while merkleValid
+    MerkleTree merkleTree;
+    bool merkleValid = false;
+};
+
+// Reference to one output of a previous transaction (36 bytes: txid + index)
+struct OutPoint {
+    uint256 txid;
+    uint32_t index;
+
+    OutPoint() : index(0) {}
+    OutPoint(const uint256 &h, uint32_t i) : txid(h), index(i) {}
+
+    bool operator==(const OutPoint &o) const { return index == o.index && txid == o.txid; }
+    bool operator<(const OutPoint &o) const {
+        int c = std::memcmp(txid.data, o.txid.data, 32);
+        return c < 0 || (c == 0 && index < o.index);
+    }
+
+    std::string toString() const {
+        return txid.toHex() + ":" + std::to_string(index);
+    }
+};
@@ -0,0 +1,97 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <algorithm>
+#include "primitives.cpp"
+#include "siphash.cpp"
+
+// ------------------- ROLLING BLOOM FILTER -------------------
+// Remembers roughly the last `maxElements` hashes inserted, in fixed memory.
+// Entries are kept in three generations of maxElements/2. Each bit position
+// holds a 2-bit generation number, so starting a new generation only has to
+// clear the positions of the oldest one. Anything among the most recent
+// maxElements is always found; older entries age out. Entries that were never
+// inserted are found with probability about fpRate.
+//
+// Hash positions come from two salted SipHashes (h1 + i*h2), so peers can't
+// craft txids that fill one node's filters.
+
+class RollingBloomFilter {
+public:
+    RollingBloomFilter(size_t maxElements, double fpRate) {
+        entriesPerGeneration = std::max<size_t>(1, (maxElements + 1) / 2);
+        size_t stored = entriesPerGeneration * 3;
+        double logFpRate = std::log(fpRate);
+        hashFuncs = std::max(1, std::min(static_cast<int>(std::round(logFpRate / std::log(0.5))), 50));
+        double bits = std::ceil(-1.0 * hashFuncs * stored / std::log(1.0 - std::exp(logFpRate / hashFuncs)));
+        // Two words per 64 positions: the low and high bit of each generation number
+        data.assign((static_cast<size_t>(bits) + 63) / 64 * 2, 0);
+        std::mt19937_64 rng(std::random_device{}());
+        uint64_t k[4] = {rng(), rng(), rng(), rng()};
+        hasher1 = SipHasher(k[0], k[1]);
+        hasher2 = SipHasher(k[2], k[3]);
+    }
+
+    void insert(const uint256 &hash) {
+        if (entriesThisGeneration == entriesPerGeneration) startGeneration();
+        entriesThisGeneration++;
+        uint64_t h1 = hasher1.hash(hash);
+        uint64_t h2 = hasher2.hash(hash);
+        uint64_t low = generation & 1;
+        uint64_t high = generation >> 1;
+        for (int i = 0; i < hashFuncs; i++) {
+            uint64_t h = h1 + i * h2;
+            size_t word = position(h);
+            int bit = h & 63;
+            data[word] = (data[word] & ~(uint64_t(1) << bit)) | (low << bit);
+            data[word + 1] = (data[word + 1] & ~(uint64_t(1) << bit)) | (high << bit);
+        }
+    }
+
+    bool contains(const uint256 &hash) const {
+        uint64_t h1 = hasher1.hash(hash);
+        uint64_t h2 = hasher2.hash(hash);
+        for (int i = 0; i < hashFuncs; i++) {
+            uint64_t h = h1 + i * h2;
+            size_t word = position(h);
+            int bit = h & 63;
+            if (!(((data[word] | data[word + 1]) >> bit) & 1)) return false;
+        }
+        return true;
+    }
+
+    size_t memoryUsage() const {
+        return data.size() * sizeof(uint64_t);
+    }
+
+private:
+    // Even index of the word pair for a hash, spread over the whole filter
+    size_t position(uint64_t h) const {
+        uint64_t pairs = data.size() / 2;
+        return static_cast<size_t>(((h >> 32) * pairs) >> 32) * 2;
+    }
+
+    // Move on to the next generation number (1, 2, 3, 1, ...) and clear every
+    // position still holding it
+    void startGeneration() {
+        entriesThisGeneration = 0;
+        generation = generation == 3 ? 1 : generation + 1;
+        uint64_t mask1 = ~uint64_t(0) * (generation & 1);
+        uint64_t mask2 = ~uint64_t(0) * (generation >> 1);
+        for (size_t i = 0; i < data.size(); i += 2) {
+            uint64_t keep = (data[i] ^ mask1) | (data[i + 1] ^ mask2);
+            data[i] &= keep;
+            data[i + 1] &= keep;
+        }
+    }
+
+    std::vector<uint64_t> data;
+    size_t entriesPerGeneration;
+    size_t entriesThisGeneration = 0;
+    uint64_t generation = 1;
+    int hashFuncs;
+    SipHasher hasher1{0, 0};
+    SipHasher hasher2{0, 0};
+};
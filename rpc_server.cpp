@@ -0,0 +1,1044 @@
+#pragma once
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <filesystem>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+
+#ifdef _WIN32
+  #include <winsock2.h>
+  #include <ws2tcpip.h>
+  typedef int socklen_t;
+  #ifndef SHUT_RDWR
+    #define SHUT_RDWR SD_BOTH
+  #endif
+#else
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+  #include <arpa/inet.h>
+  #include <sys/socket.h>
+#endif
+
+#include "blockchain_core.cpp"
+#include "net_messages.cpp"
+#include "net_reactor.cpp"
+#include "thread_pool.cpp"
+
+// ------------------- JSON-RPC SERVER -------------------
+// HTTP/1.1 JSON-RPC on rpcPort (bound to rpcBind, localhost by default) for
+// the tools that poll the node for its tip, blocks, coins and mempool.
+//
+// One I/O thread polls the listening socket and every connection, parses
+// requests and writes responses out of each connection's send ring.
+// Connections are persistent unless the client asks otherwise, and a client
+// may pipeline: its next request is parsed once the current one is answered.
+// Complete requests go to a pool of rpcThreads workers; while rpcWorkQueue
+// requests are already waiting for one, new ones are refused with 503 instead
+// of queueing without bound.
+//
+// Every request must carry HTTP Basic credentials: rpcUser/rpcPassword from
+// the config, or, when those are unset, __cookie__ and the random password the
+// node writes to <dataDir>/.cookie at startup (readable by its user only). The
+// body must be sent as Content-Type: application/json.
+//
+// A request body is a single call or a batch (a JSON array of calls, answered
+// with an array in the same order). Responses that fit in one kRpcChunkBytes
+// piece are sent with a Content-Length; bigger ones (whole blocks, the
+// mempool) are generated piece by piece and sent with chunked encoding, the
+// worker waiting whenever more than kRpcSendBufferLimit bytes are still
+// unsent, so a result is never held in memory as one string. A client that
+// takes nothing for kRpcSendTimeoutSecs while a response is queued is
+// disconnected, which also releases a worker waiting on it.
+//
+// Everything here reads the chain through its snapshots, the block index and
+// the block store, and never waits for a block being connected.
+// sendrawtransaction goes through mempool admission like a relayed one.
+
+static const size_t kRpcMaxHeaderBytes = 8 * 1024;
+static const size_t kRpcMaxBodyBytes = 4u << 20;
+static const size_t kRpcChunkBytes = 64 * 1024;
+static const size_t kRpcSendBufferLimit = 1u << 20;
+static const size_t kRpcMaxConnections = 128;
+static const size_t kRpcMaxReadPerEvent = 1u << 20;
+static const int64_t kRpcIdleTimeoutSecs = 30;
+static const int64_t kRpcSendTimeoutSecs = 30;
+
+// JSON-RPC and Bitcoin Core error codes
+static const int kRpcInvalidRequest = -32600;
+static const int kRpcMethodNotFound = -32601;
+static const int kRpcInvalidParams = -32602;
+static const int kRpcInternalError = -32603;
+static const int kRpcParseError = -32700;
+static const int kRpcInvalidParameter = -8;
+static const int kRpcNotFound = -5;         // RPC_INVALID_ADDRESS_OR_KEY
+static const int kRpcDeserializationError = -22;
+static const int kRpcVerifyRejected = -26;
+
+static std::string encodeHex(const unsigned char *data, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    std::string out(len * 2, '\0');
+    for (size_t i = 0; i < len; i++) {
+        out[2 * i] = digits[data[i] >> 4];
+        out[2 * i + 1] = digits[data[i] & 15];
+    }
+    return out;
+}
+
+static std::string encodeHex(const std::string &data) {
+    return encodeHex(reinterpret_cast<const unsigned char*>(data.data()), data.size());
+}
+
+static int hexDigitValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool decodeHex(const std::string &hex, std::string &out) {
+    if (hex.size() % 2) return false;
+    out.clear();
+    out.reserve(hex.size() / 2);
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        int hi = hexDigitValue(hex[i]);
+        int lo = hexDigitValue(hex[i + 1]);
+        if (hi < 0 || lo < 0) return false;
+        out.push_back(static_cast<char>((hi << 4) | lo));
+    }
+    return true;
+}
+
+// Compact (single line) JSON text
+static std::string toJson(const Json::Value &value) {
+    static const Json::StreamWriterBuilder builder = []() {
+        Json::StreamWriterBuilder b;
+        b["indentation"] = "";
+        return b;
+    }();
+    return Json::writeString(builder, value);
+}
+
+static bool parseJson(const std::string &text, Json::Value &out) {
+    static const Json::CharReaderBuilder builder;
+    std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+    std::string errors;
+    return reader->parse(text.data(), text.data() + text.size(), &out, &errors);
+}
+
+// ------------------- CONNECTIONS -------------------
+
+// recvBuffer and the parse state belong to the I/O thread; the send ring is
+// shared with the worker answering the current request.
+struct RpcConnection {
+    int sock;
+    std::string address;
+    bool closed = false;                   // I/O thread only
+    std::string recvBuffer;                // I/O thread only
+    bool continueSent = false;             // I/O thread only: "100 Continue" for the request in recvBuffer
+    int64_t lastActive = 0;                // I/O thread only
+    std::atomic<bool> busy{false};         // a worker is answering a request
+    std::atomic<bool> closeAfterSend{false};
+    std::atomic<bool> failed{false};       // gone: writes are dropped and waiting writers released
+
+    std::mutex sendMutex;
+    std::condition_variable sendDrained;   // signalled as the ring empties below the limit
+    ByteRing sendBuffer;
+    std::atomic<size_t> sendQueued{0};
+    std::atomic<int64_t> sendProgress{0};  // when the ring last went non-empty or the socket took bytes
+
+    std::mutex interestMutex;
+    int interest = 0;
+
+    RpcConnection(int s, const std::string &addr) : sock(s), address(addr) {}
+    ~RpcConnection() { closeSocket(sock); }
+};
+typedef std::shared_ptr<RpcConnection> RpcConnRef;
+
+struct HttpRequest {
+    std::string method;
+    std::string target;
+    bool keepAlive = true;
+    std::string authorization;   // as sent, not lowercased
+    std::string contentType;     // media type only, lowercased
+    std::string body;
+};
+
+static int64_t steadySeconds() {
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static const char *httpStatusText(int status) {
+    switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 413: return "Payload Too Large";
+    case 415: return "Unsupported Media Type";
+    case 431: return "Request Header Fields Too Large";
+    case 501: return "Not Implemented";
+    case 503: return "Service Unavailable";
+    default: return "Error";
+    }
+}
+
+static int base64DigitValue(char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+static bool decodeBase64(const std::string &text, std::string &out) {
+    out.clear();
+    uint32_t bits = 0;
+    int count = 0;
+    size_t end = text.find_last_not_of('=') + 1;
+    if (text.size() % 4 || text.size() - end > 2) return false;
+    for (size_t i = 0; i < end; i++) {
+        int v = base64DigitValue(text[i]);
+        if (v < 0) return false;
+        bits = (bits << 6) | static_cast<uint32_t>(v);
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            out.push_back(static_cast<char>((bits >> count) & 0xff));
+        }
+    }
+    return true;
+}
+
+static std::string httpHeader(int status, bool keepAlive, const std::string &contentType, const std::string &lengthHeader) {
+    std::string out = "HTTP/1.1 " + std::to_string(status) + " " + httpStatusText(status) + "\r\n";
+    out += "Content-Type: " + contentType + "\r\n";
+    if (!keepAlive) out += "Connection: close\r\n";
+    out += lengthHeader + "\r\n\r\n";
+    return out;
+}
+
+class RpcResponseWriter;
+
+class RpcServer {
+public:
+    // Listen on bindAddress:port and start the I/O thread and the workers.
+    // Requests must authenticate as `credentials` ("user:password").
+    bool start(const std::string &bindAddress, uint16_t port, unsigned threads, size_t queueLimit,
+               const std::string &credentials) {
+        expectedCredentials = credentials;
+        workQueueLimit = std::max<size_t>(1, queueLimit);
+        listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenSocket < 0) {
+            std::cerr << "[RPC] Could not create socket" << std::endl;
+            return false;
+        }
+        sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        int optval = 1;
+        setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&optval), sizeof(optval));
+        if (inet_pton(AF_INET, bindAddress.c_str(), &addr.sin_addr) != 1
+            || bind(listenSocket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0
+            || listen(listenSocket, SOMAXCONN) < 0 || !setNonBlocking(listenSocket)) {
+            std::cerr << "[RPC] Failed to listen on " << bindAddress << ":" << port << std::endl;
+            closeSocket(listenSocket);
+            listenSocket = -1;
+            return false;
+        }
+        workers.reset(new ThreadPool(std::max(1u, threads)));
+        poller.add(listenSocket, Poller::Read, &listenSocket);
+        std::thread(&RpcServer::ioLoop, this).detach();
+        std::cout << "[RPC] Listening on " << bindAddress << ":" << port << " (" << workers->size()
+                  << " threads, work queue " << workQueueLimit << ")" << std::endl;
+        return true;
+    }
+
+    // Queue bytes of the current response; false once the client is gone
+    bool send(RpcConnection &conn, const std::string &data) {
+        {
+            std::lock_guard<std::mutex> lock(conn.sendMutex);
+            if (conn.failed) return false;
+            if (conn.sendBuffer.empty()) conn.sendProgress = steadySeconds();
+            conn.sendBuffer.write(data.data(), data.size());
+            conn.sendQueued = conn.sendBuffer.size();
+        }
+        updateInterest(conn);
+        return true;
+    }
+
+    // Block the worker while the client is slow to read (closeIdle fails the
+    // connection if it stops reading altogether)
+    void waitForRoom(RpcConnection &conn) {
+        std::unique_lock<std::mutex> lock(conn.sendMutex);
+        conn.sendDrained.wait(lock, [&conn]() { return conn.failed || conn.sendBuffer.size() <= kRpcSendBufferLimit; });
+    }
+
+    // Queue the last bytes of the response and hand the connection back to the
+    // I/O thread in one step, so it neither parses the next request early nor
+    // misses that it may
+    void finish(RpcConnection &conn, const std::string &data, bool keepAlive) {
+        {
+            std::lock_guard<std::mutex> lock(conn.sendMutex);
+            if (!keepAlive) conn.closeAfterSend = true;
+            if (!conn.failed) {
+                if (conn.sendBuffer.empty()) conn.sendProgress = steadySeconds();
+                conn.sendBuffer.write(data.data(), data.size());
+                conn.sendQueued = conn.sendBuffer.size();
+            }
+            conn.busy = false;
+        }
+        updateInterest(conn);
+    }
+
+private:
+    // Reads unless a worker has the connection (or it is closing); writes
+    // while anything is queued
+    void updateInterest(RpcConnection &conn) {
+        std::lock_guard<std::mutex> lock(conn.interestMutex);
+        if (conn.failed) return;
+        int interest = (conn.busy || conn.closeAfterSend ? 0 : Poller::Read) | (conn.sendQueued > 0 ? Poller::Write : 0);
+        if (interest != conn.interest) {
+            conn.interest = interest;
+            poller.modify(conn.sock, interest, &conn);
+        }
+    }
+
+    void ioLoop() {
+        std::vector<Poller::Event> events;
+        int64_t lastSweep = steadySeconds();
+        while (true) {
+            poller.wait(events, 1000);
+            int64_t now = steadySeconds();
+            for (auto &ev : events) {
+                if (ev.tag == &listenSocket) {
+                    acceptConnections(now);
+                    continue;
+                }
+                auto it = connections.find(static_cast<RpcConnection*>(ev.tag));
+                if (it == connections.end()) continue;
+                RpcConnRef conn = it->second;
+                if (!conn->failed && (ev.readable || ev.error)) readFrom(*conn, now);
+                if (!conn->failed && ev.writable) writeTo(*conn, now);
+                if (conn->failed) closeConnection(*conn);
+            }
+            if (now != lastSweep) {
+                lastSweep = now;
+                closeIdle(now);
+            }
+        }
+    }
+
+    void acceptConnections(int64_t now) {
+        while (true) {
+            sockaddr_in clientAddr;
+            socklen_t addrLen = sizeof(clientAddr);
+            int sock = accept(listenSocket, reinterpret_cast<sockaddr*>(&clientAddr), &addrLen);
+            if (sock < 0) return;
+            if (connections.size() >= kRpcMaxConnections || !setNonBlocking(sock)) {
+                closeSocket(sock);
+                continue;
+            }
+            int optval = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&optval), sizeof(optval));
+            char ip[INET_ADDRSTRLEN] = {0};
+            inet_ntop(AF_INET, &clientAddr.sin_addr, ip, sizeof(ip));
+            RpcConnRef conn = std::make_shared<RpcConnection>(sock, std::string(ip) + ":" + std::to_string(ntohs(clientAddr.sin_port)));
+            conn->lastActive = now;
+            conn->interest = Poller::Read;
+            connections[conn.get()] = conn;
+            poller.add(sock, Poller::Read, conn.get());
+        }
+    }
+
+    void closeConnection(RpcConnection &conn) {
+        if (conn.closed) return;
+        conn.closed = true;
+        {
+            std::lock_guard<std::mutex> lock(conn.sendMutex);
+            conn.failed = true;
+        }
+        conn.sendDrained.notify_all();
+        poller.remove(conn.sock);
+        shutdown(conn.sock, SHUT_RDWR);
+        // A worker still answering keeps the connection (and socket) alive until it is done
+        connections.erase(&conn);
+    }
+
+    // Connections that have sat without a request for kRpcIdleTimeoutSecs, and
+    // ones whose client has read none of a queued response for
+    // kRpcSendTimeoutSecs (busy or not)
+    void closeIdle(int64_t now) {
+        std::vector<RpcConnection*> idle;
+        for (auto &c : connections) {
+            RpcConnection &conn = *c.second;
+            bool quiet = !conn.busy && conn.sendQueued == 0 && now - conn.lastActive > kRpcIdleTimeoutSecs;
+            bool stalled = conn.sendQueued > 0 && now - conn.sendProgress > kRpcSendTimeoutSecs;
+            if (stalled) std::cout << "[RPC] Dropping " << conn.address << ": response not read for " << kRpcSendTimeoutSecs << "s" << std::endl;
+            if (quiet || stalled) idle.push_back(&conn);
+        }
+        for (RpcConnection *conn : idle) {
+            closeConnection(*conn);
+        }
+    }
+
+    void readFrom(RpcConnection &conn, int64_t now) {
+        char buf[16 * 1024];
+        size_t total = 0;
+        while (total < kRpcMaxReadPerEvent) {
+            int n = recv(conn.sock, buf, sizeof(buf), 0);
+            if (n == 0 || (n < 0 && !socketWouldBlock())) {
+                conn.failed = true;
+                return;
+            }
+            if (n < 0) break;
+            conn.recvBuffer.append(buf, static_cast<size_t>(n));
+            total += static_cast<size_t>(n);
+            if (conn.recvBuffer.size() > kRpcMaxHeaderBytes + kRpcMaxBodyBytes) break; // parse rejects it
+        }
+        conn.lastActive = now;
+        if (!conn.busy) processRequests(conn);
+    }
+
+    void writeTo(RpcConnection &conn, int64_t now) {
+        bool idle;
+        {
+            std::lock_guard<std::mutex> lock(conn.sendMutex);
+            while (!conn.sendBuffer.empty()) {
+                long sent = sendFromRing(conn.sock, conn.sendBuffer);
+                if (sent < 0) {
+                    conn.failed = true;
+                    break;
+                }
+                if (sent == 0) break;
+                conn.sendBuffer.consume(static_cast<size_t>(sent));
+                conn.sendProgress = now;
+            }
+            conn.sendQueued = conn.sendBuffer.size();
+            idle = !conn.busy && conn.sendBuffer.empty();
+        }
+        conn.sendDrained.notify_all();
+        if (conn.failed) return;
+        conn.lastActive = now;
+        if (idle && conn.closeAfterSend) {
+            conn.failed = true;
+            return;
+        }
+        updateInterest(conn);
+        // A request pipelined behind the one just answered
+        if (idle && !conn.recvBuffer.empty()) processRequests(conn);
+    }
+
+    enum ParseResult { Incomplete, Ready, Invalid };
+
+    // Take one request off the front of recvBuffer. On Invalid, `status` is the
+    // HTTP error to answer with before closing.
+    ParseResult parseRequest(RpcConnection &conn, HttpRequest &req, int &status) {
+        std::string &buf = conn.recvBuffer;
+        size_t headerEnd = buf.find("\r\n\r\n");
+        if (headerEnd == std::string::npos) {
+            status = 431;
+            return buf.size() > kRpcMaxHeaderBytes ? Invalid : Incomplete;
+        }
+        if (headerEnd > kRpcMaxHeaderBytes) {
+            status = 431;
+            return Invalid;
+        }
+        status = 400;
+        size_t lineEnd = buf.find("\r\n");
+        std::string requestLine = buf.substr(0, lineEnd);
+        size_t sp1 = requestLine.find(' ');
+        size_t sp2 = requestLine.rfind(' ');
+        if (sp1 == std::string::npos || sp2 == sp1) return Invalid;
+        req.method = requestLine.substr(0, sp1);
+        req.target = requestLine.substr(sp1 + 1, sp2 - sp1 - 1);
+        std::string version = requestLine.substr(sp2 + 1);
+        if (version != "HTTP/1.1" && version != "HTTP/1.0") return Invalid;
+        req.keepAlive = version == "HTTP/1.1";
+
+        size_t contentLength = 0;
+        bool expectContinue = false;
+        size_t pos = lineEnd + 2;
+        while (pos < headerEnd) {
+            size_t end = buf.find("\r\n", pos);
+            std::string line = buf.substr(pos, end - pos);
+            pos = end + 2;
+            size_t colon = line.find(':');
+            if (colon == std::string::npos) return Invalid;
+            std::string name = line.substr(0, colon);
+            std::string value = line.substr(colon + 1);
+            value.erase(0, value.find_first_not_of(" \t"));
+            value.erase(value.find_last_not_of(" \t") + 1);
+            for (auto &c : name) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            if (name == "authorization") req.authorization = value;
+            for (auto &c : value) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            if (name == "content-type") {
+                req.contentType = value.substr(0, value.find(';'));
+                req.contentType.erase(req.contentType.find_last_not_of(" \t") + 1);
+            } else if (name == "content-length") {
+                if (value.empty() || value.size() > 10 || value.find_first_not_of("0123456789") != std::string::npos) return Invalid;
+                contentLength = static_cast<size_t>(std::stoull(value));
+                if (contentLength > kRpcMaxBodyBytes) {
+                    status = 413;
+                    return Invalid;
+                }
+            } else if (name == "transfer-encoding" && value != "identity") {
+                status = 501; // chunked request bodies aren't supported
+                return Invalid;
+            } else if (name == "connection") {
+                if (value.find("close") != std::string::npos) req.keepAlive = false;
+                else if (value.find("keep-alive") != std::string::npos) req.keepAlive = true;
+            } else if (name == "expect" && value == "100-continue") {
+                expectContinue = true;
+            }
+        }
+        size_t bodyStart = headerEnd + 4;
+        if (buf.size() - bodyStart < contentLength) {
+            // curl waits a second for this before sending bigger bodies
+            if (expectContinue && !conn.continueSent) {
+                conn.continueSent = true;
+                send(conn, "HTTP/1.1 100 Continue\r\n\r\n");
+            }
+            return Incomplete;
+        }
+        req.body = buf.substr(bodyStart, contentLength);
+        buf.erase(0, bodyStart + contentLength);
+        conn.continueSent = false;
+        return Ready;
+    }
+
+    // Answer a request without a worker
+    void respondNow(RpcConnection &conn, int status, bool keepAlive, const std::string &message,
+                    const std::string &extraHeaders = "") {
+        std::string body = message + "\n";
+        if (!keepAlive) conn.closeAfterSend = true;
+        send(conn, httpHeader(status, keepAlive, "text/plain", extraHeaders + "Content-Length: " + std::to_string(body.size())) + body);
+    }
+
+    // "Basic <base64 of user:password>" matching the configured credentials
+    bool authorized(const HttpRequest &req) const {
+        std::string credentials;
+        if (req.authorization.compare(0, 6, "Basic ") != 0 || !decodeBase64(req.authorization.substr(6), credentials)) return false;
+        return credentials.size() == expectedCredentials.size()
+            && CRYPTO_memcmp(credentials.data(), expectedCredentials.data(), credentials.size()) == 0;
+    }
+
+    // Parse and dispatch requests until one goes to a worker or no complete
+    // request is left (I/O thread, connection not busy)
+    void processRequests(RpcConnection &conn) {
+        while (!conn.failed && !conn.busy && !conn.closeAfterSend) {
+            HttpRequest req;
+            int status = 0;
+            ParseResult result = parseRequest(conn, req, status);
+            if (result == Incomplete) return;
+            if (result == Invalid) {
+                respondNow(conn, status, false, httpStatusText(status));
+                return;
+            }
+            if (req.method != "POST") {
+                respondNow(conn, 405, req.keepAlive, "JSON-RPC server handles only POST requests");
+                continue;
+            }
+            if (req.target != "/") {
+                respondNow(conn, 404, req.keepAlive, "Not found");
+                continue;
+            }
+            if (!authorized(req)) {
+                std::cout << "[RPC] Incorrect credentials from " << conn.address << std::endl;
+                respondNow(conn, 401, req.keepAlive, "Authorization required", "WWW-Authenticate: Basic realm=\"jsonrpc\"\r\n");
+                continue;
+            }
+            if (req.contentType != "application/json") {
+                respondNow(conn, 415, req.keepAlive, "Content-Type must be application/json");
+                continue;
+            }
+            if (workers->queueDepth() >= workQueueLimit) {
+                respondNow(conn, 503, req.keepAlive, "Work queue depth exceeded");
+                continue;
+            }
+            conn.busy = true;
+            updateInterest(conn);
+            RpcConnRef ref = connections[&conn];
+            bool keepAlive = req.keepAlive;
+            std::string body = std::move(req.body);
+            workers->submit([this, ref, body, keepAlive]() { handleRequest(ref, body, keepAlive); });
+        }
+    }
+
+    void handleRequest(const RpcConnRef &conn, const std::string &body, bool keepAlive);
+
+    Poller poller;
+    int listenSocket = -1;
+    std::unique_ptr<ThreadPool> workers;
+    size_t workQueueLimit = 16;
+    std::string expectedCredentials;
+    std::unordered_map<RpcConnection*, RpcConnRef> connections; // I/O thread only
+};
+
+// Builds one HTTP response body on a worker. Output is buffered up to
+// kRpcChunkBytes; past that it goes out as chunks while the rest is produced.
+class RpcResponseWriter {
+public:
+    RpcResponseWriter(RpcServer &server, const RpcConnRef &conn, bool keepAlive)
+        : server(server), conn(conn), keepAlive(keepAlive) {}
+
+    // False once the client has gone away; long results stop early
+    bool ok() const {
+        return !conn->failed;
+    }
+
+    void write(const std::string &text) {
+        pending += text;
+        if (pending.size() >= kRpcChunkBytes) flushChunk();
+    }
+
+    // Send the rest; the connection goes back to the I/O thread
+    void finish() {
+        std::string out;
+        if (!chunked) {
+            out = httpHeader(200, keepAlive, "application/json", "Content-Length: " + std::to_string(pending.size() + 1));
+            out += pending + "\n";
+        } else {
+            pending += "\n";
+            out = chunkOf(pending) + "0\r\n\r\n";
+        }
+        pending.clear();
+        server.finish(*conn, out, keepAlive);
+    }
+
+private:
+    static std::string chunkOf(const std::string &data) {
+        char size[20];
+        std::snprintf(size, sizeof(size), "%zx\r\n", data.size());
+        return size + data + "\r\n";
+    }
+
+    void flushChunk() {
+        std::string out;
+        if (!chunked) {
+            chunked = true;
+            out = httpHeader(200, keepAlive, "application/json", "Transfer-Encoding: chunked");
+        }
+        out += chunkOf(pending);
+        pending.clear();
+        if (server.send(*conn, out)) server.waitForRoom(*conn);
+    }
+
+    RpcServer &server;
+    RpcConnRef conn;
+    bool keepAlive;
+    bool chunked = false;
+    std::string pending;
+};
+
+// ------------------- METHODS -------------------
+
+// What a method returns: a value, or for big results a function that writes
+// the result's JSON text piece by piece. Methods do everything that can fail
+// before returning, so a streamed result never has to turn into an error.
+struct RpcResult {
+    Json::Value value;
+    std::function<void(RpcResponseWriter&)> stream;
+    int errorCode = 0;
+    std::string errorMessage;
+};
+
+typedef bool (*RpcMethod)(const Json::Value &params, RpcResult &result);
+
+static bool rpcError(RpcResult &result, int code, const std::string &message) {
+    result.errorCode = code;
+    result.errorMessage = message;
+    return false;
+}
+
+static bool paramHash(const Json::Value &params, Json::ArrayIndex i, uint256 &out, RpcResult &result) {
+    if (params.size() <= i || !params[i].isString() || !out.setHex(params[i].asString())) {
+        return rpcError(result, kRpcInvalidParameter, "parameter " + std::to_string(i + 1) + " must be a 64-character hex hash");
+    }
+    return true;
+}
+
+static bool paramUInt(const Json::Value &params, Json::ArrayIndex i, uint64_t &out, RpcResult &result) {
+    if (params.size() <= i || !params[i].isUInt64()) {
+        return rpcError(result, kRpcInvalidParameter, "parameter " + std::to_string(i + 1) + " must be a non-negative integer");
+    }
+    out = params[i].asUInt64();
+    return true;
+}
+
+// Optional boolean (or 0/1 verbosity) with a default
+static bool paramBool(const Json::Value &params, Json::ArrayIndex i, bool fallback) {
+    if (params.size() <= i || params[i].isNull()) return fallback;
+    if (params[i].isBool()) return params[i].asBool();
+    if (params[i].isUInt64()) return params[i].asUInt64() != 0;
+    return params[i].isInt64() && params[i].asInt64() != 0;
+}
+
+// Confirmations of a block at `height` as of `snapshot` (-1: not on the active chain)
+static Json::Value blockHeaderJson(const BlockHeader &header, const uint256 &hash, uint64_t height,
+                                   const ChainSnapshot &snapshot) {
+    const BlockIndex *active = height <= snapshot.height ? snapshot.tipIndex->getAncestor(static_cast<uint32_t>(height)) : nullptr;
+    bool onChain = active && active->hash == hash;
+    Json::Value out(Json::objectValue);
+    out["hash"] = hash.toHex();
+    out["confirmations"] = onChain ? Json::Value(Json::UInt64(snapshot.height - height + 1)) : Json::Value(-1);
+    out["height"] = Json::UInt64(height);
+    out["version"] = header.version;
+    out["merkleroot"] = header.merkleRoot.toHex();
+    out["time"] = header.timestamp;
+    out["bits"] = header.difficultyTarget;
+    out["nonce"] = header.nonce;
+    if (height > 0) out["previousblockhash"] = header.prevBlockHash.toHex();
+    if (onChain && height < snapshot.height) {
+        out["nextblockhash"] = snapshot.tipIndex->getAncestor(static_cast<uint32_t>(height + 1))->hash.toHex();
+    }
+    return out;
+}
+
+static Json::Value transactionJson(const Transaction &tx) {
+    Json::Value out(Json::objectValue);
+    out["txid"] = tx.getTxId().toHex();
+    out["size"] = Json::UInt64(tx.getSerializedSize());
+    out["version"] = tx.version;
+    out["locktime"] = tx.lockTime;
+    Json::Value vin(Json::arrayValue);
+    for (auto &in : tx.inputs) {
+        Json::Value input(Json::objectValue);
+        if (tx.isCoinbase()) {
+            input["coinbase"] = encodeHex(in.signature);
+        } else {
+            input["txid"] = in.txid.toHex();
+            input["vout"] = in.index;
+            input["scriptSig"] = encodeHex(in.signature);
+        }
+        vin.append(input);
+    }
+    out["vin"] = vin;
+    Json::Value vout(Json::arrayValue);
+    for (size_t i = 0; i < tx.outputs.size(); i++) {
+        Json::Value output(Json::objectValue);
+        output["value"] = Json::UInt64(tx.outputs[i].amount);
+        output["n"] = Json::UInt64(i);
+        output["pubKeyHash"] = tx.outputs[i].pubKeyHash.toHex();
+        vout.append(output);
+    }
+    out["vout"] = vout;
+    return out;
+}
+
+// Hex, written a piece at a time
+static void streamHex(RpcResponseWriter &out, const std::string &data) {
+    out.write("\"");
+    for (size_t pos = 0; pos < data.size() && out.ok(); pos += kRpcChunkBytes / 2) {
+        out.write(encodeHex(reinterpret_cast<const unsigned char*>(data.data()) + pos, std::min(kRpcChunkBytes / 2, data.size() - pos)));
+    }
+    out.write("\"");
+}
+
+static bool rpcGetBlockCount(const Json::Value &, RpcResult &result) {
+    result.value = Json::UInt64(getBlockchain()->getSnapshot()->height);
+    return true;
+}
+
+static bool rpcGetBestBlockHash(const Json::Value &, RpcResult &result) {
+    result.value = getBlockchain()->getSnapshot()->tipHash.toHex();
+    return true;
+}
+
+static bool rpcGetBlockchainInfo(const Json::Value &, RpcResult &result) {
+    ChainSnapshotRef snapshot = getBlockchain()->getSnapshot();
+    result.value["blocks"] = Json::UInt64(snapshot->height);
+    result.value["bestblockhash"] = snapshot->tipHash.toHex();
+    result.value["chainwork"] = Json::UInt64(snapshot->tipIndex->chainWork);
+    result.value["utxos"] = Json::UInt64(snapshot->utxos.size());
+    return true;
+}
+
+static bool rpcGetBlockHash(const Json::Value &params, RpcResult &result) {
+    uint64_t height;
+    if (!paramUInt(params, 0, height, result)) return false;
+    ChainSnapshotRef snapshot = getBlockchain()->getSnapshot();
+    if (height > snapshot->height) return rpcError(result, kRpcInvalidParameter, "Block height out of range");
+    result.value = snapshot->tipIndex->getAncestor(static_cast<uint32_t>(height))->hash.toHex();
+    return true;
+}
+
+static bool rpcGetBlockHeader(const Json::Value &params, RpcResult &result) {
+    uint256 hash;
+    if (!paramHash(params, 0, hash, result)) return false;
+    BlockHeader header;
+    uint64_t height;
+    if (!getBlockchain()->getBlockHeaderByHash(hash, header, height)) return rpcError(result, kRpcNotFound, "Block not found");
+    result.value = blockHeaderJson(header, hash, height, *getBlockchain()->getSnapshot());
+    return true;
+}
+
+// getblock hash [verbosity]: 0 = hex, 1 = with txids (default), 2 = with transactions
+static bool rpcGetBlock(const Json::Value &params, RpcResult &result) {
+    uint256 hash;
+    if (!paramHash(params, 0, hash, result)) return false;
+    uint64_t verbosity = 1;
+    if (params.size() > 1 && params[1].isBool()) verbosity = params[1].asBool() ? 1 : 0;
+    else if (params.size() > 1 && !paramUInt(params, 1, verbosity, result)) return false;
+    Blockchain *chain = getBlockchain();
+    auto block = std::make_shared<Block>();
+    BlockHeader header;
+    uint64_t height;
+    if (!chain->getBlockHeaderByHash(hash, header, height) || !chain->getBlockByHash(hash, *block)) {
+        return rpcError(result, kRpcNotFound, "Block not found");
+    }
+    if (verbosity == 0) {
+        auto raw = std::make_shared<std::string>();
+        block->serialize(*raw);
+        result.stream = [raw](RpcResponseWriter &out) { streamHex(out, *raw); };
+        return true;
+    }
+    Json::Value fields = blockHeaderJson(header, hash, height, *chain->getSnapshot());
+    fields["ntx"] = Json::UInt64(block->getTransactions().size());
+    bool full = verbosity >= 2;
+    result.stream = [block, fields, full](RpcResponseWriter &out) {
+        // The header fields, then the transactions one at a time
+        std::string head = toJson(fields);
+        head.pop_back(); // the closing brace
+        out.write(head + ",\"tx\":[");
+        for (size_t i = 0; i < block->getTransactions().size() && out.ok(); i++) {
+            if (i) out.write(",");
+            const Transaction &tx = *block->getTransactions()[i];
+            out.write(full ? toJson(transactionJson(tx)) : "\"" + tx.getTxId().toHex() + "\"");
+        }
+        out.write("]}");
+    };
+    return true;
+}
+
+// gettxout txid n [include_mempool]: the unspent output, or null. With the
+// mempool (default), outputs it spends are null and outputs it creates count.
+static bool rpcGetTxOut(const Json::Value &params, RpcResult &result) {
+    uint256 txid;
+    uint64_t index;
+    if (!paramHash(params, 0, txid, result) || !paramUInt(params, 1, index, result)) return false;
+    if (index > UINT32_MAX) return rpcError(result, kRpcInvalidParameter, "Output index out of range");
+    bool includeMempool = paramBool(params, 2, true);
+    Blockchain *chain = getBlockchain();
+    Mempool &mempool = chain->getMempool();
+    ChainSnapshotRef snapshot = chain->getSnapshot();
+    OutPoint key(txid, static_cast<uint32_t>(index));
+    UTXO coin;
+    bool confirmed = snapshot->utxos.find(key, coin);
+    if (!confirmed && includeMempool) {
+        TransactionRef tx = mempool.get(txid);
+        if (!tx || index >= tx->outputs.size()) return true; // null
+        coin = UTXO{tx->outputs[index].amount, tx->outputs[index].pubKeyHash};
+    } else if (!confirmed) {
+        return true;
+    }
+    if (includeMempool && mempool.isSpent(key)) return true;
+    result.value["bestblock"] = snapshot->tipHash.toHex();
+    result.value["confirmed"] = confirmed;
+    result.value["value"] = Json::UInt64(coin.amount);
+    result.value["pubKeyHash"] = coin.pubKeyHash.toHex();
+    return true;
+}
+
+static bool rpcGetMempoolInfo(const Json::Value &, RpcResult &result) {
+    Mempool &mempool = getBlockchain()->getMempool();
+    result.value["size"] = Json::UInt64(mempool.size());
+    result.value["usage"] = Json::UInt64(mempool.memoryUsage());
+    return true;
+}
+
+static bool rpcGetRawMempool(const Json::Value &, RpcResult &result) {
+    auto txids = std::make_shared<std::vector<uint256>>();
+    getBlockchain()->getMempool().forEachTransaction([&txids](const TransactionRef &tx) {
+        txids->push_back(tx->getTxId());
+    });
+    result.stream = [txids](RpcResponseWriter &out) {
+        out.write("[");
+        for (size_t i = 0; i < txids->size() && out.ok(); i++) {
+            out.write((i ? ",\"" : "\"") + (*txids)[i].toHex() + "\"");
+        }
+        out.write("]");
+    };
+    return true;
+}
+
+// getrawtransaction txid [verbose]: mempool transactions only (there is no tx index)
+static bool rpcGetRawTransaction(const Json::Value &params, RpcResult &result) {
+    uint256 txid;
+    if (!paramHash(params, 0, txid, result)) return false;
+    TransactionRef tx = getBlockchain()->getMempool().get(txid);
+    if (!tx) return rpcError(result, kRpcNotFound, "No such mempool transaction");
+    if (paramBool(params, 1, false)) {
+        result.value = transactionJson(*tx);
+    } else {
+        std::string raw;
+        tx->serialize(raw);
+        result.value = encodeHex(raw);
+    }
+    return true;
+}
+
+static bool rpcSendRawTransaction(const Json::Value &params, RpcResult &result) {
+    std::string raw;
+    if (params.size() < 1 || !params[0].isString() || !decodeHex(params[0].asString(), raw)) {
+        return rpcError(result, kRpcInvalidParameter, "parameter 1 must be a hex string");
+    }
+    TransactionRef tx = deserializeTxMessage(reinterpret_cast<const unsigned char*>(raw.data()), raw.size());
+    if (!tx) return rpcError(result, kRpcDeserializationError, "TX decode failed");
+    Blockchain *chain = getBlockchain();
+    std::string reason;
+    // Accepted transactions are relayed by the P2P layer's listener
+    if (!chain->getMempool().contains(tx->getTxId()) && !chain->acceptTransaction(tx, reason)) {
+        return rpcError(result, kRpcVerifyRejected, reason);
+    }
+    result.value = tx->getTxId().toHex();
+    return true;
+}
+
+static const std::map<std::string, RpcMethod> &rpcMethods() {
+    static const std::map<std::string, RpcMethod> methods = {
+        {"getblockcount", rpcGetBlockCount},
+        {"getbestblockhash", rpcGetBestBlockHash},
+        {"getblockchaininfo", rpcGetBlockchainInfo},
+        {"getblockhash", rpcGetBlockHash},
+        {"getblockheader", rpcGetBlockHeader},
+        {"getblock", rpcGetBlock},
+        {"gettxout", rpcGetTxOut},
+        {"getmempoolinfo", rpcGetMempoolInfo},
+        {"getrawmempool", rpcGetRawMempool},
+        {"getrawtransaction", rpcGetRawTransaction},
+        {"sendrawtransaction", rpcSendRawTransaction},
+    };
+    return methods;
+}
+
+// One call of a request or batch, answered as {"result", "error", "id"}
+static void handleRpcCall(const Json::Value &call, RpcResponseWriter &out) {
+    Json::Value id;
+    RpcResult result;
+    bool ok = false;
+    if (!call.isObject()) {
+        rpcError(result, kRpcInvalidRequest, "Invalid request object");
+    } else {
+        id = call.get("id", Json::Value());
+        const Json::Value &method = call["method"];
+        const Json::Value &params = call.isMember("params") ? call["params"] : Json::Value(Json::arrayValue);
+        auto it = method.isString() ? rpcMethods().find(method.asString()) : rpcMethods().end();
+        if (!method.isString()) {
+            rpcError(result, kRpcInvalidRequest, "Method must be a string");
+        } else if (it == rpcMethods().end()) {
+            rpcError(result, kRpcMethodNotFound, "Method not found");
+        } else if (!params.isArray()) {
+            rpcError(result, kRpcInvalidParams, "Params must be an array");
+        } else {
+            // Nothing a method throws on (a parameter it didn't check) may reach the worker
+            try {
+                ok = it->second(params, result);
+            } catch (const std::exception &e) {
+                ok = rpcError(result, kRpcInternalError, std::string("Internal error: ") + e.what());
+            }
+        }
+    }
+    if (!ok) {
+        Json::Value error(Json::objectValue);
+        error["code"] = result.errorCode;
+        error["message"] = result.errorMessage;
+        out.write("{\"result\":null,\"error\":" + toJson(error) + ",\"id\":" + toJson(id) + "}");
+        return;
+    }
+    out.write("{\"result\":");
+    if (result.stream) result.stream(out);
+    else out.write(toJson(result.value));
+    out.write(",\"error\":null,\"id\":" + toJson(id) + "}");
+}
+
+void RpcServer::handleRequest(const RpcConnRef &conn, const std::string &body, bool keepAlive) {
+    RpcResponseWriter out(*this, conn, keepAlive);
+    Json::Value request;
+    if (!parseJson(body, request)) {
+        out.write("{\"result\":null,\"error\":{\"code\":" + std::to_string(kRpcParseError)
+                  + ",\"message\":\"Parse error\"},\"id\":null}");
+    } else if (request.isArray() && !request.empty()) {
+        out.write("[");
+        for (Json::ArrayIndex i = 0; i < request.size() && out.ok(); i++) {
+            if (i) out.write(",");
+            handleRpcCall(request[i], out);
+        }
+        out.write("]");
+    } else {
+        handleRpcCall(request.isArray() ? Json::Value() : request, out); // an empty batch is invalid
+    }
+    out.finish();
+}
+
+static RpcServer g_rpcServer;
+
+// __cookie__:<random password>, written to `path` for clients on this machine
+static bool writeRpcCookie(const std::string &path, std::string &credentials) {
+    unsigned char secret[32];
+    if (RAND_bytes(secret, sizeof(secret)) != 1) {
+        std::cerr << "[RPC] Could not generate the cookie" << std::endl;
+        return false;
+    }
+    credentials = "__cookie__:" + encodeHex(secret, sizeof(secret));
+    std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            std::cerr << "[RPC] Could not write " << tmpPath << std::endl;
+            return false;
+        }
+        std::error_code ec;
+        std::filesystem::permissions(tmpPath, std::filesystem::perms::owner_read | std::filesystem::perms::owner_write,
+                                     std::filesystem::perm_options::replace, ec);
+        out << credentials;
+        if (!out.flush()) {
+            std::cerr << "[RPC] Could not write " << tmpPath << std::endl;
+            return false;
+        }
+    }
+    if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::cerr << "[RPC] Could not write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Start the JSON-RPC server (needs the chain to be initialized)
+void startRPC() {
+    Json::Value cfg = loadConfig("config.json");
+    uint16_t port = cfg.get("rpcPort", 8332).asUInt();
+    std::string bindAddress = cfg.get("rpcBind", "127.0.0.1").asString();
+    unsigned threads = cfg.get("rpcThreads", 4).asUInt();
+    size_t workQueue = cfg.get("rpcWorkQueue", 16).asUInt();
+    std::string user = cfg.get("rpcUser", "").asString();
+    std::string password = cfg.get("rpcPassword", "").asString();
+    std::string credentials;
+    if (!user.empty() && !password.empty()) {
+        credentials = user + ":" + password;
+    } else {
+        std::string dataDir = cfg.get("dataDir", "data").asString();
+        ensureDirectory(dataDir);
+        if (!writeRpcCookie(dataDir + "/.cookie", credentials)) {
+            std::cerr << "[RPC] Not starting: set rpcUser and rpcPassword or make " << dataDir << " writable" << std::endl;
+            return;
+        }
+        std::cout << "[RPC] Authentication cookie written to " << dataDir << "/.cookie" << std::endl;
+    }
+    g_rpcServer.start(bindAddress, port, threads, workQueue, credentials);
+}
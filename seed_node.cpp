@@ -6,6 +6,10 @@
 int main_seedNode() {
     std::cout << "[Seed Node] Starting seed node..." << std::endl;
     initBlockchain();  // if you want it also to hold the blockchain
+    // Hand out addresses from the address manager and only dial out to collect
+    // more; nodes hang up once they have our list, so they spread over the
+    // network instead of all staying connected here
+    g_seedMode = true;
     startP2P();
     // Keep running
     while(true) {
@@ -0,0 +1,455 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+  #define SHA256_X86_BACKENDS 1
+  #include <immintrin.h>
+  #include <cpuid.h>
+#endif
+
+// Scalar SHA-256 compression (FIPS 180-4).
+// One-shot hashing of whole messages still goes through OpenSSL; this is for the
+// places that need the internal state, e.g. reusing a midstate across nonces.
+
+static const uint32_t kSha256Init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t kSha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t sha256Rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+static inline uint32_t readBE32(const unsigned char *p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+static inline void writeBE32(unsigned char *p, uint32_t v) {
+    p[0] = static_cast<unsigned char>(v >> 24);
+    p[1] = static_cast<unsigned char>(v >> 16);
+    p[2] = static_cast<unsigned char>(v >> 8);
+    p[3] = static_cast<unsigned char>(v);
+}
+
+// Compress one 64-byte chunk into `state`
+static void sha256Transform(uint32_t state[8], const unsigned char *chunk) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = readBE32(chunk + 4 * i);
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = sha256Rotr(w[i - 15], 7) ^ sha256Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = sha256Rotr(w[i - 2], 17) ^ sha256Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t S1 = sha256Rotr(e, 6) ^ sha256Rotr(e, 11) ^ sha256Rotr(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + S1 + ch + kSha256K[i] + w[i];
+        uint32_t S0 = sha256Rotr(a, 2) ^ sha256Rotr(a, 13) ^ sha256Rotr(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = S0 + maj;
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+// SHA-256 state after absorbing a whole number of 64-byte chunks
+struct Sha256Midstate {
+    uint32_t state[8];
+    uint64_t bytes; // bytes absorbed so far (for the final length field)
+
+    Sha256Midstate() : bytes(0) {
+        std::memcpy(state, kSha256Init, sizeof(state));
+    }
+
+    void absorb(const unsigned char *chunk) {
+        sha256Transform(state, chunk);
+        bytes += 64;
+    }
+};
+
+// Prepare the padded final chunk for a message tail of `len` (< 56) bytes whose
+// total message length is `totalBytes`. Callers can then patch bytes inside the
+// tail (e.g. a nonce) and compress it repeatedly.
+static void sha256PadFinalChunk(unsigned char chunk[64], const unsigned char *tail, size_t len, uint64_t totalBytes) {
+    std::memset(chunk, 0, 64);
+    std::memcpy(chunk, tail, len);
+    chunk[len] = 0x80;
+    uint64_t bits = totalBytes * 8;
+    writeBE32(chunk + 56, static_cast<uint32_t>(bits >> 32));
+    writeBE32(chunk + 60, static_cast<uint32_t>(bits));
+}
+
+static inline void sha256StateToDigest(const uint32_t state[8], unsigned char out[32]) {
+    for (int i = 0; i < 8; i++) {
+        writeBE32(out + 4 * i, state[i]);
+    }
+}
+
+// ------------------- MULTI-BUFFER / SIMD BACKENDS -------------------
+// Many workloads hash lots of independent, equally sized messages: a batch of
+// nonces on the same header midstate, or every pair on one merkle tree level.
+// The lane kernels below compress 4/8/16 independent chunks at once, one message
+// per 32-bit vector lane; SHA-NI accelerates the single-buffer compression.
+// The implementation is chosen once at startup from CPUID, among the kernels
+// that pass a known-answer self-test, and must produce exactly the same output
+// as sha256Transform() above (test_sha256.cpp checks every one).
+
+struct Sha256Backend {
+    const char *name;
+    // Single-chunk compression
+    void (*transform)(uint32_t state[8], const unsigned char *chunk);
+    // Compresses exactly `lanes` independent (state, chunk) pairs; null if lanes == 1
+    void (*transformLanes)(uint32_t (*states)[8], const unsigned char *const *chunks);
+    size_t lanes;
+};
+
+#ifdef SHA256_X86_BACKENDS
+
+typedef uint32_t Sha256Vec4 __attribute__((vector_size(16)));
+typedef uint32_t Sha256Vec8 __attribute__((vector_size(32)));
+typedef uint32_t Sha256Vec16 __attribute__((vector_size(64)));
+
+// Lane-parallel SHA-256 written with GCC/Clang vector extensions. It is only ever
+// inlined into the target-specific wrappers below, which decide the instruction set.
+#define SHA256_VEC_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+template <typename V, int N>
+static inline __attribute__((always_inline))
+void sha256TransformLanesImpl(uint32_t (*states)[8], const unsigned char *const *chunks) {
+    V w[16];
+    for (int i = 0; i < 16; i++) {
+        for (int j = 0; j < N; j++) {
+            w[i][j] = readBE32(chunks[j] + 4 * i);
+        }
+    }
+    V s[8];
+    for (int k = 0; k < 8; k++) {
+        for (int j = 0; j < N; j++) {
+            s[k][j] = states[j][k];
+        }
+    }
+
+    V a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++) {
+        V wi;
+        if (i < 16) {
+            wi = w[i];
+        } else {
+            V w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+            V s0 = SHA256_VEC_ROTR(w15, 7) ^ SHA256_VEC_ROTR(w15, 18) ^ (w15 >> 3);
+            V s1 = SHA256_VEC_ROTR(w2, 17) ^ SHA256_VEC_ROTR(w2, 19) ^ (w2 >> 10);
+            wi = w[i & 15] + s0 + w[(i - 7) & 15] + s1;
+            w[i & 15] = wi;
+        }
+        V S1 = SHA256_VEC_ROTR(e, 6) ^ SHA256_VEC_ROTR(e, 11) ^ SHA256_VEC_ROTR(e, 25);
+        V ch = (e & f) ^ (~e & g);
+        V t1 = h + S1 + ch + kSha256K[i] + wi;
+        V S0 = SHA256_VEC_ROTR(a, 2) ^ SHA256_VEC_ROTR(a, 13) ^ SHA256_VEC_ROTR(a, 22);
+        V maj = (a & b) ^ (a & c) ^ (b & c);
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + S0 + maj;
+    }
+    s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+    s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+
+    for (int k = 0; k < 8; k++) {
+        for (int j = 0; j < N; j++) {
+            states[j][k] = s[k][j];
+        }
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void sha256Transform4WaySse4(uint32_t (*states)[8], const unsigned char *const *chunks) {
+    sha256TransformLanesImpl<Sha256Vec4, 4>(states, chunks);
+}
+
+__attribute__((target("avx2")))
+static void sha256Transform8WayAvx2(uint32_t (*states)[8], const unsigned char *const *chunks) {
+    sha256TransformLanesImpl<Sha256Vec8, 8>(states, chunks);
+}
+
+__attribute__((target("avx512f")))
+static void sha256Transform16WayAvx512(uint32_t (*states)[8], const unsigned char *const *chunks) {
+    sha256TransformLanesImpl<Sha256Vec16, 16>(states, chunks);
+}
+
+// SHA-NI single-buffer compression (two rounds per sha256rnds2)
+__attribute__((target("sha,sse4.1")))
+static void sha256TransformShaNi(uint32_t state[8], const unsigned char *chunk) {
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // Rearrange the state into the ABEF / CDGH layout the instructions expect
+    __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0]));
+    __m128i state1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4]));
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);            // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1B);      // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);   // CDGH
+    const __m128i abefSave = state0;
+    const __m128i cdghSave = state1;
+
+    __m128i msg[16];
+    for (int g = 0; g < 16; g++) {
+        if (g < 4) {
+            msg[g] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(chunk + 16 * g)), byteSwap);
+        } else {
+            __m128i t = _mm_sha256msg1_epu32(msg[g - 4], msg[g - 3]);
+            t = _mm_add_epi32(t, _mm_alignr_epi8(msg[g - 1], msg[g - 2], 4));
+            msg[g] = _mm_sha256msg2_epu32(t, msg[g - 1]);
+        }
+        __m128i m = _mm_add_epi32(msg[g], _mm_loadu_si128(reinterpret_cast<const __m128i*>(&kSha256K[4 * g])));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+        m = _mm_shuffle_epi32(m, 0x0E);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+    }
+
+    state0 = _mm_add_epi32(state0, abefSave);
+    state1 = _mm_add_epi32(state1, cdghSave);
+    tmp = _mm_shuffle_epi32(state0, 0x1B);         // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);      // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);   // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);      // ABEF
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), state1);
+}
+
+static bool cpuHasShaNi() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return (ebx & (1u << 29)) != 0;
+}
+
+#endif // SHA256_X86_BACKENDS
+
+// SHA-256("abc"), one padded chunk (FIPS 180-2, appendix B.1)
+static const unsigned char kSha256AbcDigest[32] = {
+    0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+    0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+};
+
+// Run before a backend may be selected: the known answer for "abc" through the
+// single-chunk transform and through every lane, then a different state and
+// chunk in each lane against sha256Transform(), so a kernel that mixes up its
+// lanes is caught as well as one that computes the wrong thing.
+static bool sha256BackendSelfTest(const Sha256Backend &backend) {
+    const size_t kMaxLanes = 16;
+    unsigned char abc[64];
+    sha256PadFinalChunk(abc, reinterpret_cast<const unsigned char*>("abc"), 3, 3);
+    uint32_t state[8];
+    unsigned char digest[32];
+    std::memcpy(state, kSha256Init, sizeof(state));
+    backend.transform(state, abc);
+    sha256StateToDigest(state, digest);
+    if (std::memcmp(digest, kSha256AbcDigest, sizeof(digest)) != 0) return false;
+    if (!backend.transformLanes) return true;
+    if (backend.lanes > kMaxLanes) return false;
+
+    uint32_t states[kMaxLanes][8], expected[kMaxLanes][8];
+    unsigned char data[kMaxLanes][64];
+    const unsigned char *chunks[kMaxLanes];
+    for (size_t i = 0; i < backend.lanes; i++) {
+        std::memcpy(states[i], kSha256Init, sizeof(kSha256Init));
+        chunks[i] = abc;
+    }
+    backend.transformLanes(states, chunks);
+    for (size_t i = 0; i < backend.lanes; i++) {
+        sha256StateToDigest(states[i], digest);
+        if (std::memcmp(digest, kSha256AbcDigest, sizeof(digest)) != 0) return false;
+    }
+
+    for (size_t i = 0; i < backend.lanes; i++) {
+        for (size_t j = 0; j < 64; j++) {
+            data[i][j] = static_cast<unsigned char>(i * 67 + j * 13 + 1);
+        }
+        for (size_t k = 0; k < 8; k++) {
+            states[i][k] = kSha256Init[k] ^ static_cast<uint32_t>((i + 1) * 0x9e3779b9u + k);
+        }
+        std::memcpy(expected[i], states[i], sizeof(expected[i]));
+        sha256Transform(expected[i], data[i]);
+        chunks[i] = data[i];
+    }
+    backend.transformLanes(states, chunks);
+    for (size_t i = 0; i < backend.lanes; i++) {
+        if (std::memcmp(states[i], expected[i], sizeof(expected[i])) != 0) return false;
+    }
+    return true;
+}
+
+// Every backend usable on this CPU that passes its self-test. Lane backends
+// fall back to the best single-buffer transform (SHA-NI if present) for batch
+// leftovers.
+static std::vector<Sha256Backend> sha256DetectBackends() {
+    std::vector<Sha256Backend> backends;
+    auto admit = [&backends](const Sha256Backend &b) {
+        if (sha256BackendSelfTest(b)) {
+            backends.push_back(b);
+            return true;
+        }
+        std::cerr << "[SHA256] The " << b.name << " backend failed its self-test; not using it" << std::endl;
+        return false;
+    };
+    void (*single)(uint32_t[8], const unsigned char*) = sha256Transform;
+#ifdef SHA256_X86_BACKENDS
+    __builtin_cpu_init();
+    if (cpuHasShaNi() && __builtin_cpu_supports("sse4.1")) {
+        if (admit(Sha256Backend{"sha-ni", sha256TransformShaNi, nullptr, 1})) {
+            single = sha256TransformShaNi;
+        }
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        admit(Sha256Backend{"avx512-16way", single, sha256Transform16WayAvx512, 16});
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        admit(Sha256Backend{"avx2-8way", single, sha256Transform8WayAvx2, 8});
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        admit(Sha256Backend{"sse4-4way", single, sha256Transform4WaySse4, 4});
+    }
+#endif
+    // The reference every other backend is checked against; kept even if it
+    // fails, as there is nothing left to fall back on
+    if (!admit(Sha256Backend{"scalar", sha256Transform, nullptr, 1})) {
+        backends.push_back(Sha256Backend{"scalar", sha256Transform, nullptr, 1});
+    }
+    return backends;
+}
+
+static const std::vector<Sha256Backend> &sha256AvailableBackends() {
+    static const std::vector<Sha256Backend> available = sha256DetectBackends();
+    return available;
+}
+
+static void sha256TransformManyWith(const Sha256Backend &backend, uint32_t (*states)[8],
+                                    const unsigned char *const *chunks, size_t n) {
+    size_t i = 0;
+    if (backend.transformLanes) {
+        for (; i + backend.lanes <= n; i += backend.lanes) {
+            backend.transformLanes(states + i, chunks + i);
+        }
+    }
+    for (; i < n; i++) {
+        backend.transform(states[i], chunks[i]);
+    }
+}
+
+// Whether SHA-NI or a wide lane kernel is faster for batches differs between
+// CPU generations, so time each candidate on a small batch once (~1ms total).
+static const Sha256Backend *sha256CalibrateBackend() {
+    const std::vector<Sha256Backend> &available = sha256AvailableBackends();
+    const size_t kMsgs = 64;
+    static unsigned char data[kMsgs * 64];
+    uint32_t states[kMsgs][8];
+    const unsigned char *chunks[kMsgs];
+    for (size_t i = 0; i < kMsgs; i++) {
+        chunks[i] = data + i * 64;
+        std::memcpy(states[i], kSha256Init, sizeof(kSha256Init));
+    }
+
+    const Sha256Backend *best = nullptr;
+    double bestTime = 0;
+    for (auto &b : available) {
+        double fastest = 0;
+        for (int rep = 0; rep < 5; rep++) {
+            auto start = std::chrono::steady_clock::now();
+            sha256TransformManyWith(b, states, chunks, kMsgs);
+            double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (rep == 0 || t < fastest) fastest = t;
+        }
+        if (!best || fastest < bestTime) {
+            best = &b;
+            bestTime = fastest;
+        }
+    }
+    return best;
+}
+
+static std::atomic<const Sha256Backend*> g_sha256Backend{nullptr};
+
+static const Sha256Backend &sha256Backend() {
+    const Sha256Backend *backend = g_sha256Backend.load(std::memory_order_acquire);
+    if (!backend) {
+        static const Sha256Backend *calibrated = sha256CalibrateBackend();
+        backend = calibrated;
+        const Sha256Backend *expected = nullptr;
+        // Don't clobber a backend forced by setSha256Backend() in the meantime
+        if (!g_sha256Backend.compare_exchange_strong(expected, backend)) {
+            backend = expected;
+        }
+    }
+    return *backend;
+}
+
+// Force a specific backend by name (benchmarks, cross-checking). Returns false if
+// it isn't available on this CPU.
+static bool setSha256Backend(const std::string &name) {
+    for (auto &b : sha256AvailableBackends()) {
+        if (name == b.name) {
+            g_sha256Backend.store(&b, std::memory_order_release);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Compress n independent (state, chunk) pairs with the selected backend
+static void sha256TransformMany(uint32_t (*states)[8], const unsigned char *const *chunks, size_t n) {
+    sha256TransformManyWith(sha256Backend(), states, chunks, n);
+}
+
+// SHA-256 of n independent 64-byte messages: in[i*64 .. i*64+64) -> out[i*32 .. i*32+32).
+// This is exactly the shape of one merkle tree level (each node hashes two child hashes).
+// `out` may equal `in`: every output is written only after its input has been consumed.
+static void sha256Hash64Many(const unsigned char *in, unsigned char *out, size_t n) {
+    // Every 64-byte message has the same padding chunk
+    static const unsigned char padding[64] = {
+        0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0x00  // 512 bits
+    };
+    const size_t kBatch = 64;
+    uint32_t states[kBatch][8];
+    const unsigned char *chunks[kBatch];
+
+    for (size_t base = 0; base < n; base += kBatch) {
+        size_t count = std::min(kBatch, n - base);
+        for (size_t i = 0; i < count; i++) {
+            std::memcpy(states[i], kSha256Init, sizeof(kSha256Init));
+            chunks[i] = in + (base + i) * 64;
+        }
+        sha256TransformMany(states, chunks, count);
+        for (size_t i = 0; i < count; i++) {
+            chunks[i] = padding;
+        }
+        sha256TransformMany(states, chunks, count);
+        for (size_t i = 0; i < count; i++) {
+            sha256StateToDigest(states[i], out + (base + i) * 32);
+        }
+    }
+}
@@ -0,0 +1,202 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <random>
+#include <cstdint>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+#include "primitives.cpp"
+#include "thread_pool.cpp"
+
+// ------------------- SIGNATURES -------------------
+// TxInput::signature carries compactSize(len) DER signature | compactSize(len) public key.
+// The public key must hash (sha256) to the spent output's pubKeyHash.
+// Input i signs sha256(txDigest | i), where txDigest is the sha256 of the
+// transaction serialized with every input signature empty. The digest is the
+// same for all inputs, so it is computed once per transaction.
+
+static bool decodeSignatureScript(const std::string &script, std::string &derSig, std::string &pubKey) {
+    ByteReader in(script.data(), script.size());
+    in.readString(derSig);
+    in.readString(pubKey);
+    return !in.failed && in.left == 0 && !derSig.empty() && !pubKey.empty();
+}
+
+template <typename Tx>
+static uint256 signatureDigest(const Tx &tx) {
+    std::string buf;
+    appendLE32(buf, tx.version);
+    appendCompactSize(buf, tx.inputs.size());
+    for (auto &in : tx.inputs) {
+        appendBytes(buf, in.txid.data, 32);
+        appendLE32(buf, in.index);
+        appendCompactSize(buf, 0);
+    }
+    appendCompactSize(buf, tx.outputs.size());
+    for (auto &out : tx.outputs) {
+        out.serialize(buf);
+    }
+    appendLE32(buf, tx.lockTime);
+    return sha256(buf);
+}
+
+static uint256 signatureHash(const uint256 &txDigest, uint32_t inputIndex) {
+    unsigned char buf[36];
+    std::memcpy(buf, txDigest.data, 32);
+    writeLE32(buf + 32, inputIndex);
+    return sha256(buf, sizeof(buf));
+}
+
+// The EC_KEY API matches the wallet's; it is deprecated (not removed) in OpenSSL 3
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#endif
+
+// secp256k1 ECDSA check of a DER signature against an encoded public key
+static bool verifyEcdsa(const uint256 &sighash, const std::string &pubKey, const std::string &derSig) {
+    EC_KEY *key = EC_KEY_new_by_curve_name(NID_secp256k1);
+    if (!key) return false;
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(pubKey.data());
+    bool ok = o2i_ECPublicKey(&key, &p, static_cast<long>(pubKey.size())) != nullptr
+        && ECDSA_verify(0, sighash.data, 32, reinterpret_cast<const unsigned char*>(derSig.data()),
+                        static_cast<int>(derSig.size()), key) == 1;
+    EC_KEY_free(key);
+    return ok;
+}
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+// Bounded set of (sighash, pubkey, signature) triples that already verified, so a
+// transaction checked on admission isn't verified again when its block arrives.
+// Entries are salted hashes, so peers can't aim collisions at chosen slots. When
+// every slot a new entry may use is taken, one of them is overwritten.
+class SignatureCache {
+public:
+    explicit SignatureCache(size_t maxBytes) {
+        std::random_device rd;
+        for (auto &b : salt) b = static_cast<unsigned char>(rd());
+        resize(maxBytes);
+    }
+
+    void resize(size_t maxBytes) {
+        size_t n = kProbe;
+        while (n * 2 * sizeof(uint256) <= maxBytes) n *= 2;
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        entries.assign(n, uint256());
+    }
+
+    uint256 entryFor(const uint256 &sighash, const std::string &pubKey, const std::string &sig) const {
+        std::string buf(reinterpret_cast<const char*>(salt), sizeof(salt));
+        appendBytes(buf, sighash.data, 32);
+        appendCompactSize(buf, pubKey.size());
+        buf += pubKey;
+        buf += sig;
+        return sha256(buf);
+    }
+
+    bool contains(const uint256 &entry) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        size_t mask = entries.size() - 1;
+        size_t home = static_cast<size_t>(entry.getCheapHash());
+        for (size_t i = 0; i < kProbe; i++) {
+            if (entries[(home + i) & mask] == entry) return true;
+        }
+        return false;
+    }
+
+    void insert(const uint256 &entry) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        size_t mask = entries.size() - 1;
+        size_t home = static_cast<size_t>(entry.getCheapHash());
+        for (size_t i = 0; i < kProbe; i++) {
+            uint256 &slot = entries[(home + i) & mask];
+            if (slot.isNull() || slot == entry) {
+                slot = entry;
+                return;
+            }
+        }
+        entries[(home + (evictCounter++ % kProbe)) & mask] = entry;
+    }
+
+private:
+    static const size_t kProbe = 8;
+
+    mutable std::shared_mutex mutex;
+    std::vector<uint256> entries;
+    unsigned char salt[32];
+    size_t evictCounter = 0;
+};
+
+static SignatureCache &getSignatureCache() {
+    static SignatureCache cache(32u << 20);
+    return cache;
+}
+
+// One signature to verify; `owner` is the position of its transaction (in the
+// block or burst), used to report the first failure.
+struct SigCheck {
+    uint256 sighash;
+    std::string pubKey;
+    std::string sig;
+    size_t owner = 0;
+};
+
+// Decode input k's signature script into a check. The key it carries must
+// hash to the pubKeyHash of the coin being spent.
+static bool makeSigCheck(const Transaction &tx, const uint256 &txDigest, size_t k,
+                         const uint256 &pubKeyHash, size_t owner, SigCheck &out) {
+    if (!decodeSignatureScript(tx.inputs[k].signature, out.sig, out.pubKey)) return false;
+    if (sha256(out.pubKey) != pubKeyHash) return false;
+    out.sighash = signatureHash(txDigest, static_cast<uint32_t>(k));
+    out.owner = owner;
+    return true;
+}
+
+// Signature checks gathered across many transactions (all inputs of a block, or a
+// burst of mempool transactions) and verified together on the worker pool.
+class SigCheckQueue {
+public:
+    void add(SigCheck check) { checks.push_back(std::move(check)); }
+
+    void add(std::vector<SigCheck> &batch) {
+        for (auto &c : batch) checks.push_back(std::move(c));
+        batch.clear();
+    }
+
+    size_t size() const { return checks.size(); }
+
+    // Verify everything queued, then empty the queue. Returns false and the lowest
+    // failing owner if any check fails; work for later owners stops early.
+    // cacheResults: remember successes (mempool admission); blocks only read the cache.
+    bool run(bool cacheResults, size_t &firstFailedOwner) {
+        SignatureCache &cache = getSignatureCache();
+        std::atomic<size_t> firstFailed(SIZE_MAX);
+        getWorkerPool().parallelFor(checks.size(), 16, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                const SigCheck &c = checks[i];
+                if (c.owner > firstFailed.load(std::memory_order_relaxed)) continue;
+                uint256 entry = cache.entryFor(c.sighash, c.pubKey, c.sig);
+                if (cache.contains(entry)) continue;
+                if (verifyEcdsa(c.sighash, c.pubKey, c.sig)) {
+                    if (cacheResults) cache.insert(entry);
+                    continue;
+                }
+                size_t seen = firstFailed.load();
+                while (c.owner < seen && !firstFailed.compare_exchange_weak(seen, c.owner)) {}
+            }
+        });
+        checks.clear();
+        firstFailedOwner = firstFailed.load();
+        return firstFailedOwner == SIZE_MAX;
+    }
+
+private:
+    std::vector<SigCheck> checks;
+};
@@ -0,0 +1,52 @@
+#pragma once
+#include <cstdint>
+#include "primitives.cpp"
+
+// ------------------- SIPHASH -------------------
+// Keyed hash for tables and ids built from attacker-chosen hashes (txids):
+// without the key nobody can make them collide on purpose.
+
+// SipHash-2-4 of a 32-byte message (a txid)
+class SipHasher {
+public:
+    SipHasher(uint64_t k0, uint64_t k1) {
+        v[0] = 0x736f6d6570736575ULL ^ k0;
+        v[1] = 0x646f72616e646f6dULL ^ k1;
+        v[2] = 0x6c7967656e657261ULL ^ k0;
+        v[3] = 0x7465646279746573ULL ^ k1;
+    }
+
+    uint64_t hash(const uint256 &h) const {
+        uint64_t s[4] = {v[0], v[1], v[2], v[3]};
+        for (size_t i = 0; i < 32; i += 8) {
+            uint64_t m = readLE64(h.data + i);
+            s[3] ^= m;
+            round(s);
+            round(s);
+            s[0] ^= m;
+        }
+        uint64_t last = uint64_t(32) << 56;
+        s[3] ^= last;
+        round(s);
+        round(s);
+        s[0] ^= last;
+        s[2] ^= 0xff;
+        round(s);
+        round(s);
+        round(s);
+        round(s);
+        return s[0] ^ s[1] ^ s[2] ^ s[3];
+    }
+
+private:
+    static uint64_t rotl(uint64_t x, int b) { return (x << b) | (x >> (64 - b)); }
+
+    static void round(uint64_t s[4]) {
+        s[0] += s[1]; s[1] = rotl(s[1], 13); s[1] ^= s[0]; s[0] = rotl(s[0], 32);
+        s[2] += s[3]; s[3] = rotl(s[3], 16); s[3] ^= s[2];
+        s[0] += s[3]; s[3] = rotl(s[3], 21); s[3] ^= s[0];
+        s[2] += s[1]; s[1] = rotl(s[1], 17); s[1] ^= s[2]; s[2] = rotl(s[2], 32);
+    }
+
+    uint64_t v[4];
+};
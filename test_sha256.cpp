@@ -0,0 +1,116 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <cstring>
+#include <openssl/sha.h>
+#include "sha256.cpp"
+
+// Every SHA-256 backend this CPU has against OpenSSL's one-shot SHA256():
+// messages of odd and multi-block lengths hashed many at a time through
+// sha256TransformMany (so lane kernels see full batches and leftovers), and
+// sha256Hash64Many, in place and out of place.
+
+static int g_failures = 0;
+
+static void check(bool ok, const std::string &what) {
+    if (!ok) {
+        std::cerr << "[Test] FAILED: " << what << std::endl;
+        g_failures++;
+    }
+}
+
+static std::string randomBytes(std::mt19937 &rng, size_t len) {
+    std::string s(len, '\0');
+    for (auto &c : s) c = static_cast<char>(rng());
+    return s;
+}
+
+// Message, 0x80, zeros, 64-bit big-endian bit length: whole 64-byte chunks
+static std::string pad(const std::string &msg) {
+    std::string p = msg;
+    p += '\x80';
+    while (p.size() % 64 != 56) p += '\0';
+    uint64_t bits = static_cast<uint64_t>(msg.size()) * 8;
+    for (int i = 7; i >= 0; i--) p += static_cast<char>(bits >> (8 * i));
+    return p;
+}
+
+// Hash equally long messages side by side, one chunk of each per call
+static std::vector<std::string> hashMany(const std::vector<std::string> &messages) {
+    size_t n = messages.size();
+    std::vector<std::string> padded;
+    for (auto &m : messages) padded.push_back(pad(m));
+    std::vector<uint32_t> flat(n * 8);
+    uint32_t (*states)[8] = reinterpret_cast<uint32_t (*)[8]>(flat.data());
+    for (size_t i = 0; i < n; i++) std::memcpy(states[i], kSha256Init, sizeof(kSha256Init));
+    std::vector<const unsigned char*> chunks(n);
+    for (size_t offset = 0; offset < padded[0].size(); offset += 64) {
+        for (size_t i = 0; i < n; i++) {
+            chunks[i] = reinterpret_cast<const unsigned char*>(padded[i].data()) + offset;
+        }
+        sha256TransformMany(states, chunks.data(), n);
+    }
+    std::vector<std::string> digests(n, std::string(32, '\0'));
+    for (size_t i = 0; i < n; i++) {
+        sha256StateToDigest(states[i], reinterpret_cast<unsigned char*>(&digests[i][0]));
+    }
+    return digests;
+}
+
+static std::string reference(const std::string &msg) {
+    std::string d(32, '\0');
+    SHA256(reinterpret_cast<const unsigned char*>(msg.data()), msg.size(), reinterpret_cast<unsigned char*>(&d[0]));
+    return d;
+}
+
+static void testBackend(const Sha256Backend &backend) {
+    std::string name = backend.name;
+    check(setSha256Backend(name), name + ": can be selected");
+    std::mt19937 rng(7);
+
+    const size_t lengths[] = {0, 1, 3, 31, 55, 56, 63, 64, 65, 100, 119, 120, 127, 128, 129, 200, 1000};
+    const size_t counts[] = {1, 3, 4, 8, 15, 16, 17, 37};
+    for (size_t len : lengths) {
+        for (size_t count : counts) {
+            std::vector<std::string> messages;
+            for (size_t i = 0; i < count; i++) messages.push_back(randomBytes(rng, len));
+            std::vector<std::string> digests = hashMany(messages);
+            for (size_t i = 0; i < count; i++) {
+                check(digests[i] == reference(messages[i]), name + ": " + std::to_string(count) + " messages of "
+                      + std::to_string(len) + " bytes, message " + std::to_string(i));
+            }
+        }
+    }
+
+    for (size_t n : {size_t(1), size_t(5), size_t(16), size_t(63), size_t(64), size_t(65), size_t(130)}) {
+        std::string in = randomBytes(rng, n * 64);
+        std::string out(n * 32, '\0');
+        sha256Hash64Many(reinterpret_cast<const unsigned char*>(in.data()), reinterpret_cast<unsigned char*>(&out[0]), n);
+        std::string inPlace = in;
+        unsigned char *p = reinterpret_cast<unsigned char*>(&inPlace[0]);
+        sha256Hash64Many(p, p, n);
+        for (size_t i = 0; i < n; i++) {
+            std::string expected = reference(in.substr(i * 64, 64));
+            check(out.substr(i * 32, 32) == expected, name + ": sha256Hash64Many(" + std::to_string(n) + ") message " + std::to_string(i));
+            check(inPlace.substr(i * 32, 32) == expected, name + ": sha256Hash64Many(" + std::to_string(n) + ") in place, message " + std::to_string(i));
+        }
+    }
+}
+
+int main() {
+    const std::vector<Sha256Backend> &backends = sha256AvailableBackends();
+    bool hasScalar = false;
+    for (auto &b : backends) {
+        if (std::string(b.name) == "scalar") hasScalar = true;
+        check(sha256BackendSelfTest(b), std::string(b.name) + ": self-test");
+        testBackend(b);
+        std::cout << "[Test] sha256 backend " << b.name << " checked" << std::endl;
+    }
+    check(hasScalar, "the scalar backend is always available");
+    if (g_failures) {
+        std::cerr << "[Test] " << g_failures << " failure(s)" << std::endl;
+        return 1;
+    }
+    return 0;
+}
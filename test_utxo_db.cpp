@@ -0,0 +1,160 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <filesystem>
+#include "fs_util.cpp"
+
+// A crash in the middle of a flush: the process "dies" after its first N
+// page/log writes (every later write fails and nothing after it runs), the
+// store is reopened, and after the write-ahead log is replayed it must hold
+// exactly the state before the batch (log not written) or after it. N covers
+// the points where a chain rewrite goes from its primary page to an overflow
+// page or back, where records moved between pages are half written, and a
+// sample of the rest.
+
+static int g_failures = 0;
+static long g_writesLeft = -1;            // -1: no crash
+static std::vector<uint64_t> g_offsets;   // of the writes made
+
+static bool crashingWriteAt(int fd, const void *buf, size_t len, uint64_t offset) {
+    if (g_writesLeft == 0) return false;
+    if (g_writesLeft > 0) g_writesLeft--;
+    g_offsets.push_back(offset);
+    return writeAt(fd, buf, len, offset);
+}
+#define writeAt crashingWriteAt
+#include "utxo_db.cpp"
+#undef writeAt
+
+typedef std::map<std::pair<std::string, uint32_t>, uint64_t> Model;
+
+static void check(bool ok, const std::string &what) {
+    if (!ok) {
+        std::cerr << "[Test] FAILED: " << what << std::endl;
+        g_failures++;
+    }
+}
+
+static OutPoint makeKey(uint32_t n) {
+    return OutPoint(sha256("coin " + std::to_string(n)), n % 3);
+}
+
+static UTXO makeCoin(uint64_t amount) {
+    return UTXO{amount, sha256("owner " + std::to_string(amount))};
+}
+
+static void applyToModel(Model &model, const std::vector<UtxoOp> &ops) {
+    for (auto &op : ops) {
+        auto key = std::make_pair(op.key.txid.toHex(), op.key.index);
+        if (op.erase) model.erase(key);
+        else model[key] = op.value.amount;
+    }
+}
+
+// Every entry once, the count in the header right, and every key of
+// `touched` found or not found as the model says
+static bool matches(UtxoDiskStore &store, const Model &model, const std::vector<UtxoOp> &touched) {
+    Model seen;
+    bool duplicate = false;
+    store.forEach([&](const OutPoint &key, const UTXO &coin) {
+        auto k = std::make_pair(key.txid.toHex(), key.index);
+        if (seen.count(k)) duplicate = true;
+        seen[k] = coin.amount;
+        return true;
+    });
+    if (duplicate || seen != model || store.getEntryCount() != model.size()) return false;
+    for (auto &op : touched) {
+        UTXO coin;
+        auto it = model.find(std::make_pair(op.key.txid.toHex(), op.key.index));
+        bool found = store.get(op.key, coin);
+        if (found != (it != model.end()) || (found && coin.amount != it->second)) return false;
+    }
+    return true;
+}
+
+int main() {
+    const std::string dir = "test_utxo_db.tmp";
+    const std::string base = dir + "/base";
+    const std::string work = dir + "/work";
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+
+    // Enough coins for some overflow chains, below the point where the file grows
+    const uint32_t kCoins = 39000;
+    std::vector<UtxoOp> fill;
+    for (uint32_t n = 0; n < kCoins; n++) fill.push_back(UtxoOp{makeKey(n), makeCoin(n), false});
+    Model before;
+    applyToModel(before, fill);
+    {
+        UtxoDiskStore store;
+        check(store.open(base) && store.writeBatch(fill, sha256("block 1"), 1), "initial batch");
+    }
+
+    // Spend a third, change some amounts, add as many new coins: chains both
+    // shrink off their overflow pages and grow onto new ones
+    std::vector<UtxoOp> batch;
+    for (uint32_t n = 0; n < kCoins; n += 3) batch.push_back(UtxoOp{makeKey(n), UTXO(), true});
+    for (uint32_t n = 1; n < kCoins; n += 5) batch.push_back(UtxoOp{makeKey(n), makeCoin(n + 1000000), false});
+    for (uint32_t n = kCoins; n < kCoins + kCoins / 3; n++) batch.push_back(UtxoOp{makeKey(n), makeCoin(n), false});
+    Model after = before;
+    applyToModel(after, batch);
+
+    auto restoreBase = [&]() {
+        std::filesystem::remove_all(work, ec);
+        std::filesystem::copy(base, work, ec);
+        return !ec;
+    };
+
+    // How many writes the batch takes when nothing goes wrong
+    long totalWrites = 0;
+    {
+        check(restoreBase(), "copy the store");
+        UtxoDiskStore store;
+        check(store.open(work), "open the copy");
+        g_offsets.clear();
+        check(store.writeBatch(batch, sha256("block 2"), 2), "batch without a crash");
+        totalWrites = static_cast<long>(g_offsets.size());
+        check(matches(store, after, batch), "state after the batch");
+    }
+    std::vector<long> crashPoints;
+    size_t switches = 0;
+    const uint64_t firstOverflowPage = (1 + kUtxoInitialBuckets) * kUtxoPageSize;
+    for (long i = 0; i < totalWrites; i++) {
+        bool switched = i > 1 && (g_offsets[i - 1] >= firstOverflowPage) != (g_offsets[i] >= firstOverflowPage);
+        if (switched) switches++;
+        if ((switched && switches <= 60) || i % 128 == 0 || i == totalWrites - 1) crashPoints.push_back(i);
+    }
+    check(switches > 0, "the batch rewrites multi-page chains");
+
+    for (long crashAt : crashPoints) {
+        if (!restoreBase()) {
+            check(false, "copy the store");
+            break;
+        }
+        {
+            UtxoDiskStore store;
+            store.open(work);
+            g_writesLeft = crashAt;
+            check(!store.writeBatch(batch, sha256("block 2"), 2), "crash after " + std::to_string(crashAt) + " writes");
+            g_writesLeft = -1;
+        }
+        UtxoDiskStore store;
+        if (!store.open(work)) {
+            check(false, "reopen after a crash after " + std::to_string(crashAt) + " writes");
+            continue;
+        }
+        bool replayed = store.getBestHeight() == 2;
+        check(replayed == (crashAt > 0), "log replayed iff written, crash after " + std::to_string(crashAt) + " writes");
+        check(matches(store, replayed ? after : before, batch), "state after a crash after " + std::to_string(crashAt) + " writes");
+    }
+    std::cout << "[Test] utxo_db: crashed a " << batch.size() << "-change flush at " << crashPoints.size() << " of its "
+              << totalWrites << " writes" << std::endl;
+
+    std::filesystem::remove_all(dir, ec);
+    if (g_failures) {
+        std::cerr << "[Test] " << g_failures << " failure(s)" << std::endl;
+        return 1;
+    }
+    return 0;
+}
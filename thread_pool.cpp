@@ -0,0 +1,124 @@
+#pragma once
+#include <thread>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+
+// Fixed-size worker pool shared by the CPU-heavy parts of the node
+// (merkle hashing, block validation, signature checks, ...).
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threads) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (unsigned i = 0; i < threads; i++) {
+            workers.emplace_back([this]() { workerLoop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto &t : workers) {
+            t.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool &operator=(const ThreadPool&) = delete;
+
+    unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+    // Queue a task; it runs on some worker thread
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        cv.notify_one();
+    }
+
+    // Number of tasks waiting for a worker
+    size_t queueDepth() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return tasks.size();
+    }
+
+    // Run fn(begin, end) over [0, n) in chunks of at least minChunk items and wait
+    // for all of them. The calling thread works on chunks too, so this is safe to
+    // call from inside a pool task (it never waits on a chunk nobody has started).
+    void parallelFor(size_t n, size_t minChunk, const std::function<void(size_t, size_t)> &fn) {
+        if (n == 0) return;
+        minChunk = std::max<size_t>(1, minChunk);
+        size_t chunks = std::min<size_t>((n + minChunk - 1) / minChunk, size_t(size()) * 4);
+        if (chunks <= 1) {
+            fn(0, n);
+            return;
+        }
+        size_t chunkSize = (n + chunks - 1) / chunks;
+        chunks = (n + chunkSize - 1) / chunkSize;
+
+        struct Job {
+            std::atomic<size_t> next{0};
+            size_t done = 0;
+            std::mutex m;
+            std::condition_variable cv;
+        };
+        auto job = std::make_shared<Job>();
+        // Claim and run chunks until none are left
+        auto run = [job, n, chunks, chunkSize, &fn]() {
+            size_t c;
+            while ((c = job->next.fetch_add(1)) < chunks) {
+                size_t begin = c * chunkSize;
+                fn(begin, std::min(n, begin + chunkSize));
+                std::lock_guard<std::mutex> lock(job->m);
+                if (++job->done == chunks) {
+                    job->cv.notify_all();
+                }
+            }
+        };
+        size_t helpers = std::min<size_t>(chunks - 1, size());
+        for (size_t i = 0; i < helpers; i++) {
+            submit(run);
+        }
+        run();
+        std::unique_lock<std::mutex> lock(job->m);
+        job->cv.wait(lock, [&]() { return job->done == chunks; });
+    }
+
+private:
+    void workerLoop() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (stopping && tasks.empty()) return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+};
+
+// Process-wide pool with one thread per core
+static ThreadPool &getWorkerPool() {
+    static ThreadPool pool(0);
+    return pool;
+}
@@ -0,0 +1,699 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <shared_mutex>
+#include <cstdio>
+#include "primitives.cpp"
+#include "utxo_set.cpp"
+#include "fs_util.cpp"
+
+// ------------------- ON-DISK UTXO STORE -------------------
+// <dir>/utxo.dat is a page-based hash file:
+//   page 0          header (magic, bucket count, entry count, best block, hash salt, checksum)
+//   pages 1..N      primary bucket pages, N = bucketCount (a power of two)
+//   pages > N       overflow pages, chained from their bucket page
+// Every data page is: count(LE16) | reserved(6) | next overflow page(LE64, 0 = none) | records.
+// A record is txid(32) | index(LE32) | amount(LE64) | pubKeyHash(32) = 76 bytes.
+//
+// Writes go through <dir>/utxo.wal first: the whole flush batch plus a commit
+// record (best block, height, checksum) is written and fsync'd before any page is
+// touched. On open, a complete WAL is replayed and a torn one is discarded, so
+// the file always matches the recorded best block.
+//
+// Chains are rewritten in place, so a crash can leave one half old and half
+// new. The rewrite order (see writeChain) makes sure such a chain still holds
+// every record the batch keeps, possibly one of them twice. Lookups and replay
+// use the first copy of a key and the replayed rewrite drops the rest, so
+// applying the batch again gives the same result as applying it once. A page
+// is assumed to be written whole or not at all.
+//
+// Chain snapshots read the store while blocks are connected, so each flush
+// starts a new version of it and leaves the coins it changed, as they were, with
+// the version before (getAt). Reads and flushes exclude each other.
+
+static const size_t kUtxoPageSize = 4096;
+static const size_t kUtxoPageHeaderSize = 16;
+static const size_t kUtxoRecordSize = 76;
+static const size_t kUtxoRecordsPerPage = (kUtxoPageSize - kUtxoPageHeaderSize) / kUtxoRecordSize;
+static const uint64_t kUtxoInitialBuckets = 1024;
+
+// One change in a flush batch
+struct UtxoOp {
+    OutPoint key;
+    UTXO value;
+    bool erase;
+};
+
+// The op for `key` in `ops` sorted by key, or nullptr
+static const UtxoOp *findUtxoOp(const std::vector<UtxoOp> &ops, const OutPoint &key) {
+    auto it = std::lower_bound(ops.begin(), ops.end(), key, [](const UtxoOp &op, const OutPoint &k) { return op.key < k; });
+    return it != ops.end() && it->key == key ? &*it : nullptr;
+}
+
+// The store's contents between two flushes. The flush that ends a version sets
+// `overwritten` (what it changed, as it was: erase = no coin, sorted by key)
+// and `next`; until then both are empty.
+struct UtxoVersion {
+    uint64_t entries = 0;
+    std::vector<UtxoOp> overwritten;
+    std::shared_ptr<UtxoVersion> next;
+};
+
+static void encodeUtxoRecord(unsigned char *p, const OutPoint &key, const UTXO &value) {
+    std::memcpy(p, key.txid.data, 32);
+    writeLE32(p + 32, key.index);
+    writeLE64(p + 36, value.amount);
+    std::memcpy(p + 44, value.pubKeyHash.data, 32);
+}
+
+static void decodeUtxoRecord(const unsigned char *p, OutPoint &key, UTXO &value) {
+    std::memcpy(key.txid.data, p, 32);
+    key.index = readLE32(p + 32);
+    value.amount = readLE64(p + 36);
+    std::memcpy(value.pubKeyHash.data, p + 44, 32);
+}
+
+class UtxoDiskStore {
+public:
+    UtxoDiskStore() : hasher(0, 0) {}
+    ~UtxoDiskStore() { close(); }
+
+    bool isOpen() const { return fd >= 0; }
+
+    bool open(const std::string &directory) {
+        close();
+        dir = directory;
+        if (!ensureDirectory(dir)) {
+            std::cerr << "[UTXO DB] Cannot create directory " << dir << std::endl;
+            return false;
+        }
+        fd = openFile(dataPath(), true);
+        if (fd < 0) {
+            std::cerr << "[UTXO DB] Cannot open " << dataPath() << std::endl;
+            return false;
+        }
+        if (fileSize(fd) == 0) {
+            if (!initEmpty(fd, kUtxoInitialBuckets)) return fail("cannot initialise data file");
+        } else if (!readHeader()) {
+            return fail("corrupt header");
+        }
+        // Overflow pages written by an interrupted flush may lie past the recorded
+        // end; never hand them out again.
+        nextFreePage = std::max(fileSize(fd) / kUtxoPageSize, 1 + bucketCount);
+        if (!recoverWal()) return fail("cannot replay write-ahead log");
+        version = std::make_shared<UtxoVersion>();
+        version->entries = entryCount;
+        return true;
+    }
+
+    void close() {
+        if (fd >= 0) {
+            closeFile(fd);
+            fd = -1;
+        }
+        version.reset();
+    }
+
+    const uint256 &getBestBlock() const { return bestBlock; }
+    uint64_t getBestHeight() const { return bestHeight; }
+    uint64_t getEntryCount() const { return entryCount; }
+
+    // The version the next flush will end (null while closed)
+    std::shared_ptr<const UtxoVersion> currentVersion() const { return version; }
+
+    bool get(const OutPoint &key, UTXO &out) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return getLocked(key, out);
+    }
+
+    // `key` as of `since`, a version of this store: the first flush after it
+    // that changed the coin knows what it was
+    bool getAt(const UtxoVersion &since, const OutPoint &key, UTXO &out) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        for (const UtxoVersion *v = &since; v->next; v = v->next.get()) {
+            const UtxoOp *op = findUtxoOp(v->overwritten, key);
+            if (op) {
+                if (op->erase) return false;
+                out = op->value;
+                return true;
+            }
+        }
+        return getLocked(key, out);
+    }
+
+    // Apply a batch crash-safely and move the best-block marker with it. Once
+    // pages have been written a new version starts, even if the batch fails.
+    bool writeBatch(const std::vector<UtxoOp> &ops, const uint256 &best, uint64_t height) {
+        if (fd < 0) return false;
+        if (!writeWal(ops, best, height)) return false;
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        std::vector<UtxoOp> before;
+        bool applied = applyOps(ops, &before);
+        std::sort(before.begin(), before.end(), [](const UtxoOp &a, const UtxoOp &b) { return a.key < b.key; });
+        auto next = std::make_shared<UtxoVersion>();
+        next->entries = entryCount;
+        version->overwritten = std::move(before);
+        version->next = next;
+        version = next;
+        if (!applied) return false;
+        bestBlock = best;
+        bestHeight = height;
+        if (entryCount > bucketCount * kUtxoRecordsPerPage * 3 / 4 && !grow()) return false;
+        if (!writeHeader() || !syncFile(fd)) return false;
+        std::remove(walPath().c_str());
+        syncDirectory(dir);
+        return true;
+    }
+
+    // Visit every stored entry; fn(key, value) returns false to stop
+    template <typename F>
+    void forEach(F fn) {
+        if (fd < 0) return;
+        for (uint64_t b = 0; b < bucketCount; b++) {
+            std::vector<uint64_t> pages;
+            std::vector<UtxoOp> records;
+            if (!readChain(b, pages, records)) return;
+            for (auto &r : records) {
+                if (!fn(r.key, r.value)) return;
+            }
+        }
+    }
+
+    // Drop every entry and the best-block marker
+    bool wipe() {
+        if (fd < 0) return false;
+        close();
+        std::remove(walPath().c_str());
+        std::remove(dataPath().c_str());
+        return open(dir);
+    }
+
+private:
+    std::string dataPath() const { return dir + "/utxo.dat"; }
+    std::string walPath() const { return dir + "/utxo.wal"; }
+
+    bool fail(const char *what) {
+        std::cerr << "[UTXO DB] " << dataPath() << ": " << what << std::endl;
+        close();
+        return false;
+    }
+
+    uint64_t bucketOf(const OutPoint &key) const { return hasher(key) & (bucketCount - 1); }
+
+    // The first copy of a key wins (see the top of the file)
+    bool getLocked(const OutPoint &key, UTXO &out) const {
+        if (fd < 0) return false;
+        std::vector<unsigned char> page(kUtxoPageSize);
+        uint64_t pageNo = 1 + bucketOf(key);
+        while (pageNo != 0) {
+            if (!readAt(fd, page.data(), kUtxoPageSize, pageNo * kUtxoPageSize)) return false;
+            size_t count = pageCount(page.data());
+            for (size_t i = 0; i < count; i++) {
+                const unsigned char *rec = page.data() + kUtxoPageHeaderSize + i * kUtxoRecordSize;
+                if (std::memcmp(rec, key.txid.data, 32) == 0 && readLE32(rec + 32) == key.index) {
+                    OutPoint k;
+                    decodeUtxoRecord(rec, k, out);
+                    return true;
+                }
+            }
+            pageNo = readLE64(page.data() + 8);
+        }
+        return false;
+    }
+
+    static size_t pageCount(const unsigned char *page) {
+        return std::min<size_t>(page[0] | (size_t(page[1]) << 8), kUtxoRecordsPerPage);
+    }
+
+    // ---- header ----
+
+    static const size_t kHeaderSize = 8 + 8 + 8 + 32 + 8 + 8 + 8 + 32;
+
+    void encodeHeader(unsigned char *p) const {
+        std::memcpy(p, "MCUTXO01", 8);
+        writeLE64(p + 8, bucketCount);
+        writeLE64(p + 16, entryCount);
+        std::memcpy(p + 24, bestBlock.data, 32);
+        writeLE64(p + 56, bestHeight);
+        writeLE64(p + 64, hasher.key0());
+        writeLE64(p + 72, hasher.key1());
+        uint256 check = sha256(p, 80);
+        std::memcpy(p + 80, check.data, 32);
+    }
+
+    bool writeHeaderTo(int file) const {
+        unsigned char page[kUtxoPageSize] = {0};
+        encodeHeader(page);
+        return writeAt(file, page, kUtxoPageSize, 0);
+    }
+
+    bool writeHeader() const { return writeHeaderTo(fd); }
+
+    bool readHeader() {
+        unsigned char p[kHeaderSize];
+        if (!readAt(fd, p, kHeaderSize, 0)) return false;
+        if (std::memcmp(p, "MCUTXO01", 8) != 0) return false;
+        uint256 check = sha256(p, 80);
+        if (std::memcmp(check.data, p + 80, 32) != 0) return false;
+        bucketCount = readLE64(p + 8);
+        entryCount = readLE64(p + 16);
+        std::memcpy(bestBlock.data, p + 24, 32);
+        bestHeight = readLE64(p + 56);
+        hasher = OutPointHasher(readLE64(p + 64), readLE64(p + 72));
+        return bucketCount != 0 && (bucketCount & (bucketCount - 1)) == 0;
+    }
+
+    bool initEmpty(int file, uint64_t buckets) {
+        std::random_device rd;
+        hasher = OutPointHasher((uint64_t(rd()) << 32) ^ rd(), (uint64_t(rd()) << 32) ^ rd());
+        bucketCount = buckets;
+        entryCount = 0;
+        bestBlock.setNull();
+        bestHeight = 0;
+        // Bucket pages start zero-filled (count 0, no overflow)
+        return truncateFile(file, (1 + buckets) * kUtxoPageSize) && writeHeaderTo(file) && syncFile(file);
+    }
+
+    // ---- bucket chains ----
+
+    // A chain's pages and records, without the later copies an interrupted
+    // rewrite may have left
+    bool readChain(uint64_t bucket, std::vector<uint64_t> &pages, std::vector<UtxoOp> &records) {
+        unsigned char page[kUtxoPageSize];
+        uint64_t pageNo = 1 + bucket;
+        while (pageNo != 0) {
+            if (!readAt(fd, page, kUtxoPageSize, pageNo * kUtxoPageSize)) return false;
+            pages.push_back(pageNo);
+            size_t count = pageCount(page);
+            for (size_t i = 0; i < count; i++) {
+                UtxoOp r;
+                r.erase = false;
+                decodeUtxoRecord(page + kUtxoPageHeaderSize + i * kUtxoRecordSize, r.key, r.value);
+                if (std::none_of(records.begin(), records.end(), [&](const UtxoOp &o) { return o.key == r.key; })) {
+                    records.push_back(r);
+                }
+            }
+            pageNo = readLE64(page + 8);
+            if (pages.size() > (1u << 20)) return false; // corrupt cycle
+        }
+        return true;
+    }
+
+    // Rewrite a bucket chain, reusing its pages and appending overflow pages if
+    // needed. applyOps only ever moves a record towards the front of the chain
+    // (into the slot of an erased one) and appends new ones, so writing the new
+    // pages first and then the old ones front to back never drops a record that
+    // is in both versions, wherever the writes stop: its new slot is written
+    // before its old one is overwritten. New pages are unreachable until the
+    // page before them is written.
+    static bool writeChain(int file, uint64_t &nextFree, std::vector<uint64_t> &pages,
+                           const std::vector<UtxoOp> &records) {
+        size_t needed = std::max<size_t>(1, (records.size() + kUtxoRecordsPerPage - 1) / kUtxoRecordsPerPage);
+        size_t existing = pages.size();
+        while (pages.size() < needed) {
+            pages.push_back(nextFree++);
+        }
+        unsigned char page[kUtxoPageSize];
+        auto writePage = [&](size_t i) {
+            std::memset(page, 0, kUtxoPageSize);
+            size_t first = std::min(records.size(), i * kUtxoRecordsPerPage);
+            size_t n = std::min(kUtxoRecordsPerPage, records.size() - first);
+            page[0] = static_cast<unsigned char>(n);
+            page[1] = static_cast<unsigned char>(n >> 8);
+            writeLE64(page + 8, i + 1 < pages.size() ? pages[i + 1] : 0);
+            for (size_t j = 0; j < n; j++) {
+                encodeUtxoRecord(page + kUtxoPageHeaderSize + j * kUtxoRecordSize, records[first + j].key, records[first + j].value);
+            }
+            return writeAt(file, page, kUtxoPageSize, pages[i] * kUtxoPageSize);
+        };
+        for (size_t i = existing; i < pages.size(); i++) {
+            if (!writePage(i)) return false;
+        }
+        for (size_t i = 0; i < existing; i++) {
+            if (!writePage(i)) return false;
+        }
+        return true;
+    }
+
+    // With `before`, adds each changed key's record as it was before the chain
+    // holding it is rewritten
+    bool applyOps(const std::vector<UtxoOp> &ops, std::vector<UtxoOp> *before = nullptr) {
+        // Group by bucket so each chain is read and written once
+        std::vector<std::pair<uint64_t, size_t>> order;
+        order.reserve(ops.size());
+        for (size_t i = 0; i < ops.size(); i++) {
+            order.emplace_back(bucketOf(ops[i].key), i);
+        }
+        std::sort(order.begin(), order.end());
+
+        for (size_t i = 0; i < order.size(); ) {
+            uint64_t bucket = order[i].first;
+            std::vector<uint64_t> pages;
+            std::vector<UtxoOp> records;
+            if (!readChain(bucket, pages, records)) return false;
+            int64_t added = 0;
+            for (; i < order.size() && order[i].first == bucket; i++) {
+                const UtxoOp &op = ops[order[i].second];
+                auto it = std::find_if(records.begin(), records.end(),
+                                       [&](const UtxoOp &r) { return r.key == op.key; });
+                if (before) before->push_back(it != records.end() ? *it : UtxoOp{op.key, UTXO(), true});
+                if (op.erase) {
+                    if (it != records.end()) {
+                        // The last record fills the hole: records only move forward (see writeChain)
+                        *it = records.back();
+                        records.pop_back();
+                        added--;
+                    }
+                } else if (it != records.end()) {
+                    it->value = op.value;
+                } else {
+                    records.push_back(op);
+                    records.back().erase = false;
+                    added++;
+                }
+            }
+            if (!writeChain(fd, nextFreePage, pages, records)) return false;
+            entryCount += added;
+        }
+        return true;
+    }
+
+    // Double the bucket count (linear hashing split): bucket b's entries land in
+    // b or b + oldCount, so the new file is written one chain at a time.
+    bool grow() {
+        std::string tmpPath = dataPath() + ".tmp";
+        std::remove(tmpPath.c_str());
+        int out = openFile(tmpPath, true);
+        if (out < 0) return false;
+        uint64_t oldCount = bucketCount;
+        uint64_t newCount = oldCount * 2;
+        OutPointHasher keepHasher = hasher;
+        if (!truncateFile(out, (1 + newCount) * kUtxoPageSize)) {
+            closeFile(out);
+            return false;
+        }
+        uint64_t outNextFree = 1 + newCount;
+        for (uint64_t b = 0; b < oldCount; b++) {
+            std::vector<uint64_t> pages;
+            std::vector<UtxoOp> records, low, high;
+            if (!readChain(b, pages, records)) {
+                closeFile(out);
+                return false;
+            }
+            for (auto &r : records) {
+                ((keepHasher(r.key) & (newCount - 1)) == b ? low : high).push_back(r);
+            }
+            std::vector<uint64_t> lowPages{1 + b}, highPages{1 + b + oldCount};
+            if (!writeChain(out, outNextFree, lowPages, low) || !writeChain(out, outNextFree, highPages, high)) {
+                closeFile(out);
+                return false;
+            }
+        }
+        bucketCount = newCount;
+        bool ok = writeHeaderTo(out) && syncFile(out);
+        closeFile(out);
+        if (!ok || std::rename(tmpPath.c_str(), dataPath().c_str()) != 0) {
+            bucketCount = oldCount;
+            return false;
+        }
+        syncDirectory(dir);
+        closeFile(fd);
+        fd = openFile(dataPath(), false);
+        nextFreePage = outNextFree;
+        return fd >= 0;
+    }
+
+    // ---- write-ahead log ----
+    // magic(8) | count(LE64) | count * (op(1) record(76)) | best block(32) | height(LE64) | sha256(all before)
+
+    bool writeWal(const std::vector<UtxoOp> &ops, const uint256 &best, uint64_t height) {
+        std::string buf;
+        buf.reserve(16 + ops.size() * (1 + kUtxoRecordSize) + 72);
+        buf.append("MCWAL001", 8);
+        appendLE64(buf, ops.size());
+        unsigned char rec[kUtxoRecordSize];
+        for (auto &op : ops) {
+            buf.push_back(op.erase ? 1 : 0);
+            encodeUtxoRecord(rec, op.key, op.value);
+            appendBytes(buf, rec, sizeof(rec));
+        }
+        appendBytes(buf, best.data, 32);
+        appendLE64(buf, height);
+        uint256 check = sha256(buf);
+        appendBytes(buf, check.data, 32);
+
+        // Replaces the log of a failed earlier flush only once complete: that
+        // batch may be half applied, and this one contains all of it
+        std::string tmpPath = walPath() + ".tmp";
+        int wal = openFile(tmpPath, true);
+        if (wal < 0) return false;
+        bool ok = truncateFile(wal, 0) && writeAt(wal, buf.data(), buf.size(), 0) && syncFile(wal);
+        closeFile(wal);
+        if (!ok || std::rename(tmpPath.c_str(), walPath().c_str()) != 0) return false;
+        syncDirectory(dir);
+        return true;
+    }
+
+    bool recoverWal() {
+        if (!fileExists(walPath())) return true;
+        int wal = openFile(walPath(), false);
+        if (wal < 0) return false;
+        std::string buf(fileSize(wal), '\0');
+        bool readOk = buf.empty() || readAt(wal, &buf[0], buf.size(), 0);
+        closeFile(wal);
+
+        const unsigned char *p = reinterpret_cast<const unsigned char*>(buf.data());
+        bool complete = false;
+        uint64_t count = 0;
+        if (readOk && buf.size() >= 16 + 72 && std::memcmp(p, "MCWAL001", 8) == 0) {
+            count = readLE64(p + 8);
+            size_t expected = 16 + count * (1 + kUtxoRecordSize) + 72;
+            if (count <= buf.size() && buf.size() == expected) {
+                uint256 check = sha256(p, buf.size() - 32);
+                complete = std::memcmp(check.data, p + buf.size() - 32, 32) == 0;
+            }
+        }
+        if (!complete) {
+            // Torn write: the flush never reached the data file
+            std::cerr << "[UTXO DB] Discarding incomplete write-ahead log" << std::endl;
+            std::remove(walPath().c_str());
+            return true;
+        }
+
+        std::vector<UtxoOp> ops(count);
+        const unsigned char *r = p + 16;
+        for (uint64_t i = 0; i < count; i++, r += 1 + kUtxoRecordSize) {
+            ops[i].erase = r[0] != 0;
+            decodeUtxoRecord(r + 1, ops[i].key, ops[i].value);
+        }
+        std::memcpy(bestBlock.data, r, 32);
+        bestHeight = readLE64(r + 32);
+        std::cout << "[UTXO DB] Replaying write-ahead log (" << count << " changes)" << std::endl;
+        if (!applyOps(ops)) return false;
+        // Part of the batch may already have been applied before the crash: recount
+        entryCount = 0;
+        forEach([this](const OutPoint &, const UTXO &) { entryCount++; return true; });
+        if (entryCount > bucketCount * kUtxoRecordsPerPage * 3 / 4 && !grow()) return false;
+        if (!writeHeader() || !syncFile(fd)) return false;
+        std::remove(walPath().c_str());
+        syncDirectory(dir);
+        return true;
+    }
+
+    int fd = -1;
+    std::string dir;
+    OutPointHasher hasher;
+    uint64_t bucketCount = 0;
+    uint64_t entryCount = 0;
+    uint64_t nextFreePage = 0;
+    uint256 bestBlock;
+    uint64_t bestHeight = 0;
+    std::shared_ptr<UtxoVersion> version;
+    mutable std::shared_mutex mutex; // readers of the file against writeBatch
+};
+
+// ------------------- WRITE-BACK UTXO CACHE -------------------
+// The UTXO set as the rest of the node sees it: a bounded in-memory cache of
+// coins in front of UtxoDiskStore. Changes stay in memory (DIRTY) and are written
+// in one crash-safe batch at a block boundary together with the best-block marker.
+// Coins created and spent between two flushes (FRESH) never touch the disk.
+class UtxoCache {
+public:
+    bool open(const std::string &dir, size_t cacheBytes, unsigned flushIntervalSeconds = 60) {
+        cacheLimit = cacheBytes;
+        flushInterval = flushIntervalSeconds;
+        cache.clear();
+        lastFlush = std::chrono::steady_clock::now();
+        bool ok = disk.open(dir);
+        bestBlock = disk.getBestBlock();
+        bestHeight = disk.getBestHeight();
+        return ok;
+    }
+
+    // Pointer to the coin, or nullptr if unspent output doesn't exist.
+    // Valid until the coin is spent or the cache is flushed.
+    const UTXO *find(const OutPoint &key) {
+        CachedCoin *c = fetch(key);
+        return (c && !(c->flags & SPENT)) ? &c->coin : nullptr;
+    }
+
+    bool contains(const OutPoint &key) { return find(key) != nullptr; }
+
+    // Lookup that never changes the cache (misses aren't cached), so several
+    // threads may call it at once as long as nothing writes meanwhile.
+    bool peek(const OutPoint &key, UTXO &out) const {
+        const CachedCoin *c = cache.find(key);
+        if (c) {
+            if (c->flags & SPENT) return false;
+            out = c->coin;
+            return true;
+        }
+        return disk.get(key, out);
+    }
+
+    // Cache a coin obtained through peek() as a clean entry, so a following
+    // erase doesn't read it from disk again. No-op if the key is cached.
+    void prime(const OutPoint &key, const UTXO &coin) {
+        if (!cache.find(key)) cache.put(key, CachedCoin{coin, 0});
+    }
+
+    // Add a coin. `fresh` promises the outpoint isn't on disk (true for outputs
+    // of any non-coinbase tx, whose txid commits to the inputs it spends).
+    bool put(const OutPoint &key, const UTXO &value, bool fresh = false) {
+        CachedCoin *c = cache.find(key);
+        if (c) {
+            bool wasFresh = (c->flags & FRESH) != 0;
+            c->coin = value;
+            c->flags = DIRTY | (wasFresh ? FRESH : 0);
+            return true;
+        }
+        cache.put(key, CachedCoin{value, static_cast<uint8_t>(DIRTY | (fresh ? FRESH : 0))});
+        return true;
+    }
+
+    // Spend a coin; copies it into *removed if given. Returns false if it doesn't exist.
+    bool erase(const OutPoint &key, UTXO *removed = nullptr) {
+        CachedCoin *c = fetch(key);
+        if (!c || (c->flags & SPENT)) return false;
+        if (removed) *removed = c->coin;
+        if (c->flags & FRESH) {
+            cache.erase(key);
+        } else {
+            c->flags = DIRTY | SPENT;
+        }
+        return true;
+    }
+
+    // Visit every unspent coin (cache first, then disk entries not shadowed by it)
+    template <typename F>
+    void forEach(F fn) {
+        bool stopped = false;
+        cache.forEach([&](const OutPoint &key, const CachedCoin &c) {
+            if (c.flags & SPENT) return true;
+            stopped = !fn(key, c.coin);
+            return !stopped;
+        });
+        if (stopped) return;
+        disk.forEach([&](const OutPoint &key, const UTXO &coin) {
+            if (cache.find(key)) return true;
+            return fn(key, coin);
+        });
+    }
+
+    void setBestBlock(const uint256 &hash, uint64_t height) {
+        bestBlock = hash;
+        bestHeight = height;
+    }
+    const uint256 &getBestBlock() const { return bestBlock; }
+    uint64_t getBestHeight() const { return bestHeight; }
+
+    size_t cacheUsage() const { return cache.memoryUsage(); }
+
+    // For chain snapshots, which read the disk store directly (UtxoView)
+    const UtxoDiskStore &diskStore() const { return disk; }
+
+    // Write every change and the best-block marker to disk in one batch. If
+    // that fails the cache keeps every change, to be written by the next flush,
+    // and no coin counts as FRESH any more: part of the batch may be on disk.
+    // Without a disk store (memory-only) there is nothing to do.
+    bool flush() {
+        lastFlush = std::chrono::steady_clock::now();
+        if (!disk.isOpen()) return true;
+        std::vector<UtxoOp> ops;
+        std::vector<OutPoint> spent;
+        cache.forEach([&](const OutPoint &key, const CachedCoin &c) {
+            if (c.flags & DIRTY) {
+                ops.push_back(UtxoOp{key, c.coin, (c.flags & SPENT) != 0});
+                if (c.flags & SPENT) spent.push_back(key);
+            }
+            return true;
+        });
+        if (!disk.writeBatch(ops, bestBlock, bestHeight)) {
+            std::cerr << "[UTXO DB] Flush failed" << std::endl;
+            cache.forEachMutable([](const OutPoint &, CachedCoin &c) {
+                c.flags &= ~FRESH;
+                return true;
+            });
+            return false;
+        }
+        cache.forEachMutable([](const OutPoint &, CachedCoin &c) {
+            c.flags = 0;
+            return true;
+        });
+        for (auto &key : spent) {
+            cache.erase(key);
+        }
+        if (cache.memoryUsage() > cacheLimit) {
+            cache.clear(); // everything is clean now, start over cold
+        }
+        return true;
+    }
+
+    // Called at block boundaries: flush when the cache is over budget or the
+    // last flush is older than the flush interval.
+    bool flushIfNeeded() {
+        auto now = std::chrono::steady_clock::now();
+        if (cache.memoryUsage() > cacheLimit || now - lastFlush >= std::chrono::seconds(flushInterval)) {
+            return flush();
+        }
+        return true;
+    }
+
+    // Drop everything, in memory and on disk
+    bool wipe() {
+        cache.clear();
+        bestBlock.setNull();
+        bestHeight = 0;
+        return disk.wipe();
+    }
+
+private:
+    enum : uint8_t { DIRTY = 1, FRESH = 2, SPENT = 4 };
+    struct CachedCoin {
+        UTXO coin;
+        uint8_t flags;
+    };
+
+    // Cache lookup, loading from disk on a miss
+    CachedCoin *fetch(const OutPoint &key) {
+        CachedCoin *c = cache.find(key);
+        if (c) return c;
+        UTXO coin;
+        if (!disk.get(key, coin)) return nullptr;
+        cache.put(key, CachedCoin{coin, 0});
+        return cache.find(key);
+    }
+
+    OutPointTable<CachedCoin> cache;
+    UtxoDiskStore disk;
+    size_t cacheLimit = 100u << 20;
+    unsigned flushInterval = 60;
+    std::chrono::steady_clock::time_point lastFlush;
+    uint256 bestBlock;
+    uint64_t bestHeight = 0;
+};
@@ -0,0 +1,243 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <random>
+#include <cstdint>
+#include <cstring>
+#include "primitives.cpp"
+
+// Compact UTXO value: amount plus the locking pubKeyHash (40 bytes)
+struct UTXO {
+    uint64_t amount;
+    uint256 pubKeyHash;
+};
+
+// Salted hash of a 36-byte outpoint. txids are uniform, but remote peers choose
+// them, so mix in per-process random keys to keep probe chains unpredictable.
+class OutPointHasher {
+public:
+    OutPointHasher() {
+        std::random_device rd;
+        k0 = (uint64_t(rd()) << 32) ^ rd();
+        k1 = (uint64_t(rd()) << 32) ^ rd();
+    }
+
+    // Fixed keys, for on-disk layouts that must hash the same way across restarts
+    OutPointHasher(uint64_t key0, uint64_t key1) : k0(key0), k1(key1) {}
+
+    uint64_t key0() const { return k0; }
+    uint64_t key1() const { return k1; }
+
+    uint64_t operator()(const OutPoint &o) const {
+        uint64_t a, b;
+        std::memcpy(&a, o.txid.data, 8);
+        std::memcpy(&b, o.txid.data + 8, 8);
+        return mix(mix(a ^ k0) ^ b ^ (uint64_t(o.index) << 32) ^ k1);
+    }
+
+private:
+    // splitmix64 finalizer
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+    }
+
+    uint64_t k0, k1;
+};
+
+// Flat open-addressing hash table keyed by outpoint (the UTXO set and its caches).
+// Probing walks a dense array of 8-byte slots (hash tag + entry index), so a
+// lookup usually touches one cache line before the single entry it wants.
+// Entries live in fixed-size arena chunks that never move, and erased entries
+// are recycled through a free list instead of going back to malloc.
+// Deletion uses backward shifting, so there are no tombstones.
+template <typename V>
+class OutPointTable {
+public:
+    struct Entry {
+        OutPoint key;
+        V value;
+    };
+
+    OutPointTable() { rehash(kMinSlots); }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    // Pointer to the value, or nullptr. Valid until the entry is erased.
+    const V *find(const OutPoint &key) const {
+        size_t pos = findSlot(key, hasher(key));
+        return pos == kNotFound ? nullptr : &entryAt(buckets[pos].entry).value;
+    }
+
+    V *find(const OutPoint &key) {
+        size_t pos = findSlot(key, hasher(key));
+        return pos == kNotFound ? nullptr : &entryAt(buckets[pos].entry).value;
+    }
+
+    bool contains(const OutPoint &key) const { return find(key) != nullptr; }
+
+    // Insert or overwrite. Returns true if the key was new.
+    bool put(const OutPoint &key, const V &value) {
+        uint64_t h = hasher(key);
+        size_t pos = findSlot(key, h);
+        if (pos != kNotFound) {
+            entryAt(buckets[pos].entry).value = value;
+            return false;
+        }
+        if ((count + 1) * kMaxLoadDen > buckets.size() * kMaxLoadNum) {
+            rehash(buckets.size() * 2);
+        }
+        uint32_t idx = allocEntry();
+        Entry &e = entryAt(idx);
+        e.key = key;
+        e.value = value;
+        insertSlot(Slot{tagOf(h), idx}, h);
+        count++;
+        return true;
+    }
+
+    // Remove a key; copies the old value into *removed if given. Returns false if absent.
+    bool erase(const OutPoint &key, V *removed = nullptr) {
+        size_t pos = findSlot(key, hasher(key));
+        if (pos == kNotFound) return false;
+        uint32_t idx = buckets[pos].entry;
+        if (removed) *removed = entryAt(idx).value;
+        freeEntries.push_back(idx);
+        count--;
+
+        // Backward-shift the rest of the probe run into the hole
+        size_t mask = buckets.size() - 1;
+        size_t hole = pos;
+        size_t next = (hole + 1) & mask;
+        while (buckets[next].tag != 0) {
+            size_t home = homeOf(buckets[next]) & mask;
+            // Move `next` back if the hole lies between its home slot and where it sits now
+            if (((next - home) & mask) >= ((next - hole) & mask)) {
+                buckets[hole] = buckets[next];
+                hole = next;
+            }
+            next = (next + 1) & mask;
+        }
+        buckets[hole] = Slot{0, 0};
+        return true;
+    }
+
+    // Gives the memory back: a cleared table is as small as a new one
+    void clear() {
+        std::vector<Slot>(kMinSlots, Slot{0, 0}).swap(buckets);
+        std::vector<std::unique_ptr<Entry[]>>().swap(chunks);
+        std::vector<uint32_t>().swap(freeEntries);
+        allocated = 0;
+        count = 0;
+    }
+
+    // Pre-size for n entries so bulk loads don't rehash repeatedly
+    void reserve(size_t n) {
+        size_t want = kMinSlots;
+        while (want * kMaxLoadNum < n * kMaxLoadDen) want *= 2;
+        if (want > buckets.size()) rehash(want);
+    }
+
+    // Visit every entry; stop early when fn returns false
+    template <typename F>
+    void forEach(F fn) const {
+        for (const Slot &s : buckets) {
+            if (s.tag == 0) continue;
+            const Entry &e = entryAt(s.entry);
+            if (!fn(e.key, e.value)) return;
+        }
+    }
+
+    // Mutable visit; fn(key, value&) returns false to stop
+    template <typename F>
+    void forEachMutable(F fn) {
+        for (const Slot &s : buckets) {
+            if (s.tag == 0) continue;
+            Entry &e = entryAt(s.entry);
+            if (!fn(e.key, e.value)) return;
+        }
+    }
+
+    // Approximate heap footprint in bytes
+    size_t memoryUsage() const {
+        return buckets.capacity() * sizeof(Slot) + chunks.size() * kChunkEntries * sizeof(Entry)
+             + freeEntries.capacity() * sizeof(uint32_t);
+    }
+
+private:
+    // tag: high 32 bits of the hash with the top bit forced on (0 = empty slot).
+    // Its low bits double as the home position, so rehashing and backward
+    // shifts never need to touch the entry itself (fine up to 2^31 buckets).
+    struct Slot {
+        uint32_t tag;
+        uint32_t entry;
+    };
+
+    static const size_t kMinSlots = 16;
+    static const size_t kMaxLoadNum = 7;   // max load factor 7/8
+    static const size_t kMaxLoadDen = 8;
+    static const size_t kChunkBits = 12;
+    static const size_t kChunkEntries = size_t(1) << kChunkBits;
+    static const size_t kNotFound = ~size_t(0);
+
+    static uint32_t tagOf(uint64_t h) { return static_cast<uint32_t>(h >> 32) | 0x80000000u; }
+    static size_t homeOf(const Slot &s) { return s.tag; }
+    static size_t homeFromHash(uint64_t h) { return tagOf(h); }
+
+    size_t findSlot(const OutPoint &key, uint64_t h) const {
+        size_t mask = buckets.size() - 1;
+        uint32_t tag = tagOf(h);
+        for (size_t pos = homeFromHash(h) & mask; ; pos = (pos + 1) & mask) {
+            const Slot &s = buckets[pos];
+            if (s.tag == 0) return kNotFound;
+            if (s.tag == tag && entryAt(s.entry).key == key) return pos;
+        }
+    }
+
+    void insertSlot(const Slot &slot, uint64_t h) {
+        size_t mask = buckets.size() - 1;
+        size_t pos = homeFromHash(h) & mask;
+        while (buckets[pos].tag != 0) pos = (pos + 1) & mask;
+        buckets[pos] = slot;
+    }
+
+    void rehash(size_t newSize) {
+        std::vector<Slot> old;
+        old.swap(buckets);
+        buckets.assign(newSize, Slot{0, 0});
+        size_t mask = newSize - 1;
+        for (const Slot &s : old) {
+            if (s.tag == 0) continue;
+            size_t pos = homeOf(s) & mask;
+            while (buckets[pos].tag != 0) pos = (pos + 1) & mask;
+            buckets[pos] = s;
+        }
+    }
+
+    uint32_t allocEntry() {
+        if (!freeEntries.empty()) {
+            uint32_t idx = freeEntries.back();
+            freeEntries.pop_back();
+            return idx;
+        }
+        if ((allocated >> kChunkBits) == chunks.size()) {
+            chunks.emplace_back(new Entry[kChunkEntries]);
+        }
+        return static_cast<uint32_t>(allocated++);
+    }
+
+    Entry &entryAt(uint32_t idx) { return chunks[idx >> kChunkBits][idx & (kChunkEntries - 1)]; }
+    const Entry &entryAt(uint32_t idx) const { return chunks[idx >> kChunkBits][idx & (kChunkEntries - 1)]; }
+
+    OutPointHasher hasher;
+    std::vector<Slot> buckets;
+    std::vector<std::unique_ptr<Entry[]>> chunks;
+    std::vector<uint32_t> freeEntries;
+    size_t allocated = 0;
+    size_t count = 0;
+};
+
+typedef OutPointTable<UTXO> UtxoTable;
@@ -7,6 +7,8 @@
 #include <QVBoxLayout>
 #include <QTextEdit>
 #include <QMessageBox>
+#include <QProgressBar>
+#include <QPointer>
 
 #include <openssl/ec.h>
 #include <openssl/obj_mac.h>
@@ -18,21 +20,11 @@
 #include <iomanip>
 
 #include "blockchain_core.cpp"
+#include "wallet_index.cpp"
+#include "key_pool.cpp"
+#include "coin_selection.cpp"
 
-static std::string pubKeyHashFromECKey(EC_KEY *ecKey) {
-    // Get public key in compressed form
-    int size = i2o_ECPublicKey(ecKey, NULL);
-    unsigned char *buffer = new unsigned char[size];
-    unsigned char *p = buffer;
-    i2o_ECPublicKey(ecKey, &p);
-
-    // Use SHA-256 to create a "pubKeyHash" (this is simplified)
-    std::string rawPubKey((char*)buffer, size);
-    std::string hash = sha256(rawPubKey);
-
-    delete[] buffer;
-    return hash;
-}
+void startP2P();
 
 // Minimal wallet main window
 class WalletWindow : public QMainWindow {
@@ -40,6 +32,19 @@ class WalletWindow : public QMainWindow {
 
 public:
     WalletWindow(QWidget *parent=nullptr) : QMainWindow(parent) {
+        walletIndex = WalletIndex::create(getBlockchain());
+        Json::Value cfg = loadConfig("config.json");
+        // Never below what the mempool relays
+        feePerKB = std::max(cfg.get("walletFeePerKB", 2000).asUInt64(), cfg.get("minRelayFeePerKB", 1000).asUInt64());
+        // Keys come from the HD seed in wallet.dat; a new wallet has no history
+        // before the current tip
+        std::string dataDir = cfg.get("dataDir", "data").asString();
+        ensureDirectory(dataDir);
+        keyPool.reset(new KeyPool(walletIndex, cfg.get("keypoolSize", 1000).asUInt()));
+        if (!keyPool->open(dataDir + "/wallet.dat", getBlockchain()->getSnapshot()->height)) {
+            QMessageBox::warning(this, "Error", "Failed to open the wallet file in " + QString::fromStdString(dataDir) + ".");
+        }
+
         QWidget *central = new QWidget(this);
         QVBoxLayout *layout = new QVBoxLayout(central);
 
@@ -73,84 +78,78 @@ public:
         layout->addWidget(balBtn);
         connect(balBtn, &QPushButton::clicked, this, &WalletWindow::onShowBalance);
 
+        // Rebuild the wallet's coins from a given block on, in the background
+        QLabel *rescanLabel = new QLabel("Rescan from height:");
+        layout->addWidget(rescanLabel);
+        rescanEdit = new QLineEdit(this);
+        layout->addWidget(rescanEdit);
+        QPushButton *rescanBtn = new QPushButton("Rescan", this);
+        layout->addWidget(rescanBtn);
+        connect(rescanBtn, &QPushButton::clicked, this, &WalletWindow::onRescan);
+        rescanProgress = new QProgressBar(this);
+        rescanProgress->setRange(0, 100);
+        layout->addWidget(rescanProgress);
+
+        // Without the seed there are no keys to hand out or sign with
+        if (!keyPool->isReady()) {
+            genBtn->setEnabled(false);
+            sendBtn->setEnabled(false);
+        }
+
         setCentralWidget(central);
     }
 
 private slots:
     void onGenerateAddress() {
-        // Generate a new ECDSA secp256k1 key
-        EC_KEY *ecKey = EC_KEY_new_by_curve_name(NID_secp256k1);
-        if (!ecKey) {
-            QMessageBox::warning(this, "Error", "Failed to create key object.");
-            return;
-        }
-        if (!EC_KEY_generate_key(ecKey)) {
-            QMessageBox::warning(this, "Error", "Failed to generate EC key.");
-            EC_KEY_free(ecKey);
+        // Next key from the pool, already derived and watched by the index
+        uint256 pkHash;
+        uint32_t keyIndex;
+        if (!keyPool->getNewKey(pkHash, keyIndex)) {
+            QMessageBox::warning(this, "Error", "Failed to get a key from the wallet.");
             return;
         }
-        std::string pkHash = pubKeyHashFromECKey(ecKey);
-
-        // In real code, store the private key (encrypted) in a secure location
-        // For demo, we show in console
-        const BIGNUM *privBN = EC_KEY_get0_private_key(ecKey);
-        char *hex = BN_bn2hex(privBN);
-        std::string privKeyHex(hex);
-        OPENSSL_free(hex);
 
         // Display
         std::stringstream ss;
-        ss << "PrivKey: " << privKeyHex << "\nPubKeyHash: " << pkHash << "\n\n";
+        ss << "Key m/0'/0'/" << keyIndex << "'\nPubKeyHash: " << pkHash.toHex() << "\n\n";
         addressDisplay->insertPlainText(QString::fromStdString(ss.str()));
-
-        // We could store this in an internal list
-        knownKeys[pkHash] = privKeyHex;
-
-        EC_KEY_free(ecKey);
     }
 
     void onSendTransaction() {
-        // Build a transaction from the first known address
-        if (knownKeys.empty()) {
-            QMessageBox::information(this, "No Keys", "Generate an address first.");
+        uint256 toPubKeyHash;
+        if (!toPubKeyHash.setHex(destEdit->text().trimmed().toStdString())) {
+            QMessageBox::warning(this, "Error", "Destination must be a 64-character hex pubKeyHash.");
             return;
         }
-        std::string fromPubKeyHash = knownKeys.begin()->first; // pick first for simplicity
-        std::string privKeyHex = knownKeys.begin()->second;    // not used in detail here
-
-        std::string toPubKeyHash = destEdit->text().toStdString();
-        uint64_t amt = static_cast<uint64_t>(amtEdit->text().toLongLong());
-
-        // We would search our UTXOs for fromPubKeyHash, sum them up, create inputs, sign them, etc.
-        // For brevity, let's do a simplified single input transaction
-
-        // This is purely conceptual: you'd need to find real UTXOs matching `fromPubKeyHash`.
-        // We'll just pick the first matching UTXO from the global set if available.
-
-        std::string foundKey;
-        uint64_t foundAmount = 0;
-        for (auto &kv : g_utxoSet) {
-            if (kv.second.pubKeyHash == fromPubKeyHash) {
-                foundKey = kv.first;
-                foundAmount = kv.second.amount;
-                break;
-            }
+        bool amountOk = false;
+        uint64_t amt = static_cast<uint64_t>(amtEdit->text().trimmed().toULongLong(&amountOk));
+        if (!amountOk || amt == 0) {
+            QMessageBox::warning(this, "Error", "Amount must be a positive number of satoshis.");
+            return;
         }
-        if (foundKey.empty()) {
-            QMessageBox::warning(this, "Error", "No UTXOs found for your address. No balance?");
+
+        // Fund it from the coins of every address that no unconfirmed
+        // transaction spends yet, preferring a set that needs no change
+        Blockchain *chain = getBlockchain();
+        std::vector<WalletIndex::Coin> coins = walletIndex->getSpendableCoins(uint256());
+        CoinSelection selection;
+        std::string error;
+        if (!selectCoins(coins, amt, 1, feePerKB, selection, error)) {
+            QMessageBox::warning(this, "Error", QString::fromStdString(error));
             return;
         }
+
         // Build the transaction
-        Transaction tx;
+        MutableTransaction tx;
         tx.version = 1;
         tx.lockTime = 0;
-        TxInput in;
-        // parse foundKey -> txid:index
-        auto pos = foundKey.find(':');
-        in.txid = foundKey.substr(0, pos);
-        in.index = std::stoi(foundKey.substr(pos+1));
-        in.signature = "dummy-signature"; // In real code, sign with ECDSA
-        tx.inputs.push_back(in);
+        for (auto &coin : selection.inputs) {
+            TxInput in;
+            in.txid = coin.key.txid;
+            in.index = coin.key.index;
+            // signature is filled in once the outputs are final
+            tx.inputs.push_back(in);
+        }
 
         // Output to destination
         TxOutput out;
@@ -158,50 +157,85 @@ private slots:
         out.pubKeyHash = toPubKeyHash;
         tx.outputs.push_back(out);
 
-        // Possibly add change output
-        uint64_t fee = 1000; // Hard-coded minimal fee
-        uint64_t change = foundAmount - amt - fee;
-        if (change > 0) {
+        if (selection.change > 0) {
+            // Change goes to a fresh key of our own
             TxOutput changeOut;
-            changeOut.amount = change;
-            changeOut.pubKeyHash = fromPubKeyHash;
+            uint32_t changeIndex;
+            if (!keyPool->getNewKey(changeOut.pubKeyHash, changeIndex)) {
+                QMessageBox::warning(this, "Error", "Failed to get a change key from the wallet.");
+                return;
+            }
+            changeOut.amount = selection.change;
             tx.outputs.push_back(changeOut);
         }
+        for (size_t i = 0; i < selection.inputs.size(); i++) {
+            uint32_t keyIndex;
+            uint256 secret;
+            if (!walletIndex->findKey(selection.inputs[i].coin.pubKeyHash, keyIndex)
+                || !keyPool->getSecret(keyIndex, secret)
+                || !signTransactionInput(tx, i, secret.toHex())) {
+                QMessageBox::warning(this, "Error", "Failed to sign the transaction.");
+                return;
+            }
+        }
 
-        // Now we can attempt to validate and apply the transaction to the local node
-        Blockchain *chain = getBlockchain();
-        if (!chain->validateTransaction(tx)) {
-            QMessageBox::warning(this, "Error", "Transaction invalid or insufficient funds.");
+        // Hand it to the local mempool, which relays it to our peers; it is spent
+        // for real once a block includes it
+        TransactionRef txRef = makeTransactionRef(std::move(tx));
+        std::string reason;
+        if (!chain->acceptTransaction(txRef, reason)) {
+            QMessageBox::warning(this, "Error", QString::fromStdString("Transaction rejected: " + reason));
             return;
         }
-        chain->applyTransaction(tx);
-
-        // In a real system, we would broadcast this transaction over the P2P network.
 
-        QMessageBox::information(this, "Success", "Transaction created and applied locally!");
+        std::stringstream ss;
+        ss << "Transaction sent to the network!\n" << selection.inputs.size() << " input(s), fee "
+           << selection.fee << " satoshis, " << (selection.change ? "change " + std::to_string(selection.change) + " satoshis" : "no change");
+        QMessageBox::information(this, "Success", QString::fromStdString(ss.str()));
     }
 
     void onShowBalance() {
-        // Summation of all UTXOs that match our known addresses
-        uint64_t balance = 0;
-        for (auto &kv : g_utxoSet) {
-            UTXO utxo = kv.second;
-            if (knownKeys.find(utxo.pubKeyHash) != knownKeys.end()) {
-                balance += utxo.amount;
-            }
-        }
+        // Summation of the wallet's own coins, kept up to date as blocks connect
+        WalletIndex::Balance balance = walletIndex->getBalance();
         std::stringstream ss;
-        ss << "Total balance for your addresses: " << balance << " satoshis";
+        ss << "Total balance for your addresses: " << balance.confirmed << " satoshis"
+           << "\nSpendable now: " << balance.spendable << " satoshis"
+           << "\nUnconfirmed incoming: " << balance.unconfirmed << " satoshis";
+        if (walletIndex->isScanning()) ss << "\n(rescan in progress)";
         QMessageBox::information(this, "Balance", QString::fromStdString(ss.str()));
     }
 
+    void onRescan() {
+        bool ok = false;
+        uint64_t fromHeight = static_cast<uint64_t>(rescanEdit->text().trimmed().toULongLong(&ok));
+        if (!ok) fromHeight = 0;
+        // Progress arrives on the scanning thread; the bar is updated on ours
+        QPointer<QProgressBar> bar = rescanProgress;
+        bool started = walletIndex->startRescan(fromHeight, [bar](uint64_t height, uint64_t tipHeight) {
+            int percent = tipHeight ? static_cast<int>(height * 100 / tipHeight) : 100;
+            QMetaObject::invokeMethod(bar, [bar, percent]() {
+                if (bar) bar->setValue(percent);
+            }, Qt::QueuedConnection);
+        });
+        if (!started) {
+            QMessageBox::information(this, "Rescan", "A rescan is already running.");
+            return;
+        }
+        rescanProgress->setValue(0);
+    }
+
 private:
     QTextEdit *addressDisplay;
     QLineEdit *destEdit;
     QLineEdit *amtEdit;
-
-    // Maps pubKeyHash -> privateKeyHex
-    std::map<std::string, std::string> knownKeys;
+    QLineEdit *rescanEdit;
+    QProgressBar *rescanProgress;
+
+    // The coins paying our keys, followed as blocks connect
+    std::shared_ptr<WalletIndex> walletIndex;
+    // HD keys derived ahead of use; their ids in walletIndex are derivation indexes
+    std::unique_ptr<KeyPool> keyPool;
+    uint64_t feePerKB; // fee rate for our transactions, satoshis per 1000 bytes
 };
 
 #include <QMetaType>
@@ -212,6 +246,7 @@ int main_wallet(int argc, char *argv[]) {
     QApplication app(argc, argv);
 
     initBlockchain(); // Initialize our blockchain instance
+    startP2P();       // Sync the chain and relay our transactions
 
     WalletWindow window;
     window.setWindowTitle("MyCoin Wallet");
@@ -0,0 +1,426 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include "blockchain_core.cpp"
+
+// ------------------- WALLET INDEX -------------------
+// The wallet's own view of the outputs paying its keys, so balance and coin
+// lookups cost O(owned outputs) instead of a walk over the whole UTXO set.
+// It follows the active chain through the chain's block connected/disconnected
+// notifications and remembers unconfirmed transactions touching its keys from
+// the mempool notifications.
+//
+// The index records the last block it applied (bestHash). A notification that
+// doesn't continue from there (missed, or delivered out of order by two
+// connecting threads) is ignored and a background catch-up reads the missing
+// blocks from the chain instead. A rescan is the same catch-up after rewinding
+// the index to an earlier height, e.g. after importing a key.
+//
+// Spent coins are kept with the block that spent them, so a disconnected block
+// can give them back and a rescan can rewind without reading old blocks.
+
+static const int kMaxBlockReadFailures = 10;
+static const int kBlockReadRetryMs = 100;   // times the number of failures so far
+
+// pubKeyHash -> key id for every key the wallet owns, probed once per output
+// the index sees. Open addressing with linear probing over 8-byte slots like
+// OutPointTable, but insert-only with the hashes in one dense array, so a miss
+// (nearly every output) usually costs a single cache line. The hashes are
+// SHA-256 outputs of our own keys, so their leading bytes serve as the hash
+// without a salt: outsiders can't choose what goes in.
+class KeyHashTable {
+public:
+    KeyHashTable() : buckets(kMinSlots, Slot{0, 0}) {}
+
+    size_t size() const { return hashes.size(); }
+
+    // False if the hash is already present (its id is kept)
+    bool insert(const uint256 &pubKeyHash, uint32_t id) {
+        if (find(pubKeyHash)) return false;
+        if ((hashes.size() + 1) * kMaxLoadDen > buckets.size() * kMaxLoadNum) rehash(buckets.size() * 2);
+        hashes.push_back(pubKeyHash);
+        ids.push_back(id);
+        place(Slot{tagOf(pubKeyHash), static_cast<uint32_t>(hashes.size() - 1)});
+        return true;
+    }
+
+    // Pointer to the key's id, or nullptr
+    const uint32_t *find(const uint256 &pubKeyHash) const {
+        size_t mask = buckets.size() - 1;
+        uint32_t tag = tagOf(pubKeyHash);
+        for (size_t pos = tag & mask; ; pos = (pos + 1) & mask) {
+            const Slot &s = buckets[pos];
+            if (s.tag == 0) return nullptr;
+            if (s.tag == tag && hashes[s.entry] == pubKeyHash) return &ids[s.entry];
+        }
+    }
+
+    bool contains(const uint256 &pubKeyHash) const { return find(pubKeyHash) != nullptr; }
+
+private:
+    // tag: 32 bits of the hash with the top bit forced on (0 = empty slot);
+    // its low bits are the home position
+    struct Slot {
+        uint32_t tag;
+        uint32_t entry;
+    };
+
+    static const size_t kMinSlots = 16;
+    static const size_t kMaxLoadNum = 7; // max load factor 7/8
+    static const size_t kMaxLoadDen = 8;
+
+    static uint32_t tagOf(const uint256 &h) { return readLE32(h.data) | 0x80000000u; }
+
+    void place(const Slot &slot) {
+        size_t mask = buckets.size() - 1;
+        size_t pos = slot.tag & mask;
+        while (buckets[pos].tag != 0) pos = (pos + 1) & mask;
+        buckets[pos] = slot;
+    }
+
+    void rehash(size_t newSize) {
+        std::vector<Slot> old;
+        old.swap(buckets);
+        buckets.assign(newSize, Slot{0, 0});
+        for (const Slot &s : old) {
+            if (s.tag != 0) place(s);
+        }
+    }
+
+    std::vector<Slot> buckets;
+    std::vector<uint256> hashes; // by entry
+    std::vector<uint32_t> ids;   // by entry
+};
+
+class WalletIndex : public std::enable_shared_from_this<WalletIndex> {
+public:
+    struct Coin {
+        OutPoint key;
+        UTXO coin;
+        uint64_t height; // of the block that created it
+    };
+
+    struct Balance {
+        uint64_t confirmed = 0;   // unspent in the active chain
+        uint64_t spendable = 0;   // confirmed and not spent by an unconfirmed tx
+        uint64_t unconfirmed = 0; // paid to us by transactions still in the mempool
+    };
+
+    // (height just scanned, tip height); called on the scanning thread
+    typedef std::function<void(uint64_t height, uint64_t tipHeight)> ProgressFn;
+
+    // An index following `chain` from its current tip. The chain's listeners
+    // keep the index alive for as long as the chain runs.
+    static std::shared_ptr<WalletIndex> create(Blockchain *chain) {
+        std::shared_ptr<WalletIndex> index(new WalletIndex(chain));
+        // Nothing is ours yet: start at the tip. A block connected before the
+        // listeners are in place shows up as a gap at the next one and is read
+        // back by the catch-up.
+        ChainSnapshotRef snapshot = chain->getSnapshot();
+        index->bestHash = snapshot->tipHash;
+        index->nextHeight = snapshot->height + 1;
+        chain->addBlockConnectedListener([index](const Block &block, uint64_t height) {
+            index->blockConnected(block, height);
+        });
+        chain->addBlockDisconnectedListener([index](const Block &block, uint64_t height) {
+            index->blockDisconnected(block, height);
+        });
+        chain->addTransactionAcceptedListener([index](const TransactionRef &tx) {
+            index->transactionAccepted(tx);
+        });
+        return index;
+    }
+
+    // Keys with no history (freshly derived); outputs paying them in blocks
+    // already applied are only found by a rescan
+    void addKeys(const std::vector<std::pair<uint256, uint32_t>> &batch) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &key : batch) {
+            keys.insert(key.first, key.second);
+        }
+    }
+
+    bool isMine(const uint256 &pubKeyHash) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return keys.contains(pubKeyHash);
+    }
+
+    // The id the key was added with
+    bool findKey(const uint256 &pubKeyHash, uint32_t &id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const uint32_t *found = keys.find(pubKeyHash);
+        if (!found) return false;
+        id = *found;
+        return true;
+    }
+
+    Balance getBalance() {
+        Balance balance;
+        Mempool &mempool = chain->getMempool();
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &c : coins) {
+            balance.confirmed += c.second.coin.amount;
+            if (!mempool.isSpent(c.first)) balance.spendable += c.second.coin.amount;
+        }
+        for (auto it = pending.begin(); it != pending.end();) {
+            // Confirmed ones are dropped when their block connects, the rest here
+            if (!mempool.contains(it->first)) {
+                it = pending.erase(it);
+                continue;
+            }
+            for (auto &out : it->second->outputs) {
+                if (keys.contains(out.pubKeyHash)) balance.unconfirmed += out.amount;
+            }
+            ++it;
+        }
+        return balance;
+    }
+
+    // Confirmed coins of one key (or of every key, if null) that no unconfirmed
+    // transaction spends yet
+    std::vector<Coin> getSpendableCoins(const uint256 &pubKeyHash) {
+        std::vector<Coin> out;
+        Mempool &mempool = chain->getMempool();
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &c : coins) {
+            if (!pubKeyHash.isNull() && c.second.coin.pubKeyHash != pubKeyHash) continue;
+            if (mempool.isSpent(c.first)) continue;
+            out.push_back(c.second);
+        }
+        return out;
+    }
+
+    // Rebuild everything from block `fromHeight` on, on a background thread.
+    // False if a scan is already running.
+    bool startRescan(uint64_t fromHeight, ProgressFn progress) {
+        bool expected = false;
+        if (!scanning.compare_exchange_strong(expected, true)) return false;
+        std::shared_ptr<WalletIndex> self = shared_from_this();
+        std::thread([self, fromHeight, progress]() {
+            {
+                std::lock_guard<std::mutex> lock(self->mutex);
+                self->rewind(fromHeight);
+            }
+            std::cout << "[Wallet] Rescanning from height " << fromHeight << std::endl;
+            if (self->runScan(progress)) std::cout << "[Wallet] Rescan done" << std::endl;
+        }).detach();
+        return true;
+    }
+
+    bool isScanning() const {
+        return scanning.load();
+    }
+
+private:
+    explicit WalletIndex(Blockchain *chain) : chain(chain) {}
+
+    struct SpentCoin {
+        Coin coin;
+        uint256 spentIn;     // block hash
+        uint64_t spentHeight;
+    };
+
+    void blockConnected(const Block &block, uint64_t height) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (block.header.prevBlockHash == bestHash && height == nextHeight) {
+                connect(block, height);
+                return;
+            }
+            if (block.getBlockHash() == bestHash) return; // a scan got there first
+        }
+        startCatchUp();
+    }
+
+    void blockDisconnected(const Block &block, uint64_t height) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (block.getBlockHash() == bestHash) {
+                disconnect(block, height);
+                return;
+            }
+        }
+        startCatchUp();
+    }
+
+    void transactionAccepted(const TransactionRef &tx) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (isRelevant(*tx)) pending[tx->getTxId()] = tx;
+    }
+
+    bool isRelevant(const Transaction &tx) const {
+        for (auto &out : tx.outputs) {
+            if (keys.contains(out.pubKeyHash)) return true;
+        }
+        for (auto &in : tx.inputs) {
+            if (coins.count(OutPoint(in.txid, in.index))) return true;
+        }
+        return false;
+    }
+
+    // Apply a block continuing from bestHash (under the mutex)
+    void connect(const Block &block, uint64_t height) {
+        uint256 hash = block.getBlockHash();
+        for (auto &tx : block.getTransactions()) {
+            pending.erase(tx->getTxId());
+            if (!tx->isCoinbase()) {
+                for (auto &in : tx->inputs) {
+                    auto it = coins.find(OutPoint(in.txid, in.index));
+                    if (it == coins.end()) continue;
+                    spent[it->first] = SpentCoin{it->second, hash, height};
+                    coins.erase(it);
+                }
+            }
+            const uint256 &txid = tx->getTxId();
+            for (size_t i = 0; i < tx->outputs.size(); i++) {
+                const TxOutput &out = tx->outputs[i];
+                if (!keys.contains(out.pubKeyHash)) continue;
+                OutPoint key(txid, static_cast<uint32_t>(i));
+                coins[key] = Coin{key, UTXO{out.amount, out.pubKeyHash}, height};
+            }
+        }
+        bestHash = hash;
+        nextHeight = height + 1;
+    }
+
+    // Undo the block at bestHash (under the mutex)
+    void disconnect(const Block &block, uint64_t height) {
+        uint256 hash = block.getBlockHash();
+        for (size_t t = block.getTransactions().size(); t-- > 0;) {
+            const Transaction &tx = *block.getTransactions()[t];
+            const uint256 &txid = tx.getTxId();
+            for (size_t i = 0; i < tx.outputs.size(); i++) {
+                coins.erase(OutPoint(txid, static_cast<uint32_t>(i)));
+            }
+            if (tx.isCoinbase()) continue;
+            for (auto &in : tx.inputs) {
+                auto it = spent.find(OutPoint(in.txid, in.index));
+                if (it == spent.end() || it->second.spentIn != hash) continue;
+                coins[it->first] = it->second.coin;
+                spent.erase(it);
+            }
+        }
+        bestHash = block.header.prevBlockHash;
+        nextHeight = height;
+    }
+
+    // Forget everything from block `height` on (under the mutex). Only exact
+    // below the fork point if bestHash left the active chain; catchUp() rewinds
+    // that far first.
+    void rewind(uint64_t height) {
+        if (height >= nextHeight) return;
+        if (height == 0) {
+            coins.clear();
+            spent.clear();
+            bestHash.setNull();
+            nextHeight = 0;
+            return;
+        }
+        for (auto it = spent.begin(); it != spent.end();) {
+            if (it->second.spentHeight < height) {
+                ++it;
+                continue;
+            }
+            if (it->second.coin.height < height) coins[it->first] = it->second.coin;
+            it = spent.erase(it);
+        }
+        for (auto it = coins.begin(); it != coins.end();) {
+            if (it->second.height >= height) it = coins.erase(it);
+            else ++it;
+        }
+        if (!chain->getBlockHash(height - 1, bestHash)) bestHash.setNull();
+        nextHeight = height;
+    }
+
+    // Read blocks from the chain until the index reaches its tip. A block that
+    // can't be read is retried with a growing pause; false once it has failed
+    // kMaxBlockReadFailures times in a row.
+    bool catchUp(const ProgressFn &progress) {
+        int failures = 0;
+        while (true) {
+            ChainSnapshotRef snapshot = chain->getSnapshot();
+            uint64_t height;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (bestHash == snapshot->tipHash) break;
+                // Left on a branch the chain has since abandoned: back to the fork
+                if (!bestHash.isNull() && !chain->findBlockHeight(bestHash, height)) rewind(findForkHeight() + 1);
+                height = nextHeight;
+            }
+            Block block;
+            if (!chain->getBlock(height, block)) {
+                if (chain->getHeight() < height) continue; // the tip moved back; look again
+                if (++failures >= kMaxBlockReadFailures) {
+                    std::cerr << "[Wallet] Cannot read block " << height << "; stopping the catch-up" << std::endl;
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(kBlockReadRetryMs * failures));
+                continue;
+            }
+            failures = 0;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (block.header.prevBlockHash == bestHash && height == nextHeight) connect(block, height);
+            }
+            if (progress && (height % 1000 == 0 || height == snapshot->height)) progress(height, snapshot->height);
+        }
+        return true;
+    }
+
+    // Height of the last active-chain block below bestHash (under the mutex)
+    uint64_t findForkHeight() {
+        uint256 hash = bestHash;
+        uint64_t height;
+        Block block;
+        while (!chain->findBlockHeight(hash, height)) {
+            if (!chain->getBlockByHash(hash, block)) return 0;
+            hash = block.header.prevBlockHash;
+        }
+        return height;
+    }
+
+    // Catch up on the blocks a notification skipped, unless a scan is running
+    // (it only stops once the index is at the tip)
+    void startCatchUp() {
+        bool expected = false;
+        if (!scanning.compare_exchange_strong(expected, true)) return;
+        std::shared_ptr<WalletIndex> self = shared_from_this();
+        std::thread([self]() {
+            self->runScan(ProgressFn());
+        }).detach();
+    }
+
+    // Catch up, then make sure nothing was skipped while the scan was finishing
+    // (a notification arriving then wouldn't start another one). False if it
+    // gave up on an unreadable block; the next notification tries again.
+    bool runScan(const ProgressFn &progress) {
+        bool ok;
+        do {
+            ok = catchUp(progress);
+            scanning = false;
+        } while (ok && isBehind() && !scanning.exchange(true));
+        return ok;
+    }
+
+    bool isBehind() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return bestHash != chain->getTipHash();
+    }
+
+    Blockchain *chain;
+    std::mutex mutex;
+    KeyHashTable keys;
+    std::unordered_map<OutPoint, Coin, OutPointHasher> coins;
+    std::unordered_map<OutPoint, SpentCoin, OutPointHasher> spent;
+    std::unordered_map<uint256, TransactionRef, Uint256Hasher> pending; // unconfirmed txs touching our keys
+    uint256 bestHash;        // last block applied (null: none)
+    uint64_t nextHeight = 0; // height of the next block to apply
+    std::atomic<bool> scanning{false};
+};